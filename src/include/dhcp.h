@@ -36,6 +36,7 @@ extern "C" {
  *	Not for production use.
  */
 RADIUS_PACKET *fr_dhcp_recv(int sockfd);
+int fr_dhcp_packet_ok(RADIUS_PACKET *packet);
 int fr_dhcp_send(RADIUS_PACKET *packet);
 
 int fr_dhcp_encode(RADIUS_PACKET *packet, RADIUS_PACKET *original);
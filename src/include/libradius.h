@@ -110,6 +110,8 @@ typedef struct attr_flags {
 	unsigned int		extended_flags : 1; /* with flag */
 	unsigned int		evs : 1;	    /* extended VSA */
 	unsigned int		wimax: 1;	    /* WiMAX format=1,1,c */
+	unsigned int		vsa_type : 3;	    /* vendor format, or 0 */
+	unsigned int		vsa_length : 2;
 
 	int8_t			tag;	      /* tag for tunneled attributes */
 	uint8_t		        encrypt;      /* encryption method */
@@ -126,6 +128,14 @@ typedef struct attr_flags {
 
 extern const FR_NAME_NUMBER dict_attr_types[];
 
+/*
+ *  What dict_init() did with the binary cache.
+ */
+#define DICT_CACHE_FAILED            (-1) /* parsed, couldn't write */
+#define DICT_CACHE_NONE              (0)  /* no cache, or no changes */
+#define DICT_CACHE_LOADED            (1)
+#define DICT_CACHE_WRITTEN           (2)
+
 typedef struct dict_attr {
 	unsigned int		attr;
 	int			type;
@@ -277,6 +287,8 @@ int		dict_addattr(const char *name, int attr, unsigned int vendor, int type, ATT
 int		dict_addvalue(const char *namestr, const char *attrstr, int value);
 int		dict_init(const char *dir, const char *fn);
 void		dict_free(void);
+int		dict_cache_file(const char *file);
+int		dict_cache_status(void);
 DICT_ATTR	*dict_attrbyvalue(unsigned int attr, unsigned int vendor);
 DICT_ATTR	*dict_attrbyname(const char *attr);
 DICT_VALUE	*dict_valbyattr(unsigned int attr, unsigned int vendor, int val);
@@ -305,6 +317,9 @@ DICT_VENDOR	*dict_vendorbyvalue(int vendor);
 /* md5.c */
 
 void		fr_md5_calc(uint8_t *, const uint8_t *, unsigned int);
+#define FR_MD5_LANES	(8)
+void		fr_md5_calc_multi(uint8_t *output[], const uint8_t *input[],
+				  const size_t inlen[], int num);
 
 /* hmac.c */
 
@@ -386,6 +401,26 @@ ssize_t		rad_attr2vp(const RADIUS_PACKET *packet, const RADIUS_PACKET *original,
 			    const uint8_t *data, size_t length,
 			    VALUE_PAIR **pvp);
 
+/*
+ *	Where each attribute is in packet->data, so that a few of
+ *	them can be decoded without decoding the whole packet.
+ */
+typedef struct fr_attr_index_t {
+	unsigned int	attribute;	/* data[0] */
+	unsigned int	vendor;		/* for Vendor-Specific, else 0 */
+	uint16_t	offset;		/* of the attribute header */
+	uint8_t		length;		/* including the header */
+} fr_attr_index_t;
+
+int		rad_packet_index(const RADIUS_PACKET *packet,
+				 fr_attr_index_t *index, int max);
+int		rad_index_decode(const RADIUS_PACKET *packet,
+				 const RADIUS_PACKET *original,
+				 const char *secret,
+				 const fr_attr_index_t *index, int num,
+				 unsigned int attribute, unsigned int vendor,
+				 VALUE_PAIR **pvp);
+
 int rad_vp2extended(const RADIUS_PACKET *packet,
 		    const RADIUS_PACKET *original,
 		    const char *secret, const VALUE_PAIR **pvp,
@@ -559,6 +594,29 @@ void *fr_fifo_pop(fr_fifo_t *fi);
 void *fr_fifo_peek(fr_fifo_t *fi);
 int fr_fifo_num_elements(fr_fifo_t *fi);
 
+/*
+ *	Path-compressed radix trees, for longest prefix matching.
+ *	Keys are bit strings of up to "max_bits" bits, most
+ *	significant bit first.  i.e. IP addresses in network order.
+ */
+typedef struct fr_radix_tree_t fr_radix_tree_t;
+typedef void (*fr_radix_free_t)(void *);
+typedef int (*fr_radix_match_t)(void * /* ctx */, void * /* data */);
+
+fr_radix_tree_t	*fr_radix_create(int max_bits, fr_radix_free_t freeNode);
+void		fr_radix_free(fr_radix_tree_t *rt);
+int		fr_radix_insert(fr_radix_tree_t *rt, const uint8_t *key,
+				int bits, void *data);
+int		fr_radix_delete(fr_radix_tree_t *rt, const uint8_t *key,
+				int bits);
+void		*fr_radix_find(fr_radix_tree_t *rt, const uint8_t *key,
+			       int bits);
+void		*fr_radix_match(fr_radix_tree_t *rt, const uint8_t *key,
+				fr_radix_match_t callback, void *ctx);
+int		fr_radix_num_elements(fr_radix_tree_t *rt);
+int		fr_radix_walk(fr_radix_tree_t *rt,
+			      int (*callback)(void *, void *), void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
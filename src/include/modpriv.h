@@ -66,6 +66,7 @@ typedef struct module_instance_t {
 #endif
 	CONF_SECTION		*cs;
 	int			dead;
+	int			reloading;
 	fr_module_hup_t	       	*mh;
 } module_instance_t;
 
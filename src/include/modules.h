@@ -47,6 +47,7 @@ extern const section_type_value_t section_type_value[];
 #define RLM_TYPE_THREAD_UNSAFE		(1 << 0)
 #define RLM_TYPE_CHECK_CONFIG_SAFE	(1 << 1)
 #define RLM_TYPE_HUP_SAFE		(1 << 2)
+#define RLM_TYPE_HUP_BACKGROUND		(1 << 3)
 
 #define RLM_MODULE_MAGIC_NUMBER ((uint32_t) (0xf4ee4ad3))
 #define RLM_MODULE_INIT RLM_MODULE_MAGIC_NUMBER
@@ -52,6 +52,10 @@ int request_enqueue(REQUEST *request);
 
 int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 		    RADCLIENT *client, RAD_REQUEST_FUNP fun);
+int request_receive_delayed(rad_listen_t *listener, RADIUS_PACKET *packet,
+			    RADCLIENT *client, RAD_REQUEST_FUNP fun,
+			    int usec);
+void request_delayed_delete(rad_listen_t *listener, RADCLIENT *client);
 int request_insert(rad_listen_t *listener, RADIUS_PACKET *packet,
 		   RADCLIENT *client, RAD_REQUEST_FUNP fun,
 		   struct timeval *pnow);
@@ -81,6 +81,12 @@ typedef struct auth_req REQUEST;
 #define WITH_STATS
 #endif
 
+#ifdef WITH_STATS
+#ifndef WITHOUT_METRICS
+#define WITH_METRICS (1)
+#endif
+#endif
+
 #ifndef WITHOUT_COMMAND_SOCKET
 #ifdef HAVE_SYS_UN_H
 #define WITH_COMMAND_SOCKET (1)
@@ -130,6 +136,16 @@ extern "C" {
  *	See util.c
  */
 typedef struct request_data_t request_data_t;
+typedef struct request_mem_t request_mem_t;
+
+typedef struct request_mem_stats_t {
+	uint64_t		requests;
+	uint64_t		allocs;	/* calls to request_mem_alloc() */
+	uint64_t		bytes;	/* what they asked for, rounded up */
+	uint64_t		large;	/* given a block of their own */
+	uint64_t		mallocs; /* blocks which came from malloc() */
+	uint64_t		reused;	/* blocks which came from a free list */
+} request_mem_stats_t;
 
 typedef struct radclient {
 	fr_ipaddr_t		ipaddr;
@@ -161,6 +177,18 @@ typedef struct radclient {
 	int			num_connections;
 #endif
 
+	/*
+	 *	Rate limiting.  The limits are in packets per second,
+	 *	and zero means "no limit".
+	 */
+	int			max_pps;
+	int			max_pps_burst;
+	int			max_pps_per_source;
+	int			max_pps_delay;	/* ms, 0 == drop */
+	uint64_t		pps_tat;
+	fr_hash_table_t		*pps_sources;
+	struct radclient	*pps_master; /* dynamic: use the network's */
+
 #ifdef WITH_DYNAMIC_CLIENTS
 	int			lifetime;
 	int			dynamic; /* was dynamically defined */
@@ -205,6 +233,9 @@ typedef enum RAD_LISTEN_TYPE {
 #endif
 #ifdef WITH_COA
 	RAD_LISTEN_COA,
+#endif
+#ifdef WITH_METRICS
+	RAD_LISTEN_METRICS,
 #endif
 	RAD_LISTEN_MAX
 } RAD_LISTEN_TYPE;
@@ -246,6 +277,7 @@ struct auth_req {
 	struct main_config_t	*root;
 
 	request_data_t		*data;
+	request_mem_t		*mem;	/* see request_mem_alloc() */
 	RADCLIENT		*client;
 #ifdef HAVE_PTHREAD_H
 	pthread_t    		child_pid;
@@ -274,6 +306,7 @@ struct auth_req {
 	int			master_state;
 	int			child_state;
 	RAD_LISTEN_TYPE		priority;
+	struct timeval		queued;	/* when it went into the thread queue */
 
 	fr_event_t		*ev;
 
@@ -607,6 +640,9 @@ void		*request_data_get(REQUEST *request,
 				  void *unique_ptr, int unique_int);
 void		*request_data_reference(REQUEST *request,
 				  void *unique_ptr, int unique_int);
+void		*request_mem_alloc(REQUEST *request, size_t size);
+char		*request_mem_strdup(REQUEST *request, const char *str);
+void		request_mem_stats(request_mem_stats_t *stats);
 int		rad_copy_string(char *dst, const char *src);
 int		rad_copy_variable(char *dst, const char *from);
 
@@ -629,6 +665,9 @@ RADCLIENT	*client_find_old(const fr_ipaddr_t *ipaddr);
 int		client_validate(RADCLIENT_LIST *clients, RADCLIENT *master,
 				RADCLIENT *c);
 RADCLIENT	*client_read(const char *filename, int in_server, int flag);
+int		client_rate_limit(RADCLIENT *client,
+				  const fr_ipaddr_t *src_ipaddr,
+				  const struct timeval *now);
 
 
 /* files.c */
@@ -720,6 +759,23 @@ extern          void thread_pool_lock(void);
 extern          void thread_pool_unlock(void);
 extern		void thread_pool_queue_stats(int *array);
 
+/*
+ *	Classes of traffic for overload control, from most to least
+ *	important.  When the server is overloaded, the less important
+ *	classes are discarded first.
+ */
+typedef enum fr_load_class_t {
+	FR_LOAD_CLASS_AUTH_CONTINUE = 0, /* Access-Request with State */
+	FR_LOAD_CLASS_AUTH,		/* new Access-Request */
+	FR_LOAD_CLASS_ACCT,		/* Start, Stop, On, Off */
+	FR_LOAD_CLASS_ACCT_INTERIM,	/* Interim-Update */
+	FR_LOAD_CLASS_MAX
+} fr_load_class_t;
+
+extern		int thread_pool_overloaded(void);
+extern		int thread_pool_shed(fr_load_class_t load_class);
+extern		void thread_pool_shed_stats(fr_uint_t *array);
+
 #ifndef HAVE_PTHREAD_H
 #define rad_fork(n) fork()
 #define rad_waitpid(a,b) waitpid(a,b, 0)
@@ -756,6 +812,8 @@ int radius_event_init(CONF_SECTION *cs, int spawn_flag);
 void radius_event_free(void);
 int radius_event_process(void);
 int event_new_fd(rad_listen_t *listener);
+int event_fd_writable(rad_listen_t *listener, fr_event_fd_handler_t handler,
+		      int timeout);
 void revive_home_server(void *ctx);
 void mark_home_server_dead(home_server *home, struct timeval *when);
 
@@ -50,6 +50,8 @@ typedef struct fr_stats_t {
 	fr_uint_t		total_packets_dropped;
 	fr_uint_t		total_no_records;
 	fr_uint_t		total_unknown_types;
+	fr_uint_t		total_rate_limited;
+	fr_uint_t		total_rate_delayed;
 	time_t			last_packet;
 	fr_uint_t		elapsed[8];
 } fr_stats_t;
@@ -33,6 +33,7 @@ extern "C" {
 #endif
 
 RADIUS_PACKET *vqp_recv(int sockfd);
+int vqp_packet_ok(RADIUS_PACKET *packet);
 int vqp_send(RADIUS_PACKET *packet);
 int vqp_decode(RADIUS_PACKET *packet);
 int vqp_encode(RADIUS_PACKET *packet, RADIUS_PACKET *original);
@@ -196,79 +196,39 @@ static uint8_t *dhcp_get_option(dhcp_packet_t *packet, size_t packet_size,
 }
 
 /*
- *	DHCPv4 is only for IPv4.  Broadcast only works if udpfromto is
- *	defined.
+ *	Check that a received packet is one we can decode, and set
+ *	the packet code, ID, and vector from it.
+ *
+ *	Returns 1 if the packet is OK, 0 if it's not.
  */
-RADIUS_PACKET *fr_dhcp_recv(int sockfd)
+int fr_dhcp_packet_ok(RADIUS_PACKET *packet)
 {
 	uint32_t		magic;
-	struct sockaddr_storage	src;
-	struct sockaddr_storage	dst;
-	socklen_t		sizeof_src;
-	socklen_t	        sizeof_dst;
-	RADIUS_PACKET		*packet;
-	int port;
 	uint8_t			*code;
 
-	packet = rad_alloc(0);
-	if (!packet) {
-		fr_strerror_printf("Failed allocating packet");
-		return NULL;
-	}
-	memset(packet, 0, sizeof(packet));
-
-	packet->data = malloc(MAX_PACKET_SIZE);
-	if (!packet->data) {
-		fr_strerror_printf("Failed in malloc");
-		rad_free(&packet);
-		return NULL;
-	}
-
-	packet->sockfd = sockfd;
-	sizeof_src = sizeof(src);
-#ifdef WITH_UDPFROMTO
-	sizeof_dst = sizeof(dst);
-	packet->data_len = recvfromto(sockfd, packet->data, MAX_PACKET_SIZE, 0,
-				      (struct sockaddr *)&src, &sizeof_src,
-				      (struct sockaddr *)&dst, &sizeof_dst);
-#else
-	packet->data_len = recvfrom(sockfd, packet->data, MAX_PACKET_SIZE, 0,
-				    (struct sockaddr *)&src, &sizeof_src);
-#endif
-
-	if (packet->data_len <= 0) {
-		fr_strerror_printf("Failed reading DHCP socket: %s", strerror(errno));
-		rad_free(&packet);
-		return NULL;
-	}
-
 	if (packet->data_len < MIN_PACKET_SIZE) {
 		fr_strerror_printf("DHCP packet is too small (%d < %d)",
 		      packet->data_len, MIN_PACKET_SIZE);
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	if (packet->data[1] != 1) {
 		fr_strerror_printf("DHCP can only receive ethernet requests, not type %02x",
 		      packet->data[1]);
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	if (packet->data[2] != 6) {
 		fr_strerror_printf("Ethernet HW length is wrong length %d",
 			packet->data[2]);
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	memcpy(&magic, packet->data + 236, 4);
 	magic = ntohl(magic);
 	if (magic != DHCP_OPTION_MAGIC_NUMBER) {
 		fr_strerror_printf("Cannot do BOOTP");
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	/*
@@ -281,14 +241,12 @@ RADIUS_PACKET *fr_dhcp_recv(int sockfd)
 			       packet->data_len, 53);
 	if (!code) {
 		fr_strerror_printf("No message-type option was found in the packet");
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	if ((code[1] < 1) || (code[2] == 0) || (code[2] > 8)) {
 		fr_strerror_printf("Unknown value for message-type option");
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	packet->code = code[2] | PW_DHCP_OFFSET;
@@ -308,6 +266,59 @@ RADIUS_PACKET *fr_dhcp_recv(int sockfd)
 	memcpy(packet->vector, packet->data + 28, packet->data[2]);
 	packet->vector[packet->data[2]] = packet->code & 0xff;
 
+	return 1;
+}
+
+/*
+ *	DHCPv4 is only for IPv4.  Broadcast only works if udpfromto is
+ *	defined.
+ */
+RADIUS_PACKET *fr_dhcp_recv(int sockfd)
+{
+	struct sockaddr_storage	src;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_src;
+	socklen_t	        sizeof_dst;
+	RADIUS_PACKET		*packet;
+	int port;
+
+	packet = rad_alloc(0);
+	if (!packet) {
+		fr_strerror_printf("Failed allocating packet");
+		return NULL;
+	}
+	memset(packet, 0, sizeof(packet));
+
+	packet->data = malloc(MAX_PACKET_SIZE);
+	if (!packet->data) {
+		fr_strerror_printf("Failed in malloc");
+		rad_free(&packet);
+		return NULL;
+	}
+
+	packet->sockfd = sockfd;
+	sizeof_src = sizeof(src);
+#ifdef WITH_UDPFROMTO
+	sizeof_dst = sizeof(dst);
+	packet->data_len = recvfromto(sockfd, packet->data, MAX_PACKET_SIZE, 0,
+				      (struct sockaddr *)&src, &sizeof_src,
+				      (struct sockaddr *)&dst, &sizeof_dst);
+#else
+	packet->data_len = recvfrom(sockfd, packet->data, MAX_PACKET_SIZE, 0,
+				    (struct sockaddr *)&src, &sizeof_src);
+#endif
+
+	if (packet->data_len <= 0) {
+		fr_strerror_printf("Failed reading DHCP socket: %s", strerror(errno));
+		rad_free(&packet);
+		return NULL;
+	}
+
+	if (!fr_dhcp_packet_ok(packet)) {
+		rad_free(&packet);
+		return NULL;
+	}
+
 	/*
 	 *	FIXME: for DISCOVER / REQUEST: src_port == dst_port + 1
 	 *	FIXME: for OFFER / ACK       : src_port = dst_port - 1
@@ -648,6 +659,11 @@ int fr_dhcp_decode(RADIUS_PACKET *packet)
 		if ((p + 2) > (packet->data + packet->data_len)) break;
 
 		next = p + 2 + p[1];
+		if (next > (packet->data + packet->data_len)) {
+			fr_strerror_printf("Option %u overflows the packet",
+					   p[0]);
+			break;
+		}
 
 		if (p[1] >= 253) {
 			fr_strerror_printf("Attribute too long %u %u",
@@ -39,6 +39,9 @@ RCSID("$Id$")
 #include	<sys/stat.h>
 #endif
 
+#include	<fcntl.h>
+#include	<sys/mman.h>
+
 
 #define DICT_VALUE_MAX_NAME_LEN (128)
 #define DICT_VENDOR_MAX_NAME_LEN (128)
@@ -55,6 +58,16 @@ static fr_hash_table_t *values_byname = NULL;
 
 static DICT_ATTR *dict_base_attrs[256];
 
+static int max_attr = 0;
+
+/*
+ *	Most ATTRIBUTEs are bunched together by VENDOR, and most
+ *	VALUEs by ATTRIBUTE, so we remember the last one we looked
+ *	up.  These point into the pool, so dict_free() clears them.
+ */
+static DICT_VENDOR *last_vendor = NULL;
+static DICT_ATTR *last_attr = NULL;
+
 /*
  *	For faster HUP's, we cache the stat information for
  *	files we've $INCLUDEd
@@ -63,6 +76,8 @@ typedef struct dict_stat_t {
 	struct dict_stat_t *next;
 	char	   	   *name;
 	time_t		   mtime;
+	off_t		   size;
+	ino_t		   ino;
 } dict_stat_t;
 
 static char *stat_root_dir = NULL;
@@ -313,6 +328,8 @@ static void dict_stat_add(const char *name, const struct stat *stat_buf)
 
 	this->name = strdup(name);
 	this->mtime = stat_buf->st_mtime;
+	this->size = stat_buf->st_size;
+	this->ino = stat_buf->st_ino;
 
 	if (!stat_head) {
 		stat_head = stat_tail = this;
@@ -343,7 +360,9 @@ static int dict_stat_check(const char *root_dir, const char *root_file)
 	for (this = stat_head; this != NULL; this = this->next) {
 		if (stat(this->name, &buf) < 0) return 0;
 
-		if (buf.st_mtime != this->mtime) return 0;
+		if ((buf.st_mtime != this->mtime) ||
+		    (buf.st_size != this->size) ||
+		    (buf.st_ino != this->ino)) return 0;
 	}
 
 	return 1;
@@ -452,6 +471,8 @@ void dict_free(void)
 	values_byvalue = NULL;
 
 	memset(dict_base_attrs, 0, sizeof(dict_base_attrs));
+	last_vendor = NULL;
+	last_attr = NULL;
 
 	fr_pool_delete(&dict_pool);
 
@@ -531,7 +552,6 @@ int dict_addattr(const char *name, int attr, unsigned int vendor, int type,
 		 ATTR_FLAGS flags)
 {
 	size_t namelen;
-	static int      max_attr = 0;
 	const char	*p;
 	DICT_ATTR	*da;
 
@@ -631,7 +651,6 @@ int dict_addattr(const char *name, int attr, unsigned int vendor, int type,
 
 	if (vendor && (vendor != VENDORPEC_EXTENDED)) {
 		DICT_VENDOR *dv;
-		static DICT_VENDOR *last_vendor = NULL;
 
 		if (flags.has_tlv && (flags.encrypt != FLAG_ENCRYPT_NONE)) {
 			fr_strerror_printf("TLV's cannot be encrypted");
@@ -648,12 +667,6 @@ int dict_addattr(const char *name, int attr, unsigned int vendor, int type,
 			return -1;
 		}
 
-		/*
-		 *	Most ATTRIBUTEs are bunched together by
-		 *	VENDOR.  We can save a lot of lookups on
-		 *	dictionary initialization by caching the last
-		 *	vendor.
-		 */
 		if (last_vendor &&
 		    ((vendor & (FR_MAX_VENDOR - 1)) == last_vendor->vendorpec)) {
 			dv = last_vendor;
@@ -710,6 +723,15 @@ int dict_addattr(const char *name, int attr, unsigned int vendor, int type,
 		 *	Alvarion dictionaries.
 		 */
 		flags.wimax = dv->flags;
+
+		/*
+		 *	Save the encoder looking up the vendor for
+		 *	every VSA it writes.
+		 */
+		if (vendor <= FR_MAX_VENDOR) {
+			flags.vsa_type = dv->type;
+			flags.vsa_length = dv->length;
+		}
 	}
 
 	/*
@@ -794,8 +816,6 @@ int dict_addvalue(const char *namestr, const char *attrstr, int value)
 	DICT_ATTR	*dattr;
 	DICT_VALUE	*dval;
 
-	static DICT_ATTR *last_attr = NULL;
-
 	if (!*namestr) {
 		fr_strerror_printf("dict_addvalue: empty names are not permitted");
 		return -1;
@@ -815,11 +835,6 @@ int dict_addvalue(const char *namestr, const char *attrstr, int value)
 	strcpy(dval->name, namestr);
 	dval->value = value;
 
-	/*
-	 *	Most VALUEs are bunched together by ATTRIBUTE.  We can
-	 *	save a lot of lookups on dictionary initialization by
-	 *	caching the last attribute.
-	 */
 	if (last_attr && (strcasecmp(attrstr, last_attr->name) == 0)) {
 		dattr = last_attr;
 	} else {
@@ -2092,26 +2107,558 @@ static int null_callback(void *ctx, void *data)
 
 
 /*
- *	Initialize the directory, then fix the attr member of
- *	all attributes.
+ *	The parsed dictionaries can be saved to a binary cache, and
+ *	read back on the next start if none of the files it was built
+ *	from have changed.  The records are the DICT_VENDOR, DICT_ATTR
+ *	and DICT_VALUE structures as they are in memory, so a cache is
+ *	only good for the build which wrote it.  The header records
+ *	the version of the server, the structure sizes, and a checksum
+ *	of the structure layouts, including the bit fields in
+ *	ATTR_FLAGS.  Anything else gets the text files parsed again.
  */
-int dict_init(const char *dir, const char *fn)
+#define DICT_CACHE_MAGIC	(0x46524443) /* "FRDC" */
+#define DICT_CACHE_VERSION	(2)
+#define DICT_CACHE_SIZES	((sizeof(DICT_VENDOR) << 24) | \
+				 (sizeof(DICT_ATTR) << 16) | \
+				 (sizeof(DICT_VALUE) << 8) | \
+				 sizeof(ATTR_FLAGS))
+
+#ifndef RADIUSD_VERSION
+#define RADIUSD_VERSION		"unknown"
+#endif
+
+#define DICT_REC_ROOT		(1)
+#define DICT_REC_FILE		(2)
+#define DICT_REC_VENDOR		(3)
+#define DICT_REC_ATTR		(4)
+#define DICT_REC_VALUE		(5)
+
+#define DICT_REC_BYNAME		(1 << 0)
+#define DICT_REC_BYVALUE	(1 << 1)
+
+typedef struct dict_cache_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	sizes;
+	uint32_t	layout;
+	char		build[32];	/* RADIUSD_VERSION */
+	uint32_t	length;		/* of the whole file */
+	uint32_t	reserved;	/* keeps the records 8-aligned */
+} dict_cache_hdr_t;
+
+typedef struct dict_cache_rec_t {
+	uint16_t	type;
+	uint16_t	tables;		/* which hash tables it goes in */
+	uint32_t	length;		/* including this header and padding */
+} dict_cache_rec_t;
+
+typedef struct dict_cache_file_t {
+	int64_t		mtime;
+	int64_t		size;
+	uint64_t	ino;
+	char		name[1];
+} dict_cache_file_t;
+
+typedef struct dict_cache_walk_t {
+	FILE		*fp;
+	int		type;
+	fr_hash_table_t	*byname;
+	fr_hash_table_t	*byvalue;
+	int		byvalue_only;
+	size_t		length;
+} dict_cache_walk_t;
+
+static char *dict_cache_path = NULL;
+static int dict_cache_state = DICT_CACHE_NONE;
+
+/*
+ *	Set the file the dictionaries are cached in.  NULL turns
+ *	the cache off.
+ */
+int dict_cache_file(const char *file)
+{
+	free(dict_cache_path);
+	dict_cache_path = NULL;
+
+	if (!file) return 0;
+
+	dict_cache_path = strdup(file);
+	if (!dict_cache_path) {
+		fr_strerror_printf("dict_cache_file: out of memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	What the last call to dict_init() did with the cache.
+ */
+int dict_cache_status(void)
+{
+	return dict_cache_state;
+}
+
+/*
+ *	A checksum of where everything is in the structures which go
+ *	into the cache.  The bit fields can't be found with offsetof(),
+ *	so we set each one in turn, and look at the bytes.
+ */
+#define DICT_LAYOUT(_s, _f) do { \
+	off = offsetof(_s, _f); \
+	hash = fr_hash_update(&off, sizeof(off), hash); \
+	} while (0)
+
+#define DICT_LAYOUT_FLAG(_f, _v) do { \
+	memset(&flags, 0, sizeof(flags)); \
+	flags._f = _v; \
+	hash = fr_hash_update(&flags, sizeof(flags), hash); \
+	} while (0)
+
+static uint32_t dict_cache_layout(void)
+{
+	uint32_t hash = FNV_MAGIC_INIT;
+	uint32_t off;
+	ATTR_FLAGS flags;
+
+	DICT_LAYOUT(DICT_VENDOR, vendorpec);
+	DICT_LAYOUT(DICT_VENDOR, type);
+	DICT_LAYOUT(DICT_VENDOR, length);
+	DICT_LAYOUT(DICT_VENDOR, flags);
+	DICT_LAYOUT(DICT_VENDOR, name);
+
+	DICT_LAYOUT(DICT_ATTR, attr);
+	DICT_LAYOUT(DICT_ATTR, type);
+	DICT_LAYOUT(DICT_ATTR, vendor);
+	DICT_LAYOUT(DICT_ATTR, flags);
+	DICT_LAYOUT(DICT_ATTR, name);
+
+	DICT_LAYOUT(DICT_VALUE, attr);
+	DICT_LAYOUT(DICT_VALUE, vendor);
+	DICT_LAYOUT(DICT_VALUE, value);
+	DICT_LAYOUT(DICT_VALUE, name);
+
+	DICT_LAYOUT(ATTR_FLAGS, tag);
+	DICT_LAYOUT(ATTR_FLAGS, encrypt);
+	DICT_LAYOUT(ATTR_FLAGS, length);
+
+	DICT_LAYOUT_FLAG(addport, 1);
+	DICT_LAYOUT_FLAG(has_tag, 1);
+	DICT_LAYOUT_FLAG(do_xlat, 1);
+	DICT_LAYOUT_FLAG(unknown_attr, 1);
+	DICT_LAYOUT_FLAG(array, 1);
+	DICT_LAYOUT_FLAG(has_value, 1);
+	DICT_LAYOUT_FLAG(has_value_alias, 1);
+	DICT_LAYOUT_FLAG(has_tlv, 1);
+	DICT_LAYOUT_FLAG(is_tlv, 1);
+	DICT_LAYOUT_FLAG(extended, 1);
+	DICT_LAYOUT_FLAG(extended_flags, 1);
+	DICT_LAYOUT_FLAG(evs, 1);
+	DICT_LAYOUT_FLAG(wimax, 1);
+	DICT_LAYOUT_FLAG(vsa_type, 7);
+	DICT_LAYOUT_FLAG(vsa_length, 3);
+
+	return hash;
+}
+
+static int dict_cache_write_rec(FILE *fp, int type, int tables,
+				const void *data, size_t size, size_t *total)
+{
+	dict_cache_rec_t rec;
+	static const uint8_t pad[8] = { 0 };
+	size_t padding = (8 - (size & 7)) & 7;
+
+	rec.type = type;
+	rec.tables = tables;
+	rec.length = sizeof(rec) + size + padding;
+
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1) return -1;
+	if (size && (fwrite(data, size, 1, fp) != 1)) return -1;
+	if (padding && (fwrite(pad, padding, 1, fp) != 1)) return -1;
+
+	*total += rec.length;
+	return 0;
+}
+
+/*
+ *	Write one entry of a hash table.  Entries which are in both
+ *	tables are written on the walk over the "byname" table.  The
+ *	walk over the "byvalue" table then picks up the ones which
+ *	have been replaced by a newer name.
+ */
+static int dict_cache_walk(void *ctx, void *data)
+{
+	int tables;
+	size_t size;
+	dict_cache_walk_t *walk = ctx;
+
+	if (walk->byvalue_only) {
+		if (fr_hash_table_finddata(walk->byname, data) == data) {
+			return 0;
+		}
+		tables = DICT_REC_BYVALUE;
+	} else {
+		tables = DICT_REC_BYNAME;
+		if (fr_hash_table_finddata(walk->byvalue, data) == data) {
+			tables |= DICT_REC_BYVALUE;
+		}
+	}
+
+	switch (walk->type) {
+	case DICT_REC_VENDOR:
+		size = sizeof(DICT_VENDOR) + strlen(((DICT_VENDOR *) data)->name);
+		break;
+
+	case DICT_REC_ATTR:
+		size = sizeof(DICT_ATTR) + strlen(((DICT_ATTR *) data)->name);
+		break;
+
+	case DICT_REC_VALUE:
+		size = sizeof(DICT_VALUE) + strlen(((DICT_VALUE *) data)->name);
+		break;
+
+	default:
+		return -1;
+	}
+
+	return dict_cache_write_rec(walk->fp, walk->type, tables, data, size,
+				    &walk->length);
+}
+
+static int dict_cache_walk_tables(dict_cache_walk_t *walk, int type,
+				  fr_hash_table_t *byname,
+				  fr_hash_table_t *byvalue)
+{
+	walk->type = type;
+	walk->byname = byname;
+	walk->byvalue = byvalue;
+
+	walk->byvalue_only = 0;
+	if (fr_hash_table_walk(byname, dict_cache_walk, walk) != 0) return -1;
+
+	walk->byvalue_only = 1;
+	if (fr_hash_table_walk(byvalue, dict_cache_walk, walk) != 0) return -1;
+
+	return 0;
+}
+
+/*
+ *	Write the dictionaries to a temporary file, and rename it
+ *	over the cache, so that nothing ever sees half a cache.
+ */
+static int dict_cache_save(const char *dir, const char *fn)
 {
+	int fd;
+	size_t len;
+	union {
+		dict_cache_file_t	file;
+		char			buffer[1024];
+	} rec;
+	char tmp[1024];
+	dict_cache_hdr_t hdr;
+	dict_cache_walk_t walk;
+	dict_stat_t *this;
+
+	snprintf(tmp, sizeof(tmp), "%s.%u", dict_cache_path,
+		 (unsigned int) getpid());
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0) {
+		fr_strerror_printf("dict_cache_save: Failed creating %s: %s",
+				   tmp, strerror(errno));
+		return -1;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	walk.fp = fdopen(fd, "w");
+	if (!walk.fp) {
+		close(fd);
+		unlink(tmp);
+		fr_strerror_printf("dict_cache_save: Failed opening %s: %s",
+				   tmp, strerror(errno));
+		return -1;
+	}
+
 	/*
-	 *	Check if we need to change anything.  If not, don't do
-	 *	anything.
+	 *	The length is filled in at the end.
 	 */
-	if (dict_stat_check(dir, fn)) {
-		return 0;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DICT_CACHE_MAGIC;
+	hdr.version = DICT_CACHE_VERSION;
+	hdr.sizes = DICT_CACHE_SIZES;
+	hdr.layout = dict_cache_layout();
+	strlcpy(hdr.build, RADIUSD_VERSION, sizeof(hdr.build));
+	if (fwrite(&hdr, sizeof(hdr), 1, walk.fp) != 1) goto error;
+	walk.length = sizeof(hdr);
+
+	len = strlcpy(rec.buffer, dir, sizeof(rec.buffer)) + 1;
+	if (len >= sizeof(rec.buffer)) goto error;
+	len += strlcpy(rec.buffer + len, fn, sizeof(rec.buffer) - len) + 1;
+	if (len > sizeof(rec.buffer)) goto error;
+
+	if (dict_cache_write_rec(walk.fp, DICT_REC_ROOT, 0, rec.buffer, len,
+				 &walk.length) < 0) goto error;
+
+	/*
+	 *	Files go first, so that a stale cache is noticed before
+	 *	anything is loaded from it.
+	 */
+	for (this = stat_head; this != NULL; this = this->next) {
+		dict_cache_file_t *file;
+
+		len = strlen(this->name);
+		if ((sizeof(*file) + len) > sizeof(rec.buffer)) goto error;
+
+		file = &rec.file;
+		memset(file, 0, sizeof(*file));
+		file->mtime = this->mtime;
+		file->size = this->size;
+		file->ino = this->ino;
+		memcpy(file->name, this->name, len + 1);
+
+		if (dict_cache_write_rec(walk.fp, DICT_REC_FILE, 0, file,
+					 sizeof(*file) + len,
+					 &walk.length) < 0) goto error;
 	}
 
 	/*
-	 *	Free the dictionaries, and the stat cache.
+	 *	Vendors before attributes before values, so that the
+	 *	loader never sees something it can't yet look up.
 	 */
-	dict_free();
-	stat_root_dir = strdup(dir);
-	stat_root_file = strdup(fn);
+	if ((dict_cache_walk_tables(&walk, DICT_REC_VENDOR,
+				    vendors_byname, vendors_byvalue) < 0) ||
+	    (dict_cache_walk_tables(&walk, DICT_REC_ATTR,
+				    attributes_byname, attributes_byvalue) < 0) ||
+	    (dict_cache_walk_tables(&walk, DICT_REC_VALUE,
+				    values_byname, values_byvalue) < 0)) {
+		goto error;
+	}
+
+	hdr.length = walk.length;
+	if ((fseek(walk.fp, 0, SEEK_SET) < 0) ||
+	    (fwrite(&hdr, sizeof(hdr), 1, walk.fp) != 1)) goto error;
+
+	if (fclose(walk.fp) != 0) {
+		walk.fp = NULL;
+		goto error;
+	}
+
+	if (rename(tmp, dict_cache_path) < 0) {
+		fr_strerror_printf("dict_cache_save: Failed renaming %s to %s: %s",
+				   tmp, dict_cache_path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+
+ error:
+	fr_strerror_printf("dict_cache_save: Failed writing %s: %s",
+			   tmp, strerror(errno));
+	if (walk.fp) fclose(walk.fp);
+	unlink(tmp);
+	return -1;
+}
+
+/*
+ *	Check that the name is terminated inside of the record.
+ */
+static int dict_cache_name_ok(const uint8_t *name, const uint8_t *end,
+			      size_t max)
+{
+	const uint8_t *p;
+
+	p = memchr(name, '\0', end - name);
+	if (!p) return 0;
+
+	return ((size_t) (p - name) < max);
+}
+
+/*
+ *	Copy one entry from the cache into the pool, and insert it
+ *	into the tables named in the record.
+ */
+static void *dict_cache_insert(const dict_cache_rec_t *rec,
+			       const uint8_t *data, size_t size,
+			       fr_hash_table_t *byname,
+			       fr_hash_table_t *byvalue)
+{
+	void *ptr;
+
+	if (!rec->tables ||
+	    ((rec->tables & ~(DICT_REC_BYNAME | DICT_REC_BYVALUE)) != 0)) {
+		return NULL;
+	}
+
+	ptr = fr_pool_alloc(size);
+	if (!ptr) return NULL;
+	memcpy(ptr, data, size);
+
+	if ((rec->tables & DICT_REC_BYNAME) &&
+	    !fr_hash_table_insert(byname, ptr)) return NULL;
+
+	if ((rec->tables & DICT_REC_BYVALUE) &&
+	    !fr_hash_table_insert(byvalue, ptr)) return NULL;
+
+	return ptr;
+}
+
+/*
+ *	Load the dictionaries from the cache, if it was built from
+ *	the same files, and none of them have changed.  The tables
+ *	must be empty.  If this fails, they're left half-full, and
+ *	the caller has to start over.
+ */
+static int dict_cache_load(const char *dir, const char *fn)
+{
+	int fd, rcode = -1, have_root = 0;
+	size_t len;
+	struct stat buf;
+	uint8_t *map, *p, *end;
+	const dict_cache_hdr_t *hdr;
+
+	fd = open(dict_cache_path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	if ((fstat(fd, &buf) < 0) ||
+	    !S_ISREG(buf.st_mode) ||
+#ifdef S_IWOTH
+	    ((buf.st_mode & S_IWOTH) != 0) ||
+#endif
+	    (buf.st_size < (off_t) sizeof(*hdr))) {
+		close(fd);
+		return -1;
+	}
+	len = buf.st_size;
+
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	hdr = (const dict_cache_hdr_t *) map;
+	if ((hdr->magic != DICT_CACHE_MAGIC) ||
+	    (hdr->version != DICT_CACHE_VERSION) ||
+	    (hdr->sizes != DICT_CACHE_SIZES) ||
+	    (hdr->layout != dict_cache_layout()) ||
+	    (strncmp(hdr->build, RADIUSD_VERSION, sizeof(hdr->build)) != 0) ||
+	    (hdr->length != len)) goto done;
+
+	end = map + len;
+	for (p = map + sizeof(*hdr); p < end; p += ((const dict_cache_rec_t *) p)->length) {
+		const dict_cache_rec_t *rec = (const dict_cache_rec_t *) p;
+		const uint8_t *data = p + sizeof(*rec);
+		size_t size;
 
+		if (((size_t) (end - p) < sizeof(*rec)) ||
+		    (rec->length < sizeof(*rec)) ||
+		    ((rec->length & 7) != 0) ||
+		    (rec->length > (size_t) (end - p))) goto done;
+		size = rec->length - sizeof(*rec);
+
+		/*
+		 *	The root has to be the first thing in the
+		 *	cache, and it has to be the one we were asked
+		 *	to load.
+		 */
+		if (!have_root) {
+			const uint8_t *q;
+
+			if (rec->type != DICT_REC_ROOT) goto done;
+
+			q = memchr(data, '\0', size);
+			if (!q || (strcmp((const char *) data, dir) != 0)) goto done;
+			q++;
+			if (!memchr(q, '\0', (data + size) - q) ||
+			    (strcmp((const char *) q, fn) != 0)) goto done;
+
+			have_root = 1;
+			continue;
+		}
+
+		switch (rec->type) {
+		case DICT_REC_FILE:
+		{
+			const dict_cache_file_t *file = (const dict_cache_file_t *) data;
+
+			if (size < sizeof(*file)) goto done;
+			if (!dict_cache_name_ok((const uint8_t *) file->name,
+						data + size, size)) goto done;
+
+			if ((stat(file->name, &buf) < 0) ||
+			    !S_ISREG(buf.st_mode) ||
+#ifdef S_IWOTH
+			    ((buf.st_mode & S_IWOTH) != 0) ||
+#endif
+			    (buf.st_mtime != file->mtime) ||
+			    (buf.st_size != file->size) ||
+			    (buf.st_ino != file->ino)) goto done;
+
+			dict_stat_add(file->name, &buf);
+		}
+			break;
+
+		case DICT_REC_VENDOR:
+			if (size < sizeof(DICT_VENDOR)) goto done;
+			if (!dict_cache_name_ok((const uint8_t *) ((const DICT_VENDOR *) data)->name,
+						data + size,
+						DICT_VENDOR_MAX_NAME_LEN)) goto done;
+
+			if (!dict_cache_insert(rec, data, size, vendors_byname,
+					       vendors_byvalue)) goto done;
+			break;
+
+		case DICT_REC_ATTR:
+		{
+			DICT_ATTR *da;
+
+			if (size < sizeof(DICT_ATTR)) goto done;
+			if (!dict_cache_name_ok((const uint8_t *) ((const DICT_ATTR *) data)->name,
+						data + size,
+						DICT_ATTR_MAX_NAME_LEN)) goto done;
+
+			da = dict_cache_insert(rec, data, size,
+					       attributes_byname,
+					       attributes_byvalue);
+			if (!da) goto done;
+
+			if (da->vendor) break;
+
+			if ((int) da->attr > max_attr) max_attr = da->attr;
+
+			if ((rec->tables & DICT_REC_BYVALUE) &&
+			    (da->attr > 0) && (da->attr < 256)) {
+				dict_base_attrs[da->attr] = da;
+			}
+		}
+			break;
+
+		case DICT_REC_VALUE:
+			if (size < sizeof(DICT_VALUE)) goto done;
+			if (!dict_cache_name_ok((const uint8_t *) ((const DICT_VALUE *) data)->name,
+						data + size,
+						DICT_VALUE_MAX_NAME_LEN)) goto done;
+
+			if (!dict_cache_insert(rec, data, size, values_byname,
+					       values_byvalue)) goto done;
+			break;
+
+		default:
+			goto done;
+		}
+	}
+
+	if (have_root) rcode = 0;
+
+ done:
+	munmap(map, len);
+	return rcode;
+}
+
+/*
+ *	Create the (empty) hash tables.
+ */
+static int dict_tables_init(void)
+{
 	/*
 	 *	Create the table of vendor by name.   There MAY NOT
 	 *	be multiple vendors of the same name.
@@ -2176,6 +2723,73 @@ int dict_init(const char *dir, const char *fn)
 		return -1;
 	}
 
+	return 0;
+}
+
+/*
+ *	Free the dictionaries, and the stat cache, and start again
+ *	with empty tables.
+ */
+static int dict_reset(const char *dir, const char *fn)
+{
+	dict_free();
+	stat_root_dir = strdup(dir);
+	stat_root_file = strdup(fn);
+
+	return dict_tables_init();
+}
+
+/*
+ *	Walk over all of the hash tables to ensure they're
+ *	initialized.  We do this because the threads may perform
+ *	lookups, and we don't want multi-threaded re-ordering
+ *	of the table entries.  That would be bad.
+ */
+static void dict_tables_walk(void)
+{
+	fr_hash_table_walk(vendors_byname, null_callback, NULL);
+	fr_hash_table_walk(vendors_byvalue, null_callback, NULL);
+
+	fr_hash_table_walk(attributes_byname, null_callback, NULL);
+	fr_hash_table_walk(attributes_byvalue, null_callback, NULL);
+
+	fr_hash_table_walk(values_byvalue, null_callback, NULL);
+	fr_hash_table_walk(values_byname, null_callback, NULL);
+}
+
+/*
+ *	Initialize the directory, then fix the attr member of
+ *	all attributes.
+ */
+int dict_init(const char *dir, const char *fn)
+{
+	dict_cache_state = DICT_CACHE_NONE;
+
+	/*
+	 *	Check if we need to change anything.  If not, don't do
+	 *	anything.
+	 */
+	if (dict_stat_check(dir, fn)) {
+		return 0;
+	}
+
+	if (dict_reset(dir, fn) < 0) return -1;
+
+	/*
+	 *	If the cache is up to date, we don't need to look at
+	 *	the text files.  If it isn't, throw away anything
+	 *	it loaded, and parse them.
+	 */
+	if (dict_cache_path) {
+		if (dict_cache_load(dir, fn) == 0) {
+			dict_cache_state = DICT_CACHE_LOADED;
+			dict_tables_walk();
+			return 0;
+		}
+
+		if (dict_reset(dir, fn) < 0) return -1;
+	}
+
 	value_fixup = NULL;	/* just to be safe. */
 
 	if (my_dict_init(dir, fn, NULL, 0) < 0)
@@ -2225,20 +2839,20 @@ int dict_init(const char *dir, const char *fn)
 		}
 	}
 
+	dict_tables_walk();
+
 	/*
-	 *	Walk over all of the hash tables to ensure they're
-	 *	initialized.  We do this because the threads may perform
-	 *	lookups, and we don't want multi-threaded re-ordering
-	 *	of the table entries.  That would be bad.
+	 *	A cache we can't write isn't a reason to stop.  The
+	 *	caller can find out why from dict_cache_status() and
+	 *	fr_strerror().
 	 */
-	fr_hash_table_walk(vendors_byname, null_callback, NULL);
-	fr_hash_table_walk(vendors_byvalue, null_callback, NULL);
-
-	fr_hash_table_walk(attributes_byname, null_callback, NULL);
-	fr_hash_table_walk(attributes_byvalue, null_callback, NULL);
-
-	fr_hash_table_walk(values_byvalue, null_callback, NULL);
-	fr_hash_table_walk(values_byname, null_callback, NULL);
+	if (dict_cache_path) {
+		if (dict_cache_save(dir, fn) < 0) {
+			dict_cache_state = DICT_CACHE_FAILED;
+		} else {
+			dict_cache_state = DICT_CACHE_WRITTEN;
+		}
+	}
 
 	return 0;
 }
@@ -2359,3 +2973,134 @@ DICT_VENDOR *dict_vendorbyvalue(int vendorpec)
 
 	return fr_hash_table_finddata(vendors_byvalue, &dv);
 }
+
+#ifdef TESTING
+/*
+ *  cc -O2 -DTESTING -D_LIBRADIUS -I ../ dict.c .libs/libfreeradius-radius.a -lpthread
+ *
+ *  ./a.out ../../share /tmp/dictionary.cache [loops]
+ *
+ *  Time parsing the dictionaries, and loading them from the
+ *  binary cache.  Then check that both leave the same entries
+ *  in the same tables.
+ */
+#include <sys/time.h>
+
+typedef struct dict_sum_t {
+	size_t		size;
+	size_t		name;		/* offset */
+	int		count;
+	uint32_t	hash;
+} dict_sum_t;
+
+/*
+ *	Order doesn't matter, so add up the hashes of the entries.
+ */
+static int dict_sum(void *ctx, void *data)
+{
+	dict_sum_t *sum = ctx;
+
+	sum->count++;
+	sum->hash += fr_hash(data, sum->size + strlen((char *) data + sum->name));
+
+	return 0;
+}
+
+static void dict_sum_tables(dict_sum_t sums[7])
+{
+	int i;
+
+	memset(sums, 0, sizeof(sums[0]) * 7);
+	sums[0].size = sums[1].size = sizeof(DICT_VENDOR);
+	sums[2].size = sums[3].size = sizeof(DICT_ATTR);
+	sums[4].size = sums[5].size = sizeof(DICT_VALUE);
+	sums[0].name = sums[1].name = offsetof(DICT_VENDOR, name);
+	sums[2].name = sums[3].name = offsetof(DICT_ATTR, name);
+	sums[4].name = sums[5].name = offsetof(DICT_VALUE, name);
+
+	fr_hash_table_walk(vendors_byname, dict_sum, &sums[0]);
+	fr_hash_table_walk(vendors_byvalue, dict_sum, &sums[1]);
+	fr_hash_table_walk(attributes_byname, dict_sum, &sums[2]);
+	fr_hash_table_walk(attributes_byvalue, dict_sum, &sums[3]);
+	fr_hash_table_walk(values_byname, dict_sum, &sums[4]);
+	fr_hash_table_walk(values_byvalue, dict_sum, &sums[5]);
+
+	for (i = 1; i < 256; i++) {
+		if (!dict_base_attrs[i]) continue;
+		sums[6].count++;
+		sums[6].hash += fr_hash(dict_base_attrs[i]->name,
+					strlen(dict_base_attrs[i]->name));
+	}
+}
+
+static int dict_time(const char *dir, const char *cache, int loops,
+		     int expect)
+{
+	int i;
+	struct timeval start, end;
+	double usec;
+
+	dict_cache_file(cache);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		dict_free();
+		if (dict_init(dir, "dictionary") < 0) {
+			fprintf(stderr, "%s\n", fr_strerror());
+			return -1;
+		}
+		if (dict_cache_status() != expect) {
+			fprintf(stderr, "Unexpected cache status %d: %s\n",
+				dict_cache_status(), fr_strerror());
+			return -1;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0;
+	usec += end.tv_usec - start.tv_usec;
+
+	printf("%-8s %10.0f usec/init\n",
+	       (expect == DICT_CACHE_LOADED) ? "cache" : "parse",
+	       usec / loops);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, loops = 20;
+	dict_sum_t parsed[7], loaded[7];
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s dir cache [loops]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 3) loops = atoi(argv[3]);
+	if (loops < 1) loops = 1;
+
+	unlink(argv[2]);
+
+	if (dict_time(argv[1], NULL, loops, DICT_CACHE_NONE) < 0) exit(1);
+	if (dict_time(argv[1], argv[2], 1, DICT_CACHE_WRITTEN) < 0) exit(1);
+	dict_sum_tables(parsed);
+
+	if (dict_time(argv[1], argv[2], loops, DICT_CACHE_LOADED) < 0) exit(1);
+	dict_sum_tables(loaded);
+
+	for (i = 0; i < 7; i++) {
+		if ((parsed[i].count != loaded[i].count) ||
+		    (parsed[i].hash != loaded[i].hash)) {
+			fprintf(stderr, "Table %d differs: %d entries parsed, %d loaded\n",
+				i, parsed[i].count, loaded[i].count);
+			exit(1);
+		}
+	}
+
+	printf("%d vendors, %d attributes, %d values: same from both\n",
+	       parsed[0].count, parsed[2].count, parsed[5].count);
+
+	dict_cache_file(NULL);
+	dict_free();
+	return 0;
+}
+#endif
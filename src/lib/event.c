@@ -53,6 +53,9 @@ struct fr_event_list_t {
 
 	int		max_readers;
 	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+
+	int		max_writers;
+	fr_event_fd_t	writers[FR_EV_MAX_FDS];
 };
 
 /*
@@ -115,6 +118,7 @@ fr_event_list_t *fr_event_list_create(fr_event_status_t status)
 
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
+		el->writers[i].fd = -1;
 	}
 
 	el->status = status;
@@ -236,26 +240,38 @@ int fr_event_now(fr_event_list_t *el, struct timeval *when)
 }
 
 
+/*
+ *	"type" is 0 to call the handler when the FD is readable, and 1
+ *	to call it when the FD is writable.  An FD can have one of each.
+ */
 int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		       fr_event_fd_handler_t handler, void *ctx)
 {
-	int i;
-	fr_event_fd_t *ef;
+	int i, *max_fds;
+	fr_event_fd_t *ef, *fds;
 
 	if (!el || (fd < 0) || !handler || !ctx) return 0;
 
-	if (type != 0) return 0;
+	if (type == 0) {
+		fds = el->readers;
+		max_fds = &el->max_readers;
+	} else if (type == 1) {
+		fds = el->writers;
+		max_fds = &el->max_writers;
+	} else {
+		return 0;
+	}
 
-	if (el->max_readers >= FR_EV_MAX_FDS) return 0;
+	if (*max_fds >= FR_EV_MAX_FDS) return 0;
 
 	ef = NULL;
-	for (i = 0; i <= el->max_readers; i++) {
+	for (i = 0; i <= *max_fds; i++) {
 		/*
 		 *	Be fail-safe on multiple inserts.
 		 */
-		if (el->readers[i].fd == fd) {
-			if ((el->readers[i].handler != handler) ||
-			    (el->readers[i].ctx != ctx)) {
+		if (fds[i].fd == fd) {
+			if ((fds[i].handler != handler) ||
+			    (fds[i].ctx != ctx)) {
 				return 0;
 			}
 
@@ -265,10 +281,10 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 			return 1;
 		}
 
-		if (el->readers[i].fd < 0) {
-			ef = &el->readers[i];
+		if (fds[i].fd < 0) {
+			ef = &fds[i];
 
-			if (i == el->max_readers) el->max_readers = i + 1;
+			if (i == *max_fds) *max_fds = i + 1;
 			break;
 		}
 	}
@@ -286,16 +302,25 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 
 int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 {
-	int i;
+	int i, *max_fds;
+	fr_event_fd_t *fds;
 
 	if (!el || (fd < 0)) return 0;
 
-	if (type != 0) return 0;
+	if (type == 0) {
+		fds = el->readers;
+		max_fds = &el->max_readers;
+	} else if (type == 1) {
+		fds = el->writers;
+		max_fds = &el->max_writers;
+	} else {
+		return 0;
+	}
 
-	for (i = 0; i < el->max_readers; i++) {
-		if (el->readers[i].fd == fd) {
-			el->readers[i].fd = -1;
-			if ((i + 1) == el->max_readers) el->max_readers = i;
+	for (i = 0; i < *max_fds; i++) {
+		if (fds[i].fd == fd) {
+			fds[i].fd = -1;
+			if ((i + 1) == *max_fds) *max_fds = i;
 			el->changed = 1;
 			return 1;
 		}
@@ -315,9 +340,9 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 
 int fr_event_loop(fr_event_list_t *el)
 {
-	int i, rcode, maxfd = 0;
+	int i, rcode, maxfd = 0, num_writers = 0;
 	struct timeval when, *wake;
-	fd_set read_fds, master_fds;
+	fd_set read_fds, master_fds, write_fds, master_write_fds;
 
 	el->exit = 0;
 	el->dispatch = 1;
@@ -338,6 +363,19 @@ int fr_event_loop(fr_event_list_t *el)
 				}
 				FD_SET(el->readers[i].fd, &master_fds);
 			}
+
+			FD_ZERO(&master_write_fds);
+			num_writers = 0;
+
+			for (i = 0; i < el->max_writers; i++) {
+				if (el->writers[i].fd < 0) continue;
+
+				if (el->writers[i].fd > maxfd) {
+					maxfd = el->writers[i].fd;
+				}
+				FD_SET(el->writers[i].fd, &master_write_fds);
+				num_writers++;
+			}
 			
 			el->changed = 0;
 		}
@@ -388,7 +426,9 @@ int fr_event_loop(fr_event_list_t *el)
 		if (el->status) el->status(wake);
 
 		read_fds = master_fds;
-		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+		write_fds = master_write_fds;
+		rcode = select(maxfd + 1, &read_fds,
+			       num_writers ? &write_fds : NULL, NULL, wake);
 		if ((rcode < 0) && (errno != EINTR)) {
 			fr_strerror_printf("Failed in select: %s",
 					   strerror(errno));
@@ -416,6 +456,20 @@ int fr_event_loop(fr_event_list_t *el)
 
 			if (el->changed) break;
 		}
+
+		if (!num_writers || el->changed) continue;
+
+		for (i = 0; i < el->max_writers; i++) {
+			fr_event_fd_t *ef = &el->writers[i];
+
+			if (ef->fd < 0) continue;
+
+			if (!FD_ISSET(ef->fd, &write_fds)) continue;
+
+			ef->handler(el, ef->fd, ef->ctx);
+
+			if (el->changed) break;
+		}
 	}
 
 	el->dispatch = 0;
@@ -193,6 +193,79 @@ fr_MD5Final(uint8_t digest[MD5_DIGEST_LENGTH], FR_MD5_CTX *ctx)
 #define MD5STEP(f, w, x, y, z, data, s) \
 	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
 
+/*
+ * The 64 steps, shared by the one block and the many lane transforms.
+ */
+#define MD5_ROUNDS do {							\
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);		\
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);		\
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);		\
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);		\
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);		\
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);		\
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);		\
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);		\
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);		\
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);		\
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);		\
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);		\
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);		\
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);		\
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);		\
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);		\
+									\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);		\
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);		\
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);		\
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);		\
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);		\
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);		\
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);		\
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);		\
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);		\
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);		\
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);		\
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);		\
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);		\
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);		\
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);		\
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);		\
+									\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);		\
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);		\
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);		\
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);		\
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);		\
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);		\
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);		\
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);		\
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);		\
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);		\
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);		\
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);		\
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);		\
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);		\
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);		\
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);		\
+									\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);		\
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);		\
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);		\
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);		\
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);		\
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);		\
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);		\
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);		\
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);		\
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);		\
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);		\
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);		\
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);		\
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);		\
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);		\
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);		\
+} while (0)
+
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
  * reflect the addition of 16 longwords of new data.  fr_MD5Update blocks
@@ -216,73 +289,7 @@ fr_MD5Transform(uint32_t state[4], const uint8_t block[MD5_BLOCK_LENGTH])
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS;
 
 	state[0] += a;
 	state[1] += b;
@@ -290,3 +297,239 @@ fr_MD5Transform(uint32_t state[4], const uint8_t block[MD5_BLOCK_LENGTH])
 	state[3] += d;
 }
 #endif
+
+/*
+ *	Hash several independent messages at once.  Each message
+ *	gets one lane of a vector, so the 64 steps are done for all
+ *	of them together.  With GCC, the vectors are SSE2 or AVX2,
+ *	picked when the library is loaded.  Without it, or with
+ *	OpenSSL doing MD5, this is a loop over fr_md5_calc().
+ *
+ *	Messages of different lengths are fine.  A short message's
+ *	lane carries on hashing zeros, and we ignore the result.
+ */
+#if !defined(WITH_OPENSSL_MD5) && defined(__GNUC__) && (__GNUC__ >= 4)
+#define MD5_MULTI (1)
+
+typedef uint32_t md5_lanes_t __attribute__((vector_size(FR_MD5_LANES * 4)));
+
+#if defined(__x86_64__) && defined(__linux__) && (__GNUC__ >= 6)
+#define MD5_DISPATCH __attribute__((target_clones("avx2", "default")))
+#else
+#define MD5_DISPATCH
+#endif
+
+MD5_DISPATCH
+static void md5_transform_lanes(md5_lanes_t state[4],
+				const uint32_t words[MD5_BLOCK_LENGTH / 4][FR_MD5_LANES])
+{
+	md5_lanes_t a, b, c, d, in[MD5_BLOCK_LENGTH / 4];
+
+	memcpy(in, words, sizeof(in));
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	MD5_ROUNDS;
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+static const uint8_t md5_zero_block[MD5_BLOCK_LENGTH];
+
+static void md5_calc_lanes(uint8_t *output[], const uint8_t *input[],
+			   const size_t inlen[], int num)
+{
+	int i, j, lane;
+	size_t full[FR_MD5_LANES], blocks[FR_MD5_LANES], max;
+	uint8_t tail[FR_MD5_LANES][MD5_BLOCK_LENGTH * 2];
+	md5_lanes_t state[4];
+	uint32_t in[MD5_BLOCK_LENGTH / 4][FR_MD5_LANES];
+	uint32_t words[MD5_BLOCK_LENGTH / 4];
+
+	/*
+	 *	The last part of each message, with its padding and
+	 *	length, is one or two blocks.  The full blocks before
+	 *	it are read directly from the input.
+	 */
+	max = 0;
+	for (lane = 0; lane < num; lane++) {
+		size_t left, padded;
+		uint32_t bits[2];
+
+		full[lane] = inlen[lane] / MD5_BLOCK_LENGTH;
+		left = inlen[lane] % MD5_BLOCK_LENGTH;
+		padded = (left < MD5_BLOCK_LENGTH - 8) ?
+			MD5_BLOCK_LENGTH : MD5_BLOCK_LENGTH * 2;
+
+		memset(tail[lane], 0, padded);
+		memcpy(tail[lane],
+		       input[lane] + full[lane] * MD5_BLOCK_LENGTH, left);
+		tail[lane][left] = 0x80;
+		bits[0] = inlen[lane] << 3;
+		bits[1] = ((uint64_t) inlen[lane]) >> 29;
+		PUT_64BIT_LE(tail[lane] + padded - 8, bits);
+
+		blocks[lane] = full[lane] + (padded / MD5_BLOCK_LENGTH);
+		if (blocks[lane] > max) max = blocks[lane];
+	}
+
+	for (i = 0; i < FR_MD5_LANES; i++) {
+		state[0][i] = 0x67452301;
+		state[1][i] = 0xefcdab89;
+		state[2][i] = 0x98badcfe;
+		state[3][i] = 0x10325476;
+	}
+
+	for (i = 0; i < (int) max; i++) {
+		for (lane = 0; lane < FR_MD5_LANES; lane++) {
+			const uint8_t *block;
+
+			if ((lane >= num) || (i >= (int) blocks[lane])) {
+				block = md5_zero_block;
+			} else if (i < (int) full[lane]) {
+				block = input[lane] + i * MD5_BLOCK_LENGTH;
+			} else {
+				block = tail[lane] +
+					(i - full[lane]) * MD5_BLOCK_LENGTH;
+			}
+
+#ifndef WORDS_BIGENDIAN
+			/*
+			 *	One copy is a lot cheaper than assembling
+			 *	each word from bytes.
+			 */
+			memcpy(words, block, sizeof(words));
+#else
+			for (j = 0; j < MD5_BLOCK_LENGTH / 4; j++) {
+				words[j] = (uint32_t)(
+				    (uint32_t)(block[j * 4 + 0]) |
+				    (uint32_t)(block[j * 4 + 1]) <<  8 |
+				    (uint32_t)(block[j * 4 + 2]) << 16 |
+				    (uint32_t)(block[j * 4 + 3]) << 24);
+			}
+#endif
+			for (j = 0; j < MD5_BLOCK_LENGTH / 4; j++) {
+				in[j][lane] = words[j];
+			}
+		}
+
+		md5_transform_lanes(state, in);
+
+		for (lane = 0; lane < num; lane++) {
+			if (i != (int) blocks[lane] - 1) continue;
+
+			for (j = 0; j < 4; j++) {
+				PUT_32BIT_LE(output[lane] + j * 4,
+					     state[j][lane]);
+			}
+		}
+	}
+}
+#endif
+
+void fr_md5_calc_multi(uint8_t *output[], const uint8_t *input[],
+		       const size_t inlen[], int num)
+{
+	int i;
+
+#ifdef MD5_MULTI
+	for (i = 0; i < num; i += FR_MD5_LANES) {
+		int lanes = num - i;
+
+		if (lanes > FR_MD5_LANES) lanes = FR_MD5_LANES;
+
+		md5_calc_lanes(output + i, input + i, inlen + i, lanes);
+	}
+#else
+	for (i = 0; i < num; i++) {
+		fr_md5_calc(output[i], input[i], inlen[i]);
+	}
+#endif
+}
+
+#ifdef TESTING
+/*
+ *  cc -O2 -DTESTING -I ../ md5.c -o md5
+ *
+ *  ./md5 [packets]
+ *
+ *  Hashes synthetic Access-Requests plus a secret, the way the
+ *  authenticators do, one at a time and FR_MD5_LANES at a time.
+ */
+#include <sys/time.h>
+
+#define NUM_UNIQUE (1024)
+
+static double now(void)
+{
+	struct timeval when;
+
+	gettimeofday(&when, NULL);
+	return when.tv_sec + (when.tv_usec / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, loops;
+	static uint8_t packets[NUM_UNIQUE][4096 + 16];
+	static uint8_t one[NUM_UNIQUE][16], multi[NUM_UNIQUE][16];
+	size_t len[NUM_UNIQUE];
+	const uint8_t *in[NUM_UNIQUE];
+	uint8_t *out[NUM_UNIQUE];
+	double start, scalar, lanes;
+
+	loops = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	srandom(1);
+	for (i = 0; i < NUM_UNIQUE; i++) {
+		/*
+		 *	Mostly 60..250 bytes, with the odd large one.
+		 */
+		len[i] = 60 + (random() % 190);
+		if ((i % 64) == 0) len[i] = random() % 4096;
+
+		for (j = 0; j < (int) len[i]; j++) {
+			packets[i][j] = random();
+		}
+		memcpy(packets[i] + len[i], "testing123", 10);
+		len[i] += 10;
+
+		in[i] = packets[i];
+		out[i] = multi[i];
+	}
+
+	start = now();
+	for (i = 0; i < loops; i++) {
+		j = i % NUM_UNIQUE;
+		fr_md5_calc(one[j], in[j], len[j]);
+	}
+	scalar = now() - start;
+
+	start = now();
+	for (i = 0; i < loops; i += FR_MD5_LANES) {
+		j = i % NUM_UNIQUE;
+		fr_md5_calc_multi(out + j, in + j, len + j, FR_MD5_LANES);
+	}
+	lanes = now() - start;
+
+	for (i = 0; i < NUM_UNIQUE; i++) {
+		if (memcmp(one[i], multi[i], 16) != 0) {
+			fprintf(stderr, "Digest %d differs\n", i);
+			exit(1);
+		}
+	}
+
+	printf("%d packets\n", loops);
+	printf("fr_md5_calc:       %.1f ns/packet\n", scalar * 1e9 / loops);
+	printf("fr_md5_calc_multi: %.1f ns/packet (%d lanes)\n",
+	       lanes * 1e9 / loops, FR_MD5_LANES);
+
+	return 0;
+}
+#endif
@@ -38,6 +38,10 @@ RCSID("$Id$")
 #include	<malloc.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#endif
+
 #if 0
 #define VP_TRACE if (fr_debug_flag) printf
 #else
@@ -522,6 +526,7 @@ static void make_secret(uint8_t *digest, const uint8_t *vector,
 }
 
 #define MAX_PASS_LEN (128)
+#define MAX_PWDECODE_SECRET (64)
 static void make_passwd(uint8_t *output, ssize_t *outlen,
 			const uint8_t *input, size_t inlen,
 			const char *secret, const uint8_t *vector)
@@ -899,6 +904,7 @@ static ssize_t vp2data_any(const RADIUS_PACKET *packet,
 		len = 4;	/* just in case */
 		slvalue = htonl(vp->vp_signed);
 		memcpy(array, &slvalue, sizeof(slvalue));
+		data = array;
 		break;
 	}
 
@@ -1308,24 +1314,43 @@ static ssize_t vp2attr_vsa(const RADIUS_PACKET *packet,
 			   uint8_t *ptr, size_t room)
 {
 	ssize_t len;
-	DICT_VENDOR *dv;
+	size_t dv_type, dv_length;
 	const VALUE_PAIR *vp = *pvp;
 
 	/*
-	 *	Unknown vendor: RFC format.
+	 *	Attributes from the dictionary carry their vendor's
+	 *	format.  Others have to look it up.
+	 */
+	if (vp->flags.vsa_type && (vp->vendor == vendor)) {
+		dv_type = vp->flags.vsa_type;
+		dv_length = vp->flags.vsa_length;
+	} else {
+		DICT_VENDOR *dv;
+
+		/*
+		 *	Unknown vendor: RFC format.
+		 */
+		dv = dict_vendorbyvalue(vendor);
+		if (!dv) {
+			return vp2attr_rfc(packet, original, secret, pvp,
+					   attribute, ptr, room);
+		}
+		dv_type = dv->type;
+		dv_length = dv->length;
+	}
+
+	/*
 	 *	Known vendor and RFC format: go do that.
 	 */
-	dv = dict_vendorbyvalue(vendor);
-	if (!dv ||
-	    (!vp->flags.is_tlv && (dv->type == 1) && (dv->length == 1))) {
+	if (!vp->flags.is_tlv && (dv_type == 1) && (dv_length == 1)) {
 		return vp2attr_rfc(packet, original, secret, pvp,
 				   attribute, ptr, room);
 	}
 
-	switch (dv->type) {
+	switch (dv_type) {
 	default:
 		fr_strerror_printf("vp2attr_vsa: Internal sanity check failed,"
-				   " type %u", (unsigned) dv->type);
+				   " type %u", (unsigned) dv_type);
 		return -1;
 
 	case 4:
@@ -1345,39 +1370,39 @@ static ssize_t vp2attr_vsa(const RADIUS_PACKET *packet,
 		break;
 	}
 
-	switch (dv->length) {
+	switch (dv_length) {
 	default:
 		fr_strerror_printf("vp2attr_vsa: Internal sanity check failed,"
-				   " length %u", (unsigned) dv->length);
+				   " length %u", (unsigned) dv_length);
 		return -1;
 
 	case 0:
 		break;
 
 	case 2:
-		ptr[dv->type] = 0;
-		ptr[dv->type + 1] = dv->type + 2;
+		ptr[dv_type] = 0;
+		ptr[dv_type + 1] = dv_type + 2;
 		break;
 
 	case 1:
-		ptr[dv->type] = dv->type + 1;
+		ptr[dv_type] = dv_type + 1;
 		break;
 
 	}
 
-	if (room > ((unsigned) 255 - (dv->type + dv->length))) {
-		room = 255 - (dv->type + dv->length);
+	if (room > ((unsigned) 255 - (dv_type + dv_length))) {
+		room = 255 - (dv_type + dv_length);
 	}
 
 	len = vp2data_any(packet, original, secret, 0, pvp,
-			  ptr + dv->type + dv->length, room);
+			  ptr + dv_type + dv_length, room);
 	if (len <= 0) return len;
 
-	if (dv->length) ptr[dv->type + dv->length - 1] += len;
+	if (dv_length) ptr[dv_type + dv_length - 1] += len;
 
 #ifndef NDEBUG
 	if ((fr_debug_flag > 3) && fr_log_fp) {
-		switch (dv->type) {
+		switch (dv_type) {
 		default:
 			break;
 
@@ -1399,7 +1424,7 @@ static ssize_t vp2attr_vsa(const RADIUS_PACKET *packet,
 			break;
 		}
 		
-		switch (dv->length) {
+		switch (dv_length) {
 		default:
 			break;
 
@@ -1409,20 +1434,20 @@ static ssize_t vp2attr_vsa(const RADIUS_PACKET *packet,
 
 		case 1:
 			fprintf(fr_log_fp, "%02x  ",
-				ptr[dv->type]);
+				ptr[dv_type]);
 			break;
 
 		case 2:
 			fprintf(fr_log_fp, "%02x%02x  ",
-				ptr[dv->type], ptr[dv->type] + 1);
+				ptr[dv_type], ptr[dv_type] + 1);
 			break;
 		}
 
-		print_hex_data(ptr + dv->type + dv->length, len, 3);
+		print_hex_data(ptr + dv_type + dv_length, len, 3);
 	}
 #endif
 
-	return dv->type + dv->length + len;
+	return dv_type + dv_length + len;
 }
 
 
@@ -1471,6 +1496,11 @@ int rad_vp2vsa(const RADIUS_PACKET *packet, const RADIUS_PACKET *original,
 			  ptr + ptr[1], room);
 	if (len < 0) return len;
 
+	/*
+	 *	Don't send an empty Vendor-Specific.
+	 */
+	if (len == 0) return 0;
+
 #ifndef NDEBUG
 	if ((fr_debug_flag > 3) && fr_log_fp) {
 		fprintf(fr_log_fp, "\t\t%02x %02x  %02x%02x%02x%02x (%u)  ",
@@ -1766,6 +1796,70 @@ int rad_encode(RADIUS_PACKET *packet, const RADIUS_PACKET *original,
 	return 0;
 }
 
+/*
+ *	Message-Authenticator is HMAC-MD5 keyed with the shared
+ *	secret, and the key takes a whole MD5 block in each of the
+ *	inner and outer hashes.  We see the same few secrets over
+ *	and over, so we keep the keyed contexts for recently used
+ *	secrets, and skip those two blocks on every packet.
+ *
+ *	The other digests don't benefit: the authenticators hash
+ *	the secret last, and the password hiding hashes the secret
+ *	first but it's almost always shorter than a block, so MD5
+ *	has done no work on it by the time the vector arrives.
+ */
+#define HMAC_CACHE_SIZE		(64)
+#define HMAC_CACHE_SECRET	(64)
+
+typedef struct hmac_cache_t {
+	size_t			secret_len;
+	char			secret[HMAC_CACHE_SECRET];
+	fr_hmac_md5_key_t	hkey;
+} hmac_cache_t;
+
+static hmac_cache_t hmac_cache[HMAC_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t hmac_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define HMAC_CACHE_LOCK		pthread_mutex_lock(&hmac_cache_mutex)
+#define HMAC_CACHE_UNLOCK	pthread_mutex_unlock(&hmac_cache_mutex)
+#else
+#define HMAC_CACHE_LOCK
+#define HMAC_CACHE_UNLOCK
+#endif
+
+static void msg_auth_digest(const uint8_t *data, size_t data_len,
+			    const char *secret, uint8_t *digest)
+{
+	size_t secret_len = strlen(secret);
+	hmac_cache_t *cache;
+	fr_hmac_md5_key_t hkey;
+
+	/*
+	 *	Empty secrets would match the unused entries.
+	 */
+	if ((secret_len == 0) || (secret_len > HMAC_CACHE_SECRET)) {
+		fr_hmac_md5(data, data_len, (const uint8_t *) secret,
+			    secret_len, digest);
+		return;
+	}
+
+	cache = &hmac_cache[fr_hash(secret, secret_len) &
+			    (HMAC_CACHE_SIZE - 1)];
+
+	HMAC_CACHE_LOCK;
+	if ((cache->secret_len != secret_len) ||
+	    (memcmp(cache->secret, secret, secret_len) != 0)) {
+		fr_hmac_md5_init(&cache->hkey, (const uint8_t *) secret,
+				 secret_len);
+		memcpy(cache->secret, secret, secret_len);
+		cache->secret_len = secret_len;
+	}
+	hkey = cache->hkey;
+	HMAC_CACHE_UNLOCK;
+
+	fr_hmac_md5_keyed(&hkey, data, data_len, digest);
+}
 
 /**
  * @brief Sign a previously encoded packet.
@@ -1835,9 +1929,8 @@ int rad_sign(RADIUS_PACKET *packet, const RADIUS_PACKET *original,
 		 *	into the Message-Authenticator
 		 *	attribute.
 		 */
-		fr_hmac_md5(packet->data, packet->data_len,
-			    (const uint8_t *) secret, strlen(secret),
-			    calc_auth_vector);
+		msg_auth_digest(packet->data, packet->data_len, secret,
+				calc_auth_vector);
 		memcpy(packet->data + packet->offset + 2,
 		       calc_auth_vector, AUTH_VECTOR_LEN);
 
@@ -2638,9 +2731,8 @@ int rad_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 				break;
 			}
 
-			fr_hmac_md5(packet->data, packet->data_len,
-				    (const uint8_t *) secret, strlen(secret),
-				    calc_auth_vector);
+			msg_auth_digest(packet->data, packet->data_len,
+					secret, calc_auth_vector);
 			if (rad_digest_cmp(calc_auth_vector, msg_auth_vector,
 				   sizeof(calc_auth_vector)) != 0) {
 				char buffer[32];
@@ -3457,6 +3549,7 @@ static ssize_t wimax_attrlen(uint32_t vendor,
 
 		if ((data[0] != PW_VENDOR_SPECIFIC) ||
 		    (data[1] < 9) ||
+		    ((data + data[1]) > end) ||
 		    (memcmp(data + 2, &vendor, 4) != 0) ||
 		    (data[6] != start[6]) ||
 		    ((data[7] + 6) != data[1])) return -1;
@@ -3562,9 +3655,10 @@ ssize_t rad_attr2vp_wimax(const RADIUS_PACKET *packet,
 	attribute = data[6];
 
 	/*
-	 *	Attribute is continued.  Do some more work.
+	 *	Attribute is continued.  Do some more work.  The
+	 *	other bits of the flags are reserved, and ignored.
 	 */
-	if (data[8] != 0) {
+	if ((data[8] & 0x80) != 0) {
 		my_len = wimax_attrlen(htonl(lvalue), data, data + length);
 		if (my_len < 0) {
 			return rad_attr2vp_raw(packet, original, secret,
@@ -3945,6 +4039,136 @@ int rad_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 }
 
 
+/**
+ * @brief Index the attributes in a packet, without decoding them.
+ *
+ *	Most of the cost of rad_decode() is creating a VALUE_PAIR
+ *	for every attribute.  Callers which only look at a few
+ *	attributes (e.g. to filter packets) can index the packet,
+ *	and decode just those with rad_index_decode().
+ *
+ *	The packet must have passed rad_packet_ok().
+ *
+ * @return the number of entries, or -1 if the packet can't be
+ *	indexed, and the caller should use rad_decode().  That's
+ *	more than "max" attributes, or attributes which may be
+ *	continued in the next one (WiMAX and extended).
+ */
+int rad_packet_index(const RADIUS_PACKET *packet,
+		     fr_attr_index_t *index, int max)
+{
+	int num = 0;
+	const uint8_t *ptr, *end;
+
+	ptr = packet->data + AUTH_HDR_LEN;
+	end = packet->data + packet->data_len;
+
+	while (ptr < end) {
+		unsigned int vendor = 0;
+
+		if ((num >= max) || ((ptr + 2) > end) || (ptr[1] < 2) ||
+		    ((ptr + ptr[1]) > end)) {
+			return -1;
+		}
+
+		if (ptr[0] == PW_VENDOR_SPECIFIC) {
+			if ((ptr[1] >= 6) && (ptr[2] == 0)) {
+				DICT_VENDOR *dv;
+
+				memcpy(&vendor, ptr + 2, 4);
+				vendor = ntohl(vendor);
+
+				if (vendor == VENDORPEC_WIMAX) return -1;
+
+				dv = dict_vendorbyvalue(vendor);
+				if (dv && dv->flags) return -1;
+			}
+
+		} else if ((ptr[0] >= 241) && /* as enforced by dict.c */
+			   dict_attrbyvalue(ptr[0], VENDORPEC_EXTENDED)) {
+			return -1;
+		}
+
+		index[num].attribute = ptr[0];
+		index[num].vendor = vendor;
+		index[num].offset = ptr - packet->data;
+		index[num].length = ptr[1];
+		num++;
+
+		ptr += ptr[1];
+	}
+
+	return num;
+}
+
+/**
+ * @brief Decode the attributes with one number from an indexed packet.
+ *
+ *	The VALUE_PAIRs are added to the end of *pvp.
+ *
+ * @return the number added, or -1 on error.
+ */
+int rad_index_decode(const RADIUS_PACKET *packet,
+		     const RADIUS_PACKET *original,
+		     const char *secret,
+		     const fr_attr_index_t *index, int num,
+		     unsigned int attribute, unsigned int vendor,
+		     VALUE_PAIR **pvp)
+{
+	int i, found = 0;
+	VALUE_PAIR **tail;
+
+	for (tail = pvp; *tail != NULL; tail = &((*tail)->next)) {
+		/* nothing */
+	}
+
+	for (i = 0; i < num; i++) {
+		VALUE_PAIR *head, *vp, *next;
+
+		/*
+		 *	Malformed VSAs are decoded as raw attribute
+		 *	26, whatever their Vendor-Id.
+		 */
+		if (index[i].vendor != vendor) {
+			if ((vendor != 0) ||
+			    (attribute != PW_VENDOR_SPECIFIC)) {
+				continue;
+			}
+		} else if ((vendor == 0) && (index[i].attribute != attribute)) {
+			continue;
+		}
+
+		head = NULL;
+		if (rad_attr2vp(packet, original, secret,
+				packet->data + index[i].offset,
+				index[i].length, &head) < 0) {
+			return -1;
+		}
+
+		/*
+		 *	One VSA can hold many vendor attributes.
+		 */
+		for (vp = head; vp != NULL; vp = next) {
+			next = vp->next;
+			vp->next = NULL;
+
+			if ((vp->attribute != attribute) ||
+			    (vp->vendor != vendor)) {
+				pairbasicfree(vp);
+				continue;
+			}
+
+			debug_pair(vp);
+			*tail = vp;
+			tail = &vp->next;
+			found++;
+		}
+	}
+
+	return found;
+}
+
+
 /**
  * @brief Encode password.
  *
@@ -4046,6 +4270,41 @@ int rad_pwdecode(char *passwd, size_t pwlen, const char *secret,
 	 */
 	secretlen = strlen(secret);
 
+	/*
+	 *	Each block is hidden with MD5(secret + the previous
+	 *	block as it was sent), so unlike encoding, no block
+	 *	has to wait for the one before it.  Long passwords
+	 *	get all of their digests done at once.
+	 */
+	if ((pwlen > 2 * AUTH_PASS_LEN) &&
+	    (secretlen <= MAX_PWDECODE_SECRET)) {
+		int blocks = (pwlen + AUTH_PASS_LEN - 1) / AUTH_PASS_LEN;
+		uint8_t buffer[MAX_PASS_LEN / AUTH_PASS_LEN][MAX_PWDECODE_SECRET + AUTH_PASS_LEN];
+		uint8_t digests[MAX_PASS_LEN / AUTH_PASS_LEN][AUTH_PASS_LEN];
+		const uint8_t *in[MAX_PASS_LEN / AUTH_PASS_LEN];
+		uint8_t *out[MAX_PASS_LEN / AUTH_PASS_LEN];
+		size_t inlen[MAX_PASS_LEN / AUTH_PASS_LEN];
+
+		for (i = 0; i < blocks; i++) {
+			memcpy(buffer[i], secret, secretlen);
+			memcpy(buffer[i] + secretlen,
+			       (i == 0) ? vector :
+			       (uint8_t *) passwd + (i - 1) * AUTH_PASS_LEN,
+			       AUTH_PASS_LEN);
+
+			in[i] = buffer[i];
+			inlen[i] = secretlen + AUTH_PASS_LEN;
+			out[i] = digests[i];
+		}
+
+		fr_md5_calc_multi(out, in, inlen, blocks);
+
+		for (n = 0; n < pwlen; n++) {
+			passwd[n] ^= digests[n / AUTH_PASS_LEN][n % AUTH_PASS_LEN];
+		}
+		goto done;
+	}
+
 	fr_MD5Init(&context);
 	fr_MD5Update(&context, (const uint8_t *) secret, secretlen);
 	old = context;		/* save intermediate work */
@@ -4492,3 +4751,226 @@ void rad_free(RADIUS_PACKET **radius_packet_ptr)
 
 	*radius_packet_ptr = NULL;
 }
+
+#ifdef TESTING
+/*
+ *  cc -O2 -DTESTING -I ../ radius.c .libs/libfreeradius-radius.a -lpthread
+ *
+ *  ./a.out ../../share [packets]
+ *
+ *  Decode a 40 attribute Accounting-Request, all of it, and just
+ *  the three attributes a typical accounting policy looks at.
+ *  Then encode and sign an Access-Accept which is mostly VSAs.
+ */
+#include <sys/time.h>
+
+static const char *acct_attrs[] = {
+	"User-Name", "bob@example.com",
+	"NAS-IP-Address", "192.0.2.1",
+	"NAS-Port", "12345",
+	"NAS-Port-Type", "Ethernet",
+	"Service-Type", "Framed-User",
+	"Framed-Protocol", "PPP",
+	"Framed-IP-Address", "10.0.0.1",
+	"Called-Station-Id", "00-11-22-33-44-55",
+	"Calling-Station-Id", "66-77-88-99-aa-bb",
+	"NAS-Identifier", "bras1.example.com",
+	"Acct-Status-Type", "Interim-Update",
+	"Acct-Delay-Time", "0",
+	"Acct-Input-Octets", "123456789",
+	"Acct-Output-Octets", "987654321",
+	"Acct-Session-Id", "4D2C0E5B-00000A1F",
+	"Acct-Authentic", "RADIUS",
+	"Acct-Session-Time", "3600",
+	"Acct-Input-Packets", "100000",
+	"Acct-Output-Packets", "200000",
+	"Acct-Input-Gigawords", "1",
+	"Acct-Output-Gigawords", "2",
+	"Event-Timestamp", "Jan  1 2011 00:00:00 UTC",
+	"NAS-Port-Id", "GigabitEthernet0/0/1.100",
+	"Class", "0x0123456789abcdef",
+	"Acct-Multi-Session-Id", "4D2C0E5B",
+	"Acct-Link-Count", "1",
+	"Connect-Info", "1000BASE-T",
+	"Acct-Interim-Interval", "600",
+	"Cisco-AVPair", "connect-progress=LAN Ses Up",
+	"Cisco-AVPair", "nas-tx-speed=1000000000",
+	"Cisco-AVPair", "nas-rx-speed=1000000000",
+	"Cisco-AVPair", "client-mac-address=6677.8899.aabb",
+	"Cisco-AVPair", "circuit-id-tag=eth 0/1:100",
+	"Cisco-AVPair", "remote-id-tag=0011.2233.4455",
+	"Cisco-NAS-Port", "0/0/1/100",
+	"Cisco-Account-Info", "S10.0.0.1",
+	"Cisco-Service-Info", "QU;10000000;D;10000000",
+	"Ascend-Data-Rate", "1000000",
+	"Ascend-Xmit-Rate", "1000000",
+	"Framed-MTU", "1500",
+	NULL
+};
+
+static const char *accept_attrs[] = {
+	"Framed-IP-Address", "10.0.0.1",
+	"Session-Timeout", "86400",
+	"Acct-Interim-Interval", "600",
+	"Class", "0x0123456789abcdef",
+	"Cisco-AVPair", "ip:inacl#1=permit tcp any any eq 80",
+	"Cisco-AVPair", "ip:inacl#2=permit tcp any any eq 443",
+	"Cisco-AVPair", "ip:inacl#3=permit udp any any eq 53",
+	"Cisco-AVPair", "ip:inacl#4=deny ip any any",
+	"Cisco-AVPair", "ip:outacl#1=permit ip any any",
+	"Cisco-AVPair", "subscriber:accounting-list=default",
+	"Cisco-AVPair", "ip:vrf-id=customers",
+	"Cisco-AVPair", "ip:ip-unnumbered=Loopback100",
+	"Cisco-Account-Info", "AINTERNET",
+	"Cisco-Account-Info", "AVOIP",
+	"WISPr-Bandwidth-Max-Up", "10000000",
+	"WISPr-Bandwidth-Max-Down", "50000000",
+	"WISPr-Session-Terminate-Time", "2011-12-31T23:59:59",
+	"Ascend-Data-Filter", "ip in forward dstip 10.0.0.0/8",
+	"Ascend-Client-Primary-DNS", "192.0.2.53",
+	"Ascend-Client-Secondary-DNS", "198.51.100.53",
+	"Lucent-Max-Shared-Users", "5",
+	"USR-Last-Number-Dialed-Out", "5551234",
+	"Juniper-Local-User-Name", "customer",
+	"Juniper-Allow-Commands", "show.*",
+	"Reply-Message", "Welcome",
+	"Message-Authenticator", "0x00",
+	NULL
+};
+
+static double now(void)
+{
+	struct timeval when;
+
+	gettimeofday(&when, NULL);
+	return when.tv_sec + (when.tv_usec / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, loops, num;
+	const char *secret = "testing123";
+	RADIUS_PACKET *packet, *reply, rx;
+	VALUE_PAIR *vp;
+	fr_attr_index_t index[64];
+	double start, full, lazy;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: radius <dictionary dir> [packets]\n");
+		exit(1);
+	}
+	loops = (argc > 2) ? atoi(argv[2]) : 1000000;
+
+	if (dict_init(argv[1], "dictionary") < 0) {
+		fr_perror("radius");
+		exit(1);
+	}
+
+	packet = rad_alloc(1);
+	packet->code = PW_ACCOUNTING_REQUEST;
+	packet->id = 1;
+	for (i = 0; acct_attrs[i] != NULL; i += 2) {
+		vp = pairmake(acct_attrs[i], acct_attrs[i + 1], T_OP_ADD);
+		if (!vp) {
+			fr_perror(acct_attrs[i]);
+			exit(1);
+		}
+		pairadd(&packet->vps, vp);
+	}
+
+	if ((rad_encode(packet, NULL, secret) < 0) ||
+	    (rad_sign(packet, NULL, secret) < 0)) {
+		fr_perror("radius");
+		exit(1);
+	}
+
+	memset(&rx, 0, sizeof(rx));
+	rx.code = packet->code;
+	rx.data = packet->data;
+	rx.data_len = packet->data_len;
+
+	start = now();
+	for (i = 0; i < loops; i++) {
+		if (rad_decode(&rx, NULL, secret) < 0) {
+			fr_perror("rad_decode");
+			exit(1);
+		}
+		pairfree(&rx.vps);
+	}
+	full = now() - start;
+
+	start = now();
+	for (i = 0; i < loops; i++) {
+		num = rad_packet_index(&rx, index, 64);
+		if ((num < 0) ||
+		    (rad_index_decode(&rx, NULL, secret, index, num,
+				      PW_ACCT_STATUS_TYPE, 0, &rx.vps) != 1) ||
+		    (rad_index_decode(&rx, NULL, secret, index, num,
+				      PW_USER_NAME, 0, &rx.vps) != 1) ||
+		    (rad_index_decode(&rx, NULL, secret, index, num,
+				      PW_ACCT_SESSION_ID, 0, &rx.vps) != 1)) {
+			fprintf(stderr, "rad_index_decode failed\n");
+			exit(1);
+		}
+		pairfree(&rx.vps);
+	}
+	lazy = now() - start;
+
+	printf("%d packets, %d bytes, %d attributes\n",
+	       loops, (int) packet->data_len, num);
+	printf("rad_decode:       %.1f ns/packet\n", full * 1e9 / loops);
+	printf("rad_index_decode: %.1f ns/packet (3 attributes)\n",
+	       lazy * 1e9 / loops);
+
+	/*
+	 *	Reuse the request as the original for the reply.
+	 */
+	packet->code = PW_AUTHENTICATION_REQUEST;
+	pairfree(&packet->vps);
+	reply = rad_alloc_reply(packet);
+	reply->code = PW_AUTHENTICATION_ACK;
+	for (i = 0; accept_attrs[i] != NULL; i += 2) {
+		vp = pairmake(accept_attrs[i], accept_attrs[i + 1], T_OP_ADD);
+		if (!vp) {
+			fr_perror(accept_attrs[i]);
+			exit(1);
+		}
+		pairadd(&reply->vps, vp);
+	}
+
+	start = now();
+	for (i = 0; i < loops; i++) {
+		if (rad_encode(reply, packet, secret) < 0) {
+			fr_perror("rad_encode");
+			exit(1);
+		}
+		free(reply->data);
+		reply->data = NULL;
+	}
+	full = now() - start;
+
+	start = now();
+	for (i = 0; i < loops; i++) {
+		if ((rad_encode(reply, packet, secret) < 0) ||
+		    (rad_sign(reply, packet, secret) < 0)) {
+			fr_perror("radius");
+			exit(1);
+		}
+		if (i < (loops - 1)) {
+			free(reply->data);
+			reply->data = NULL;
+		}
+	}
+	lazy = now() - start;
+
+	printf("rad_encode:       %.1f ns/packet (%d bytes)\n",
+	       full * 1e9 / loops, (int) reply->data_len);
+	printf("rad_encode+sign:  %.1f ns/packet\n", lazy * 1e9 / loops);
+
+	rad_free(&reply);
+	rad_free(&packet);
+	dict_free();
+
+	return 0;
+}
+#endif
@@ -0,0 +1,587 @@
+/*
+ * radix.c	Path-compressed radix (PATRICIA) trees, for longest
+ *		prefix matching of IP addresses.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	Every node holds the full prefix (masked to "bits"), so that
+ *	a lookup never has to back-track.  Nodes without data are
+ *	"glue", and always have two children.
+ */
+#define FR_RADIX_MAX_BITS (128)
+
+typedef struct fr_radix_node_t {
+	struct fr_radix_node_t	*parent;
+	struct fr_radix_node_t	*child[2];
+	int			bits;
+	void			*data;
+	uint8_t			key[FR_RADIX_MAX_BITS / 8];
+} fr_radix_node_t;
+
+struct fr_radix_tree_t {
+	fr_radix_node_t		*root;
+	int			max_bits;
+	int			num_elements;
+	fr_radix_free_t		freeNode;
+};
+
+#define BIT(_key, _n) (((_key)[(_n) >> 3] >> (7 - ((_n) & 0x07))) & 0x01)
+
+/*
+ *	Do the first "bits" bits of "a" and "b" match?
+ */
+static int prefix_match(const uint8_t *a, const uint8_t *b, int bits)
+{
+	int bytes = bits >> 3;
+	uint8_t mask;
+
+	if (bytes && (memcmp(a, b, bytes) != 0)) return 0;
+
+	bits &= 0x07;
+	if (!bits) return 1;
+
+	mask = (0xff << (8 - bits)) & 0xff;
+
+	return (((a[bytes] ^ b[bytes]) & mask) == 0);
+}
+
+/*
+ *	How many leading bits do "a" and "b" have in common?
+ */
+static int prefix_common(const uint8_t *a, const uint8_t *b, int max)
+{
+	int i, bits;
+	uint8_t diff;
+
+	bits = 0;
+	for (i = 0; bits < max; i++) {
+		diff = a[i] ^ b[i];
+		if (!diff) {
+			bits += 8;
+			continue;
+		}
+
+		while ((diff & 0x80) == 0) {
+			bits++;
+			diff <<= 1;
+		}
+		break;
+	}
+
+	if (bits > max) bits = max;
+
+	return bits;
+}
+
+static fr_radix_node_t *node_alloc(const uint8_t *key, int bits, void *data)
+{
+	int bytes;
+	fr_radix_node_t *node;
+
+	node = malloc(sizeof(*node));
+	if (!node) return NULL;
+	memset(node, 0, sizeof(*node));
+
+	node->bits = bits;
+	node->data = data;
+
+	/*
+	 *	Copy the key, and zero out the bits past the prefix.
+	 */
+	bytes = (bits + 7) >> 3;
+	memcpy(node->key, key, bytes);
+	if (bits & 0x07) {
+		node->key[bytes - 1] &= (0xff << (8 - (bits & 0x07))) & 0xff;
+	}
+
+	return node;
+}
+
+/*
+ *	Put "new" where "old" used to be.
+ */
+static void node_replace(fr_radix_tree_t *rt, fr_radix_node_t *old,
+			 fr_radix_node_t *new)
+{
+	fr_radix_node_t *parent = old->parent;
+
+	new->parent = parent;
+
+	if (!parent) {
+		rt->root = new;
+	} else {
+		parent->child[parent->child[1] == old] = new;
+	}
+}
+
+
+fr_radix_tree_t *fr_radix_create(int max_bits, fr_radix_free_t freeNode)
+{
+	fr_radix_tree_t *rt;
+
+	if ((max_bits <= 0) || (max_bits > FR_RADIX_MAX_BITS) ||
+	    ((max_bits & 0x07) != 0)) return NULL;
+
+	rt = malloc(sizeof(*rt));
+	if (!rt) return NULL;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->max_bits = max_bits;
+	rt->freeNode = freeNode;
+
+	return rt;
+}
+
+static void node_free(fr_radix_tree_t *rt, fr_radix_node_t *node)
+{
+	if (!node) return;
+
+	node_free(rt, node->child[0]);
+	node_free(rt, node->child[1]);
+
+	if (node->data && rt->freeNode) rt->freeNode(node->data);
+
+	free(node);
+}
+
+void fr_radix_free(fr_radix_tree_t *rt)
+{
+	if (!rt) return;
+
+	node_free(rt, rt->root);
+	free(rt);
+}
+
+/*
+ *	Insert data for the prefix "key/bits".  Returns 0 if the
+ *	prefix is already in the tree.
+ */
+int fr_radix_insert(fr_radix_tree_t *rt, const uint8_t *key, int bits,
+		    void *data)
+{
+	int common = 0;
+	fr_radix_node_t *node, *parent, *new, *glue;
+
+	if (!rt || !key || !data || (bits < 0) || (bits > rt->max_bits)) {
+		return 0;
+	}
+
+	parent = NULL;
+	node = rt->root;
+
+	/*
+	 *	Walk down while the nodes are a prefix of the key.
+	 */
+	while (node) {
+		common = prefix_common(node->key, key,
+				       (node->bits < bits) ? node->bits : bits);
+		if (common < node->bits) break;
+
+		if (node->bits == bits) {
+			if (node->data) return 0;
+
+			/*
+			 *	It was glue.  Now it's not.
+			 */
+			node->data = data;
+			rt->num_elements++;
+			return 1;
+		}
+
+		parent = node;
+		node = node->child[BIT(key, node->bits)];
+	}
+
+	new = node_alloc(key, bits, data);
+	if (!new) return 0;
+
+	/*
+	 *	Fell off of the bottom of the tree.
+	 */
+	if (!node) {
+		new->parent = parent;
+		if (!parent) {
+			rt->root = new;
+		} else {
+			parent->child[BIT(key, parent->bits)] = new;
+		}
+		rt->num_elements++;
+		return 1;
+	}
+
+	/*
+	 *	The new prefix is a prefix of the node.  It goes
+	 *	directly above it.
+	 */
+	if (common == bits) {
+		node_replace(rt, node, new);
+		new->child[BIT(node->key, bits)] = node;
+		node->parent = new;
+		rt->num_elements++;
+		return 1;
+	}
+
+	/*
+	 *	They diverge part way through the node's prefix.  Add
+	 *	a glue node at the point where they differ.
+	 */
+	glue = node_alloc(key, common, NULL);
+	if (!glue) {
+		free(new);
+		return 0;
+	}
+
+	node_replace(rt, node, glue);
+	glue->child[BIT(key, common)] = new;
+	glue->child[BIT(node->key, common)] = node;
+	new->parent = glue;
+	node->parent = glue;
+
+	rt->num_elements++;
+	return 1;
+}
+
+static fr_radix_node_t *node_find(const fr_radix_tree_t *rt,
+				  const uint8_t *key, int bits)
+{
+	fr_radix_node_t *node;
+
+	if (!rt || !key) return NULL;
+
+	node = rt->root;
+	while (node && (node->bits <= bits)) {
+		if (!prefix_match(node->key, key, node->bits)) return NULL;
+
+		if (node->bits == bits) {
+			return node->data ? node : NULL;
+		}
+
+		if (node->bits >= rt->max_bits) return NULL;
+
+		node = node->child[BIT(key, node->bits)];
+	}
+
+	return NULL;
+}
+
+/*
+ *	Find the data for exactly "key/bits".
+ */
+void *fr_radix_find(fr_radix_tree_t *rt, const uint8_t *key, int bits)
+{
+	fr_radix_node_t *node;
+
+	node = node_find(rt, key, bits);
+	if (!node) return NULL;
+
+	return node->data;
+}
+
+/*
+ *	Delete "key/bits" from the tree, and remove any glue which
+ *	is no longer needed.
+ */
+int fr_radix_delete(fr_radix_tree_t *rt, const uint8_t *key, int bits)
+{
+	fr_radix_node_t *node, *parent, *child;
+
+	node = node_find(rt, key, bits);
+	if (!node) return 0;
+
+	if (rt->freeNode) rt->freeNode(node->data);
+	node->data = NULL;
+	rt->num_elements--;
+
+	while (node && !node->data) {
+		if (node->child[0] && node->child[1]) break;
+
+		child = node->child[0] ? node->child[0] : node->child[1];
+		if (child) {
+			node_replace(rt, node, child);
+			free(node);
+			break;
+		}
+
+		/*
+		 *	A leaf.  Removing it may leave the parent as
+		 *	glue with only one child, so check that, too.
+		 */
+		parent = node->parent;
+		if (!parent) {
+			rt->root = NULL;
+		} else {
+			parent->child[parent->child[1] == node] = NULL;
+		}
+		free(node);
+		node = parent;
+	}
+
+	return 1;
+}
+
+/*
+ *	Longest prefix match.  The key is "max_bits" long.
+ *
+ *	We descend the tree once, remembering every node which has
+ *	data.  The callback (if any) is then given those from the
+ *	longest prefix to the shortest, and the first one it accepts
+ *	is returned.
+ */
+void *fr_radix_match(fr_radix_tree_t *rt, const uint8_t *key,
+		     fr_radix_match_t callback, void *ctx)
+{
+	int depth;
+	fr_radix_node_t *node;
+	fr_radix_node_t *found[FR_RADIX_MAX_BITS + 1];
+
+	if (!rt || !key) return NULL;
+
+	depth = 0;
+	node = rt->root;
+	while (node) {
+		if (!prefix_match(node->key, key, node->bits)) break;
+
+		if (node->data) found[depth++] = node;
+
+		if (node->bits >= rt->max_bits) break;
+
+		node = node->child[BIT(key, node->bits)];
+	}
+
+	while (depth > 0) {
+		depth--;
+
+		if (!callback || callback(ctx, found[depth]->data)) {
+			return found[depth]->data;
+		}
+	}
+
+	return NULL;
+}
+
+int fr_radix_num_elements(fr_radix_tree_t *rt)
+{
+	if (!rt) return 0;
+
+	return rt->num_elements;
+}
+
+static int node_walk(fr_radix_node_t *node,
+		     int (*callback)(void *, void *), void *ctx)
+{
+	int rcode;
+
+	if (!node) return 0;
+
+	if (node->data) {
+		rcode = callback(ctx, node->data);
+		if (rcode != 0) return rcode;
+	}
+
+	rcode = node_walk(node->child[0], callback, ctx);
+	if (rcode != 0) return rcode;
+
+	return node_walk(node->child[1], callback, ctx);
+}
+
+/*
+ *	Walk over the data in prefix order.  The callback MUST NOT
+ *	insert or delete anything.
+ */
+int fr_radix_walk(fr_radix_tree_t *rt,
+		  int (*callback)(void *, void *), void *ctx)
+{
+	if (!rt || !callback) return 0;
+
+	return node_walk(rt->root, callback, ctx);
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../include radix.c rbtree.c -o radix
+ *
+ *  ./radix [num_prefixes] [num_lookups]
+ *
+ *  Compares longest prefix matching using the radix tree against
+ *  the older method of one rbtree per prefix length.
+ */
+#include <sys/time.h>
+
+typedef struct test_prefix_t {
+	uint32_t	addr;
+	int		bits;
+} test_prefix_t;
+
+static uint32_t mask_bits(uint32_t addr, int bits)
+{
+	if (bits == 0) return 0;
+	return addr & (~((uint32_t) 0) << (32 - bits));
+}
+
+static int prefix_cmp(const void *one, const void *two)
+{
+	const test_prefix_t *a = one;
+	const test_prefix_t *b = two;
+
+	if (a->addr < b->addr) return -1;
+	if (a->addr > b->addr) return +1;
+	return 0;
+}
+
+static void key_set(uint8_t *key, uint32_t addr)
+{
+	key[0] = (addr >> 24) & 0xff;
+	key[1] = (addr >> 16) & 0xff;
+	key[2] = (addr >> 8) & 0xff;
+	key[3] = addr & 0xff;
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start->tv_sec) +
+		((end.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, num, lookups, found_radix, found_rbtree;
+	uint8_t key[4];
+	uint32_t *addrs;
+	test_prefix_t *prefixes, my_prefix, *p;
+	fr_radix_tree_t *rt;
+	rbtree_t *trees[33];
+	struct timeval start;
+	double t_radix, t_rbtree;
+
+	num = (argc > 1) ? atoi(argv[1]) : 40000;
+	lookups = (argc > 2) ? atoi(argv[2]) : 1000000;
+
+	rt = fr_radix_create(32, NULL);
+	for (i = 0; i <= 32; i++) {
+		trees[i] = rbtree_create(prefix_cmp, NULL, 0);
+	}
+
+	prefixes = malloc(sizeof(*prefixes) * num);
+	addrs = malloc(sizeof(*addrs) * lookups);
+	if (!rt || !prefixes || !addrs) exit(1);
+
+	/*
+	 *	Mostly single NASes, with some networks of various sizes.
+	 */
+	srandom(42);
+	for (i = 0; i < num; i++) {
+		p = &prefixes[i];
+
+		switch (random() % 8) {
+		case 0:
+			p->bits = 8 + (random() % 24);
+			break;
+
+		default:
+			p->bits = 32;
+			break;
+		}
+		p->addr = mask_bits(random(), p->bits);
+
+		key_set(key, p->addr);
+		if (!fr_radix_insert(rt, key, p->bits, p)) continue;
+
+		rbtree_insert(trees[p->bits], p);
+	}
+
+	/*
+	 *	Half of the lookups hit a known prefix.
+	 */
+	for (i = 0; i < lookups; i++) {
+		if (i & 0x01) {
+			addrs[i] = random();
+		} else {
+			p = &prefixes[random() % num];
+			addrs[i] = p->addr | (random() & ~mask_bits(~0, p->bits));
+		}
+	}
+
+	printf("%d prefixes, %d lookups\n", fr_radix_num_elements(rt), lookups);
+
+	found_radix = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < lookups; i++) {
+		key_set(key, addrs[i]);
+		if (fr_radix_match(rt, key, NULL, NULL)) found_radix++;
+	}
+	t_radix = elapsed(&start);
+
+	found_rbtree = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < lookups; i++) {
+		for (j = 32; j >= 0; j--) {
+			if (!rbtree_num_elements(trees[j])) continue;
+
+			my_prefix.addr = mask_bits(addrs[i], j);
+			if (rbtree_finddata(trees[j], &my_prefix)) {
+				found_rbtree++;
+				break;
+			}
+		}
+	}
+	t_rbtree = elapsed(&start);
+
+	printf("radix tree:\t%d found in %.3fs (%.0f lookups/s)\n",
+	       found_radix, t_radix, lookups / t_radix);
+	printf("rbtrees:\t%d found in %.3fs (%.0f lookups/s)\n",
+	       found_rbtree, t_rbtree, lookups / t_rbtree);
+
+	if (found_radix != found_rbtree) {
+		fprintf(stderr, "MISMATCH\n");
+		exit(1);
+	}
+
+	/*
+	 *	Everything must be deletable, and the tree must end
+	 *	up empty.
+	 */
+	for (i = 0; i < num; i++) {
+		key_set(key, prefixes[i].addr);
+		fr_radix_delete(rt, key, prefixes[i].bits);
+	}
+
+	if (fr_radix_num_elements(rt) != 0) {
+		fprintf(stderr, "Failed to delete all entries\n");
+		exit(1);
+	}
+
+	fr_radix_free(rt);
+	for (i = 0; i <= 32; i++) rbtree_free(trees[i]);
+	free(prefixes);
+	free(addrs);
+
+	return 0;
+}
+#endif
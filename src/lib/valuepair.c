@@ -166,6 +166,16 @@ VALUE_PAIR *paircreate_raw(int attr, int vendor, int type, VALUE_PAIR *vp)
 	vp->length = 0;
 	memset(&vp->flags, 0, sizeof(vp->flags));
 	vp->flags.unknown_attr = 1;
+
+	/*
+	 *	Unknown attributes of WiMAX-style vendors have to
+	 *	be encoded in that format, too.
+	 */
+	if (vendor && (vendor <= FR_MAX_VENDOR)) {
+		DICT_VENDOR *dv = dict_vendorbyvalue(vendor);
+
+		if (dv) vp->flags.wimax = dv->flags;
+	}
 	
 	if (!vp_print_name(p, FR_VP_NAME_LEN, vp->attribute, vp->vendor)) {
 		free(vp);
@@ -270,36 +270,17 @@ static ssize_t vqp_recvfrom(int sockfd, uint8_t **pbuf, int flags,
 	return data_len;
 }
 
-RADIUS_PACKET *vqp_recv(int sockfd)
+/*
+ *	Check that a received packet is formatted the way
+ *	vqp_decode() expects, and set the packet code and ID.
+ *
+ *	Returns 1 if the packet is OK, 0 if it's malformed.
+ */
+int vqp_packet_ok(RADIUS_PACKET *packet)
 {
 	uint8_t *ptr;
 	ssize_t length;
 	uint32_t id;
-	RADIUS_PACKET *packet;
-
-	/*
-	 *	Allocate the new request data structure
-	 */
-	if ((packet = malloc(sizeof(*packet))) == NULL) {
-		fr_strerror_printf("out of memory");
-		return NULL;
-	}
-	memset(packet, 0, sizeof(*packet));
-
-	packet->data_len = vqp_recvfrom(sockfd, &packet->data, 0,
-					&packet->src_ipaddr, &packet->src_port,
-					&packet->dst_ipaddr, &packet->dst_port);
-
-	/*
-	 *	Check for socket errors.
-	 */
-	if (packet->data_len < 0) {
-		fr_strerror_printf("Error receiving packet: %s", strerror(errno));
-		/* packet->data is NULL */
-		free(packet);
-		return NULL;
-	}
-
 
 	/*
 	 *	We can only receive packets formatted in a way we
@@ -308,8 +289,7 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 	 */
 	if (packet->data_len < VQP_HDR_LEN) {
 		fr_strerror_printf("VQP packet is too short");
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	ptr = packet->data;
@@ -326,8 +306,7 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 
 	if (ptr[3] > VQP_MAX_ATTRIBUTES) {
 		fr_strerror_printf("Too many VQP attributes");
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	if (packet->data_len > VQP_HDR_LEN) {
@@ -342,8 +321,7 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 		while (length > 0) {
 			if (length < 7) {
 				fr_strerror_printf("Packet contains malformed attribute");
-				rad_free(&packet);
-				return NULL;
+				return 0;
 			}
 
 			/*
@@ -353,8 +331,7 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 			if ((ptr[0] != 0) || (ptr[1] != 0) ||
 			    (ptr[2] != 0x0c) || (ptr[3] < 1) || (ptr[3] > 8)) {
 				fr_strerror_printf("Packet contains invalid attribute");
-				rad_free(&packet);
-				return NULL;
+				return 0;
 			}
 
 			/*
@@ -371,18 +348,18 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 			if ((ptr[3] != 5) &&
 			    ((ptr[4] != 0) || (ptr[5] > MAX_VMPS_LEN))) {
 				fr_strerror_printf("Packet contains attribute with invalid length %02x %02x", ptr[4], ptr[5]);
-				rad_free(&packet);
-				return NULL;
+				return 0;
 			}
 			attrlen = (ptr[4] << 8) | ptr[5];
+			if ((6 + attrlen) > length) {
+				fr_strerror_printf("Packet contains attribute which overflows the packet");
+				return 0;
+			}
 			ptr += 6 + attrlen;
 			length -= (6 + attrlen);
 		}
 	}
 
-	packet->sockfd = sockfd;
-	packet->vps = NULL;
-
 	/*
 	 *	This is more than a bit of a hack.
 	 */
@@ -391,6 +368,44 @@ RADIUS_PACKET *vqp_recv(int sockfd)
 	memcpy(&id, packet->data + 4, 4);
 	packet->id = ntohl(id);
 
+	return 1;
+}
+
+RADIUS_PACKET *vqp_recv(int sockfd)
+{
+	RADIUS_PACKET *packet;
+
+	/*
+	 *	Allocate the new request data structure
+	 */
+	if ((packet = malloc(sizeof(*packet))) == NULL) {
+		fr_strerror_printf("out of memory");
+		return NULL;
+	}
+	memset(packet, 0, sizeof(*packet));
+
+	packet->data_len = vqp_recvfrom(sockfd, &packet->data, 0,
+					&packet->src_ipaddr, &packet->src_port,
+					&packet->dst_ipaddr, &packet->dst_port);
+
+	/*
+	 *	Check for socket errors.
+	 */
+	if (packet->data_len < 0) {
+		fr_strerror_printf("Error receiving packet: %s", strerror(errno));
+		/* packet->data is NULL */
+		free(packet);
+		return NULL;
+	}
+
+	if (!vqp_packet_ok(packet)) {
+		rad_free(&packet);
+		return NULL;
+	}
+
+	packet->sockfd = sockfd;
+	packet->vps = NULL;
+
 	/*
 	 *	FIXME: Create a fake "request authenticator", to
 	 *	avoid duplicates?  Or is the VQP sequence number
@@ -617,7 +632,6 @@ int vqp_encode(RADIUS_PACKET *packet, RADIUS_PACKET *original)
 		ptr[2] = 0;
 	} else {
 		ptr[2] = vp->lvalue & 0xff;
-		return 0;
 	}
 
 	/*
@@ -644,6 +658,14 @@ int vqp_encode(RADIUS_PACKET *packet, RADIUS_PACKET *original)
 		ptr[3] = 2;
 	}
 
+	/*
+	 *	Errors have a header, and nothing else.
+	 */
+	if (vp) {
+		ptr[3] = 0;
+		return 0;
+	}
+
 	ptr += 8;
 
 	/*
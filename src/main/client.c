@@ -27,6 +27,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/process.h>
 
 #include <sys/stat.h>
 
@@ -39,14 +40,24 @@ RCSID("$Id$")
 #endif
 #endif
 
+/*
+ *	Clients are kept in radix trees, one for IPv4 and one for
+ *	IPv6, so that finding the client for a packet is a single
+ *	longest prefix match.
+ */
 struct radclient_list {
-	/*
-	 *	FIXME: One set of trees for IPv4, and another for IPv6?
-	 */
-	rbtree_t	*trees[129]; /* for 0..128, inclusive. */
-	int		min_prefix;
+	fr_radix_tree_t	*v4;
+	fr_radix_tree_t	*v6;
 };
 
+/*
+ *	All of the clients with the same address and prefix.  They
+ *	can differ only by protocol, so there are at most two.
+ */
+typedef struct client_prefix_t {
+	RADCLIENT	*client[2];
+} client_prefix_t;
+
 
 #ifdef WITH_STATS
 static rbtree_t		*tree_num = NULL;     /* client numbers 0..N */
@@ -106,6 +117,8 @@ void client_free(RADCLIENT *client)
 	free(client->client_server);
 #endif
 
+	if (client->pps_sources) fr_hash_table_free(client->pps_sources);
+
 	free(client);
 }
 
@@ -146,19 +159,69 @@ static int client_num_cmp(const void *one, const void *two)
 #endif
 
 /*
- *	Free a RADCLIENT list.
+ *	Callback for freeing the clients in a radix tree.
  */
-void clients_free(RADCLIENT_LIST *clients)
+static void client_prefix_free(void *data)
+{
+	client_prefix_t *prefix = data;
+
+	if (prefix->client[0]) client_free(prefix->client[0]);
+	if (prefix->client[1]) client_free(prefix->client[1]);
+
+	free(prefix);
+}
+
+/*
+ *	Find a client with the same address, prefix, and protocol.
+ */
+static RADCLIENT *client_prefix_find(const client_prefix_t *prefix,
+				     const RADCLIENT *client)
 {
 	int i;
 
-	if (!clients) return;
+	for (i = 0; i < 2; i++) {
+		if (!prefix->client[i]) continue;
 
-	for (i = 0; i <= 128; i++) {
-		if (clients->trees[i]) rbtree_free(clients->trees[i]);
-		clients->trees[i] = NULL;
+		if (client_ipaddr_cmp(prefix->client[i], client) == 0) {
+			return prefix->client[i];
+		}
 	}
 
+	return NULL;
+}
+
+static fr_radix_tree_t *client_tree(const RADCLIENT_LIST *clients, int af)
+{
+	switch (af) {
+	case AF_INET:
+		return clients->v4;
+
+	case AF_INET6:
+		return clients->v6;
+
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+#define CLIENT_KEY(_ipaddr) (((_ipaddr)->af == AF_INET) ? \
+	(const uint8_t *) &(_ipaddr)->ipaddr.ip4addr : \
+	(const uint8_t *) &(_ipaddr)->ipaddr.ip6addr)
+
+/*
+ *	Free a RADCLIENT list.
+ */
+void clients_free(RADCLIENT_LIST *clients)
+{
+	if (!clients) return;
+
+	fr_radix_free(clients->v4);
+	clients->v4 = NULL;
+	fr_radix_free(clients->v6);
+	clients->v6 = NULL;
+
 	if (clients == root_clients) {
 #ifdef WITH_STATS
 		if (tree_num) rbtree_free(tree_num);
@@ -186,8 +249,6 @@ RADCLIENT_LIST *clients_init(void)
 
 	if (!clients) return NULL;
 
-	clients->min_prefix = 128;
-
 	return clients;
 }
 
@@ -272,6 +333,8 @@ static int client_sane(RADCLIENT *client)
 int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
 	RADCLIENT *old;
+	fr_radix_tree_t *tree;
+	client_prefix_t *prefix;
 
 	if (!client) {
 		return 0;
@@ -300,20 +363,25 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Create a tree for it.
 	 */
-	if (!clients->trees[client->prefix]) {
-		clients->trees[client->prefix] = rbtree_create(client_ipaddr_cmp,
-							       (void *) client_free, 0);
-		if (!clients->trees[client->prefix]) {
-			return 0;
+	if (!client_tree(clients, client->ipaddr.af)) {
+		if (client->ipaddr.af == AF_INET) {
+			clients->v4 = fr_radix_create(32, client_prefix_free);
+		} else {
+			clients->v6 = fr_radix_create(128, client_prefix_free);
 		}
 	}
 
+	tree = client_tree(clients, client->ipaddr.af);
+	if (!tree) return 0;
+
 #define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
 
 	/*
 	 *	Cannot insert the same client twice.
 	 */
-	old = rbtree_finddata(clients->trees[client->prefix], client);
+	prefix = fr_radix_find(tree, CLIENT_KEY(&client->ipaddr),
+			       client->prefix);
+	old = prefix ? client_prefix_find(prefix, client) : NULL;
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
@@ -348,7 +416,24 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Other error adding client: likely is fatal.
 	 */
-	if (!rbtree_insert(clients->trees[client->prefix], client)) {
+	if (!prefix) {
+		prefix = rad_malloc(sizeof(*prefix));
+		memset(prefix, 0, sizeof(*prefix));
+		prefix->client[0] = client;
+
+		if (!fr_radix_insert(tree, CLIENT_KEY(&client->ipaddr),
+				     client->prefix, prefix)) {
+			free(prefix);
+			return 0;
+		}
+
+	} else if (!prefix->client[0]) {
+		prefix->client[0] = client;
+
+	} else if (!prefix->client[1]) {
+		prefix->client[1] = client;
+
+	} else {
 		return 0;
 	}
 
@@ -384,17 +469,188 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->prefix < clients->min_prefix) {
-		clients->min_prefix = client->prefix;
+	return 1;
+}
+
+
+/*
+ *	Rate limiting state for each source address of a client
+ *	which is a network.
+ */
+typedef struct client_pps_source_t {
+	fr_ipaddr_t	ipaddr;
+	uint64_t	tat;
+} client_pps_source_t;
+
+#define MAX_PPS_SOURCES (65536)
+
+static uint32_t pps_source_hash(const void *data)
+{
+	const client_pps_source_t *source = data;
+
+	if (source->ipaddr.af == AF_INET) {
+		return fr_hash(&source->ipaddr.ipaddr.ip4addr,
+			       sizeof(source->ipaddr.ipaddr.ip4addr));
 	}
 
-	return 1;
+	return fr_hash(&source->ipaddr.ipaddr.ip6addr,
+		       sizeof(source->ipaddr.ipaddr.ip6addr));
+}
+
+static int pps_source_cmp(const void *one, const void *two)
+{
+	const client_pps_source_t *a = one;
+	const client_pps_source_t *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+/*
+ *	Delete sources which have been idle long enough that their
+ *	bucket has refilled.  They're indistinguishable from new ones.
+ */
+typedef struct pps_expire_t {
+	uint64_t	when;
+	fr_hash_table_t	*ht;
+} pps_expire_t;
+
+static int pps_source_expire(void *ctx, void *data)
+{
+	pps_expire_t *expire = ctx;
+	client_pps_source_t *source = data;
+
+	if (source->tat <= expire->when) {
+		fr_hash_table_delete(expire->ht, source);
+	}
+
+	return 0;
+}
+
+/*
+ *	How long (in microseconds) from "now" until the next packet
+ *	is within the limit.  This is the "virtual scheduling" form
+ *	of the generic cell rate algorithm, which is equivalent to a
+ *	token bucket of "burst" packets, refilled at "pps".
+ */
+static uint64_t pps_wait(uint64_t tat, uint64_t now, int pps, int burst)
+{
+	uint64_t interval, tolerance;
+
+	interval = 1000000 / pps;
+	tolerance = (burst - 1) * interval;
+
+	if (tat <= (now + tolerance)) return 0;
+
+	return tat - tolerance - now;
+}
+
+static void pps_use(uint64_t *tat, uint64_t when, int pps)
+{
+	if (*tat < when) *tat = when;
+
+	*tat += 1000000 / pps;
 }
 
+/*
+ *	Check a packet from "src_ipaddr" against the client's rate
+ *	limits.
+ *
+ *	Returns -1 if the packet should be discarded, 0 if it should
+ *	be processed now, or the number of microseconds it should be
+ *	delayed for before being processed.
+ */
+int client_rate_limit(RADCLIENT *client, const fr_ipaddr_t *src_ipaddr,
+		      const struct timeval *now)
+{
+	int burst;
+	uint64_t when, wait, source_wait;
+	client_pps_source_t *source = NULL;
+
+	/*
+	 *	Dynamic clients share the limits of their network.
+	 */
+	if (client->pps_master) client = client->pps_master;
+
+	when = now->tv_sec;
+	when *= 1000000;
+	when += now->tv_usec;
+	wait = 0;
+
+	if (client->max_pps) {
+		burst = client->max_pps_burst;
+		if (!burst) burst = client->max_pps;
+
+		wait = pps_wait(client->pps_tat, when, client->max_pps, burst);
+	}
+
+	if (client->max_pps_per_source) {
+		client_pps_source_t my_source;
+
+		if (!client->pps_sources) {
+			client->pps_sources = fr_hash_table_create(pps_source_hash,
+								   pps_source_cmp,
+								   free);
+			if (!client->pps_sources) return 0;
+		}
+
+		my_source.ipaddr = *src_ipaddr;
+		source = fr_hash_table_finddata(client->pps_sources, &my_source);
+		if (!source) {
+			if (fr_hash_table_num_elements(client->pps_sources) >= MAX_PPS_SOURCES) {
+				pps_expire_t expire;
+
+				expire.when = when;
+				expire.ht = client->pps_sources;
+				fr_hash_table_walk(client->pps_sources,
+						   pps_source_expire, &expire);
+			}
+
+			/*
+			 *	If it's still full, don't track this source.
+			 */
+			if (fr_hash_table_num_elements(client->pps_sources) < MAX_PPS_SOURCES) {
+				source = rad_malloc(sizeof(*source));
+				memset(source, 0, sizeof(*source));
+				source->ipaddr = *src_ipaddr;
+
+				if (!fr_hash_table_insert(client->pps_sources, source)) {
+					free(source);
+					source = NULL;
+				}
+			}
+		}
+
+		if (source) {
+			burst = client->max_pps_burst;
+			if (!burst) burst = client->max_pps_per_source;
+
+			source_wait = pps_wait(source->tat, when,
+					       client->max_pps_per_source,
+					       burst);
+			if (source_wait > wait) wait = source_wait;
+		}
+	}
+
+	if (wait > ((uint64_t) client->max_pps_delay * 1000)) return -1;
+
+	/*
+	 *	The packet will be processed, either now or later.
+	 *	Charge it to the buckets.
+	 */
+	if (client->max_pps) pps_use(&client->pps_tat, when + wait,
+				     client->max_pps);
+	if (source) pps_use(&source->tat, when + wait,
+			    client->max_pps_per_source);
+
+	return (int) wait;
+}
 
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	fr_radix_tree_t *tree;
+	client_prefix_t *prefix;
+
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
@@ -408,7 +664,34 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_STATS
 	rbtree_deletebydata(tree_num, client);
 #endif
-	rbtree_deletebydata(clients->trees[client->prefix], client);
+
+	tree = client_tree(clients, client->ipaddr.af);
+	if (!tree) return;
+
+	prefix = fr_radix_find(tree, CLIENT_KEY(&client->ipaddr),
+			       client->prefix);
+	if (!prefix) return;
+
+	if (prefix->client[0] == client) {
+		prefix->client[0] = NULL;
+	} else if (prefix->client[1] == client) {
+		prefix->client[1] = NULL;
+	} else {
+		return;
+	}
+
+	if (!prefix->client[0] && !prefix->client[1]) {
+		fr_radix_delete(tree, CLIENT_KEY(&client->ipaddr),
+				client->prefix);
+	}
+
+	/*
+	 *	Packets held back by the rate limit refer to the
+	 *	client, so they have to go, too.
+	 */
+	request_delayed_delete(NULL, client);
+
+	client_free(client);
 }
 #endif
 
@@ -445,46 +728,61 @@ RADCLIENT *client_findbynumber(const RADCLIENT_LIST *clients,
 /*
  *	Find a client in the RADCLIENTS list.
  */
+typedef struct client_match_t {
+	int		proto;
+	RADCLIENT	*client;
+} client_match_t;
+
+/*
+ *	Callback for fr_radix_match.  Is there a client for this
+ *	protocol?
+ */
+static int client_prefix_match(void *ctx, void *data)
+{
+	int i;
+	client_match_t *match = ctx;
+	client_prefix_t *prefix = data;
+
+	for (i = 0; i < 2; i++) {
+		RADCLIENT *client = prefix->client[i];
+
+		if (!client) continue;
+
+#ifdef WITH_TCP
+		if ((client->proto != match->proto) &&
+		    (client->proto != IPPROTO_IP) &&
+		    (match->proto != IPPROTO_IP)) continue;
+#endif
+
+		match->client = client;
+		return 1;
+	}
+
+	return 0;
+}
+
 RADCLIENT *client_find(const RADCLIENT_LIST *clients,
 		       const fr_ipaddr_t *ipaddr, int proto)
 {
-	int i, max_prefix;
-	RADCLIENT myclient;
+	fr_radix_tree_t *tree;
+	client_match_t match;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
+	tree = client_tree(clients, ipaddr->af);
+	if (!tree) return NULL;
 
-	case AF_INET6:
-		max_prefix = 128;
-		break;
+	match.proto = proto;
+	match.client = NULL;
 
-	default :
+	if (!fr_radix_match(tree, CLIENT_KEY(ipaddr),
+			    client_prefix_match, &match)) {
 		return NULL;
 	}
 
-	for (i = max_prefix; i >= clients->min_prefix; i--) {
-		void *data;
-
-		myclient.prefix = i;
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		client_sane(&myclient);	/* clean up the ipaddress */
-
-		if (!clients->trees[i]) continue;
-
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) {
-			return data;
-		}
-	}
-
-	return NULL;
+	return match.client;
 }
 
 
@@ -549,6 +847,15 @@ static const CONF_PARSER client_config[] = {
 	  offsetof(RADCLIENT, coa_name), 0, NULL },
 #endif
 
+	{ "max_pps",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, max_pps), 0, "0" },
+	{ "max_pps_burst",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, max_pps_burst), 0, "0" },
+	{ "max_pps_per_source",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, max_pps_per_source), 0, "0" },
+	{ "max_pps_delay",  PW_TYPE_INTEGER,
+	  offsetof(RADCLIENT, max_pps_delay), 0, "0" },
+
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -589,6 +896,26 @@ static RADCLIENT *client_parse(CONF_SECTION *cs, int in_server)
 		return NULL;
 	}
 
+	if ((c->max_pps < 0) || (c->max_pps > 1000000) ||
+	    (c->max_pps_per_source < 0) ||
+	    (c->max_pps_per_source > 1000000)) {
+		cf_log_err(cf_sectiontoitem(cs),
+			   "max_pps must be between 0 and 1000000");
+		goto error;
+	}
+
+	if (c->max_pps_burst < 0) {
+		cf_log_err(cf_sectiontoitem(cs),
+			   "max_pps_burst cannot be negative");
+		goto error;
+	}
+
+	if ((c->max_pps_delay < 0) || (c->max_pps_delay > 10000)) {
+		cf_log_err(cf_sectiontoitem(cs),
+			   "max_pps_delay must be between 0 and 10000");
+		goto error;
+	}
+
 	/*
 	 *	Global clients can set servers to use,
 	 *	per-server clients cannot.
@@ -993,6 +1320,19 @@ int client_validate(RADCLIENT_LIST *clients, RADCLIENT *master, RADCLIENT *c)
 		goto error;
 	}
 
+	/*
+	 *	Inherit the rate limits of the enclosing network.  The
+	 *	buckets are the network's, too, so that "max_pps" still
+	 *	covers all of its NASes combined.
+	 */
+	if (!c->max_pps && !c->max_pps_per_source) {
+		c->max_pps = master->max_pps;
+		c->max_pps_burst = master->max_pps_burst;
+		c->max_pps_per_source = master->max_pps_per_source;
+		c->max_pps_delay = master->max_pps_delay;
+		c->pps_master = master;
+	}
+
 	/*
 	 *	Initialize the remaining fields.
 	 */
@@ -1567,6 +1567,8 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 	cprintf(listener, "\tbad_signature\t%u\n", stats->total_bad_authenticators);
 	cprintf(listener, "\tdropped\t\t%u\n", stats->total_packets_dropped);
 	cprintf(listener, "\tunknown_types\t%u\n", stats->total_unknown_types);
+	cprintf(listener, "\trate_limited\t%u\n", stats->total_rate_limited);
+	cprintf(listener, "\trate_delayed\t%u\n", stats->total_rate_delayed);
 
 	cprintf(listener, "\tlast_packet\t%lu\n", stats->last_packet);
 	for (i = 0; i < 8; i++) {
@@ -1577,6 +1579,33 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 	return 1;
 }
 
+static int command_stats_memory(rad_listen_t *listener,
+				UNUSED int argc, UNUSED char *argv[])
+{
+	request_mem_stats_t stats;
+
+	request_mem_stats(&stats);
+
+	cprintf(listener, "\trequests\t%" PRIu64 "\n", stats.requests);
+	cprintf(listener, "\tallocs\t\t%" PRIu64 "\n", stats.allocs);
+	cprintf(listener, "\tbytes\t\t%" PRIu64 "\n", stats.bytes);
+	cprintf(listener, "\tlarge\t\t%" PRIu64 "\n", stats.large);
+	cprintf(listener, "\tblocks_malloced\t%" PRIu64 "\n", stats.mallocs);
+	cprintf(listener, "\tblocks_reused\t%" PRIu64 "\n", stats.reused);
+
+	/*
+	 *	How often a request has to go to malloc() for a region
+	 *	block.  This does NOT count the mallocs done outside of
+	 *	the region, e.g. for attributes.
+	 */
+	if (stats.requests) {
+		cprintf(listener, "\tblocks_malloced/request\t%.3f\n",
+			(double) stats.mallocs / stats.requests);
+	}
+
+	return 1;
+}
+
 #ifdef WITH_DETAIL
 static FR_NAME_NUMBER state_names[] = {
 	{ "unopened", STATE_UNOPENED },
@@ -1941,6 +1970,10 @@ static fr_command_table_t command_table_stats[] = {
 	  command_stats_home_server, NULL },
 #endif
 
+	{ "memory", FR_READ,
+	  "stats memory - show how much per-request memory came from malloc()",
+	  command_stats_memory, NULL },
+
 	{ "socket", FR_READ,
 	  "stats socket <ipaddr> <port> "
 #ifdef WITH_TCP
@@ -401,8 +401,8 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 		if (compare == 0) for (i = 0; i <= REQUEST_MAX_REGEX; i++) {
 			char *r;
 
-			free(request_data_get(request, request,
-					      REQUEST_DATA_REGEX | i));
+			request_data_get(request, request,
+					 REQUEST_DATA_REGEX | i);
 
 			/*
 			 *	No %{i}, skip it.
@@ -413,14 +413,15 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 			/*
 			 *	Copy substring into allocated buffer
 			 */
-			r = rad_malloc(rxmatch[i].rm_eo -rxmatch[i].rm_so + 1);
+			r = request_mem_alloc(request,
+					      rxmatch[i].rm_eo - rxmatch[i].rm_so + 1);
 			memcpy(r, pleft + rxmatch[i].rm_so,
 			       rxmatch[i].rm_eo - rxmatch[i].rm_so);
 			r[rxmatch[i].rm_eo - rxmatch[i].rm_so] = '\0';
 
 			request_data_add(request, request,
 					 REQUEST_DATA_REGEX | i,
-					 r, free);
+					 r, NULL);
 		}
 		result = (compare == 0);
 	}
@@ -1298,6 +1298,8 @@ static int auth_socket_recv(rad_listen_t *listener)
 	RAD_REQUEST_FUNP fun = NULL;
 	RADCLIENT	*client = NULL;
 	fr_ipaddr_t	src_ipaddr;
+	int		delay = 0;
+	struct timeval	now;
 
 	rcode = rad_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
@@ -1318,6 +1320,20 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	FR_STATS_TYPE_INC(client->auth.total_requests);
 
+	/*
+	 *	Enforce the client's rate limit, before doing any
+	 *	more work on the packet.
+	 */
+	if (client->max_pps || client->max_pps_per_source) {
+		gettimeofday(&now, NULL);
+		delay = client_rate_limit(client, &src_ipaddr, &now);
+		if (delay < 0) {
+			rad_recv_discard(listener->fd);
+			FR_STATS_INC(auth, total_rate_limited);
+			return 0;
+		}
+	}
+
 	/*
 	 *	Some sanity checks, based on the packet code.
 	 */
@@ -1357,7 +1373,11 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	if (!request_receive(listener, packet, client, fun)) {
+	if (delay > 0) {
+		FR_STATS_INC(auth, total_rate_delayed);
+	}
+
+	if (!request_receive_delayed(listener, packet, client, fun, delay)) {
 		FR_STATS_INC(auth, total_packets_dropped);
 		rad_free(&packet);
 		return 0;
@@ -1379,6 +1399,8 @@ static int acct_socket_recv(rad_listen_t *listener)
 	RAD_REQUEST_FUNP fun = NULL;
 	RADCLIENT	*client = NULL;
 	fr_ipaddr_t	src_ipaddr;
+	int		delay = 0;
+	struct timeval	now;
 
 	rcode = rad_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
@@ -1399,6 +1421,20 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	FR_STATS_TYPE_INC(client->acct.total_requests);
 
+	/*
+	 *	Enforce the client's rate limit, before doing any
+	 *	more work on the packet.
+	 */
+	if (client->max_pps || client->max_pps_per_source) {
+		gettimeofday(&now, NULL);
+		delay = client_rate_limit(client, &src_ipaddr, &now);
+		if (delay < 0) {
+			rad_recv_discard(listener->fd);
+			FR_STATS_INC(acct, total_rate_limited);
+			return 0;
+		}
+	}
+
 	/*
 	 *	Some sanity checks, based on the packet code.
 	 */
@@ -1441,7 +1477,11 @@ static int acct_socket_recv(rad_listen_t *listener)
 	/*
 	 *	There can be no duplicate accounting packets.
 	 */
-	if (!request_receive(listener, packet, client, fun)) {
+	if (delay > 0) {
+		FR_STATS_INC(acct, total_rate_delayed);
+	}
+
+	if (!request_receive_delayed(listener, packet, client, fun, delay)) {
 		FR_STATS_INC(acct, total_packets_dropped);
 		rad_free(&packet);
 		return 0;
@@ -1883,6 +1923,8 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 
 #include "command.c"
 
+#include "metrics.c"
+
 static const rad_listen_master_t master_listen[RAD_LISTEN_MAX] = {
 #ifdef WITH_STATS
 	{ common_socket_parse, NULL,
@@ -1949,6 +1991,13 @@ static const rad_listen_master_t master_listen[RAD_LISTEN_MAX] = {
 	  socket_print, client_socket_encode, client_socket_decode },
 #endif
 
+#ifdef WITH_METRICS
+	/* HTTP statistics exposition */
+	{ metrics_socket_parse, metrics_socket_free,
+	  metrics_socket_accept, metrics_socket_send,
+	  metrics_socket_print, metrics_socket_encode, metrics_socket_decode },
+#endif
+
 };
 
 
@@ -2352,6 +2401,13 @@ static rad_listen_t *listen_alloc(RAD_LISTEN_TYPE type)
 		break;
 #endif
 
+#ifdef WITH_METRICS
+	case RAD_LISTEN_METRICS:
+		this->data = rad_malloc(sizeof(fr_metrics_socket_t));
+		memset(this->data, 0, sizeof(fr_metrics_socket_t));
+		break;
+#endif
+
 	default:
 		rad_assert("Unsupported option!" == NULL);
 		break;
@@ -2502,6 +2558,9 @@ static const FR_NAME_NUMBER listen_compare[] = {
 #endif
 #ifdef WITH_COA
 	{ "coa",	RAD_LISTEN_COA },
+#endif
+#ifdef WITH_METRICS
+	{ "metrics",	RAD_LISTEN_METRICS },
 #endif
 	{ NULL, 0 },
 };
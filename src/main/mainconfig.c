@@ -772,6 +772,8 @@ int read_mainconfig(int reload)
 {
 	const char *p = NULL;
 	CONF_PAIR *cp;
+	int usec;
+	struct timeval start, end;
 	CONF_SECTION *cs;
 	struct stat statbuf;
 	cached_config_t *cc;
@@ -902,12 +904,38 @@ int read_mainconfig(int reload)
 	cp = cf_pair_find(cs, "dictionary");
 	if (cp) p = cf_pair_value(cp);
 	if (!p) p = radius_dir;
+
+	cp = cf_pair_find(cs, "dictionary_cache");
+	if (dict_cache_file(cp ? cf_pair_value(cp) : NULL) < 0) {
+		radlog(L_ERR, "%s", fr_strerror());
+		return -1;
+	}
+
 	DEBUG2("including dictionary file %s/%s", p, RADIUS_DICTIONARY);
+	gettimeofday(&start, NULL);
 	if (dict_init(p, RADIUS_DICTIONARY) != 0) {
 		radlog(L_ERR, "Errors reading dictionary: %s",
 				fr_strerror());
 		return -1;
 	}
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000;
+	usec += end.tv_usec - start.tv_usec;
+
+	switch (dict_cache_status()) {
+	case DICT_CACHE_LOADED:
+		DEBUG2(" dictionary loaded from cache %s in %d usec",
+		       cf_pair_value(cp), usec);
+		break;
+
+	case DICT_CACHE_FAILED:
+		radlog(L_INFO, "Not caching dictionary: %s", fr_strerror());
+		/* FALL-THROUGH */
+
+	default:
+		DEBUG2(" dictionary parsed in %d usec", usec);
+		break;
+	}
 
 	/*
 	 *	This allows us to figure out where, relative to
@@ -0,0 +1,957 @@
+/*
+ * metrics.c	Prometheus / OpenMetrics exposition of server statistics.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2011 The FreeRADIUS server project
+ */
+
+#ifdef WITH_METRICS
+
+/*
+ *	A "metrics" listener is a TCP socket which speaks just enough
+ *	HTTP/1.0 to answer "GET /metrics" with the server statistics
+ *	in the Prometheus text exposition format.
+ *
+ *	Everything here runs in the main event loop, exactly like the
+ *	command socket.  Replies are written without blocking, and
+ *	whatever the kernel won't take at once is sent as the socket
+ *	becomes writable, so a slow scraper can't stall the server.
+ *
+ *	The statistics are only ever updated from the main thread (see
+ *	request_stats_final), so we read them without locking, and we
+ *	never touch the request path.
+ */
+#define METRICS_BUFFER_SIZE (2048)
+#define METRICS_DEFAULT_PORT (9812)
+#define METRICS_WRITE_TIMEOUT (10)
+
+typedef struct fr_metrics_socket_t {
+	listen_socket_t	sock;	/* MUST be first */
+
+	char		*path;
+	int		per_client;
+	int		per_home_server;
+
+	/*
+	 *	Buffer management for the HTTP request.
+	 */
+	size_t		offset;
+	char		buffer[METRICS_BUFFER_SIZE];
+
+	/*
+	 *	The part of the reply which hasn't been sent yet.
+	 */
+	char		*reply;
+	size_t		reply_len;
+	size_t		reply_sent;
+} fr_metrics_socket_t;
+
+static const CONF_PARSER metrics_config[] = {
+  { "path",  PW_TYPE_STRING_PTR,
+    offsetof(fr_metrics_socket_t, path), NULL, "/metrics"},
+  { "per_client",  PW_TYPE_BOOLEAN,
+    offsetof(fr_metrics_socket_t, per_client), NULL, "yes"},
+  { "per_home_server",  PW_TYPE_BOOLEAN,
+    offsetof(fr_metrics_socket_t, per_home_server), NULL, "yes"},
+
+  { NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	Growable output buffer.  The whole response is rendered
+ *	before anything is written, so that we can send a correct
+ *	Content-Length.
+ */
+typedef struct metrics_buf_t {
+	char	*data;
+	size_t	used;
+	size_t	size;
+} metrics_buf_t;
+
+static void mprintf(metrics_buf_t *mb, const char *fmt, ...)
+#ifdef __GNUC__
+		__attribute__ ((format (printf, 2, 3)))
+#endif
+;
+
+static void mprintf(metrics_buf_t *mb, const char *fmt, ...)
+{
+	int len;
+	va_list ap;
+
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(mb->data + mb->used, mb->size - mb->used,
+				fmt, ap);
+		va_end(ap);
+
+		if (len < 0) return;
+
+		if ((mb->used + len) < mb->size) {
+			mb->used += len;
+			return;
+		}
+
+		mb->size *= 2;
+		mb->data = realloc(mb->data, mb->size);
+		if (!mb->data) {
+			radlog(L_ERR, "Out of memory rendering metrics");
+			exit(1);
+		}
+	}
+}
+
+/*
+ *	Label values are quoted strings, with '\', '"' and LF escaped.
+ */
+static const char *metrics_escape(const char *in, char *out, size_t outlen)
+{
+	char *p = out;
+
+	if (!in) in = "";
+
+	while (*in && ((size_t) (p - out) < (outlen - 3))) {
+		if ((*in == '\\') || (*in == '"')) {
+			*(p++) = '\\';
+			*(p++) = *in;
+		} else if (*in == '\n') {
+			*(p++) = '\\';
+			*(p++) = 'n';
+		} else {
+			*(p++) = *in;
+		}
+		in++;
+	}
+	*p = '\0';
+
+	return out;
+}
+
+typedef struct fr_stats2metric {
+	const char	*name;
+	const char	*help;
+	size_t		offset;
+	int		auth_only;
+} fr_stats2metric;
+
+static const fr_stats2metric stats2metric[] = {
+	{ "requests_total", "Requests received",
+	  offsetof(fr_stats_t, total_requests), 0 },
+	{ "responses_total", "Responses sent",
+	  offsetof(fr_stats_t, total_responses), 0 },
+	{ "access_accepts_total", "Access-Accepts sent",
+	  offsetof(fr_stats_t, total_access_accepts), 1 },
+	{ "access_rejects_total", "Access-Rejects sent",
+	  offsetof(fr_stats_t, total_access_rejects), 1 },
+	{ "access_challenges_total", "Access-Challenges sent",
+	  offsetof(fr_stats_t, total_access_challenges), 1 },
+	{ "dup_requests_total", "Duplicate requests received",
+	  offsetof(fr_stats_t, total_dup_requests), 0 },
+	{ "invalid_requests_total", "Requests from unknown clients",
+	  offsetof(fr_stats_t, total_invalid_requests), 0 },
+	{ "malformed_requests_total", "Malformed requests received",
+	  offsetof(fr_stats_t, total_malformed_requests), 0 },
+	{ "bad_authenticators_total", "Requests with bad authenticators",
+	  offsetof(fr_stats_t, total_bad_authenticators), 0 },
+	{ "packets_dropped_total", "Packets dropped",
+	  offsetof(fr_stats_t, total_packets_dropped), 0 },
+	{ "unknown_types_total", "Packets of unknown type",
+	  offsetof(fr_stats_t, total_unknown_types), 0 },
+	{ "rate_limited_total", "Packets discarded by client rate limits",
+	  offsetof(fr_stats_t, total_rate_limited), 0 },
+	{ "rate_delayed_total", "Packets delayed by client rate limits",
+	  offsetof(fr_stats_t, total_rate_delayed), 0 },
+
+	{ NULL, NULL, 0, 0 }
+};
+
+/*
+ *	Upper bounds (in seconds) of fr_stats_t.elapsed[0..6].
+ *	elapsed[7] is everything >= 10s.  See stats_time().
+ */
+static const char *elapsed_le[7] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10"
+};
+
+/*
+ *	One labelled source of an fr_stats_t.  "labels" may be empty,
+ *	and is shared between the auth / acct entries of one client.
+ */
+typedef struct metrics_source_t {
+	const char	*type;
+	const char	*labels;
+	fr_stats_t	*stats;
+	int		auth;
+	void		*ctx;
+} metrics_source_t;
+
+#define METRICS_LABEL_SIZE (320)
+
+/*
+ *	The EMA values are kept as microseconds * EMA_SCALE.
+ *	See stats.c
+ */
+#define METRICS_EMA_SCALE (100)
+
+static void metrics_print_counters(metrics_buf_t *mb, const char *prefix,
+				   metrics_source_t *src, int num)
+{
+	int i, j;
+	char labels[METRICS_LABEL_SIZE + 32];
+
+	for (i = 0; stats2metric[i].name != NULL; i++) {
+		mprintf(mb, "# HELP freeradius_%s%s %s.\n",
+			prefix, stats2metric[i].name, stats2metric[i].help);
+		mprintf(mb, "# TYPE freeradius_%s%s counter\n",
+			prefix, stats2metric[i].name);
+
+		for (j = 0; j < num; j++) {
+			fr_uint_t value;
+
+			if (stats2metric[i].auth_only && !src[j].auth) continue;
+
+			value = *(fr_uint_t *) (((char *) src[j].stats) +
+						stats2metric[i].offset);
+			mprintf(mb, "freeradius_%s%s{type=\"%s\"%s} %lu\n",
+				prefix, stats2metric[i].name,
+				src[j].type, src[j].labels,
+				(unsigned long) value);
+		}
+	}
+
+	mprintf(mb, "# HELP freeradius_%slatency_seconds Time between request and response.\n",
+		prefix);
+	mprintf(mb, "# TYPE freeradius_%slatency_seconds histogram\n",
+		prefix);
+
+	for (j = 0; j < num; j++) {
+		unsigned long total = 0;
+
+		snprintf(labels, sizeof(labels), "type=\"%s\"%s",
+			 src[j].type, src[j].labels);
+
+		for (i = 0; i < 7; i++) {
+			total += src[j].stats->elapsed[i];
+			mprintf(mb, "freeradius_%slatency_seconds_bucket{%s,le=\"%s\"} %lu\n",
+				prefix, labels, elapsed_le[i], total);
+		}
+		total += src[j].stats->elapsed[7];
+		mprintf(mb, "freeradius_%slatency_seconds_bucket{%s,le=\"+Inf\"} %lu\n",
+			prefix, labels, total);
+		mprintf(mb, "freeradius_%slatency_seconds_count{%s} %lu\n",
+			prefix, labels, total);
+	}
+}
+
+/*
+ *	Queue names, in RAD_LISTEN_TYPE order.
+ */
+#ifdef HAVE_PTHREAD_H
+static const FR_NAME_NUMBER metrics_load_class_names[] = {
+	{ "auth_continue",	FR_LOAD_CLASS_AUTH_CONTINUE },
+	{ "auth",		FR_LOAD_CLASS_AUTH },
+	{ "acct",		FR_LOAD_CLASS_ACCT },
+	{ "acct_interim",	FR_LOAD_CLASS_ACCT_INTERIM },
+	{ NULL, 0 }
+};
+#endif
+
+static const FR_NAME_NUMBER metrics_queue_names[] = {
+	{ "status",	RAD_LISTEN_NONE },
+#ifdef WITH_PROXY
+	{ "proxy",	RAD_LISTEN_PROXY },
+#endif
+	{ "auth",	RAD_LISTEN_AUTH },
+#ifdef WITH_ACCOUNTING
+	{ "acct",	RAD_LISTEN_ACCT },
+#endif
+#ifdef WITH_DETAIL
+	{ "detail",	RAD_LISTEN_DETAIL },
+#endif
+#ifdef WITH_VMPS
+	{ "vmps",	RAD_LISTEN_VQP },
+#endif
+#ifdef WITH_DHCP
+	{ "dhcp",	RAD_LISTEN_DHCP },
+#endif
+#ifdef WITH_COA
+	{ "coa",	RAD_LISTEN_COA },
+#endif
+	{ NULL, 0 }
+};
+
+#define SOURCE(_type, _labels, _stats, _auth, _ctx) do { \
+		src[num].type = _type; \
+		src[num].labels = _labels; \
+		src[num].stats = _stats; \
+		src[num].auth = _auth; \
+		src[num].ctx = _ctx; \
+		num++; \
+	} while (0)
+
+static void metrics_print_server(metrics_buf_t *mb)
+{
+	int num = 0;
+	metrics_source_t src[4];
+
+	SOURCE("auth", "", &radius_auth_stats, 1, NULL);
+#ifdef WITH_ACCOUNTING
+	SOURCE("acct", "", &radius_acct_stats, 0, NULL);
+#endif
+#ifdef WITH_COA
+	SOURCE("coa", "", &radius_coa_stats, 1, NULL);
+	SOURCE("disconnect", "", &radius_dsc_stats, 1, NULL);
+#endif
+
+	metrics_print_counters(mb, "", src, num);
+
+#ifdef WITH_PROXY
+	num = 0;
+	SOURCE("auth", "", &proxy_auth_stats, 1, NULL);
+#ifdef WITH_ACCOUNTING
+	SOURCE("acct", "", &proxy_acct_stats, 0, NULL);
+#endif
+#ifdef WITH_COA
+	SOURCE("coa", "", &proxy_coa_stats, 1, NULL);
+	SOURCE("disconnect", "", &proxy_dsc_stats, 1, NULL);
+#endif
+
+	metrics_print_counters(mb, "proxy_", src, num);
+#endif
+}
+
+static void metrics_print_queues(metrics_buf_t *mb)
+{
+	int i, array[RAD_LISTEN_MAX];
+
+#ifdef HAVE_PTHREAD_H
+	thread_pool_queue_stats(array);
+#else
+	memset(array, 0, sizeof(array));
+#endif
+
+	mprintf(mb, "# HELP freeradius_queue_depth Requests waiting for a worker thread.\n");
+	mprintf(mb, "# TYPE freeradius_queue_depth gauge\n");
+
+	for (i = 0; metrics_queue_names[i].name != NULL; i++) {
+		mprintf(mb, "freeradius_queue_depth{queue=\"%s\"} %d\n",
+			metrics_queue_names[i].name,
+			array[metrics_queue_names[i].number]);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	{
+		fr_uint_t shed[FR_LOAD_CLASS_MAX];
+
+		thread_pool_shed_stats(shed);
+
+		mprintf(mb, "# HELP freeradius_overload_active Whether the server is currently shedding load.\n");
+		mprintf(mb, "# TYPE freeradius_overload_active gauge\n");
+		mprintf(mb, "freeradius_overload_active %d\n",
+			thread_pool_overloaded() ? 1 : 0);
+
+		mprintf(mb, "# HELP freeradius_overload_dropped_total Packets discarded by overload control.\n");
+		mprintf(mb, "# TYPE freeradius_overload_dropped_total counter\n");
+		for (i = 0; metrics_load_class_names[i].name != NULL; i++) {
+			mprintf(mb, "freeradius_overload_dropped_total{class=\"%s\"} %lu\n",
+				metrics_load_class_names[i].name,
+				(unsigned long) shed[metrics_load_class_names[i].number]);
+		}
+	}
+#endif
+}
+
+/*
+ *	Walk the listeners.  Only auth / acct / coa sockets carry
+ *	useful statistics.
+ */
+static void metrics_print_listeners(metrics_buf_t *mb)
+{
+	int num;
+	rad_listen_t *this;
+	metrics_source_t *src;
+	char *labels;
+
+	num = 0;
+	for (this = mainconfig.listen; this != NULL; this = this->next) num++;
+	if (!num) return;
+
+	src = rad_malloc(num * sizeof(*src));
+	labels = rad_malloc(num * METRICS_LABEL_SIZE);
+
+	num = 0;
+	for (this = mainconfig.listen; this != NULL; this = this->next) {
+		listen_socket_t *sock = this->data;
+		char *p = labels + (num * METRICS_LABEL_SIZE);
+		const char *type;
+		char buffer[128];
+
+		if (this->type == RAD_LISTEN_AUTH) {
+			type = "auth";
+#ifdef WITH_ACCOUNTING
+		} else if (this->type == RAD_LISTEN_ACCT) {
+			type = "acct";
+#endif
+#ifdef WITH_COA
+		} else if (this->type == RAD_LISTEN_COA) {
+			type = "coa";
+#endif
+		} else continue;
+
+		snprintf(p, METRICS_LABEL_SIZE,
+			 ",address=\"%s\",port=\"%d\"",
+			 ip_ntoh(&sock->my_ipaddr, buffer, sizeof(buffer)),
+			 sock->my_port);
+		SOURCE(type, p, &this->stats, (this->type != RAD_LISTEN_ACCT),
+		       this);
+	}
+
+	if (num) metrics_print_counters(mb, "listener_", src, num);
+
+	free(labels);
+	free(src);
+}
+
+static void metrics_print_clients(metrics_buf_t *mb)
+{
+	int i, num, count;
+	RADCLIENT *client;
+	metrics_source_t *src;
+	char *labels;
+
+	for (count = 0; client_findbynumber(NULL, count) != NULL; count++) {
+		/* nothing */
+	}
+	if (!count) return;
+
+	src = rad_malloc(2 * count * sizeof(*src));
+	labels = rad_malloc(count * METRICS_LABEL_SIZE);
+
+	num = 0;
+	for (i = 0; i < count; i++) {
+		char *p = labels + (i * METRICS_LABEL_SIZE);
+		char name[128], buffer[128];
+
+		client = client_findbynumber(NULL, i);
+		if (!client) break;
+
+		snprintf(p, METRICS_LABEL_SIZE,
+			 ",client=\"%s/%d\",shortname=\"%s\"",
+			 ip_ntoh(&client->ipaddr, buffer, sizeof(buffer)),
+			 client->prefix,
+			 metrics_escape(client->shortname, name, sizeof(name)));
+
+		SOURCE("auth", p, &client->auth, 1, client);
+#ifdef WITH_ACCOUNTING
+		SOURCE("acct", p, &client->acct, 0, client);
+#endif
+	}
+
+	metrics_print_counters(mb, "client_", src, num);
+
+	free(labels);
+	free(src);
+}
+
+#ifdef WITH_PROXY
+static void metrics_print_home_servers(metrics_buf_t *mb)
+{
+	int i, num, count;
+	home_server *home;
+	metrics_source_t *src;
+	char *labels;
+	char buffer[128];
+
+	for (count = 0; home_server_bynumber(count) != NULL; count++) {
+		/* nothing */
+	}
+	if (!count) return;
+
+	src = rad_malloc(count * sizeof(*src));
+	labels = rad_malloc(count * METRICS_LABEL_SIZE);
+
+	num = 0;
+	for (i = 0; i < count; i++) {
+		char *p = labels + (num * METRICS_LABEL_SIZE);
+		const char *type;
+		char name[128];
+
+		home = home_server_bynumber(i);
+		if (!home) break;
+
+		/*
+		 *	Internal "virtual" home server.
+		 */
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+
+		if (home->type == HOME_TYPE_AUTH) {
+			type = "auth";
+		} else if (home->type == HOME_TYPE_ACCT) {
+			type = "acct";
+#ifdef WITH_COA
+		} else if (home->type == HOME_TYPE_COA) {
+			type = "coa";
+#endif
+		} else continue;
+
+		snprintf(p, METRICS_LABEL_SIZE,
+			 ",server=\"%s\",address=\"%s\",port=\"%d\",proto=\"%s\"",
+			 metrics_escape(home->name, name, sizeof(name)),
+			 ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)),
+			 home->port,
+			 (home->proto == IPPROTO_TCP) ? "tcp" : "udp");
+
+		SOURCE(type, p, &home->stats, (home->type != HOME_TYPE_ACCT),
+		       home);
+	}
+
+	if (!num) goto done;
+
+	metrics_print_counters(mb, "home_server_", src, num);
+
+	mprintf(mb, "# HELP freeradius_home_server_state Home server state (0 = alive, 1 = zombie, 2 = dead).\n");
+	mprintf(mb, "# TYPE freeradius_home_server_state gauge\n");
+	for (i = 0; i < num; i++) {
+		home = src[i].ctx;
+		mprintf(mb, "freeradius_home_server_state{type=\"%s\"%s} %d\n",
+			src[i].type, src[i].labels, home->state);
+	}
+
+	mprintf(mb, "# HELP freeradius_home_server_outstanding Requests sent to the home server and not yet answered.\n");
+	mprintf(mb, "# TYPE freeradius_home_server_outstanding gauge\n");
+	for (i = 0; i < num; i++) {
+		home = src[i].ctx;
+		mprintf(mb, "freeradius_home_server_outstanding{type=\"%s\"%s} %d\n",
+			src[i].type, src[i].labels,
+			home->currently_outstanding);
+	}
+
+	mprintf(mb, "# HELP freeradius_home_server_response_time_seconds Moving average of home server response time.\n");
+	mprintf(mb, "# TYPE freeradius_home_server_response_time_seconds gauge\n");
+	for (i = 0; i < num; i++) {
+		int usec;
+
+		home = src[i].ctx;
+		if (home->ema.window == 0) continue;
+
+		usec = home->ema.ema1 / METRICS_EMA_SCALE;
+		mprintf(mb, "freeradius_home_server_response_time_seconds{type=\"%s\"%s,window=\"1\"} %d.%06d\n",
+			src[i].type, src[i].labels,
+			usec / 1000000, usec % 1000000);
+
+		usec = home->ema.ema10 / METRICS_EMA_SCALE;
+		mprintf(mb, "freeradius_home_server_response_time_seconds{type=\"%s\"%s,window=\"10\"} %d.%06d\n",
+			src[i].type, src[i].labels,
+			usec / 1000000, usec % 1000000);
+	}
+
+ done:
+	free(labels);
+	free(src);
+}
+#endif
+
+#undef SOURCE
+
+static void metrics_render(fr_metrics_socket_t *ms, metrics_buf_t *mb)
+{
+	mprintf(mb, "# HELP freeradius_start_time_seconds Time at which the server started.\n");
+	mprintf(mb, "# TYPE freeradius_start_time_seconds gauge\n");
+	mprintf(mb, "freeradius_start_time_seconds %lu\n",
+		(unsigned long) fr_start_time);
+
+	metrics_print_server(mb);
+	metrics_print_queues(mb);
+	metrics_print_listeners(mb);
+	if (ms->per_client) metrics_print_clients(mb);
+#ifdef WITH_PROXY
+	if (ms->per_home_server) metrics_print_home_servers(mb);
+#endif
+}
+
+static void metrics_close_socket(rad_listen_t *this)
+{
+	this->status = RAD_LISTEN_STATUS_CLOSED;
+	event_new_fd(this);
+}
+
+/*
+ *	Send as much of the reply as the socket will take.  Returns 1
+ *	when it has all been sent, 0 if there's more to send, and -1
+ *	on error.
+ */
+static int metrics_flush(rad_listen_t *this)
+{
+	ssize_t rcode;
+	fr_metrics_socket_t *ms = this->data;
+
+	while (ms->reply_sent < ms->reply_len) {
+		rcode = write(this->fd, ms->reply + ms->reply_sent,
+			      ms->reply_len - ms->reply_sent);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return -1;
+		}
+
+		ms->reply_sent += rcode;
+	}
+
+	return 1;
+}
+
+static void metrics_write_handler(UNUSED fr_event_list_t *el, UNUSED int fd,
+				  void *ctx)
+{
+	rad_listen_t *this = ctx;
+
+	if (metrics_flush(this) == 0) return;
+
+	event_fd_writable(this, NULL, 0);
+	metrics_close_socket(this);
+}
+
+static void metrics_reply(rad_listen_t *this, int code, const char *reason,
+			  metrics_buf_t *body, int head)
+{
+	int len;
+	fr_metrics_socket_t *ms = this->data;
+
+	ms->reply = rad_malloc(256 + body->used);
+	len = snprintf(ms->reply, 256,
+		       "HTTP/1.0 %d %s\r\n"
+		       "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		       "Content-Length: %lu\r\n"
+		       "Connection: close\r\n"
+		       "\r\n",
+		       code, reason, (unsigned long) body->used);
+	if ((len < 0) || (len >= 256)) len = 0;
+
+	ms->reply_len = len;
+	ms->reply_sent = 0;
+	if (!head) {
+		memcpy(ms->reply + ms->reply_len, body->data, body->used);
+		ms->reply_len += body->used;
+	}
+}
+
+/*
+ *	Read (part of) an HTTP request.  Once we have all of the
+ *	headers, answer it and close the connection.
+ */
+static int metrics_http_recv(rad_listen_t *listener)
+{
+	ssize_t len;
+	int head = FALSE;
+	char *method, *uri, *p;
+	metrics_buf_t mb;
+	fr_metrics_socket_t *ms = listener->data;
+
+	/*
+	 *	We're still sending the reply.  Anything else the
+	 *	client sends is ignored.
+	 */
+	if (ms->reply) {
+		char junk[256];
+
+		len = recv(listener->fd, junk, sizeof(junk), 0);
+		if (len > 0) return 0;
+		if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+			return 0;
+		}
+
+		event_fd_writable(listener, NULL, 0);
+		goto close_socket;
+	}
+
+	len = recv(listener->fd, ms->buffer + ms->offset,
+		   sizeof(ms->buffer) - ms->offset - 1, 0);
+	if (len == 0) goto close_socket;
+	if (len < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+		goto close_socket;
+	}
+
+	ms->offset += len;
+	ms->buffer[ms->offset] = '\0';
+
+	if (!strstr(ms->buffer, "\r\n\r\n") && !strstr(ms->buffer, "\n\n")) {
+		if (ms->offset < (sizeof(ms->buffer) - 1)) return 0;
+
+		DEBUG2(" ... metrics request too large");
+		goto close_socket;
+	}
+
+	mb.size = 8192;
+	mb.used = 0;
+	mb.data = rad_malloc(mb.size);
+	mb.data[0] = '\0';
+
+	/*
+	 *	"GET /metrics HTTP/1.1"
+	 */
+	method = ms->buffer;
+	p = strchr(method, ' ');
+	if (!p) goto bad_request;
+	*(p++) = '\0';
+
+	uri = p;
+	p = strpbrk(uri, " \r\n?");
+	if (!p) goto bad_request;
+	*p = '\0';
+
+	if (strcmp(method, "HEAD") == 0) {
+		head = TRUE;
+
+	} else if (strcmp(method, "GET") != 0) {
+		mprintf(&mb, "Method not allowed\n");
+		metrics_reply(listener, 405, "Method Not Allowed", &mb, FALSE);
+		goto done;
+	}
+
+	if (strcmp(uri, ms->path) != 0) {
+		mprintf(&mb, "Not found\n");
+		metrics_reply(listener, 404, "Not Found", &mb, head);
+		goto done;
+	}
+
+	DEBUG2(" ... sending metrics");
+
+	metrics_render(ms, &mb);
+	metrics_reply(listener, 200, "OK", &mb, head);
+	goto done;
+
+ bad_request:
+	mprintf(&mb, "Bad request\n");
+	metrics_reply(listener, 400, "Bad Request", &mb, FALSE);
+
+ done:
+	free(mb.data);
+
+	/*
+	 *	Send what we can now, and the rest when the socket
+	 *	becomes writable.
+	 */
+	if ((metrics_flush(listener) == 0) &&
+	    event_fd_writable(listener, metrics_write_handler,
+			      METRICS_WRITE_TIMEOUT)) {
+		return 0;
+	}
+
+ close_socket:
+	metrics_close_socket(listener);
+	return 0;
+}
+
+static int metrics_socket_accept(rad_listen_t *listener)
+{
+	int newfd, src_port;
+	rad_listen_t *this;
+	socklen_t salen;
+	struct sockaddr_storage src;
+	fr_metrics_socket_t *ms;
+	fr_ipaddr_t src_ipaddr;
+
+	salen = sizeof(src);
+
+	DEBUG2(" ... new connection request on metrics socket.");
+
+	newfd = accept(listener->fd, (struct sockaddr *) &src, &salen);
+	if (newfd < 0) {
+		/*
+		 *	Non-blocking sockets must handle this.
+		 */
+		if (errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		DEBUG2(" ... failed to accept connection.");
+		return 0;
+	}
+
+	if (!fr_sockaddr2ipaddr(&src, salen, &src_ipaddr, &src_port)) {
+		DEBUG2(" ... unknown address family.");
+		close(newfd);
+		return 0;
+	}
+
+	/*
+	 *	Never block the event loop on a slow scraper.
+	 */
+	if (fr_nonblock(newfd) < 0) {
+		DEBUG2(" ... failed setting socket to non-blocking.");
+		close(newfd);
+		return 0;
+	}
+
+	/*
+	 *	Add the new listener.
+	 */
+	this = listen_alloc(listener->type);
+	if (!this) return 0;
+
+	/*
+	 *	Copy everything, including the pointer to the socket
+	 *	information.
+	 */
+	ms = this->data;
+	memcpy(this->data, listener->data, sizeof(*ms));
+	memcpy(this, listener, sizeof(*this));
+	this->next = NULL;
+	this->data = ms;	/* fix it back */
+
+	ms->sock.other_ipaddr = src_ipaddr;
+	ms->sock.other_port = src_port;
+	ms->sock.ev = NULL;
+	ms->offset = 0;
+	ms->reply = NULL;
+
+	this->fd = newfd;
+	this->status = RAD_LISTEN_STATUS_INIT;
+	this->recv = metrics_http_recv;
+
+	/*
+	 *	Tell the event loop that we have a new FD
+	 */
+	event_new_fd(this);
+
+	return 0;
+}
+
+/*
+ *	Parse a "metrics" listener.
+ */
+static int metrics_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
+{
+	int		rcode;
+	int		listen_port;
+	fr_ipaddr_t	ipaddr;
+	fr_metrics_socket_t *ms = this->data;
+
+	this->cs = cs;
+
+	if (cf_section_parse(cs, ms, metrics_config) < 0) {
+		return -1;
+	}
+
+	if (!ms->path || (ms->path[0] != '/')) {
+		cf_log_err(cf_sectiontoitem(cs),
+			   "The \"path\" must begin with '/'");
+		return -1;
+	}
+
+	/*
+	 *	Try IPv4 first
+	 */
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
+	rcode = cf_item_parse(cs, "ipaddr", PW_TYPE_IPADDR,
+			      &ipaddr.ipaddr.ip4addr, NULL);
+	if (rcode < 0) return -1;
+
+	if (rcode == 0) { /* successfully parsed IPv4 */
+		ipaddr.af = AF_INET;
+
+	} else {	/* maybe IPv6? */
+		rcode = cf_item_parse(cs, "ipv6addr", PW_TYPE_IPV6ADDR,
+				      &ipaddr.ipaddr.ip6addr, NULL);
+		if (rcode < 0) return -1;
+
+		if (rcode == 1) {
+			cf_log_err(cf_sectiontoitem(cs),
+				   "No address specified in listen section");
+			return -1;
+		}
+		ipaddr.af = AF_INET6;
+	}
+
+	rcode = cf_item_parse(cs, "port", PW_TYPE_INTEGER,
+			      &listen_port, Stringify(METRICS_DEFAULT_PORT));
+	if (rcode < 0) return -1;
+
+	if ((listen_port <= 0) || (listen_port > 65535)) {
+			cf_log_err(cf_sectiontoitem(cs),
+				   "Invalid value for \"port\"");
+			return -1;
+	}
+
+	ms->sock.my_ipaddr = ipaddr;
+	ms->sock.my_port = listen_port;
+	ms->sock.proto = IPPROTO_TCP;
+
+	if (check_config) return 0;
+
+	if (listen_bind(this) < 0) {
+		char buffer[128];
+		cf_log_err(cf_sectiontoitem(cs),
+			   "Error binding to port for %s port %d",
+			   ip_ntoh(&ms->sock.my_ipaddr, buffer, sizeof(buffer)),
+			   ms->sock.my_port);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void metrics_socket_free(rad_listen_t *this)
+{
+	fr_metrics_socket_t *ms = this->data;
+
+	free(ms->reply);
+	ms->reply = NULL;
+}
+
+static int metrics_socket_print(const rad_listen_t *this, char *buffer, size_t bufsize)
+{
+	char ipbuf[128];
+	fr_metrics_socket_t *ms = this->data;
+
+	if (this->recv == metrics_http_recv) {
+		snprintf(buffer, bufsize, "metrics from client (%s, %d)",
+			 ip_ntoh(&ms->sock.other_ipaddr, ipbuf, sizeof(ipbuf)),
+			 ms->sock.other_port);
+		return 1;
+	}
+
+	snprintf(buffer, bufsize, "metrics address %s port %d",
+		 ip_ntoh(&ms->sock.my_ipaddr, ipbuf, sizeof(ipbuf)),
+		 ms->sock.my_port);
+	return 1;
+}
+
+static int metrics_socket_send(UNUSED rad_listen_t *listener,
+			       UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_encode(UNUSED rad_listen_t *listener,
+				 UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_decode(UNUSED rad_listen_t *listener,
+				 UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+#endif /* WITH_METRICS */
@@ -369,14 +369,60 @@ static int module_instance_cmp(const void *one, const void *two)
 }
 
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Modules which are RLM_TYPE_HUP_BACKGROUND are re-instantiated
+ *	in a thread of their own, so the server keeps processing
+ *	packets while they load.  The lock protects the lists of old
+ *	instances, which those threads add to.
+ */
+static pthread_mutex_t	module_hup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int		module_hup_exiting = FALSE;
+
+/*
+ *	detach_modules() waits on the condition for the reload
+ *	threads to finish, and the threads wait on it for the
+ *	old instance to be free-able, or for the server to exit.
+ */
+static pthread_cond_t	module_hup_cond = PTHREAD_COND_INITIALIZER;
+static int		module_reload_threads = 0;
+
+typedef struct module_reload_t {
+	module_instance_t	*node;
+	CONF_SECTION		*cs;
+} module_reload_t;
+#else
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#endif
+
+/*
+ *	Old instances are kept for 60 seconds after a HUP, which is
+ *	longer than any request using them can still be running.
+ */
+#define MODULE_HUP_GRACE (60)
+
+static void module_instance_detach(CONF_SECTION *cs, module_instance_t *node,
+				   void *insthandle)
+{
+	cf_section_parse_free(cs, insthandle);
+
+	if (node->entry->module->detach) {
+		(node->entry->module->detach)(insthandle);
+	} else {
+		free(insthandle);
+	}
+}
+
 static void module_instance_free_old(CONF_SECTION *cs, module_instance_t *node,
 				     time_t when)
 {
-	fr_module_hup_t *mh, **last;
+	fr_module_hup_t *mh, **last, *old = NULL;
 
 	/*
-	 *	Walk the list, freeing up old instances.
+	 *	Walk the list, unlinking old instances.
 	 */
+	pthread_mutex_lock(&module_hup_mutex);
 	last = &(node->mh);
 	while (*last) {
 		mh = *last;
@@ -384,20 +430,25 @@ static void module_instance_free_old(CONF_SECTION *cs, module_instance_t *node,
 		/*
 		 *	Free only every 60 seconds.
 		 */
-		if ((when - mh->when) < 60) {
+		if ((when - mh->when) < MODULE_HUP_GRACE) {
 			last = &(mh->next);
 			continue;
 		}
 
-		cf_section_parse_free(cs, mh->insthandle);
-		
-		if (node->entry->module->detach) {
-			(node->entry->module->detach)(mh->insthandle);
-		} else {
-			free(mh->insthandle);
-		}
-
 		*last = mh->next;
+		mh->next = old;
+		old = mh;
+	}
+	pthread_mutex_unlock(&module_hup_mutex);
+
+	/*
+	 *	And free them without holding the lock.
+	 */
+	while (old) {
+		mh = old;
+		old = mh->next;
+
+		module_instance_detach(cs, node, mh->insthandle);
 		free(mh);
 	}
 }
@@ -461,6 +512,21 @@ static void module_entry_free(void *data)
  */
 int detach_modules(void)
 {
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Tell any reload threads to leave the instances alone,
+	 *	and wait for them to finish.  They may be running
+	 *	module code, which we're about to unload.
+	 */
+	pthread_mutex_lock(&module_hup_mutex);
+	module_hup_exiting = TRUE;
+	pthread_cond_broadcast(&module_hup_cond);
+	while (module_reload_threads > 0) {
+		pthread_cond_wait(&module_hup_cond, &module_hup_mutex);
+	}
+	pthread_mutex_unlock(&module_hup_mutex);
+#endif
+
 	rbtree_free(instance_tree);
 	rbtree_free(module_tree);
 
@@ -1329,10 +1395,157 @@ int virtual_servers_load(CONF_SECTION *config)
 	return 0;
 }
 
+/*
+ *	Make a new instance the current one, and keep the old one
+ *	around until the requests using it have finished.
+ */
+static void module_instance_swap_locked(module_instance_t *node,
+					void *insthandle, time_t when)
+{
+	fr_module_hup_t *mh;
+
+	mh = rad_malloc(sizeof(*mh));
+	mh->mi = node;
+	mh->when = when;
+
+	mh->insthandle = node->insthandle;
+	mh->next = node->mh;
+	node->mh = mh;
+
+	node->insthandle = insthandle;
+}
+
+/*
+ *	Requests read node->insthandle without locking.  They see
+ *	either the old instance or the new one, and both stay valid.
+ *	Unlocking the mutex ensures that the new instance is complete
+ *	before anyone can see it.
+ */
+static void module_instance_swap(module_instance_t *node, void *insthandle,
+				 time_t when)
+{
+	pthread_mutex_lock(&module_hup_mutex);
+	module_instance_swap_locked(node, insthandle, when);
+	pthread_mutex_unlock(&module_hup_mutex);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *module_reload_thread(void *arg)
+{
+	module_reload_t *r = arg;
+	module_instance_t *node = r->node;
+	void *insthandle = NULL;
+	int rcode;
+	struct timespec deadline;
+
+	rcode = (node->entry->module->instantiate)(r->cs, &insthandle);
+
+	/*
+	 *	The node stays valid until we say we're done, because
+	 *	detach_modules() waits for us.  But the swap has to
+	 *	happen under the same lock as the check, or it could
+	 *	land after the server has started exiting.
+	 */
+	pthread_mutex_lock(&module_hup_mutex);
+	node->reloading = FALSE;
+
+	if (rcode < 0) {
+		pthread_mutex_unlock(&module_hup_mutex);
+		radlog(L_ERR, " Module: HUP failed for module \"%s\".  Using old configuration.",
+		       node->name);
+		goto done;
+	}
+
+	if (module_hup_exiting) {
+		pthread_mutex_unlock(&module_hup_mutex);
+		module_instance_detach(r->cs, node, insthandle);
+		goto done;
+	}
+
+	module_instance_swap_locked(node, insthandle, time(NULL));
+	pthread_mutex_unlock(&module_hup_mutex);
+
+	radlog(L_INFO, " Module: Reloaded module \"%s\"", node->name);
+
+	/*
+	 *	Come back when the old instance can be freed, rather
+	 *	than waiting for the next HUP.  If the server exits
+	 *	first, the instance tree frees it.
+	 */
+	deadline.tv_sec = time(NULL) + MODULE_HUP_GRACE;
+	deadline.tv_nsec = 0;
+
+	pthread_mutex_lock(&module_hup_mutex);
+	while (!module_hup_exiting &&
+	       (pthread_cond_timedwait(&module_hup_cond, &module_hup_mutex,
+				       &deadline) != ETIMEDOUT)) {
+		/* nothing */
+	}
+	rcode = module_hup_exiting;
+	pthread_mutex_unlock(&module_hup_mutex);
+
+	if (!rcode) module_instance_free_old(r->cs, node, time(NULL));
+
+ done:
+	free(r);
+
+	pthread_mutex_lock(&module_hup_mutex);
+	module_reload_threads--;
+	pthread_cond_broadcast(&module_hup_cond);
+	pthread_mutex_unlock(&module_hup_mutex);
+
+	return NULL;
+}
+
+/*
+ *	Start a thread to re-instantiate the module.  Returns 0 if
+ *	the caller should do it instead.
+ */
+static int module_reload_start(CONF_SECTION *cs, module_instance_t *node)
+{
+	int rcode;
+	pthread_t thread;
+	pthread_attr_t attr;
+	module_reload_t *r;
+
+	pthread_mutex_lock(&module_hup_mutex);
+	if (node->reloading) {
+		pthread_mutex_unlock(&module_hup_mutex);
+		radlog(L_INFO, " Module: Module \"%s\" is still reloading from the last HUP",
+		       node->name);
+		return 1;
+	}
+	node->reloading = TRUE;
+	module_reload_threads++;
+	pthread_mutex_unlock(&module_hup_mutex);
+
+	r = rad_malloc(sizeof(*r));
+	r->node = node;
+	r->cs = cs;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rcode = pthread_create(&thread, &attr, module_reload_thread, r);
+	pthread_attr_destroy(&attr);
+
+	if (rcode != 0) {
+		radlog(L_ERR, " Module: Failed starting thread to reload module \"%s\": %s",
+		       node->name, strerror(rcode));
+		pthread_mutex_lock(&module_hup_mutex);
+		node->reloading = FALSE;
+		module_reload_threads--;
+		pthread_mutex_unlock(&module_hup_mutex);
+		free(r);
+		return 0;
+	}
+
+	return 1;
+}
+#endif
+
 int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 {
 	void *insthandle = NULL;
-	fr_module_hup_t *mh;
 
 	if (!node ||
 	    !node->entry->module->instantiate ||
@@ -1341,6 +1554,15 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	}
 
 	cf_log_module(cs, "Trying to reload module \"%s\"", node->name);
+
+	module_instance_free_old(cs, node, when);
+
+#ifdef HAVE_PTHREAD_H
+	if (((node->entry->module->type & RLM_TYPE_HUP_BACKGROUND) != 0) &&
+	    module_reload_start(cs, node)) {
+		return 1;
+	}
+#endif
 	
 	if ((node->entry->module->instantiate)(cs, &insthandle) < 0) {
 		cf_log_err(cf_sectiontoitem(cs),
@@ -1351,19 +1573,10 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 
 	radlog(L_INFO, " Module: Reloaded module \"%s\"", node->name);
 
-	module_instance_free_old(cs, node, when);
-
 	/*
 	 *	Save the old instance handle for later deletion.
 	 */
-	mh = rad_malloc(sizeof(*mh));
-	mh->mi = node;
-	mh->when = when;
-	mh->insthandle = node->insthandle;
-	mh->next = node->mh;
-	node->mh = mh;
-
-	node->insthandle = insthandle;
+	module_instance_swap(node, insthandle, when);
 	
 	/*
 	 *	FIXME: Set a timeout to come back in 60s, so that
@@ -1290,6 +1290,122 @@ int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 	return request_insert(listener, packet, client, fun, &now);
 }
 
+/*
+ *	A packet which has been held back by the client's rate limit.
+ *
+ *	The entries are kept on a list, so that they can be deleted
+ *	when the listener or client they refer to goes away.  The list
+ *	is only touched from the main event loop, so it isn't locked.
+ */
+typedef struct request_delayed_t {
+	struct request_delayed_t *prev;
+	struct request_delayed_t *next;
+	rad_listen_t		*listener;
+	RADIUS_PACKET		*packet;
+	RADCLIENT		*client;
+	RAD_REQUEST_FUNP	fun;
+	struct timeval		when;
+	fr_event_t		*ev;
+} request_delayed_t;
+
+static request_delayed_t *delayed_head = NULL;
+
+static void request_delayed_unlink(request_delayed_t *delayed)
+{
+	if (delayed->prev) {
+		delayed->prev->next = delayed->next;
+	} else {
+		delayed_head = delayed->next;
+	}
+
+	if (delayed->next) delayed->next->prev = delayed->prev;
+}
+
+static void request_delayed_timer(void *ctx)
+{
+	request_delayed_t *delayed = ctx;
+	rad_listen_t *listener = delayed->listener;
+	RADCLIENT *client = delayed->client;
+
+	request_delayed_unlink(delayed);
+
+	if (!request_receive(listener, delayed->packet, client,
+			     delayed->fun)) {
+		if (listener->type == RAD_LISTEN_AUTH) {
+			FR_STATS_INC(auth, total_packets_dropped);
+		}
+#ifdef WITH_ACCOUNTING
+		else if (listener->type == RAD_LISTEN_ACCT) {
+			FR_STATS_INC(acct, total_packets_dropped);
+		}
+#endif
+		rad_free(&delayed->packet);
+	}
+
+	free(delayed);
+}
+
+/*
+ *	Discard the delayed packets which were received on "listener",
+ *	or from "client".  If both are NULL, discard all of them.
+ */
+void request_delayed_delete(rad_listen_t *listener, RADCLIENT *client)
+{
+	request_delayed_t *delayed, *next;
+
+	for (delayed = delayed_head; delayed != NULL; delayed = next) {
+		next = delayed->next;
+
+		if ((listener || client) &&
+		    (delayed->listener != listener) &&
+		    (delayed->client != client)) continue;
+
+		request_delayed_unlink(delayed);
+		if (el) fr_event_delete(el, &delayed->ev);
+		rad_free(&delayed->packet);
+		free(delayed);
+	}
+}
+
+/*
+ *	Receive the packet "usec" microseconds from now.  The packet
+ *	isn't looked at until then, so retransmissions which arrive
+ *	in the mean time are not detected as duplicates until they,
+ *	too, are received.
+ */
+int request_receive_delayed(rad_listen_t *listener, RADIUS_PACKET *packet,
+			    RADCLIENT *client, RAD_REQUEST_FUNP fun, int usec)
+{
+	request_delayed_t *delayed;
+
+	if (!el || (usec <= 0)) {
+		return request_receive(listener, packet, client, fun);
+	}
+
+	delayed = rad_malloc(sizeof(*delayed));
+	memset(delayed, 0, sizeof(*delayed));
+
+	delayed->listener = listener;
+	delayed->packet = packet;
+	delayed->client = client;
+	delayed->fun = fun;
+
+	gettimeofday(&delayed->when, NULL);
+	tv_add(&delayed->when, usec);
+
+	if (!fr_event_insert(el, request_delayed_timer, delayed,
+			     &delayed->when, &delayed->ev)) {
+		free(delayed);
+		return request_receive(listener, packet, client, fun);
+	}
+
+	delayed->next = delayed_head;
+	if (delayed_head) delayed_head->prev = delayed;
+	delayed_head = delayed;
+
+	return 1;
+}
+
 int request_insert(rad_listen_t *listener, RADIUS_PACKET *packet,
 		   RADCLIENT *client, RAD_REQUEST_FUNP fun,
 		   struct timeval *pnow)
@@ -3253,6 +3369,114 @@ static void request_coa_process(REQUEST *request, int action)
  *	Event handlers.
  *
  ***********************************************************************/
+#ifdef HAVE_PTHREAD_H
+#ifndef AUTH_HDR_LEN
+#define AUTH_HDR_LEN (20)
+#endif
+
+/*
+ *	Look for an attribute in a raw packet.  The packet has
+ *	already been checked to be long enough for the header.
+ */
+static const uint8_t *packet_attr_find(const uint8_t *data, size_t len,
+				       int attr)
+{
+	const uint8_t *p, *end;
+
+	end = data + len;
+	for (p = data + AUTH_HDR_LEN; (p + 2) <= end; p += p[1]) {
+		if ((p[1] < 2) || ((p + p[1]) > end)) return NULL;
+
+		if (p[0] == attr) return p;
+	}
+
+	return NULL;
+}
+
+/*
+ *	The thread pool is overloaded.  Peek at the next packet on
+ *	the socket, and decide whether or not to discard it before
+ *	doing any real work on it.
+ *
+ *	We only look at the code and one or two attributes, so this
+ *	is much cheaper than reading, decoding, and inserting the
+ *	request, only to throw it away later.
+ */
+static int event_socket_shed(rad_listen_t *listener)
+{
+	ssize_t len;
+	size_t packet_len;
+	fr_load_class_t load_class;
+	const uint8_t *attr;
+	RADCLIENT *client = NULL;
+	listen_socket_t *sock;
+	uint8_t data[4096];
+
+	if ((listener->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	    && (listener->type != RAD_LISTEN_ACCT)
+#endif
+		) return 0;
+
+	sock = listener->data;
+#ifdef WITH_TCP
+	if (sock->proto == IPPROTO_TCP) return 0;
+#endif
+
+	len = recv(listener->fd, data, sizeof(data), MSG_PEEK);
+	if (len < AUTH_HDR_LEN) return 0; /* let the normal code complain */
+
+	packet_len = (data[2] << 8) | data[3];
+	if ((packet_len < AUTH_HDR_LEN) || (packet_len > (size_t) len)) {
+		return 0;
+	}
+
+	switch (data[0]) {
+	case PW_AUTHENTICATION_REQUEST:
+		load_class = FR_LOAD_CLASS_AUTH;
+		if (packet_attr_find(data, packet_len, PW_STATE)) {
+			load_class = FR_LOAD_CLASS_AUTH_CONTINUE;
+		}
+		break;
+
+#ifdef WITH_ACCOUNTING
+	case PW_ACCOUNTING_REQUEST:
+		load_class = FR_LOAD_CLASS_ACCT;
+		attr = packet_attr_find(data, packet_len, PW_ACCT_STATUS_TYPE);
+		if (attr && (attr[1] == 6) && (attr[2] == 0) &&
+		    (attr[3] == 0) && (attr[4] == 0) &&
+		    (attr[5] == PW_STATUS_ALIVE)) {
+			load_class = FR_LOAD_CLASS_ACCT_INTERIM;
+		}
+		break;
+#endif
+
+		/*
+		 *	Status-Server, etc. are never discarded.
+		 */
+	default:
+		return 0;
+	}
+
+	if (!thread_pool_shed(load_class)) return 0;
+
+	rad_recv_discard(listener->fd);
+
+	if (listener->type == RAD_LISTEN_AUTH) {
+		FR_STATS_INC(auth, total_requests);
+		FR_STATS_INC(auth, total_packets_dropped);
+	}
+#ifdef WITH_ACCOUNTING
+	else {
+		FR_STATS_INC(acct, total_requests);
+		FR_STATS_INC(acct, total_packets_dropped);
+	}
+#endif
+
+	return 1;
+}
+#endif	/* HAVE_PTHREAD_H */
+
 static void event_socket_handler(fr_event_list_t *xel, UNUSED int fd,
 				 void *ctx)
 {
@@ -3276,6 +3500,14 @@ static void event_socket_handler(fr_event_list_t *xel, UNUSED int fd,
 		rad_panic("Socket was closed on us!");
 		_exit(1);
 	}
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Shed load here, before the packet is read.
+	 */
+	if (spawn_flag && thread_pool_overloaded() &&
+	    event_socket_shed(listener)) return;
+#endif
 	
 	listener->recv(listener);
 }
@@ -3472,6 +3704,12 @@ int event_new_fd(rad_listen_t *this)
 		fr_event_fd_delete(el, 0, this->fd);
 		FD_MUTEX_UNLOCK(&fd_mutex);
 
+		/*
+		 *	Packets held back by the rate limit won't be
+		 *	able to use the socket, either.
+		 */
+		request_delayed_delete(this, NULL);
+
 #ifdef WITH_TCP
 		/*
 		 *	We track requests using this socket only for
@@ -3647,6 +3885,7 @@ finish:
 		 */
 		FD_MUTEX_LOCK(&fd_mutex);
 		fr_event_fd_delete(el, 0, this->fd);
+		fr_event_fd_delete(el, 1, this->fd);
 		FD_MUTEX_UNLOCK(&fd_mutex);
 		
 #ifdef WITH_PROXY
@@ -3682,6 +3921,59 @@ finish:
 	return 1;
 }
 
+#ifdef WITH_TCP
+static void event_fd_write_timeout(void *ctx)
+{
+	rad_listen_t *this = ctx;
+
+	DEBUG2(" ... timed out writing to socket");
+
+	this->status = RAD_LISTEN_STATUS_CLOSED;
+	event_new_fd(this);
+}
+
+/*
+ *	Call "handler" when the listener's socket is writable, for
+ *	sockets which have more to send than the kernel would take.
+ *	If the data hasn't all been sent within "timeout" seconds,
+ *	the socket is closed.  A NULL handler stops the calls.
+ *
+ *	Called ONLY from the main thread.
+ */
+int event_fd_writable(rad_listen_t *this, fr_event_fd_handler_t handler,
+		      int timeout)
+{
+	listen_socket_t *sock = this->data;
+	struct timeval when;
+
+	if (sock->ev) fr_event_delete(el, &sock->ev);
+
+	if (!handler) {
+		FD_MUTEX_LOCK(&fd_mutex);
+		fr_event_fd_delete(el, 1, this->fd);
+		FD_MUTEX_UNLOCK(&fd_mutex);
+		return 1;
+	}
+
+	FD_MUTEX_LOCK(&fd_mutex);
+	if (!fr_event_fd_insert(el, 1, this->fd, handler, this)) {
+		FD_MUTEX_UNLOCK(&fd_mutex);
+		return 0;
+	}
+	FD_MUTEX_UNLOCK(&fd_mutex);
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += timeout;
+
+	if (!fr_event_insert(el, event_fd_write_timeout, this,
+			     &when, &sock->ev)) {
+		rad_panic("Failed to insert event");
+	}
+
+	return 1;
+}
+#endif
+
 /***********************************************************************
  *
  *	Signal handlers.
@@ -4020,6 +4312,8 @@ void radius_event_free(void)
 	fr_packet_list_free(pl);
 	pl = NULL;
 
+	request_delayed_delete(NULL, NULL);
+
 	fr_event_list_free(el);
 }
 
@@ -26,6 +26,12 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/conf.h>
 #include <freeradius-devel/radpaths.h>
+#ifdef WITH_VMPS
+#include <freeradius-devel/vqp.h>
+#endif
+#ifdef WITH_DHCP
+#include <freeradius-devel/dhcp.h>
+#endif
 
 #include <ctype.h>
 
@@ -673,18 +679,673 @@ static void process_file(const char *filename)
 	if (fp != stdin) fclose(fp);
 }
 
+/*
+ *	Benchmark and fuzz harness for the packet codecs.
+ *
+ *	The input is a "corpus" of packets, one per line, in hex.
+ *	Each packet is decoded and re-encoded, either many times
+ *	to measure the codec, or after random mutations, to check
+ *	that what we decode can be encoded again, and decodes to
+ *	the same attributes.
+ */
+#define MAX_CORPUS (1024)
+#define MAX_PACKET_LEN (4096)
+#define AUTH_HDR_LEN (20)
+
+typedef struct corpus_t {
+	uint8_t		*data;
+	size_t		len;
+} corpus_t;
+
+typedef struct codec_t {
+	const char	*name;
+	int		(*ok)(RADIUS_PACKET *packet);
+	int		(*decode)(RADIUS_PACKET *packet,
+				  RADIUS_PACKET *original);
+	int		(*encode)(RADIUS_PACKET *packet,
+				  RADIUS_PACKET *original);
+	void		(*fixup)(uint8_t *data, size_t len);
+} codec_t;
+
+static const char *secret = "testing123";
+static int strict = 0;
+
+/*
+ *	Requests are decoded and encoded without an original.
+ *	Everything else uses the packet it was decoded from.
+ */
+static int radius_is_request(int code)
+{
+	switch (code) {
+	case PW_AUTHENTICATION_REQUEST:
+	case PW_ACCOUNTING_REQUEST:
+	case PW_DISCONNECT_REQUEST:
+	case PW_COA_REQUEST:
+		return 1;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int radius_ok(RADIUS_PACKET *packet)
+{
+	return rad_packet_ok(packet, 0);
+}
+
+static int radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original)
+{
+	VALUE_PAIR *vp;
+
+	if (radius_is_request(packet->code)) original = NULL;
+
+	if (rad_decode(packet, original, secret) < 0) return -1;
+
+	/*
+	 *	We don't sign the packets we encode, so the
+	 *	signature would always be different.
+	 */
+	for (vp = packet->vps; vp != NULL; vp = vp->next) {
+		if ((vp->attribute == PW_MESSAGE_AUTHENTICATOR) &&
+		    (vp->vendor == 0)) {
+			memset(vp->vp_octets, 0, vp->length);
+		}
+	}
+
+	return 0;
+}
+
+static int radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET *original)
+{
+	if (radius_is_request(packet->code)) original = NULL;
+
+	return rad_encode(packet, original, secret);
+}
+
+/*
+ *	Most mutations change the packet length, which the header
+ *	has to agree with, or the packet is just thrown away.
+ */
+static void radius_fixup(uint8_t *data, size_t len)
+{
+	if ((len < 4) || (random() & 0x03) == 0) return;
+
+	data[2] = (len >> 8) & 0xff;
+	data[3] = len & 0xff;
+}
+
+#ifdef WITH_VMPS
+static int vqp_decode_wrapper(RADIUS_PACKET *packet,
+			      UNUSED RADIUS_PACKET *original)
+{
+	VALUE_PAIR *vp;
+
+	if (vqp_decode(packet) < 0) return -1;
+
+	/*
+	 *	The decoder always adds an error code, but the
+	 *	encoder sends an error packet if there is one.
+	 */
+	vp = pairfind(packet->vps, PW_VQP_ERROR_CODE, 0);
+	if (vp && (vp->vp_integer == 0)) {
+		pairdelete(&packet->vps, PW_VQP_ERROR_CODE, 0);
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef WITH_DHCP
+static int dhcp_decode_wrapper(RADIUS_PACKET *packet,
+			       UNUSED RADIUS_PACKET *original)
+{
+	return fr_dhcp_decode(packet);
+}
+#endif
+
+static const codec_t codecs[] = {
+	{ "radius", radius_ok, radius_decode, radius_encode,
+	  radius_fixup },
+#ifdef WITH_VMPS
+	{ "vqp", vqp_packet_ok, vqp_decode_wrapper, vqp_encode, NULL },
+#endif
+#ifdef WITH_DHCP
+	{ "dhcp", fr_dhcp_packet_ok, dhcp_decode_wrapper,
+	  fr_dhcp_encode, NULL },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static uint64_t now_usec(void)
+{
+	struct timeval when;
+
+	gettimeofday(&when, NULL);
+	return (((uint64_t) when.tv_sec) * 1000000) + when.tv_usec;
+}
+
+static int corpus_load(const char *filename, corpus_t *corpus, int max)
+{
+	int lineno, num;
+	ssize_t len;
+	FILE *fp;
+	char buffer[16384];
+	uint8_t data[MAX_PACKET_LEN + 1];
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Error opening %s: %s\n",
+			filename, strerror(errno));
+		exit(1);
+	}
+
+	lineno = num = 0;
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		char *p;
+
+		lineno++;
+
+		p = strchr(buffer, '#');
+		if (p) *p = '\0';
+
+		p = buffer;
+		while (isspace((int) *p)) p++;
+		if (!*p) continue;
+
+		len = encode_hex(p, data, sizeof(data));
+		if (len == 0) {
+			fprintf(stderr, "Invalid packet at line %d of %s\n",
+				lineno, filename);
+			exit(1);
+		}
+
+		if (num == max) {
+			fprintf(stderr, "Too many packets in %s\n", filename);
+			exit(1);
+		}
+
+		corpus[num].data = malloc(len);
+		memcpy(corpus[num].data, data, len);
+		corpus[num].len = len;
+		num++;
+	}
+
+	fclose(fp);
+
+	if (num == 0) {
+		fprintf(stderr, "No packets in %s\n", filename);
+		exit(1);
+	}
+
+	return num;
+}
+
+static void vps_prints(char *out, size_t outlen, const VALUE_PAIR *vp)
+{
+	size_t len;
+
+	*out = '\0';
+	for (; vp != NULL; vp = vp->next) {
+		vp_prints(out, outlen, vp);
+		len = strlen(out);
+		out += len;
+		outlen -= len;
+
+		if (vp->next && (outlen > 2)) {
+			strcpy(out, ", ");
+			out += 2;
+			outlen -= 2;
+		}
+	}
+}
+
+static int vps_count(const VALUE_PAIR *vp)
+{
+	int num = 0;
+
+	for (; vp != NULL; vp = vp->next) num++;
+
+	return num;
+}
+
+static void print_packet(FILE *fp, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) fprintf(fp, "%02x", data[i]);
+	fprintf(fp, "\n");
+}
+
+typedef struct type_stats_t {
+	uint64_t	attrs;
+	uint64_t	decode_usec;
+	uint64_t	decode_ops;
+	uint64_t	encode_usec;
+	uint64_t	encode_ops;
+} type_stats_t;
+
+/*
+ *	Time each attribute in a RADIUS packet on its own, so that
+ *	we can see which data types are expensive.
+ */
+static void bench_attrs(const RADIUS_PACKET *packet, int loops,
+			type_stats_t *stats)
+{
+	int i;
+	ssize_t len, my_len;
+	uint64_t start;
+	uint8_t *attr;
+	VALUE_PAIR *vp;
+	const VALUE_PAIR *next;
+	RADIUS_PACKET reply;
+	const RADIUS_PACKET *original = packet;
+	uint8_t data[MAX_PACKET_LEN];
+
+	if (radius_is_request(packet->code)) original = NULL;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.code = packet->code;
+	reply.id = packet->id;
+	memcpy(reply.vector, packet->vector, sizeof(reply.vector));
+
+	attr = packet->data + AUTH_HDR_LEN;
+	len = packet->data_len - AUTH_HDR_LEN;
+
+	while (len > 0) {
+		int type;
+
+		vp = NULL;
+		my_len = rad_attr2vp(packet, original, secret, attr, len, &vp);
+		if (my_len <= 0) return;
+
+		type = vp ? vp->type : PW_TYPE_OCTETS;
+		if ((type < 0) || (type > PW_TYPE_INTEGER64)) {
+			type = PW_TYPE_OCTETS;
+		}
+		pairfree(&vp);
+
+		start = now_usec();
+		for (i = 0; i < loops; i++) {
+			vp = NULL;
+			rad_attr2vp(packet, original, secret, attr, len, &vp);
+			pairfree(&vp);
+		}
+		stats[type].decode_usec += now_usec() - start;
+		stats[type].decode_ops += loops;
+		stats[type].attrs++;
+
+		vp = NULL;
+		rad_attr2vp(packet, original, secret, attr, len, &vp);
+		if (vp && (vp->attribute != PW_MESSAGE_AUTHENTICATOR)) {
+			start = now_usec();
+			for (i = 0; i < loops; i++) {
+				next = vp;
+				rad_vp2attr(&reply, original, secret, &next,
+					    data, sizeof(data));
+			}
+			stats[type].encode_usec += now_usec() - start;
+			stats[type].encode_ops += loops;
+		}
+		pairfree(&vp);
+
+		attr += my_len;
+		len -= my_len;
+	}
+}
+
+static int bench_corpus(const codec_t *codec, const corpus_t *corpus, int num,
+			int loops)
+{
+	int i, j;
+	uint64_t start, decode_usec, encode_usec;
+	uint64_t vps, bytes, packets;
+	RADIUS_PACKET packet, reply;
+	type_stats_t stats[PW_TYPE_INTEGER64 + 1];
+
+	memset(stats, 0, sizeof(stats));
+	decode_usec = encode_usec = 0;
+	vps = bytes = packets = 0;
+
+	for (i = 0; i < num; i++) {
+		uint8_t data[MAX_PACKET_LEN];
+
+		memset(&packet, 0, sizeof(packet));
+		memcpy(data, corpus[i].data, corpus[i].len);
+		packet.data = data;
+		packet.data_len = corpus[i].len;
+		packet.src_ipaddr.af = AF_INET;
+
+		if (!codec->ok(&packet) ||
+		    (codec->decode(&packet, &packet) < 0)) {
+			fprintf(stderr, "Failed decoding packet %d: %s\n",
+				i + 1, fr_strerror());
+			return 1;
+		}
+
+		memset(&reply, 0, sizeof(reply));
+		reply.code = packet.code;
+		reply.id = packet.id;
+		memcpy(reply.vector, packet.vector, sizeof(reply.vector));
+		reply.vps = packet.vps;
+		packet.vps = NULL;
+
+		if (codec->encode(&reply, &packet) < 0) {
+			fprintf(stderr, "Failed encoding packet %d: %s\n",
+				i + 1, fr_strerror());
+			return 1;
+		}
+		free(reply.data);
+		reply.data = NULL;
+
+		vps += vps_count(reply.vps);
+		bytes += vps_count(reply.vps) * sizeof(VALUE_PAIR);
+		packets++;
+
+		/*
+		 *	The whole packet, as the server sees it.
+		 */
+		start = now_usec();
+		for (j = 0; j < loops; j++) {
+			packet.data_len = corpus[i].len;
+			packet.vps = NULL;
+			codec->ok(&packet);
+			codec->decode(&packet, &packet);
+			pairfree(&packet.vps);
+		}
+		decode_usec += now_usec() - start;
+
+		start = now_usec();
+		for (j = 0; j < loops; j++) {
+			codec->encode(&reply, &packet);
+			free(reply.data);
+			reply.data = NULL;
+		}
+		encode_usec += now_usec() - start;
+
+		pairfree(&reply.vps);
+
+		if (strcmp(codec->name, "radius") == 0) {
+			packet.data_len = corpus[i].len;
+			codec->ok(&packet);
+			bench_attrs(&packet, loops, stats);
+		}
+	}
+
+	printf("%s: %d packets, %d loops\n\n", codec->name, num, loops);
+	printf("\t%-12s %14s %14s %8s %10s\n", "",
+	       "decode ns/op", "encode ns/op", "VPs", "VP bytes");
+	printf("\t%-12s %14u %14u %8.1f %10u\n", "packet",
+	       (unsigned int) ((decode_usec * 1000) / (packets * loops)),
+	       (unsigned int) ((encode_usec * 1000) / (packets * loops)),
+	       ((double) vps) / packets, (unsigned int) (bytes / packets));
+
+	for (i = 0; i <= PW_TYPE_INTEGER64; i++) {
+		if (!stats[i].attrs) continue;
+
+		printf("\t%-12s %14u %14u %8u\n",
+		       fr_int2str(dict_attr_types, i, "?Unknown?"),
+		       (unsigned int) ((stats[i].decode_usec * 1000) /
+				       stats[i].decode_ops),
+		       stats[i].encode_ops ?
+		       (unsigned int) ((stats[i].encode_usec * 1000) /
+				       stats[i].encode_ops) : 0,
+		       (unsigned int) stats[i].attrs);
+	}
+	printf("\n\t(VPs and VP bytes are the allocations for decoding one packet)\n");
+
+	return 0;
+}
+
+/*
+ *	Encode the attributes of a decoded packet, and decode the
+ *	result into a new packet.
+ */
+static RADIUS_PACKET *fuzz_reencode(const codec_t *codec,
+				    RADIUS_PACKET *packet,
+				    RADIUS_PACKET *original,
+				    const char **error)
+{
+	RADIUS_PACKET *reply;
+
+	reply = rad_alloc(0);
+	reply->code = packet->code;
+	reply->id = packet->id;
+	memcpy(reply->vector, packet->vector, sizeof(reply->vector));
+	reply->src_ipaddr.af = AF_INET;
+	reply->dst_ipaddr.af = AF_INET;
+	reply->vps = paircopy(packet->vps);
+
+	if (codec->encode(reply, original) < 0) {
+		*error = NULL;	/* not everything can be encoded */
+		rad_free(&reply);
+		return NULL;
+	}
+
+	pairfree(&reply->vps);
+
+	if (!codec->ok(reply)) {
+		*error = fr_strerror();
+		rad_free(&reply);
+		return NULL;
+	}
+
+	if (codec->decode(reply, original) < 0) {
+		*error = fr_strerror();
+		rad_free(&reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+/*
+ *	Returns 1 if the packet survives the round trip, or
+ *	doesn't decode at all, 0 if it doesn't.
+ */
+static int fuzz_one(const codec_t *codec, const uint8_t *data, size_t len)
+{
+	const char *error = NULL;
+	RADIUS_PACKET *packet, *reply = NULL, *again = NULL;
+	static char before[65536], after[65536];
+
+	packet = rad_alloc(0);
+	packet->data = malloc(len);
+	memcpy(packet->data, data, len);
+	packet->data_len = len;
+	packet->src_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.af = AF_INET;
+
+	if (!codec->ok(packet) || (codec->decode(packet, packet) < 0)) {
+		rad_free(&packet);
+		return 1;
+	}
+
+	vps_prints(before, sizeof(before), packet->vps);
+	*after = '\0';
+
+	reply = fuzz_reencode(codec, packet, packet, &error);
+	if (!reply) goto done;
+
+	/*
+	 *	Not everything we decode can be encoded again:
+	 *	VQP only encodes some attributes, and empty
+	 *	passwords are dropped.  So by default, we check that
+	 *	a second round gets the same attributes as the
+	 *	first.  Strict checking compares them with the
+	 *	original packet.
+	 */
+	if (!strict) {
+		vps_prints(before, sizeof(before), reply->vps);
+
+		again = fuzz_reencode(codec, reply, packet, &error);
+		if (!again) goto done;
+
+		vps_prints(after, sizeof(after), again->vps);
+	} else {
+		vps_prints(after, sizeof(after), reply->vps);
+	}
+
+	if (strcmp(before, after) != 0) error = "attributes changed";
+
+done:
+	if (error) {
+		fprintf(stderr, "Round trip failed: %s\n\tpacket ", error);
+		print_packet(stderr, data, len);
+		fprintf(stderr, "\tbefore %s\n\tafter  %s\n", before, after);
+	}
+
+	rad_free(&again);
+	rad_free(&reply);
+	rad_free(&packet);
+	return (error == NULL);
+}
+
+/*
+ *	Mutations which tend to find problems in TLV decoders:
+ *	flipped bits, odd lengths, truncation, and bits of one
+ *	attribute copied over another.
+ */
+static size_t fuzz_mutate(uint8_t *data, size_t len, size_t max)
+{
+	int i, num;
+	size_t where, from, size;
+	static const uint8_t interesting[] = { 0, 1, 2, 3, 4, 0x7f, 0x80,
+					       0xfe, 0xff };
+
+	num = 1 + (random() & 0x03);
+	for (i = 0; i < num; i++) {
+		if (len == 0) break;
+
+		where = random() % len;
+
+		switch (random() % 6) {
+		case 0:
+			data[where] ^= 1 << (random() & 0x07);
+			break;
+
+		case 1:
+			data[where] = random() & 0xff;
+			break;
+
+		case 2:
+			data[where] = interesting[random() % sizeof(interesting)];
+			break;
+
+		case 3:
+			len = where + 1;
+			break;
+
+		case 4:
+			size = 1 + (random() & 0x0f);
+			if ((len + size) > max) break;
+			while (size--) data[len++] = random() & 0xff;
+			break;
+
+		default:
+			from = random() % len;
+			size = 1 + (random() % (len - from));
+			if ((where + size) > len) size = len - where;
+			memmove(data + where, data + from, size);
+			break;
+		}
+	}
+
+	return len;
+}
+
+static int fuzz_corpus(const codec_t *codec, const corpus_t *corpus, int num,
+		       int loops, unsigned int seed)
+{
+	int i, failed;
+	size_t len;
+	uint8_t data[MAX_PACKET_LEN];
+
+	srandom(seed);
+	failed = 0;
+
+	/*
+	 *	The corpus itself must survive, too.
+	 */
+	for (i = 0; i < num; i++) {
+		if (!fuzz_one(codec, corpus[i].data, corpus[i].len)) failed++;
+	}
+
+	for (i = 0; i < loops; i++) {
+		const corpus_t *c = &corpus[random() % num];
+
+		memcpy(data, c->data, c->len);
+		len = fuzz_mutate(data, c->len, sizeof(data));
+		if (codec->fixup) codec->fixup(data, len);
+
+		if (!fuzz_one(codec, data, len)) failed++;
+	}
+
+	printf("%s: %d packets, %d mutations, seed %u: %d failed\n",
+	       codec->name, num, loops, seed, failed);
+
+	return (failed != 0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: radattr [OPTS] filename\n");
+	fprintf(stderr, "  -d <raddb>             Set dictionary directory.\n");
+	fprintf(stderr, "  -b <loops>             Benchmark decoding and encoding the packets in the file.\n");
+	fprintf(stderr, "  -f <mutations>         Fuzz the packets in the file, and check they round trip.\n");
+	fprintf(stderr, "  -r <seed>              Random seed for fuzzing.\n");
+	fprintf(stderr, "  -s <secret>            Shared secret for RADIUS packets.\n");
+	fprintf(stderr, "  -x                     Fuzzed packets must re-encode exactly, with no attributes lost.\n");
+	fprintf(stderr, "  -t <type>              Packet type: radius (default)");
+#ifdef WITH_VMPS
+	fprintf(stderr, ", vqp");
+#endif
+#ifdef WITH_DHCP
+	fprintf(stderr, ", dhcp");
+#endif
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	int c;
+	int c, num;
+	int bench = 0, fuzz = 0;
+	unsigned int seed = 1;
 	const char *radius_dir = RADDBDIR;
+	const codec_t *codec = &codecs[0];
+	corpus_t *corpus;
 
-	while ((c = getopt(argc, argv, "d:")) != EOF) switch(c) {
+	while ((c = getopt(argc, argv, "b:d:f:r:s:t:x")) != EOF) switch(c) {
+		case 'b':
+			bench = atoi(optarg);
+			if (bench <= 0) usage();
+			break;
 		case 'd':
 			radius_dir = optarg;
 			break;
+		case 'f':
+			fuzz = atoi(optarg);
+			if (fuzz < 0) usage();
+			break;
+		case 'r':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			secret = optarg;
+			break;
+		case 't':
+			for (codec = &codecs[0]; codec->name; codec++) {
+				if (strcmp(codec->name, optarg) == 0) break;
+			}
+			if (!codec->name) usage();
+			break;
+		case 'x':
+			strict = 1;
+			break;
 		default:
-			fprintf(stderr, "usage: radattr [OPTS] filename\n");
-			exit(1);
+			usage();
 	}
 	argc -= (optind - 1);
 	argv += (optind - 1);
@@ -694,6 +1355,23 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (bench || fuzz) {
+		if (argc < 2) usage();
+
+		corpus = malloc(sizeof(*corpus) * MAX_CORPUS);
+		num = corpus_load(argv[1], corpus, MAX_CORPUS);
+
+		if (bench && bench_corpus(codec, corpus, num, bench)) return 1;
+
+		if (fuzz && fuzz_corpus(codec, corpus, num, fuzz, seed)) {
+			return 1;
+		}
+
+		while (num > 0) free(corpus[--num].data);
+		free(corpus);
+		return 0;
+	}
+
 	if (argc < 2) {
 		process_file("-");
 
@@ -28,8 +28,10 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/conf.h>
 #include <freeradius-devel/radpaths.h>
+#include <freeradius-devel/md5.h>
 
 #include <ctype.h>
+#include <math.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -68,6 +70,7 @@ const char *proto = NULL;
 static int ipproto = IPPROTO_UDP;
 
 static rbtree_t *filename_tree = NULL;
+static rbtree_t *detail_tree = NULL;
 static fr_packet_list_t *pl = NULL;
 
 static int sleep_time = -1;
@@ -98,17 +101,23 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  <command>    One of auth, acct, status, coa, or disconnect.\n");
 	fprintf(stderr, "  -c count    Send each packet 'count' times.\n");
 	fprintf(stderr, "  -d raddb    Set dictionary directory.\n");
+	fprintf(stderr, "  -D file     Read packets from a detail file.\n");
+	fprintf(stderr, "  -e          With -R, send packets at random (Poisson) intervals.\n");
 	fprintf(stderr, "  -f file     Read packets from file, not stdin.\n");
 	fprintf(stderr, "  -F          Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h          Print usage help information.\n");
 	fprintf(stderr, "  -i id       Set request id to 'id'.  Values may be 0..255\n");
 	fprintf(stderr, "  -n num      Send N requests/s\n");
+	fprintf(stderr, "  -N num      With -R, send from 'num' sockets (default 8).\n");
 	fprintf(stderr, "  -p num      Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q          Do not print anything out.\n");
 	fprintf(stderr, "  -r retries  If timeout, retry sending the packet 'retries' times.\n");
+	fprintf(stderr, "  -R rate     Benchmark: send 'rate' packets/s without waiting for replies,\n");
+	fprintf(stderr, "              cycling through the packets read, and print latencies.\n");
 	fprintf(stderr, "  -s          Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S file     read secret from file, not command line.\n");
 	fprintf(stderr, "  -t timeout  Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T secs     With -R, run the benchmark for 'secs' seconds (default 10).\n");
 	fprintf(stderr, "  -v          Show program version information.\n");
 	fprintf(stderr, "  -x          Debugging mode.\n");
 	fprintf(stderr, "  -4          Use IPv4 address of server\n");
@@ -191,6 +200,150 @@ static int mschapv1_encode(VALUE_PAIR **request, const char *password)
 }
 
 
+/*
+ *	Allocate a radclient data structure for one packet.
+ */
+static radclient_t *radclient_alloc(const char *filename, int packet_number)
+{
+	radclient_t *radclient;
+
+	radclient = malloc(sizeof(*radclient));
+	if (!radclient) {
+		perror("radclient: X");
+		return NULL;
+	}
+	memset(radclient, 0, sizeof(*radclient));
+
+	radclient->request = rad_alloc(1);
+	if (!radclient->request) {
+		fr_perror("radclient: Y");
+		free(radclient);
+		return NULL;
+	}
+
+#ifdef WITH_TCP
+	radclient->request->src_ipaddr = client_ipaddr;
+	radclient->request->src_port = client_port;
+	radclient->request->dst_ipaddr = server_ipaddr;
+	radclient->request->dst_port = server_port;
+#endif
+
+	radclient->filename = filename;
+	radclient->request->id = -1; /* allocate when sending */
+	radclient->packet_number = packet_number;
+
+	return radclient;
+}
+
+/*
+ *	Fix up the VP's read for a packet, and add it to the
+ *	tail of the global list.
+ */
+static void radclient_add(radclient_t *radclient)
+{
+	VALUE_PAIR *vp;
+
+	/*
+	 *	Keep a copy of the the User-Password attribute.
+	 */
+	if ((vp = pairfind(radclient->request->vps, PW_USER_PASSWORD, 0)) != NULL) {
+		strlcpy(radclient->password, vp->vp_strvalue,
+			sizeof(radclient->password));
+		/*
+		 *	Otherwise keep a copy of the CHAP-Password attribute.
+		 */
+	} else if ((vp = pairfind(radclient->request->vps, PW_CHAP_PASSWORD, 0)) != NULL) {
+		strlcpy(radclient->password, vp->vp_strvalue,
+			sizeof(radclient->password));
+
+	} else if ((vp = pairfind(radclient->request->vps, PW_MSCHAP_PASSWORD, 0)) != NULL) {
+		strlcpy(radclient->password, vp->vp_strvalue,
+			sizeof(radclient->password));
+	} else {
+		radclient->password[0] = '\0';
+	}
+
+	/*
+	 *  Fix up Digest-Attributes issues
+	 */
+	for (vp = radclient->request->vps; vp != NULL; vp = vp->next) {
+		switch (vp->attribute) {
+		default:
+			break;
+
+			/*
+			 *	Allow it to set the packet type in
+			 *	the attributes read from the file.
+			 */
+		case PW_PACKET_TYPE:
+			radclient->request->code = vp->vp_integer;
+			break;
+
+		case PW_PACKET_DST_PORT:
+			radclient->request->dst_port = (vp->vp_integer & 0xffff);
+			break;
+
+		case PW_PACKET_DST_IP_ADDRESS:
+			radclient->request->dst_ipaddr.af = AF_INET;
+			radclient->request->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+			break;
+
+		case PW_PACKET_DST_IPV6_ADDRESS:
+			radclient->request->dst_ipaddr.af = AF_INET6;
+			radclient->request->dst_ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
+			break;
+
+		case PW_PACKET_SRC_PORT:
+			radclient->request->src_port = (vp->vp_integer & 0xffff);
+			break;
+
+		case PW_PACKET_SRC_IP_ADDRESS:
+			radclient->request->src_ipaddr.af = AF_INET;
+			radclient->request->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+			break;
+
+		case PW_PACKET_SRC_IPV6_ADDRESS:
+			radclient->request->src_ipaddr.af = AF_INET6;
+			radclient->request->src_ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
+			break;
+
+		case PW_DIGEST_REALM:
+		case PW_DIGEST_NONCE:
+		case PW_DIGEST_METHOD:
+		case PW_DIGEST_URI:
+		case PW_DIGEST_QOP:
+		case PW_DIGEST_ALGORITHM:
+		case PW_DIGEST_BODY_DIGEST:
+		case PW_DIGEST_CNONCE:
+		case PW_DIGEST_NONCE_COUNT:
+		case PW_DIGEST_USER_NAME:
+			/* overlapping! */
+			memmove(&vp->vp_octets[2], &vp->vp_octets[0],
+				vp->length);
+			vp->vp_octets[0] = vp->attribute - PW_DIGEST_REALM + 1;
+			vp->length += 2;
+			vp->vp_octets[1] = vp->length;
+			vp->attribute = PW_DIGEST_ATTRIBUTES;
+			break;
+		}
+	} /* loop over the VP's we read in */
+
+	/*
+	 *	Add it to the tail of the list.
+	 */
+	if (!radclient_head) {
+		assert(radclient_tail == NULL);
+		radclient_head = radclient;
+		radclient->prev = NULL;
+	} else {
+		assert(radclient_tail->next == NULL);
+		radclient_tail->next = radclient;
+		radclient->prev = radclient_tail;
+	}
+	radclient_tail = radclient;
+	radclient->next = NULL;
+}
+
 /*
  *	Initialize a radclient data structure and add it to
  *	the global linked list.
@@ -198,7 +351,6 @@ static int mschapv1_encode(VALUE_PAIR **request, const char *password)
 static int radclient_init(const char *filename)
 {
 	FILE *fp;
-	VALUE_PAIR *vp;
 	radclient_t *radclient;
 	int filedone = 0;
 	int packet_number = 1;
@@ -223,36 +375,12 @@ static int radclient_init(const char *filename)
 	 *	Loop until the file is done.
 	 */
 	do {
-		/*
-		 *	Allocate it.
-		 */
-		radclient = malloc(sizeof(*radclient));
+		radclient = radclient_alloc(filename, packet_number++);
 		if (!radclient) {
-			perror("radclient: X");
-			if (fp != stdin) fclose(fp);
-			return 0;
-		}
-		memset(radclient, 0, sizeof(*radclient));
-
-		radclient->request = rad_alloc(1);
-		if (!radclient->request) {
-			fr_perror("radclient: Y");
-			free(radclient);
 			if (fp != stdin) fclose(fp);
 			return 0;
 		}
 
-#ifdef WITH_TCP
-		radclient->request->src_ipaddr = client_ipaddr;
-		radclient->request->src_port = client_port;
-		radclient->request->dst_ipaddr = server_ipaddr;
-		radclient->request->dst_port = server_port;
-#endif
-
-		radclient->filename = filename;
-		radclient->request->id = -1; /* allocate when sending */
-		radclient->packet_number = packet_number++;
-
 		/*
 		 *	Read the VP's.
 		 */
@@ -264,114 +392,166 @@ static int radclient_init(const char *filename)
 			return 1;
 		}
 
-		/*
-		 *	Keep a copy of the the User-Password attribute.
-		 */
-		if ((vp = pairfind(radclient->request->vps, PW_USER_PASSWORD, 0)) != NULL) {
-			strlcpy(radclient->password, vp->vp_strvalue,
-				sizeof(radclient->password));
-			/*
-			 *	Otherwise keep a copy of the CHAP-Password attribute.
-			 */
-		} else if ((vp = pairfind(radclient->request->vps, PW_CHAP_PASSWORD, 0)) != NULL) {
-			strlcpy(radclient->password, vp->vp_strvalue,
-				sizeof(radclient->password));
+		radclient_add(radclient);
 
-		} else if ((vp = pairfind(radclient->request->vps, PW_MSCHAP_PASSWORD, 0)) != NULL) {
-			strlcpy(radclient->password, vp->vp_strvalue,
-				sizeof(radclient->password));
-		} else {
-			radclient->password[0] = '\0';
-		}
+	} while (!filedone); /* loop until the file is done. */
 
-		/*
-		 *  Fix up Digest-Attributes issues
-		 */
-		for (vp = radclient->request->vps; vp != NULL; vp = vp->next) {
-			switch (vp->attribute) {
-			default:
-				break;
+	if (fp != stdin) fclose(fp);
 
-				/*
-				 *	Allow it to set the packet type in
-				 *	the attributes read from the file.
-				 */
-			case PW_PACKET_TYPE:
-				radclient->request->code = vp->vp_integer;
-				break;
+	/*
+	 *	And we're done.
+	 */
+	return 1;
+}
 
-			case PW_PACKET_DST_PORT:
-				radclient->request->dst_port = (vp->vp_integer & 0xffff);
-				break;
 
-			case PW_PACKET_DST_IP_ADDRESS:
-				radclient->request->dst_ipaddr.af = AF_INET;
-				radclient->request->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-				break;
+/*
+ *	Finish one entry read from a detail file.
+ */
+static void radclient_detail_add(radclient_t *radclient)
+{
+	if (!radclient->request->vps) {
+		rad_free(&radclient->request);
+		free(radclient);
+		return;
+	}
 
-			case PW_PACKET_DST_IPV6_ADDRESS:
-				radclient->request->dst_ipaddr.af = AF_INET6;
-				radclient->request->dst_ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
-				break;
+	if (!pairfind(radclient->request->vps, PW_PACKET_TYPE, 0)) {
+		radclient->request->code = PW_ACCOUNTING_REQUEST;
+	}
 
-			case PW_PACKET_SRC_PORT:
-				radclient->request->src_port = (vp->vp_integer & 0xffff);
-				break;
+	radclient_add(radclient);
+}
 
-			case PW_PACKET_SRC_IP_ADDRESS:
-				radclient->request->src_ipaddr.af = AF_INET;
-				radclient->request->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-				break;
+/*
+ *	Attributes which rlm_detail writes, but which aren't part of
+ *	the packet.
+ */
+static const char *detail_skip[] = {
+	"Request-Authenticator",
+	"Client-IP-Address",
+	"Timestamp",
+	"Packet-Src-IP-Address",
+	"Packet-Dst-IP-Address",
+	"Packet-Src-IPv6-Address",
+	"Packet-Dst-IPv6-Address",
+	"Packet-Src-IP-Port",
+	"Packet-Dst-IP-Port",
+	"Packet-Src-Port",	/* the dictionary names for the above */
+	"Packet-Dst-Port",
+	NULL
+};
+
+static int radclient_detail_skip(const char *key)
+{
+	int i;
 
-			case PW_PACKET_SRC_IPV6_ADDRESS:
-				radclient->request->src_ipaddr.af = AF_INET6;
-				radclient->request->src_ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
-				break;
+	for (i = 0; detail_skip[i] != NULL; i++) {
+		if (strcasecmp(key, detail_skip[i]) == 0) return 1;
+	}
 
-			case PW_DIGEST_REALM:
-			case PW_DIGEST_NONCE:
-			case PW_DIGEST_METHOD:
-			case PW_DIGEST_URI:
-			case PW_DIGEST_QOP:
-			case PW_DIGEST_ALGORITHM:
-			case PW_DIGEST_BODY_DIGEST:
-			case PW_DIGEST_CNONCE:
-			case PW_DIGEST_NONCE_COUNT:
-			case PW_DIGEST_USER_NAME:
-				/* overlapping! */
-				memmove(&vp->vp_octets[2], &vp->vp_octets[0],
-					vp->length);
-				vp->vp_octets[0] = vp->attribute - PW_DIGEST_REALM + 1;
-				vp->length += 2;
-				vp->vp_octets[1] = vp->length;
-				vp->attribute = PW_DIGEST_ATTRIBUTES;
-				break;
-			}
-		} /* loop over the VP's we read in */
+	return 0;
+}
+
+/*
+ *	Read packets from a detail file, as written by rlm_detail.
+ *
+ *	Each entry is a date header, followed by one attribute per
+ *	line, and a blank line.  The attributes the detail module
+ *	adds for its own use are skipped.  Entries without a
+ *	Packet-Type are sent as Accounting-Request packets, as that's
+ *	what most detail files contain.
+ */
+static int radclient_detail_init(const char *filename)
+{
+	FILE *fp;
+	int lineno = 0;
+	int packet_number = 1;
+	char buffer[2048];
+	char key[256], op[8], value[1024];
+	radclient_t *radclient = NULL;
+	VALUE_PAIR *vp, **tail = NULL;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "radclient: Error opening %s: %s\n",
+			filename, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		lineno++;
 
 		/*
-		 *	Add it to the tail of the list.
+		 *	Blank line: the end of the current entry.
 		 */
-		if (!radclient_head) {
-			assert(radclient_tail == NULL);
-			radclient_head = radclient;
-			radclient->prev = NULL;
-		} else {
-			assert(radclient_tail->next == NULL);
-			radclient_tail->next = radclient;
-			radclient->prev = radclient_tail;
+		if ((buffer[0] == '\n') || (buffer[0] == '\r')) {
+			if (radclient) radclient_detail_add(radclient);
+			radclient = NULL;
+			continue;
 		}
-		radclient_tail = radclient;
-		radclient->next = NULL;
 
-	} while (!filedone); /* loop until the file is done. */
+		/*
+		 *	Lines which aren't indented are the date
+		 *	header, which starts a new entry.
+		 */
+		if (!isspace((int) buffer[0])) {
+			if (radclient) {
+				fprintf(stderr, "radclient: %s[%d]: Missing blank line before new entry\n",
+					filename, lineno);
+				goto error;
+			}
 
-	if (fp != stdin) fclose(fp);
+			radclient = radclient_alloc(filename, packet_number++);
+			if (!radclient) {
+				fclose(fp);
+				return 0;
+			}
+			tail = &radclient->request->vps;
+			continue;
+		}
+
+		if (!radclient) continue; /* no header yet */
+
+		if ((sscanf(buffer, "%255s %7s %1023s", key, op, value) != 3) ||
+		    !strchr(op, '=')) {
+			fprintf(stderr, "radclient: %s[%d]: Skipping badly formatted line\n",
+				filename, lineno);
+			continue;
+		}
+
+		/*
+		 *	Skip non-protocol attributes, and the packet
+		 *	header, which describes where the original
+		 *	packet came from, not where we're sending it.
+		 */
+		if (radclient_detail_skip(key)) continue;
+
+		vp = NULL;
+		if ((userparse(buffer, &vp) <= 0) || !vp) {
+			fprintf(stderr, "radclient: %s[%d]: %s\n",
+				filename, lineno, fr_strerror());
+			goto error;
+		}
+
+		*tail = vp;
+		while (vp->next) vp = vp->next;
+		tail = &vp->next;
+	}
 
 	/*
-	 *	And we're done.
+	 *	The last entry may not be followed by a blank line.
 	 */
+	if (radclient) radclient_detail_add(radclient);
+
+	fclose(fp);
 	return 1;
+
+ error:
+	rad_free(&radclient->request);
+	free(radclient);
+	fclose(fp);
+	return 0;
 }
 
 
@@ -414,6 +594,19 @@ static int filename_cmp(const void *one, const void *two)
 	return strcmp((const char *) one, (const char *) two);
 }
 
+static int detail_walk(void *context, void *data)
+{
+	const char	*filename = data;
+
+	context = context;	/* -Wunused */
+
+	if (!radclient_detail_init(filename)) {
+		return 1;	/* stop walking */
+	}
+
+	return 0;
+}
+
 static int filename_walk(void *context, void *data)
 {
 	const char	*filename = data;
@@ -522,6 +715,52 @@ static void print_hex(RADIUS_PACKET *packet)
 	fflush(stdout);
 }
 
+/*
+ *	Update the password, so it can be encrypted with the
+ *	new authentication vector.
+ */
+static void radclient_password(radclient_t *radclient)
+{
+	VALUE_PAIR *vp;
+
+	if (radclient->password[0] == '\0') return;
+
+	if ((vp = pairfind(radclient->request->vps, PW_USER_PASSWORD, 0)) != NULL) {
+		strlcpy(vp->vp_strvalue, radclient->password,
+			sizeof(vp->vp_strvalue));
+		vp->length = strlen(vp->vp_strvalue);
+
+	} else if ((vp = pairfind(radclient->request->vps, PW_CHAP_PASSWORD, 0)) != NULL) {
+	  /*
+	   *	FIXME: AND there's no CHAP-Challenge,
+	   *	       AND vp->length != 17
+	   *	       AND rad_chap_encode() != vp->vp_octets
+	   */
+		strlcpy(vp->vp_strvalue, radclient->password,
+			sizeof(vp->vp_strvalue));
+		vp->length = strlen(vp->vp_strvalue);
+
+		rad_chap_encode(radclient->request,
+				vp->vp_octets,
+				radclient->request->id, vp);
+		vp->length = 17;
+
+	} else if (pairfind(radclient->request->vps, PW_MSCHAP_PASSWORD, 0) != NULL) {
+		/*
+		 *	Don't stack up challenges when the packet
+		 *	is sent more than once.
+		 */
+		pairdelete(&radclient->request->vps, PW_MSCHAP_CHALLENGE,
+			   VENDORPEC_MICROSOFT);
+		pairdelete(&radclient->request->vps, PW_MSCHAP_RESPONSE,
+			   VENDORPEC_MICROSOFT);
+		mschapv1_encode(&radclient->request->vps,
+				radclient->password);
+	} else if (fr_debug_flag) {
+		printf("WARNING: No password in the request\n");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -592,40 +831,7 @@ static int send_one_packet(radclient_t *radclient)
 			((uint32_t *) radclient->request->vector)[i] = fr_rand();
 		}
 
-		/*
-		 *	Update the password, so it can be encrypted with the
-		 *	new authentication vector.
-		 */
-		if (radclient->password[0] != '\0') {
-			VALUE_PAIR *vp;
-
-			if ((vp = pairfind(radclient->request->vps, PW_USER_PASSWORD, 0)) != NULL) {
-				strlcpy(vp->vp_strvalue, radclient->password,
-					sizeof(vp->vp_strvalue));
-				vp->length = strlen(vp->vp_strvalue);
-
-			} else if ((vp = pairfind(radclient->request->vps, PW_CHAP_PASSWORD, 0)) != NULL) {
-			  /*
-			   *	FIXME: AND there's no CHAP-Challenge,
-			   *	       AND vp->length != 17
-			   *	       AND rad_chap_encode() != vp->vp_octets
-			   */
-				strlcpy(vp->vp_strvalue, radclient->password,
-					sizeof(vp->vp_strvalue));
-				vp->length = strlen(vp->vp_strvalue);
-
-				rad_chap_encode(radclient->request,
-						vp->vp_octets,
-						radclient->request->id, vp);
-				vp->length = 17;
-
-			} else if (pairfind(radclient->request->vps, PW_MSCHAP_PASSWORD, 0) != NULL) {
-				mschapv1_encode(&radclient->request->vps,
-						radclient->password);
-			} else if (fr_debug_flag) {
-				printf("WARNING: No password in the request\n");
-			}
-		}
+		radclient_password(radclient);
 
 		radclient->timestamp = time(NULL);
 		radclient->tries = 1;
@@ -851,6 +1057,435 @@ static int recv_one_packet(int wait_time)
 }
 
 
+/*
+ *	Benchmark mode.
+ *
+ *	The packets read from the input files are used as templates,
+ *	and are sent round-robin at a fixed rate, without waiting for
+ *	the replies.  i.e. the load is "open loop": a slow server sees
+ *	the same offered load as a fast one, and the latency of each
+ *	reply is measured from when the request should have been sent.
+ *
+ *	Requests are spread over a number of sockets, each of which
+ *	has its own 256 IDs.  Requests which aren't answered within
+ *	the timeout are counted as lost, and are not retransmitted.
+ */
+#define BENCH_SUB_BITS	(4)
+#define BENCH_HIST_SIZE	((32 - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS)
+#define BENCH_MAX_SOCKETS (256)
+
+typedef struct bench_slot_t {
+	uint64_t	when;	/* usec since start */
+	uint8_t		vector[AUTH_VECTOR_LEN];
+	int		in_use;
+} bench_slot_t;
+
+typedef struct bench_sock_t {
+	int		fd;
+	int		num_outstanding;
+	int		next_id;
+	bench_slot_t	slot[256];
+} bench_sock_t;
+
+static int bench_rate = 0;
+static int bench_poisson = 0;
+static int bench_duration = 10;
+static int bench_num_sockets = 8;
+
+static struct timeval bench_start;
+static bench_sock_t *bench_socks = NULL;
+static int bench_next_sock = 0;
+static unsigned long bench_hist[BENCH_HIST_SIZE];
+
+static unsigned long bench_sent, bench_received, bench_accepted, bench_rejected;
+static unsigned long bench_lost, bench_no_id, bench_bad, bench_outstanding;
+static uint64_t bench_latency_min, bench_latency_max, bench_latency_total;
+static uint64_t bench_last_reply;
+
+static uint64_t bench_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((uint64_t) (now.tv_sec - bench_start.tv_sec)) * 1000000 +
+		now.tv_usec - bench_start.tv_usec;
+}
+
+/*
+ *	Latencies are kept in a log-linear histogram: 16 buckets
+ *	for each power of two, so each bucket is within ~6% of the
+ *	real value, and the memory used is fixed.
+ */
+static int bench_bucket(uint32_t usec)
+{
+	int msb;
+
+	if (usec < (1 << BENCH_SUB_BITS)) return usec;
+
+	for (msb = 0; (usec >> msb) > 1; msb++) {
+		/* nothing */
+	}
+
+	return ((msb - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+		((usec >> (msb - BENCH_SUB_BITS)) & ((1 << BENCH_SUB_BITS) - 1));
+}
+
+/*
+ *	The middle of the range of latencies in a bucket.
+ */
+static double bench_bucket_value(int bucket)
+{
+	int shift;
+
+	if (bucket < (1 << BENCH_SUB_BITS)) return bucket;
+
+	shift = (bucket >> BENCH_SUB_BITS) - 1;
+
+	return (((1 << BENCH_SUB_BITS) + (bucket & ((1 << BENCH_SUB_BITS) - 1))) << shift) +
+		((1 << shift) / 2.0);
+}
+
+static double bench_percentile(double pct)
+{
+	int i;
+	unsigned long count, target;
+	double value;
+
+	if (!bench_received) return 0;
+
+	target = (unsigned long) ((bench_received * pct) / 100.0);
+	if (target >= bench_received) target = bench_received - 1;
+
+	count = 0;
+	for (i = 0; i < BENCH_HIST_SIZE; i++) {
+		count += bench_hist[i];
+		if (count > target) break;
+	}
+	if (i == BENCH_HIST_SIZE) i--;
+
+	/*
+	 *	The bucket value is approximate, so keep it within
+	 *	what we actually saw.
+	 */
+	value = bench_bucket_value(i);
+	if (value < bench_latency_min) return bench_latency_min;
+	if (value > bench_latency_max) return bench_latency_max;
+
+	return value;
+}
+
+/*
+ *	Time until the next packet should be sent.
+ */
+static double bench_interval(void)
+{
+	double u;
+
+	if (!bench_poisson) return 1000000.0 / bench_rate;
+
+	/*
+	 *	Exponentially distributed gaps give Poisson arrivals.
+	 *	u is in (0,1], so the log is always defined.
+	 */
+	u = (((double) fr_rand()) + 1.0) / 4294967296.0;
+
+	return -log(u) * 1000000.0 / bench_rate;
+}
+
+static void bench_send(radclient_t *radclient, uint64_t when)
+{
+	int i, id;
+	bench_sock_t *sock = NULL;
+	RADIUS_PACKET *request = radclient->request;
+
+	/*
+	 *	Find a socket with a free ID, starting with the one
+	 *	after the one we used last.
+	 */
+	for (i = 0; i < bench_num_sockets; i++) {
+		sock = &bench_socks[bench_next_sock];
+		bench_next_sock = (bench_next_sock + 1) % bench_num_sockets;
+		if (sock->num_outstanding < 256) break;
+	}
+
+	/*
+	 *	Every ID on every socket is in use.  The load is open
+	 *	loop, so we don't wait for one: count it, and move on.
+	 */
+	if (i == bench_num_sockets) {
+		bench_no_id++;
+		return;
+	}
+
+	id = sock->next_id;
+	while (sock->slot[id].in_use) id = (id + 1) & 0xff;
+	sock->next_id = (id + 1) & 0xff;
+
+	if (request->data) {
+		free(request->data);
+		request->data = NULL;
+	}
+	request->id = id;
+	request->sockfd = sock->fd;
+	for (i = 0; i < 4; i++) {
+		((uint32_t *) request->vector)[i] = fr_rand();
+	}
+	radclient_password(radclient);
+
+	if (rad_send(request, NULL, secret) < 0) {
+		fprintf(stderr, "radclient: Failed to send packet for ID %d: %s\n",
+			request->id, fr_strerror());
+		bench_no_id++;
+		return;
+	}
+
+	/*
+	 *	Accounting packets have their vector calculated when
+	 *	they're signed, so take it from the packet as sent.
+	 */
+	memcpy(sock->slot[id].vector, request->data + 4, AUTH_VECTOR_LEN);
+	sock->slot[id].when = when;
+	sock->slot[id].in_use = 1;
+	sock->num_outstanding++;
+	bench_outstanding++;
+	bench_sent++;
+}
+
+static void bench_recv(bench_sock_t *sock)
+{
+	ssize_t len;
+	size_t packet_len;
+	uint64_t latency;
+	bench_slot_t *slot;
+	FR_MD5_CTX context;
+	uint8_t buffer[4096];
+	uint8_t vector[AUTH_VECTOR_LEN], digest[AUTH_VECTOR_LEN];
+
+	/*
+	 *	Drain the socket.
+	 */
+	while ((len = recv(sock->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+		if (len < 20) {
+			bench_bad++;
+			continue;
+		}
+
+		packet_len = (buffer[2] << 8) | buffer[3];
+		if ((packet_len < 20) || (packet_len > (size_t) len)) {
+			bench_bad++;
+			continue;
+		}
+
+		slot = &sock->slot[buffer[1]];
+		if (!slot->in_use) {
+			bench_bad++; /* late, or not ours */
+			continue;
+		}
+
+		/*
+		 *	Check the Response Authenticator.
+		 */
+		memcpy(vector, buffer + 4, AUTH_VECTOR_LEN);
+		memcpy(buffer + 4, slot->vector, AUTH_VECTOR_LEN);
+		fr_MD5Init(&context);
+		fr_MD5Update(&context, buffer, packet_len);
+		fr_MD5Update(&context, (const uint8_t *) secret, strlen(secret));
+		fr_MD5Final(digest, &context);
+		if (memcmp(digest, vector, AUTH_VECTOR_LEN) != 0) {
+			bench_bad++;
+			continue;
+		}
+
+		bench_last_reply = bench_now();
+		latency = bench_last_reply - slot->when;
+		slot->in_use = 0;
+		sock->num_outstanding--;
+		bench_outstanding--;
+		bench_received++;
+
+		if ((buffer[0] == PW_AUTHENTICATION_ACK) ||
+		    (buffer[0] == PW_ACCOUNTING_RESPONSE) ||
+		    (buffer[0] == PW_COA_ACK) ||
+		    (buffer[0] == PW_DISCONNECT_ACK)) {
+			bench_accepted++;
+		} else {
+			bench_rejected++;
+		}
+
+		if (latency > 0xffffffff) latency = 0xffffffff;
+		bench_hist[bench_bucket(latency)]++;
+		bench_latency_total += latency;
+		if ((bench_received == 1) || (latency < bench_latency_min)) {
+			bench_latency_min = latency;
+		}
+		if (latency > bench_latency_max) bench_latency_max = latency;
+	}
+}
+
+/*
+ *	Give up on requests which have waited longer than the timeout.
+ */
+static void bench_expire(uint64_t now)
+{
+	int i, id;
+	uint64_t limit = (uint64_t) (timeout * 1000000);
+
+	for (i = 0; i < bench_num_sockets; i++) {
+		if (!bench_socks[i].num_outstanding) continue;
+
+		for (id = 0; id < 256; id++) {
+			bench_slot_t *slot = &bench_socks[i].slot[id];
+
+			if (!slot->in_use || ((now - slot->when) < limit)) continue;
+
+			slot->in_use = 0;
+			bench_socks[i].num_outstanding--;
+			bench_outstanding--;
+			bench_lost++;
+		}
+	}
+}
+
+static int radclient_bench(void)
+{
+	int i, max_fd;
+	fd_set set;
+	struct timeval tv;
+	radclient_t *this = radclient_head;
+	uint64_t now, end, wait;
+	uint64_t last_expire = 0, last_report = 0;
+	unsigned long last_sent = 0, last_received = 0;
+	double next_send = 0;
+
+	bench_socks = calloc(bench_num_sockets, sizeof(*bench_socks));
+	if (!bench_socks) {
+		fprintf(stderr, "radclient: Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < bench_num_sockets; i++) {
+		bench_socks[i].fd = fr_socket(&client_ipaddr, 0);
+		if (bench_socks[i].fd < 0) {
+			fprintf(stderr, "radclient: socket: %s\n", fr_strerror());
+			exit(1);
+		}
+		if (bench_socks[i].fd >= FD_SETSIZE) {
+			fprintf(stderr, "radclient: Too many open files\n");
+			exit(1);
+		}
+		bench_socks[i].next_id = fr_rand() & 0xff;
+	}
+
+	gettimeofday(&bench_start, NULL);
+	end = ((uint64_t) bench_duration) * 1000000;
+
+	while (1) {
+		now = bench_now();
+
+		/*
+		 *	Send everything which is due.  If we've fallen
+		 *	behind, this sends a burst to catch up, but we
+		 *	stop now and then to read the replies.
+		 */
+		for (i = 0; (i < 1024) && (next_send <= now) && (next_send < end); i++) {
+			bench_send(this, (uint64_t) next_send);
+			next_send += bench_interval();
+
+			this = this->next;
+			if (!this) this = radclient_head;
+		}
+
+		if ((now - last_expire) >= 100000) {
+			bench_expire(now);
+			last_expire = now;
+		}
+
+		if (do_output && ((now - last_report) >= 1000000)) {
+			double secs = (now - last_report) / 1000000.0;
+
+			if (last_report) {
+				printf("%5.1fs: sent %.0f/s, received %.0f/s, outstanding %lu, lost %lu\n",
+				       now / 1000000.0,
+				       (bench_sent - last_sent) / secs,
+				       (bench_received - last_received) / secs,
+				       bench_outstanding, bench_lost);
+				fflush(stdout);
+			}
+			last_report = now;
+			last_sent = bench_sent;
+			last_received = bench_received;
+		}
+
+		if ((next_send >= end) && !bench_outstanding) break;
+
+		/*
+		 *	Wait for replies, or until the next packet is due.
+		 */
+		if (next_send >= end) {
+			wait = 100000;
+		} else if (next_send <= now) {
+			wait = 0;
+		} else {
+			wait = next_send - now;
+			if (wait > 100000) wait = 100000;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = wait;
+
+		FD_ZERO(&set);
+		max_fd = 0;
+		for (i = 0; i < bench_num_sockets; i++) {
+			FD_SET(bench_socks[i].fd, &set);
+			if (bench_socks[i].fd >= max_fd) max_fd = bench_socks[i].fd + 1;
+		}
+
+		if (select(max_fd, &set, NULL, NULL, &tv) <= 0) continue;
+
+		for (i = 0; i < bench_num_sockets; i++) {
+			if (FD_ISSET(bench_socks[i].fd, &set)) {
+				bench_recv(&bench_socks[i]);
+			}
+		}
+	}
+
+	now = bench_now();
+
+	for (i = 0; i < bench_num_sockets; i++) {
+		close(bench_socks[i].fd);
+	}
+	free(bench_socks);
+
+	printf("\n\t        Benchmark time:  %.2fs (%d packets/s %s, %d sockets)\n",
+	       now / 1000000.0, bench_rate,
+	       bench_poisson ? "poisson" : "constant", bench_num_sockets);
+	printf("\t                  Sent:  %lu (%.1f/s)\n",
+	       bench_sent, bench_sent / (bench_duration * 1.0));
+	printf("\t              Received:  %lu (%.1f/s)\n",
+	       bench_received,
+	       bench_last_reply ? bench_received / (bench_last_reply / 1000000.0) : 0);
+	printf("\t              Accepted:  %lu\n", bench_accepted);
+	printf("\t              Rejected:  %lu\n", bench_rejected);
+	printf("\t                  Lost:  %lu\n", bench_lost);
+	printf("\t     Not sent (no IDs):  %lu\n", bench_no_id);
+	printf("\t           Bad replies:  %lu\n", bench_bad);
+
+	if (bench_received) {
+		printf("\t          Latency (ms):  min %.3f, avg %.3f, max %.3f\n",
+		       bench_latency_min / 1000.0,
+		       (bench_latency_total / (double) bench_received) / 1000.0,
+		       bench_latency_max / 1000.0);
+		printf("\t                         p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+		       bench_percentile(50) / 1000.0,
+		       bench_percentile(90) / 1000.0,
+		       bench_percentile(99) / 1000.0,
+		       bench_percentile(99.9) / 1000.0);
+	}
+
+	return (bench_received > 0);
+}
+
+
 static int getport(const char *name)
 {
 	struct	servent		*svp;
@@ -879,12 +1514,13 @@ int main(int argc, char **argv)
 	fr_debug_flag = 0;
 
 	filename_tree = rbtree_create(filename_cmp, NULL, 0);
-	if (!filename_tree) {
+	detail_tree = rbtree_create(filename_cmp, NULL, 0);
+	if (!filename_tree || !detail_tree) {
 		fprintf(stderr, "radclient: Out of memory\n");
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46c:d:D:ef:Fhi:n:N:p:qr:R:sS:t:T:vx"
 #ifdef WITH_TCP
 			   "P:"
 #endif
@@ -903,6 +1539,12 @@ int main(int argc, char **argv)
 		case 'd':
 			radius_dir = optarg;
 			break;
+		case 'D':
+			rbtree_insert(detail_tree, optarg);
+			break;
+		case 'e':
+			bench_poisson = 1;
+			break;
 		case 'f':
 			rbtree_insert(filename_tree, optarg);
 			break;
@@ -923,6 +1565,12 @@ int main(int argc, char **argv)
 			if (persec <= 0) usage();
 			break;
 
+		case 'N':
+			bench_num_sockets = atoi(optarg);
+			if ((bench_num_sockets <= 0) ||
+			    (bench_num_sockets > BENCH_MAX_SOCKETS)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -961,6 +1609,10 @@ int main(int argc, char **argv)
 			retries = atoi(optarg);
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
+		case 'R':
+			bench_rate = atoi(optarg);
+			if (bench_rate <= 0) usage();
+			break;
 		case 's':
 			do_summary = 1;
 			break;
@@ -997,6 +1649,10 @@ int main(int argc, char **argv)
 				usage();
 			timeout = atof(optarg);
 			break;
+		case 'T':
+			bench_duration = atoi(optarg);
+			if (bench_duration <= 0) usage();
+			break;
 		case 'v':
 			printf("radclient: " RADIUSD_VERSION " built on " __DATE__ " at " __TIME__ "\n");
 			exit(0);
@@ -1114,9 +1770,10 @@ int main(int argc, char **argv)
 	if (argv[3]) secret = argv[3];
 
 	/*
-	 *	If no '-f' is specified, we're reading from stdin.
+	 *	If no '-f' or '-D' is specified, we're reading from stdin.
 	 */
-	if (rbtree_num_elements(filename_tree) == 0) {
+	if ((rbtree_num_elements(filename_tree) == 0) &&
+	    (rbtree_num_elements(detail_tree) == 0)) {
 		rbtree_insert(filename_tree, "-");
 	}
 
@@ -1126,6 +1783,9 @@ int main(int argc, char **argv)
 	if (rbtree_walk(filename_tree, InOrder, filename_walk, NULL) != 0) {
 		exit(1);
 	}
+	if (rbtree_walk(detail_tree, InOrder, detail_walk, NULL) != 0) {
+		exit(1);
+	}
 
 	/*
 	 *	No packets read.  Die.
@@ -1182,6 +1842,18 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (bench_rate) {
+#ifdef WITH_TCP
+		if (proto) {
+			fprintf(stderr, "radclient: Benchmark mode only supports UDP\n");
+			exit(1);
+		}
+#endif
+		success = radclient_bench();
+		do_summary = 0;
+		goto finish;
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -1311,7 +1983,9 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+ finish:
 	rbtree_free(filename_tree);
+	rbtree_free(detail_tree);
 	fr_packet_list_free(pl);
 	while (radclient_head) radclient_free(radclient_head);
 	dict_free();
@@ -38,6 +38,12 @@ static VALUE_PAIR *filter_vps = NULL;
 #undef DEBUG
 #define DEBUG if (fr_debug_flag) printf
 
+/*
+ *	Packets with more attributes than this are fully decoded
+ *	before filtering.
+ */
+#define MAX_INDEX (1024)
+
 static int minimal = 0;
 static int do_sort = 0;
 struct timeval start_pcap = {0, 0};
@@ -200,6 +206,7 @@ static void got_packet(uint8_t *args, const struct pcap_pkthdr *header, const ui
 	/* For FreeRADIUS */
 	RADIUS_PACKET *packet, *original;
 	struct timeval elapsed;
+	int filtered = 0;
 
 	args = args;		/* -Wunused */
 
@@ -266,6 +273,49 @@ static void got_packet(uint8_t *args, const struct pcap_pkthdr *header, const ui
 		original = NULL;
 	}
 
+	/*
+	 *	When filtering, most packets are thrown away.  Decode
+	 *	only the attributes which the filter looks at, and
+	 *	decode the rest once we know we're keeping the packet.
+	 */
+	if (filter_vps) {
+		int num;
+		VALUE_PAIR *check_item;
+		fr_attr_index_t index[MAX_INDEX];
+
+		num = rad_packet_index(packet, index, MAX_INDEX);
+		if (num >= 0) {
+			for (check_item = filter_vps;
+			     check_item != NULL;
+			     check_item = check_item->next) {
+				if (pairfind(packet->vps, check_item->attribute,
+					     check_item->vendor)) continue;
+
+				if (rad_index_decode(packet, original,
+						     radius_secret, index, num,
+						     check_item->attribute,
+						     check_item->vendor,
+						     &packet->vps) < 0) {
+					pairfree(&packet->vps);
+					free(packet);
+					fr_perror("decode");
+					return;
+				}
+			}
+
+			if (filter_packet(packet)) {
+				pairfree(&packet->vps);
+				if (original)
+					rbtree_deletebydata(request_tree, original);
+				free(packet);
+				DEBUG("Packet number %d doesn't match\n", count++);
+				return;
+			}
+			pairfree(&packet->vps);
+			filtered = 1;
+		}
+	}
+
 	/*
 	 *	Decode the data without bothering to check the signatures.
 	 */
@@ -279,7 +329,7 @@ static void got_packet(uint8_t *args, const struct pcap_pkthdr *header, const ui
 	if (original)
 		rbtree_deletebydata(request_tree, original);
 
-	if (filter_vps && filter_packet(packet)) {
+	if (filter_vps && !filtered && filter_packet(packet)) {
 		free(packet);
 		DEBUG("Packet number %d doesn't match\n", count++);
 		return;
@@ -156,6 +156,24 @@ typedef struct THREAD_POOL {
 	int		max_queue_size;
 	int		num_queued;
 	fr_fifo_t	*fifo[NUM_FIFOS];
+
+	/*
+	 *	Overload control.  The child threads measure how long
+	 *	each request sat in the queue.  When that delay stays
+	 *	above the target for a full interval, the main thread
+	 *	is told to start shedding load at the socket, using
+	 *	the CoDel control law to pace the drops.
+	 *
+	 *	"dropping" is written with the mutex held, but may be
+	 *	read without it as a cheap hint.
+	 */
+	int		queue_delay_target; /* milliseconds, 0 is off */
+	int		queue_delay_interval; /* milliseconds */
+	struct timeval	first_above_time;
+	struct timeval	drop_next;
+	unsigned int	drop_count;
+	volatile int	dropping;
+	fr_uint_t	shed[FR_LOAD_CLASS_MAX];
 #endif	/* WITH_GCD */
 } THREAD_POOL;
 
@@ -180,6 +198,8 @@ static const CONF_PARSER thread_config[] = {
 	{ "max_requests_per_server", PW_TYPE_INTEGER, 0, &thread_pool.max_requests_per_thread, "0" },
 	{ "cleanup_delay",           PW_TYPE_INTEGER, 0, &thread_pool.cleanup_delay,           "5" },
 	{ "max_queue_size",          PW_TYPE_INTEGER, 0, &thread_pool.max_queue_size,           "65536" },
+	{ "queue_delay_target",      PW_TYPE_INTEGER, 0, &thread_pool.queue_delay_target,       "0" },
+	{ "queue_delay_interval",    PW_TYPE_INTEGER, 0, &thread_pool.queue_delay_interval,     "1000" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 #endif
@@ -337,6 +357,14 @@ int request_enqueue(REQUEST *request)
 	request->component = "<core>";
 	request->module = "<queue>";
 
+	/*
+	 *	The queue delay is measured from here, and not from
+	 *	when the packet arrived.  Requests which come back to
+	 *	the queue after a proxy reply haven't been waiting for
+	 *	a thread while the home server was answering.
+	 */
+	gettimeofday(&request->queued, NULL);
+
 	/*
 	 *	Push the request onto the appropriate fifo for that
 	 */
@@ -364,6 +392,125 @@ int request_enqueue(REQUEST *request)
 	return 1;
 }
 
+static void tv_add(struct timeval *tv, int usec_delay)
+{
+	if (usec_delay >= 1000000) {
+		tv->tv_sec += usec_delay / 1000000;
+		usec_delay %= 1000000;
+	}
+	tv->tv_usec += usec_delay;
+
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec += tv->tv_usec / 1000000;
+		tv->tv_usec %= 1000000;
+	}
+}
+
+/*
+ *	Integer square root, for the CoDel control law.
+ */
+static unsigned int isqrt(unsigned int n)
+{
+	unsigned int x, y;
+
+	if (n < 2) return n;
+
+	x = n;
+	y = (x + 1) / 2;
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+
+	return x;
+}
+
+/*
+ *	Schedule the next drop: interval / sqrt(count) from now.
+ */
+static void queue_drop_schedule(struct timeval *now)
+{
+	int usec;
+
+	usec = (thread_pool.queue_delay_interval * 1000) / isqrt(thread_pool.drop_count);
+
+	thread_pool.drop_next = *now;
+	tv_add(&thread_pool.drop_next, usec);
+}
+
+/*
+ *	Called with the queue mutex held, for every request which
+ *	leaves the queue.  Tracks how long requests are waiting, and
+ *	decides whether or not the server is overloaded.
+ */
+static void queue_delay_update(REQUEST *request)
+{
+	int delay, target;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	if (timercmp(&now, &request->queued, <)) {
+		delay = 0;
+	} else {
+		struct timeval diff;
+
+		timersub(&now, &request->queued, &diff);
+		if (diff.tv_sec > 1000) diff.tv_sec = 1000;
+		delay = (diff.tv_sec * 1000) + (diff.tv_usec / 1000);
+	}
+
+	target = thread_pool.queue_delay_target;
+
+	/*
+	 *	Below target, or the queue has drained.  Everything
+	 *	is fine.
+	 */
+	if ((delay < target) || (thread_pool.num_queued == 0)) {
+		timerclear(&thread_pool.first_above_time);
+		if (thread_pool.dropping) {
+			thread_pool.dropping = FALSE;
+			DEBUG("Queue delay is now %dms.  Leaving overload state.",
+			      delay);
+		}
+		return;
+	}
+
+	if (thread_pool.dropping) return;
+
+	/*
+	 *	Above target for the first time.  Give it an interval
+	 *	to come back down.
+	 */
+	if (!timerisset(&thread_pool.first_above_time)) {
+		thread_pool.first_above_time = now;
+		tv_add(&thread_pool.first_above_time,
+		       thread_pool.queue_delay_interval * 1000);
+		return;
+	}
+
+	if (timercmp(&now, &thread_pool.first_above_time, <)) return;
+
+	/*
+	 *	It's been above target for a full interval.  Start
+	 *	dropping.  If we were dropping recently, pick up
+	 *	close to the previous drop rate, rather than starting
+	 *	again from scratch.
+	 */
+	if ((thread_pool.drop_count > 2) &&
+	    ((now.tv_sec - thread_pool.drop_next.tv_sec) <
+	     (16 * thread_pool.queue_delay_interval) / 1000)) {
+		thread_pool.drop_count -= 2;
+	} else {
+		thread_pool.drop_count = 1;
+	}
+	thread_pool.drop_next = now;
+	thread_pool.dropping = TRUE;
+
+	radlog(L_INFO, "WARNING: Requests are waiting %dms in the queue (target %dms).  Shedding load.",
+	       delay, target);
+}
+
 /*
  *	Remove a request from the queue.
  */
@@ -428,6 +575,8 @@ static int request_dequeue(REQUEST **prequest)
 	thread_pool.num_queued--;
 	*prequest = request;
 
+	if (thread_pool.queue_delay_target) queue_delay_update(request);
+
 	rad_assert(*prequest != NULL);
 	rad_assert(request->magic == REQUEST_MAGIC);
 
@@ -800,6 +949,12 @@ int thread_pool_init(CONF_SECTION *cs, int *spawn_flag)
 		thread_pool.max_spare_threads = thread_pool.min_spare_threads;
 	if (thread_pool.max_threads == 0)
 		thread_pool.max_threads = 256;
+	if (thread_pool.queue_delay_target < 0)
+		thread_pool.queue_delay_target = 0;
+	if (thread_pool.queue_delay_interval < 10)
+		thread_pool.queue_delay_interval = 10;
+	if (thread_pool.queue_delay_interval > 60000)
+		thread_pool.queue_delay_interval = 60000;
 #endif	/* WITH_GCD */
 
 	/*
@@ -1158,6 +1313,100 @@ pid_t rad_waitpid(pid_t pid, int *status)
  */
 #endif
 
+/*
+ *	A cheap check for the main thread.  It doesn't take the
+ *	lock, so the answer is only a hint.
+ */
+int thread_pool_overloaded(void)
+{
+#ifndef WITH_GCD
+	if (pool_initialized) return thread_pool.dropping;
+#endif
+
+	return FALSE;
+}
+
+/*
+ *	Called by the main thread before reading a packet from a
+ *	socket.  Returns TRUE if the packet should be discarded
+ *	without being processed.
+ */
+int thread_pool_shed(fr_load_class_t load_class)
+{
+	int shed = FALSE;
+#ifndef WITH_GCD
+	struct timeval now;
+
+	if (!pool_initialized || !thread_pool.dropping) return FALSE;
+
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+
+	/*
+	 *	The queue may have drained without anyone noticing.
+	 */
+	if (thread_pool.num_queued == 0) {
+		thread_pool.dropping = FALSE;
+		timerclear(&thread_pool.first_above_time);
+		goto done;
+	}
+
+	if (!thread_pool.dropping) goto done;
+
+	switch (load_class) {
+		/*
+		 *	Dropping these means throwing away all of the
+		 *	work already done for the session.
+		 */
+	case FR_LOAD_CLASS_AUTH_CONTINUE:
+		break;
+
+		/*
+		 *	Interim updates are cheap to lose, the NAS will
+		 *	send another one soon enough.
+		 */
+	case FR_LOAD_CLASS_ACCT_INTERIM:
+		shed = TRUE;
+		break;
+
+	default:
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &thread_pool.drop_next, <)) break;
+
+		shed = TRUE;
+		thread_pool.drop_count++;
+		queue_drop_schedule(&now);
+		break;
+	}
+
+	if (shed) thread_pool.shed[load_class]++;
+
+ done:
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+#else
+	load_class = load_class;	/* -Wunused */
+#endif	/* WITH_GCD */
+
+	return shed;
+}
+
+void thread_pool_shed_stats(fr_uint_t *array)
+{
+	int i;
+
+#ifndef WITH_GCD
+	if (pool_initialized) {
+		for (i = 0; i < FR_LOAD_CLASS_MAX; i++) {
+			array[i] = thread_pool.shed[i];
+		}
+	} else
+#endif	/* WITH_GCD */
+	{
+		for (i = 0; i < FR_LOAD_CLASS_MAX; i++) {
+			array[i] = 0;
+		}
+	}
+}
+
 void thread_pool_queue_stats(int *array)
 {
 	int i;
@@ -75,6 +75,209 @@ void (*reset_signal(int signo, void (*func)(int)))(int)
 #endif
 }
 
+/*
+ *	Per-request memory.  The REQUEST, and anything else which
+ *	lives exactly as long as the request does, is carved out of
+ *	a chain of blocks.  request_free() releases all of them at
+ *	once.  Released blocks go onto a free list for the thread
+ *	which released them, so that most requests don't call
+ *	malloc() for any of it.
+ */
+#define REQUEST_MEM_BLOCK	(4096)
+#define REQUEST_MEM_ALIGN	(16)
+#define REQUEST_MEM_LARGE	(REQUEST_MEM_BLOCK / 4)
+#define REQUEST_MEM_CACHE	(256) /* free blocks kept per thread */
+
+struct request_mem_t {
+	request_mem_t	*next;
+	uint8_t		*free_ptr;
+	uint8_t		*end;
+	size_t		size;		/* of the whole block */
+};
+
+#define REQUEST_MEM_HDR ((sizeof(request_mem_t) + REQUEST_MEM_ALIGN - 1) & ~(REQUEST_MEM_ALIGN - 1))
+
+typedef struct request_mem_cache_t {
+	request_mem_t	*head;
+	int		count;
+} request_mem_cache_t;
+
+/*
+ *	Like the other server statistics, these are updated without
+ *	locks.  They're for seeing what's going on, not for billing.
+ */
+static request_mem_stats_t mem_stats;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_key_t	mem_cache_key;
+static pthread_once_t	mem_cache_once = PTHREAD_ONCE_INIT;
+
+/*
+ *	When a thread exits, give its blocks back.
+ */
+static void request_mem_cache_free(void *data)
+{
+	request_mem_t *mem, *next;
+	request_mem_cache_t *cache = data;
+
+	for (mem = cache->head; mem != NULL; mem = next) {
+		next = mem->next;
+		free(mem);
+	}
+	free(cache);
+}
+
+static void request_mem_make_key(void)
+{
+	pthread_key_create(&mem_cache_key, request_mem_cache_free);
+}
+
+static request_mem_cache_t *request_mem_cache(void)
+{
+	request_mem_cache_t *cache;
+
+	pthread_once(&mem_cache_once, request_mem_make_key);
+
+	cache = pthread_getspecific(mem_cache_key);
+	if (!cache) {
+		cache = malloc(sizeof(*cache));
+		if (!cache) return NULL;
+		memset(cache, 0, sizeof(*cache));
+
+		pthread_setspecific(mem_cache_key, cache);
+	}
+
+	return cache;
+}
+#else
+static request_mem_cache_t mem_cache;
+
+#define request_mem_cache() (&mem_cache)
+#endif
+
+/*
+ *	Get a block with room for at least "size" bytes.
+ */
+static request_mem_t *request_mem_block(size_t size)
+{
+	request_mem_t *mem;
+	request_mem_cache_t *cache;
+
+	if (size <= (REQUEST_MEM_BLOCK - REQUEST_MEM_HDR)) {
+		size = REQUEST_MEM_BLOCK;
+
+		cache = request_mem_cache();
+		if (cache && cache->head) {
+			mem = cache->head;
+			cache->head = mem->next;
+			cache->count--;
+			mem_stats.reused++;
+			goto init;
+		}
+	} else {
+		size += REQUEST_MEM_HDR;
+	}
+
+	mem = rad_malloc(size);
+	mem_stats.mallocs++;
+
+ init:
+	mem->next = NULL;
+	mem->free_ptr = ((uint8_t *) mem) + REQUEST_MEM_HDR;
+	mem->end = ((uint8_t *) mem) + size;
+	mem->size = size;
+
+	return mem;
+}
+
+/*
+ *	Release all of the blocks in a chain.  Large ones are
+ *	free'd, as they're unlikely to be the right size for the
+ *	next request.
+ */
+static void request_mem_release(request_mem_t *mem)
+{
+	request_mem_t *next;
+	request_mem_cache_t *cache;
+
+	cache = request_mem_cache();
+
+	for (; mem != NULL; mem = next) {
+		next = mem->next;
+
+		if (!cache || (mem->size != REQUEST_MEM_BLOCK) ||
+		    (cache->count >= REQUEST_MEM_CACHE)) {
+			free(mem);
+			continue;
+		}
+
+		mem->next = cache->head;
+		cache->head = mem;
+		cache->count++;
+	}
+}
+
+/*
+ *	Allocate memory which is free'd when the request is.  It
+ *	is NOT zeroed, and it MUST NOT be passed to free().
+ *
+ *	This call ALWAYS succeeds!
+ */
+void *request_mem_alloc(REQUEST *request, size_t size)
+{
+	void *ptr;
+	request_mem_t *mem;
+
+	rad_assert(request->mem != NULL);
+
+	size = (size + REQUEST_MEM_ALIGN - 1) & ~(REQUEST_MEM_ALIGN - 1);
+	if (!size) size = REQUEST_MEM_ALIGN;
+
+	mem_stats.allocs++;
+	mem_stats.bytes += size;
+
+	/*
+	 *	Large allocations get a block to themselves, which
+	 *	goes after the current one, so that we keep carving up
+	 *	what's left of it.
+	 */
+	if (size > REQUEST_MEM_LARGE) {
+		mem = request_mem_block(size);
+		mem->next = request->mem->next;
+		request->mem->next = mem;
+		mem_stats.large++;
+
+		return mem->free_ptr;
+	}
+
+	mem = request->mem;
+	if ((mem->free_ptr + size) > mem->end) {
+		mem = request_mem_block(size);
+		mem->next = request->mem;
+		request->mem = mem;
+	}
+
+	ptr = mem->free_ptr;
+	mem->free_ptr += size;
+
+	return ptr;
+}
+
+char *request_mem_strdup(REQUEST *request, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(request_mem_alloc(request, len), str, len);
+}
+
+/*
+ *	Copy the counters, for radmin.
+ */
+void request_mem_stats(request_mem_stats_t *stats)
+{
+	memcpy(stats, &mem_stats, sizeof(*stats));
+}
+
 /*
  *	Per-request data, added by modules...
  */
@@ -120,7 +323,7 @@ int request_data_add(REQUEST *request,
 		}
 	}
 
-	if (!this) this = rad_malloc(sizeof(*this));
+	if (!this) this = request_mem_alloc(request, sizeof(*this));
 	memset(this, 0, sizeof(*this));
 
 	this->next = next;
@@ -152,10 +355,10 @@ void *request_data_get(REQUEST *request,
 			void *ptr = this->opaque;
 
 			/*
-			 *	Remove the entry from the list, and free it.
+			 *	Remove the entry from the list.  It goes
+			 *	away with the request.
 			 */
 			*last = this->next;
-			free(this);
 			return ptr; /* don't free it, the caller does that */
 		}
 	}
@@ -234,7 +437,6 @@ void request_free(REQUEST **request_ptr)
 			if (this->opaque && /* free it, if necessary */
 			    this->free_opaque)
 				this->free_opaque(this->opaque);
-			free(this);
 		}
 		request->data = NULL;
 	}
@@ -264,7 +466,37 @@ void request_free(REQUEST **request_ptr)
 #ifdef WITH_PROXY
 	request->home_server = NULL;
 #endif
-	free(request);
+#ifndef NDEBUG
+	{
+		request_mem_t *mem, **last;
+
+		/*
+		 *	Don't recycle the block holding the REQUEST.
+		 *	The next request_alloc() in this thread would
+		 *	get the same address, and a stale pointer to
+		 *	this request would silently refer to a live one,
+		 *	instead of to one with a bad magic number.
+		 *
+		 *	The REQUEST is at the start of the first block.
+		 *	That isn't always the last one in the chain, as
+		 *	large allocations are linked in after the head,
+		 *	so look for it by address.
+		 */
+		for (last = &request->mem; *last != NULL;
+		     last = &(*last)->next) {
+			if ((uint8_t *) request ==
+			    ((uint8_t *) *last) + REQUEST_MEM_HDR) break;
+		}
+		rad_assert(*last != NULL);
+		mem = *last;
+		*last = mem->next;
+
+		request_mem_release(request->mem);
+		free(mem);
+	}
+#else
+	request_mem_release(request->mem);
+#endif
 
 	*request_ptr = NULL;
 }
@@ -373,9 +605,18 @@ void NEVER_RETURNS rad_assert_fail (const char *file, unsigned int line,
 REQUEST *request_alloc(void)
 {
 	REQUEST *request;
+	request_mem_t *mem;
+
+	/*
+	 *	The REQUEST is the first thing in its own memory.
+	 */
+	mem = request_mem_block(sizeof(REQUEST));
+	request = (REQUEST *) mem->free_ptr;
+	mem->free_ptr += (sizeof(REQUEST) + REQUEST_MEM_ALIGN - 1) & ~(REQUEST_MEM_ALIGN - 1);
+	mem_stats.requests++;
 
-	request = rad_malloc(sizeof(REQUEST));
 	memset(request, 0, sizeof(REQUEST));
+	request->mem = mem;
 #ifndef NDEBUG
 	request->magic = REQUEST_MAGIC;
 #endif
@@ -142,10 +142,7 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 			    (rxmatch[i].rm_so == -1)) {
 				p = request_data_get(request, request,
 						     REQUEST_DATA_REGEX | i);
-				if (p) {
-					free(p);
-					continue;
-				}
+				if (p) continue;
 
 				/*
 				 *	No previous match
@@ -163,16 +160,13 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 
 			/*
 			 *	Copy substring, and add it to
-			 *	the request.
-			 *
-			 *	Note that we don't check
-			 *	for out of memory, which is
-			 *	the only error we can get...
+			 *	the request.  It's free'd
+			 *	with the request.
 			 */
-			p = strdup(buffer);
+			p = request_mem_strdup(request, buffer);
 			request_data_add(request, request,
 					 REQUEST_DATA_REGEX | i,
-					 p, free);
+					 p, NULL);
 		}
 		if (compare == 0) return 0;
 		return -1;
@@ -35,6 +35,48 @@ RCSID("$Id$")
 #include	<fcntl.h>
 #include        <limits.h>
 
+#ifdef HAVE_REGEX_H
+#include	<regex.h>
+#endif
+
+/*
+ *	The "attrs" file is compiled when it's read.  Each entry gets
+ *	a hash table of its rules, indexed by attribute and vendor, so
+ *	each attribute in the packet is only compared to the rules
+ *	for that attribute.  Regular expressions are compiled once,
+ *	here, instead of on every comparison.
+ *
+ *	Each key has the list of entries to try for it, in file order:
+ *	its own entries, and the DEFAULT ones.
+ */
+typedef struct attr_filter_rule_t {
+	VALUE_PAIR		*check;
+#ifdef HAVE_REGEX_H
+	regex_t			*reg;
+#endif
+	struct attr_filter_rule_t *next;
+} attr_filter_rule_t;
+
+typedef struct attr_filter_attr_t {
+	unsigned int		attr;
+	unsigned int		vendor;
+	attr_filter_rule_t	*rules;
+	attr_filter_rule_t	**tail;
+} attr_filter_attr_t;
+
+typedef struct attr_filter_entry_t {
+	PAIR_LIST		*pl;
+	int			fall_through;
+	int			relax_filter;	/* -1 for the module default */
+	int			any_vsa;	/* Vendor-Specific =* "" */
+	fr_hash_table_t		*attrs;
+} attr_filter_entry_t;
+
+typedef struct attr_filter_key_t {
+	const char		*name;
+	int			num_entries;
+	attr_filter_entry_t	**entries;
+} attr_filter_key_t;
 
 /*
  *	Define a structure with the module configuration, so it can
@@ -45,6 +87,10 @@ struct attr_filter_instance {
 	char *key;
 	int relaxed;
 	PAIR_LIST *attrs;
+	int num_entries;
+	attr_filter_entry_t *entries;
+	fr_hash_table_t *keys;
+	attr_filter_key_t defaults;
 };
 
 static const CONF_PARSER module_config[] = {
@@ -57,14 +103,26 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
-static void check_pair(VALUE_PAIR *check_item, VALUE_PAIR *reply_item,
+static void check_pair(attr_filter_rule_t *rule, VALUE_PAIR *reply_item,
                       int *pass, int *fail)
 {
 	int compare;
 
-	if (check_item->operator == T_OP_SET) return;
+#ifdef HAVE_REGEX_H
+	if (rule->reg) {
+		char buffer[MAX_STRING_LEN * 4 + 1];
+
+		vp_prints_value(buffer, sizeof(buffer), reply_item, 0);
+		compare = regexec(rule->reg, buffer, 0, NULL, 0);
+		if (rule->check->operator == T_OP_REG_EQ) {
+			compare = (compare == 0);
+		} else {
+			compare = (compare != 0);
+		}
+	} else
+#endif
+	compare = paircmp(rule->check, reply_item);
 
-	compare = paircmp(check_item, reply_item);
 	if (compare == 1) {
 		++*(pass);
 	} else {
@@ -75,6 +133,248 @@ static void check_pair(VALUE_PAIR *check_item, VALUE_PAIR *reply_item,
 }
 
 
+static uint32_t filter_attr_hash(const void *data)
+{
+	const attr_filter_attr_t *a = data;
+	uint32_t hash;
+
+	hash = fr_hash(&a->attr, sizeof(a->attr));
+	return fr_hash_update(&a->vendor, sizeof(a->vendor), hash);
+}
+
+static int filter_attr_cmp(const void *one, const void *two)
+{
+	const attr_filter_attr_t *a = one;
+	const attr_filter_attr_t *b = two;
+
+	if (a->attr != b->attr) return a->attr - b->attr;
+	return a->vendor - b->vendor;
+}
+
+static void filter_attr_free(void *data)
+{
+	attr_filter_attr_t *a = data;
+	attr_filter_rule_t *rule, *next;
+
+	for (rule = a->rules; rule != NULL; rule = next) {
+		next = rule->next;
+#ifdef HAVE_REGEX_H
+		if (rule->reg) {
+			regfree(rule->reg);
+			free(rule->reg);
+		}
+#endif
+		free(rule);
+	}
+	free(a);
+}
+
+static uint32_t filter_key_hash(const void *data)
+{
+	const attr_filter_key_t *k = data;
+
+	return fr_hash_string(k->name);
+}
+
+static int filter_key_cmp(const void *one, const void *two)
+{
+	const attr_filter_key_t *a = one;
+	const attr_filter_key_t *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static void filter_key_free(void *data)
+{
+	attr_filter_key_t *k = data;
+
+	free(k->entries);
+	free(k);
+}
+
+/*
+ *	Turn one entry of the "attrs" file into a rule table.
+ */
+static int filter_compile_entry(const char *filename, PAIR_LIST *pl,
+				attr_filter_entry_t *entry)
+{
+	VALUE_PAIR *check_item;
+	attr_filter_attr_t my_attr, *a;
+	attr_filter_rule_t *rule;
+
+	entry->pl = pl;
+	entry->relax_filter = -1;
+	entry->attrs = fr_hash_table_create(filter_attr_hash,
+					    filter_attr_cmp,
+					    filter_attr_free);
+	if (!entry->attrs) return -1;
+
+	for (check_item = pl->check;
+	     check_item != NULL;
+	     check_item = check_item->next) {
+		if (check_item->attribute == PW_FALL_THROUGH) {
+			if (check_item->vp_integer == 1) entry->fall_through = 1;
+			continue;
+		}
+
+		if (check_item->attribute == PW_RELAX_FILTER) {
+			entry->relax_filter = check_item->vp_integer;
+			continue;
+		}
+
+		/*
+		 *	SET items are added to the output, not compared.
+		 */
+		if (check_item->operator == T_OP_SET) continue;
+
+		if ((check_item->attribute == PW_VENDOR_SPECIFIC) &&
+		    (check_item->operator == T_OP_CMP_TRUE)) {
+			entry->any_vsa = 1;
+		}
+
+		my_attr.attr = check_item->attribute;
+		my_attr.vendor = check_item->vendor;
+		a = fr_hash_table_finddata(entry->attrs, &my_attr);
+		if (!a) {
+			a = rad_malloc(sizeof(*a));
+			memset(a, 0, sizeof(*a));
+			a->attr = check_item->attribute;
+			a->vendor = check_item->vendor;
+			a->tail = &a->rules;
+			if (!fr_hash_table_insert(entry->attrs, a)) {
+				free(a);
+				return -1;
+			}
+		}
+
+		rule = rad_malloc(sizeof(*rule));
+		memset(rule, 0, sizeof(*rule));
+		rule->check = check_item;
+		*a->tail = rule;
+		a->tail = &rule->next;
+
+#ifdef HAVE_REGEX_H
+		if ((check_item->operator == T_OP_REG_EQ) ||
+		    (check_item->operator == T_OP_REG_NE)) {
+			int rcode;
+			char buffer[256];
+
+			rule->reg = rad_malloc(sizeof(*rule->reg));
+			rcode = regcomp(rule->reg, check_item->vp_strvalue,
+					REG_EXTENDED | REG_NOSUB);
+			if (rcode != 0) {
+				regerror(rcode, rule->reg, buffer, sizeof(buffer));
+				free(rule->reg);
+				rule->reg = NULL;
+				radlog(L_ERR, "%s[%d]: Invalid regular expression for %s: %s",
+				       filename, pl->lineno, check_item->name,
+				       buffer);
+				return -1;
+			}
+		}
+#endif
+	}
+
+	return 0;
+}
+
+/*
+ *	Make room for a key's own entries, and all of the DEFAULTs.
+ */
+static int filter_alloc_key(void *ctx, void *data)
+{
+	int *num_defaults = ctx;
+	attr_filter_key_t *k = data;
+
+	k->entries = rad_malloc((k->num_entries + *num_defaults) *
+				sizeof(k->entries[0]));
+	k->num_entries = 0;
+	return 0;
+}
+
+static int filter_add_default(void *ctx, void *data)
+{
+	attr_filter_entry_t *entry = ctx;
+	attr_filter_key_t *k = data;
+
+	k->entries[k->num_entries++] = entry;
+	return 0;
+}
+
+/*
+ *	Compile all of the entries, and build the per-key lists.
+ */
+static int filter_compile(struct attr_filter_instance *inst)
+{
+	int i, num_defaults = 0;
+	PAIR_LIST *pl;
+	attr_filter_key_t my_key, *k;
+
+	for (pl = inst->attrs; pl != NULL; pl = pl->next) {
+		inst->num_entries++;
+	}
+
+	inst->entries = rad_malloc((inst->num_entries + 1) * sizeof(*inst->entries));
+	memset(inst->entries, 0, (inst->num_entries + 1) * sizeof(*inst->entries));
+
+	inst->keys = fr_hash_table_create(filter_key_hash, filter_key_cmp,
+					  filter_key_free);
+	if (!inst->keys) return -1;
+
+	/*
+	 *	Compile the entries, and count how many each key has.
+	 */
+	for (pl = inst->attrs, i = 0; pl != NULL; pl = pl->next, i++) {
+		if (filter_compile_entry(inst->attrsfile, pl,
+					 &inst->entries[i]) < 0) return -1;
+
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			num_defaults++;
+			continue;
+		}
+
+		my_key.name = pl->name;
+		k = fr_hash_table_finddata(inst->keys, &my_key);
+		if (!k) {
+			k = rad_malloc(sizeof(*k));
+			memset(k, 0, sizeof(*k));
+			k->name = pl->name;
+			if (!fr_hash_table_insert(inst->keys, k)) {
+				free(k);
+				return -1;
+			}
+		}
+		k->num_entries++;
+	}
+
+	/*
+	 *	Fill in the lists, in file order.
+	 */
+	inst->defaults.name = "DEFAULT";
+	inst->defaults.entries = rad_malloc((num_defaults + 1) * sizeof(attr_filter_entry_t *));
+
+	fr_hash_table_walk(inst->keys, filter_alloc_key, &num_defaults);
+
+	for (i = 0; i < inst->num_entries; i++) {
+		pl = inst->entries[i].pl;
+
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			inst->defaults.entries[inst->defaults.num_entries++] = &inst->entries[i];
+			fr_hash_table_walk(inst->keys, filter_add_default,
+					   &inst->entries[i]);
+			continue;
+		}
+
+		my_key.name = pl->name;
+		k = fr_hash_table_finddata(inst->keys, &my_key);
+		rad_assert(k != NULL);
+		k->entries[k->num_entries++] = &inst->entries[i];
+	}
+
+	return 0;
+}
+
+
 static int getattrsfile(const char *filename, PAIR_LIST **pair_list)
 {
 	int rcode;
@@ -129,6 +429,18 @@ static int getattrsfile(const char *filename, PAIR_LIST **pair_list)
 static int attr_filter_detach(void *instance)
 {
 	struct attr_filter_instance *inst = instance;
+	int i;
+
+	if (inst->keys) fr_hash_table_free(inst->keys);
+	free(inst->defaults.entries);
+	if (inst->entries) {
+		for (i = 0; i < inst->num_entries; i++) {
+			if (inst->entries[i].attrs) {
+				fr_hash_table_free(inst->entries[i].attrs);
+			}
+		}
+		free(inst->entries);
+	}
 	pairlist_free(&inst->attrs);
 	free(inst);
 	return 0;
@@ -160,6 +472,12 @@ static int attr_filter_instantiate(CONF_SECTION *conf, void **instance)
 		attr_filter_detach(inst);
 		return -1;
 	}
+
+	if (filter_compile(inst) < 0) {
+		radlog(L_ERR|L_CONS, "Errors compiling %s", inst->attrsfile);
+		attr_filter_detach(inst);
+		return -1;
+	}
 	*instance = inst;
 	return 0;
 }
@@ -177,7 +495,8 @@ static int attr_filter_common(void *instance, REQUEST *request,
 	VALUE_PAIR	**output_tail;
 	VALUE_PAIR	*check_item;
 	PAIR_LIST	*pl;
-	int		found = 0;
+	attr_filter_key_t my_key, *key;
+	int		i, found = 0;
 	int		pass, fail = 0;
 	char		*keyname = NULL;
 	VALUE_PAIR	**input;
@@ -210,20 +529,19 @@ static int attr_filter_common(void *instance, REQUEST *request,
 	output_tail = &output;
 
 	/*
-	 *      Find the attr_filter profile entry for the entry.
+	 *      Find the attr_filter profile entries for the key.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
+	my_key.name = keyname;
+	key = fr_hash_table_finddata(inst->keys, &my_key);
+	if (!key) key = &inst->defaults;
+
+	for (i = 0; i < key->num_entries; i++) {
+		attr_filter_entry_t *entry = key->entries[i];
 		int relax_filter = inst->relaxed;
 
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-		    continue;
+		pl = entry->pl;
+		if (entry->relax_filter >= 0) {
+			relax_filter = entry->relax_filter;
 		}
 
 		DEBUG2("attr_filter: Matched entry %s at line %d", pl->name,
@@ -233,21 +551,13 @@ static int attr_filter_common(void *instance, REQUEST *request,
 		for (check_item = pl->check;
 			check_item != NULL;
 			check_item = check_item->next) {
-			if ((check_item->attribute == PW_FALL_THROUGH) &&
-				(check_item->vp_integer == 1)) {
-				fall_through = 1;
-				continue;
-			}
-			else if (check_item->attribute == PW_RELAX_FILTER) {
-				relax_filter = check_item->vp_integer;
-				continue;
-			}
-
 			/*
 			 *    If it is a SET operator, add the attribute to
 			 *    the output list without checking it.
 			 */
-			if (check_item->operator == T_OP_SET ) {
+			if ((check_item->operator == T_OP_SET) &&
+			    (check_item->attribute != PW_FALL_THROUGH) &&
+			    (check_item->attribute != PW_RELAX_FILTER)) {
 				vp = paircopyvp(check_item);
 				if (!vp) {
 					pairfree(&output);
@@ -260,39 +570,31 @@ static int attr_filter_common(void *instance, REQUEST *request,
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
-		 *	only if it matches all rules that describe an
-		 *	Idle-Timeout.
+		 *	each item to the rules for that attribute,
+		 *	then moving it to the output list only if it
+		 *	matches all of them.  IE, Idle-Timeout is
+		 *	moved only if it matches all rules that
+		 *	describe an Idle-Timeout.
 		 */
 		for (vp = *input; vp != NULL; vp = vp->next ) {
+			attr_filter_attr_t my_attr, *a;
+			attr_filter_rule_t *rule;
+
 			/* reset the pass,fail vars for each reply item */
 			pass = fail = 0;
 
 			/*
-			 *	reset the check_item pointer to
-			 *	beginning of the list
+			 *	Vendor-Specific is special, and
+			 *	matches any VSA if the comparison
+			 *	is always true.
 			 */
-			for (check_item = pl->check;
-			     check_item != NULL;
-			     check_item = check_item->next) {
-				/*
-				 *	Vendor-Specific is special, and
-				 *	matches any VSA if the comparison
-				 *	is always true.
-				 */
-				if ((check_item->attribute == PW_VENDOR_SPECIFIC) &&
-					(vp->vendor != 0) &&
-					(check_item->operator == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (entry->any_vsa && (vp->vendor != 0)) pass++;
 
-				if (vp->attribute == check_item->attribute) {
-					check_pair(check_item, vp,
-						   &pass, &fail);
-				}
+			my_attr.attr = vp->attribute;
+			my_attr.vendor = vp->vendor;
+			a = fr_hash_table_finddata(entry->attrs, &my_attr);
+			if (a) for (rule = a->rules; rule != NULL; rule = rule->next) {
+				check_pair(rule, vp, &pass, &fail);
 			}
 
 			/*  
@@ -314,7 +616,7 @@ static int attr_filter_common(void *instance, REQUEST *request,
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through)
+		if (!entry->fall_through)
 			break;
 	}
 
@@ -379,7 +681,7 @@ static int attr_filter_authorize(void *instance, REQUEST *request)
 module_t rlm_attr_filter = {
 	RLM_MODULE_INIT,
 	"attr_filter",
-	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,   	/* type */
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE | RLM_TYPE_HUP_BACKGROUND,   	/* type */
 	attr_filter_instantiate,	/* instantiation */
 	attr_filter_detach,		/* detach */
 	{
@@ -351,7 +351,6 @@ do_again:
 					if (pmatch[j].rm_so == -1){
 						p = request_data_get(request,request,REQUEST_DATA_REGEX | j);
 						if (p){
-							free(p);
 							continue;
 						}
 						break;
@@ -360,8 +359,8 @@ do_again:
 					       attr_vp->vp_strvalue + pmatch[j].rm_so,
 					       pmatch[j].rm_eo - pmatch[j].rm_so);
 					buffer[pmatch[j].rm_eo - pmatch[j].rm_so] = '\0';
-					p = strdup(buffer);
-					request_data_add(request,request,REQUEST_DATA_REGEX | j,p,free);
+					p = request_mem_strdup(request,buffer);
+					request_data_add(request,request,REQUEST_DATA_REGEX | j,p,NULL);
 				}
 			}
 
@@ -0,0 +1,673 @@
+/*
+ * rlm_cache.c	Cache attributes fetched by other modules.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+#include <ctype.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#define pthread_cond_broadcast(a)
+#endif
+
+/*
+ *	The module is listed twice in a section: once before the
+ *	module which does the real lookup, and once after it.
+ *
+ *	The first call expands the key, and looks it up.  On a hit,
+ *	the cached attributes are added to the request, and the
+ *	module returns "ok".  On a miss, it returns "notfound", and
+ *	remembers the key in the request.  The second call sees that,
+ *	and copies the configured attributes from the request into
+ *	the cache.
+ *
+ *	While one request is doing the lookup, other requests for the
+ *	same key wait for it to finish, instead of all hitting the
+ *	back-end at once.  They give up after "wait-timeout" seconds,
+ *	and do the lookup themselves.
+ *
+ *	The entries are split across a number of buckets by the high
+ *	bits of the hash.  Each bucket has its own hash table, LRU
+ *	list, lock, and condition variable.
+ */
+#define MAX_BUCKETS	(256)
+#define MAX_CACHE_ATTRS	(32)
+
+#define CACHE_PENDING	(0)
+#define CACHE_POSITIVE	(1)
+#define CACHE_NEGATIVE	(2)
+
+typedef struct cache_entry_t {
+	struct cache_entry_t	*prev;	/* more recently used */
+	struct cache_entry_t	*next;	/* less recently used */
+	uint32_t		hash;
+	int			state;
+	void			*owner;	/* request doing the lookup */
+	time_t			expires;
+	size_t			size;
+	VALUE_PAIR		*control;
+	VALUE_PAIR		*reply;
+	char			*key;
+} cache_entry_t;
+
+typedef struct cache_bucket_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+#endif
+	fr_hash_table_t		*ht;
+	cache_entry_t		*head;
+	cache_entry_t		*tail;
+	size_t			memory;
+} cache_bucket_t;
+
+typedef struct cache_attr_t {
+	unsigned int		attr;
+	unsigned int		vendor;
+} cache_attr_t;
+
+typedef struct rlm_cache_t {
+	char		*key;
+	int		ttl;
+	int		negative_ttl;
+	int		wait_timeout;
+	int		max_memory;
+	int		num_buckets;
+	char		*control_attrs;
+	char		*reply_attrs;
+
+	int		num_control;
+	cache_attr_t	control[MAX_CACHE_ATTRS];
+	int		num_reply;
+	cache_attr_t	reply[MAX_CACHE_ATTRS];
+
+	int		shift;
+	size_t		bucket_memory;
+	cache_bucket_t	*buckets;
+} rlm_cache_t;
+
+/*
+ *	What the first call leaves in the request for the second one.
+ */
+typedef struct cache_token_t {
+	rlm_cache_t	*inst;
+	int		owner;	/* did we create the pending entry? */
+	char		key[MAX_STRING_LEN];
+} cache_token_t;
+
+static const CONF_PARSER module_config[] = {
+  { "key", PW_TYPE_STRING_PTR, offsetof(rlm_cache_t,key), NULL, "%{User-Name}" },
+  { "ttl", PW_TYPE_INTEGER, offsetof(rlm_cache_t,ttl), NULL, "300" },
+  { "negative-ttl", PW_TYPE_INTEGER, offsetof(rlm_cache_t,negative_ttl), NULL, "0" },
+  { "wait-timeout", PW_TYPE_INTEGER, offsetof(rlm_cache_t,wait_timeout), NULL, "2" },
+  { "max-memory", PW_TYPE_INTEGER, offsetof(rlm_cache_t,max_memory), NULL, "0" },
+  { "buckets", PW_TYPE_INTEGER, offsetof(rlm_cache_t,num_buckets), NULL, "64" },
+  { "control", PW_TYPE_STRING_PTR, offsetof(rlm_cache_t,control_attrs), NULL, NULL },
+  { "reply", PW_TYPE_STRING_PTR, offsetof(rlm_cache_t,reply_attrs), NULL, NULL },
+  { NULL, -1, 0, NULL, NULL }
+};
+
+
+static uint32_t entry_hash(const void *data)
+{
+	const cache_entry_t *entry = data;
+
+	return entry->hash;
+}
+
+static int entry_cmp(const void *one, const void *two)
+{
+	const cache_entry_t *a = one;
+	const cache_entry_t *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static void entry_free(void *data)
+{
+	cache_entry_t *entry = data;
+
+	pairfree(&entry->control);
+	pairfree(&entry->reply);
+	free(entry);
+}
+
+/*
+ *	The hash tables pick buckets with the low bits of the hash,
+ *	so we pick our buckets with the high bits.
+ */
+static cache_bucket_t *bucket_find(rlm_cache_t *inst,
+				   cache_entry_t *probe, char *key)
+{
+	probe->key = key;
+	probe->hash = fr_hash_string(key);
+
+	if (inst->num_buckets == 1) return &inst->buckets[0];
+
+	return &inst->buckets[probe->hash >> inst->shift];
+}
+
+static void lru_unlink(cache_bucket_t *bucket, cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		bucket->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		bucket->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void lru_push(cache_bucket_t *bucket, cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = bucket->head;
+	if (bucket->head) {
+		bucket->head->prev = entry;
+	} else {
+		bucket->tail = entry;
+	}
+	bucket->head = entry;
+}
+
+/*
+ *	Called with the bucket locked.
+ */
+static void entry_delete(cache_bucket_t *bucket, cache_entry_t *entry)
+{
+	lru_unlink(bucket, entry);
+	bucket->memory -= entry->size;
+	fr_hash_table_delete(bucket->ht, entry);
+}
+
+/*
+ *	Throw away the least recently used entries until the bucket
+ *	fits.  Entries which are still being looked up are small, and
+ *	have requests waiting on them, so they're left alone.
+ */
+static void bucket_trim(rlm_cache_t *inst, cache_bucket_t *bucket)
+{
+	cache_entry_t *entry, *prev;
+
+	if (!inst->bucket_memory) return;
+
+	for (entry = bucket->tail;
+	     entry && (bucket->memory > inst->bucket_memory);
+	     entry = prev) {
+		prev = entry->prev;
+
+		if (entry->state == CACHE_PENDING) continue;
+
+		entry_delete(bucket, entry);
+	}
+}
+
+/*
+ *	Create a new entry, and add it to the bucket.  Called with
+ *	the bucket locked.  Any old entry for the key is replaced.
+ */
+static cache_entry_t *entry_add(cache_bucket_t *bucket,
+				cache_entry_t *probe, int state,
+				VALUE_PAIR *control, VALUE_PAIR *reply,
+				time_t expires)
+{
+	size_t keylen;
+	cache_entry_t *entry;
+	VALUE_PAIR *vp;
+
+	keylen = strlen(probe->key);
+	entry = rad_malloc(sizeof(*entry) + keylen + 1);
+	memset(entry, 0, sizeof(*entry));
+
+	entry->key = (char *) (entry + 1);
+	memcpy(entry->key, probe->key, keylen + 1);
+	entry->hash = probe->hash;
+	entry->state = state;
+	entry->expires = expires;
+	entry->control = control;
+	entry->reply = reply;
+
+	entry->size = sizeof(*entry) + keylen + 1;
+	for (vp = control; vp != NULL; vp = vp->next) {
+		entry->size += sizeof(*vp);
+	}
+	for (vp = reply; vp != NULL; vp = vp->next) {
+		entry->size += sizeof(*vp);
+	}
+
+	probe = fr_hash_table_finddata(bucket->ht, probe);
+	if (probe) entry_delete(bucket, probe);
+
+	if (!fr_hash_table_insert(bucket->ht, entry)) {
+		entry_free(entry);
+		return NULL;
+	}
+
+	lru_push(bucket, entry);
+	bucket->memory += entry->size;
+
+	return entry;
+}
+
+/*
+ *	Copy the configured attributes from a list.
+ */
+static VALUE_PAIR *cache_select(const cache_attr_t *attrs, int num,
+				VALUE_PAIR *vps)
+{
+	int i;
+	VALUE_PAIR *head = NULL;
+
+	for (i = 0; i < num; i++) {
+		pairadd(&head, paircopy2(vps, attrs[i].attr, attrs[i].vendor));
+	}
+
+	return head;
+}
+
+/*
+ *	The request was freed without the second call happening, so
+ *	nobody is going to fill in the entry we promised.  Remove it,
+ *	and wake up anyone waiting on it.
+ */
+static void cache_token_free(void *data)
+{
+	cache_token_t *token = data;
+	rlm_cache_t *inst = token->inst;
+	cache_bucket_t *bucket;
+	cache_entry_t my_entry, *entry;
+
+	if (token->owner) {
+		bucket = bucket_find(inst, &my_entry, token->key);
+
+		pthread_mutex_lock(&bucket->mutex);
+		entry = fr_hash_table_finddata(bucket->ht, &my_entry);
+		if (entry && (entry->state == CACHE_PENDING) &&
+		    (entry->owner == token)) {
+			entry_delete(bucket, entry);
+			pthread_cond_broadcast(&bucket->cond);
+		}
+		pthread_mutex_unlock(&bucket->mutex);
+	}
+
+	free(token);
+}
+
+/*
+ *	The second call: store whatever the other modules found.
+ */
+static int cache_fill(rlm_cache_t *inst, REQUEST *request,
+		      cache_token_t *token)
+{
+	int state, rcode;
+	time_t expires;
+	cache_bucket_t *bucket;
+	cache_entry_t my_entry;
+	VALUE_PAIR *control, *reply;
+
+	control = cache_select(inst->control, inst->num_control,
+			       request->config_items);
+	reply = cache_select(inst->reply, inst->num_reply,
+			     request->reply->vps);
+
+	if (control || reply) {
+		state = CACHE_POSITIVE;
+		expires = request->timestamp + inst->ttl;
+		rcode = RLM_MODULE_OK;
+
+	} else if (inst->negative_ttl > 0) {
+		state = CACHE_NEGATIVE;
+		expires = request->timestamp + inst->negative_ttl;
+		rcode = RLM_MODULE_NOOP;
+
+	} else {
+		RDEBUG2("Nothing to cache for key \"%s\"", token->key);
+		cache_token_free(token);
+		return RLM_MODULE_NOOP;
+	}
+
+	bucket = bucket_find(inst, &my_entry, token->key);
+
+	pthread_mutex_lock(&bucket->mutex);
+	if (entry_add(bucket, &my_entry, state,
+		      control, reply, expires) != NULL) {
+		bucket_trim(inst, bucket);
+	}
+	pthread_cond_broadcast(&bucket->cond);
+	pthread_mutex_unlock(&bucket->mutex);
+
+	RDEBUG2("Cached %s entry for key \"%s\"",
+		(state == CACHE_POSITIVE) ? "positive" : "negative",
+		token->key);
+
+	token->owner = 0;
+	cache_token_free(token);
+
+	return rcode;
+}
+
+/*
+ *	Look up the key, waiting if another request is already
+ *	fetching it.
+ */
+static int cache_lookup(void *instance, REQUEST *request)
+{
+	rlm_cache_t *inst = instance;
+	cache_token_t *token;
+	cache_bucket_t *bucket;
+	cache_entry_t my_entry, *entry;
+	VALUE_PAIR *control, *reply;
+	time_t now;
+	char key[MAX_STRING_LEN];
+#ifdef HAVE_PTHREAD_H
+	struct timespec deadline;
+#endif
+
+	token = request_data_get(request, inst, 0);
+	if (token) return cache_fill(inst, request, token);
+
+	if (!radius_xlat(key, sizeof(key), inst->key, request, NULL) ||
+	    !*key) {
+		RDEBUG2("Key \"%s\" expanded to nothing", inst->key);
+		return RLM_MODULE_NOOP;
+	}
+
+	token = rad_malloc(sizeof(*token));
+	memset(token, 0, sizeof(*token));
+	token->inst = inst;
+	strlcpy(token->key, key, sizeof(token->key));
+
+	bucket = bucket_find(inst, &my_entry, token->key);
+
+#ifdef HAVE_PTHREAD_H
+	deadline.tv_sec = time(NULL) + inst->wait_timeout;
+	deadline.tv_nsec = 0;
+#endif
+
+	pthread_mutex_lock(&bucket->mutex);
+	while (1) {
+		now = time(NULL);
+
+		entry = fr_hash_table_finddata(bucket->ht, &my_entry);
+		if (entry && (entry->expires <= now)) {
+			entry_delete(bucket, entry);
+			entry = NULL;
+		}
+
+		/*
+		 *	Nobody has it, so it's ours to fetch.
+		 */
+		if (!entry) {
+			entry = entry_add(bucket, &my_entry,
+					  CACHE_PENDING, NULL, NULL,
+					  now + inst->wait_timeout);
+			if (entry) {
+				entry->owner = token;
+				token->owner = 1;
+			}
+			break;
+		}
+
+		if (entry->state == CACHE_POSITIVE) {
+			lru_unlink(bucket, entry);
+			lru_push(bucket, entry);
+
+			control = paircopy(entry->control);
+			reply = paircopy(entry->reply);
+			pthread_mutex_unlock(&bucket->mutex);
+
+			RDEBUG2("Found entry for key \"%s\"", token->key);
+			free(token);
+
+			pairmove(&request->config_items, &control);
+			pairfree(&control);
+			pairmove(&request->reply->vps, &reply);
+			pairfree(&reply);
+
+			return RLM_MODULE_OK;
+		}
+
+		if (entry->state == CACHE_NEGATIVE) {
+			pthread_mutex_unlock(&bucket->mutex);
+
+			RDEBUG2("Found negative entry for key \"%s\"",
+				token->key);
+			free(token);
+
+			return RLM_MODULE_NOOP;
+		}
+
+		/*
+		 *	Someone else is fetching it.  Wait for them.
+		 */
+#ifdef HAVE_PTHREAD_H
+		if (pthread_cond_timedwait(&bucket->cond, &bucket->mutex,
+					   &deadline) == ETIMEDOUT) {
+			RDEBUG2("Timed out waiting for key \"%s\"",
+				token->key);
+			break;
+		}
+#else
+		break;
+#endif
+	}
+	pthread_mutex_unlock(&bucket->mutex);
+
+	/*
+	 *	Tell the second call what to fill in.
+	 */
+	if (request_data_add(request, inst, 0, token,
+			     cache_token_free) < 0) {
+		cache_token_free(token);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("No entry for key \"%s\"", token->key);
+	return RLM_MODULE_NOTFOUND;
+}
+
+/*
+ *	Turn a list of attribute names into attribute numbers.
+ */
+static int cache_parse_attrs(const char *name, const char *value,
+			     cache_attr_t *attrs, int *num)
+{
+	char *p, *q, *copy;
+	DICT_ATTR *da;
+
+	*num = 0;
+	if (!value) return 0;
+
+	copy = strdup(value);
+	for (p = copy; *p != '\0'; p = q) {
+		while (isspace((int) *p) || (*p == ',')) p++;
+		if (!*p) break;
+
+		q = p;
+		while (*q && !isspace((int) *q) && (*q != ',')) q++;
+		if (*q) *(q++) = '\0';
+
+		da = dict_attrbyname(p);
+		if (!da) {
+			radlog(L_ERR, "rlm_cache: Unknown attribute \"%s\" in %s",
+			       p, name);
+			free(copy);
+			return -1;
+		}
+
+		if (*num >= MAX_CACHE_ATTRS) {
+			radlog(L_ERR, "rlm_cache: Too many attributes in %s",
+			       name);
+			free(copy);
+			return -1;
+		}
+
+		attrs[*num].attr = da->attr;
+		attrs[*num].vendor = da->vendor;
+		(*num)++;
+	}
+
+	free(copy);
+	return 0;
+}
+
+static int cache_detach(void *instance)
+{
+	int i;
+	rlm_cache_t *inst = instance;
+
+	if (inst->buckets) {
+		for (i = 0; i < inst->num_buckets; i++) {
+			fr_hash_table_free(inst->buckets[i].ht);
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_destroy(&inst->buckets[i].mutex);
+			pthread_cond_destroy(&inst->buckets[i].cond);
+#endif
+		}
+		free(inst->buckets);
+	}
+
+	free(inst);
+	return 0;
+}
+
+static int cache_instantiate(CONF_SECTION *conf, void **instance)
+{
+	int i;
+	rlm_cache_t *inst;
+
+	inst = rad_malloc(sizeof(*inst));
+	memset(inst, 0, sizeof(*inst));
+
+	if (cf_section_parse(conf, inst, module_config) < 0) {
+		free(inst);
+		return -1;
+	}
+
+	if (!inst->key || !*inst->key) {
+		radlog(L_ERR, "rlm_cache: You must specify a key");
+		cache_detach(inst);
+		return -1;
+	}
+
+	if ((cache_parse_attrs("control", inst->control_attrs,
+			       inst->control, &inst->num_control) < 0) ||
+	    (cache_parse_attrs("reply", inst->reply_attrs,
+			       inst->reply, &inst->num_reply) < 0)) {
+		cache_detach(inst);
+		return -1;
+	}
+
+	if (!inst->num_control && !inst->num_reply) {
+		radlog(L_ERR, "rlm_cache: You must list the attributes to cache in \"control\" or \"reply\"");
+		cache_detach(inst);
+		return -1;
+	}
+
+	if (inst->ttl <= 0) inst->ttl = 1;
+	if (inst->wait_timeout <= 0) inst->wait_timeout = 1;
+
+	if ((inst->num_buckets <= 0) || (inst->num_buckets > MAX_BUCKETS) ||
+	    ((inst->num_buckets & (inst->num_buckets - 1)) != 0)) {
+		radlog(L_ERR, "rlm_cache: buckets must be a power of 2 between 1 and %d",
+		       MAX_BUCKETS);
+		cache_detach(inst);
+		return -1;
+	}
+
+	for (i = 0; (1 << i) < inst->num_buckets; i++) {
+		/* nothing */
+	}
+	inst->shift = 32 - i;
+
+	if (inst->max_memory > 0) {
+		inst->bucket_memory = inst->max_memory / inst->num_buckets;
+		if (!inst->bucket_memory) inst->bucket_memory = 1;
+	}
+
+	inst->buckets = rad_malloc(inst->num_buckets * sizeof(*inst->buckets));
+	memset(inst->buckets, 0, inst->num_buckets * sizeof(*inst->buckets));
+
+	for (i = 0; i < inst->num_buckets; i++) {
+		inst->buckets[i].ht = fr_hash_table_create(entry_hash,
+							   entry_cmp,
+							   entry_free);
+		if (!inst->buckets[i].ht) {
+			radlog(L_ERR, "rlm_cache: Failed creating hash table");
+			inst->num_buckets = i;
+			cache_detach(inst);
+			return -1;
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->buckets[i].mutex, NULL);
+		pthread_cond_init(&inst->buckets[i].cond, NULL);
+#endif
+	}
+
+	*instance = inst;
+	return 0;
+}
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ */
+module_t rlm_cache = {
+	RLM_MODULE_INIT,
+	"cache",
+	RLM_TYPE_THREAD_SAFE,		/* type */
+	cache_instantiate,		/* instantiation */
+	cache_detach,			/* detach */
+	{
+		NULL,			/* authentication */
+		cache_lookup,		/* authorization */
+		cache_lookup,		/* preaccounting */
+		cache_lookup,		/* accounting */
+		NULL,			/* checksimul */
+		cache_lookup,		/* pre-proxy */
+		cache_lookup,		/* post-proxy */
+		cache_lookup		/* post-auth */
+#ifdef WITH_COA
+		, cache_lookup,
+		cache_lookup
+#endif
+	},
+};
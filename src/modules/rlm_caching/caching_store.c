@@ -0,0 +1,755 @@
+/*
+ * caching_store.c	In-memory cache for rlm_caching.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"caching_store.h"
+
+#include	<sys/time.h>
+
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#endif
+
+/*
+ *	The cache is split across a number of shards, each with its
+ *	own hash table, LRU list, and lock.  The size limits are
+ *	split evenly across the shards, and each shard throws away
+ *	its least recently used entries when it goes over them.
+ *
+ *	Entries hold the reply attributes in the binary form made by
+ *	caching_encode(), so a hit is a copy and a decode, instead of
+ *	parsing text.
+ */
+#define MAX_SHARDS (256)
+
+typedef struct caching_entry_t {
+	struct caching_entry_t	*prev;	/* more recently used */
+	struct caching_entry_t	*next;	/* less recently used */
+	uint32_t		hash;
+	time_t			expires;
+	size_t			size;
+	char			auth_type[MAX_AUTH_TYPE];
+	size_t			len;
+	uint8_t			*data;
+	char			*key;
+} caching_entry_t;
+
+typedef struct caching_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*ht;
+	caching_entry_t		*head;
+	caching_entry_t		*tail;
+	int			num_entries;
+	size_t			memory;
+	caching_stats_t		stats;
+} caching_shard_t;
+
+struct caching_store_t {
+	int			num_shards;
+	int			shift;
+	int			max_entries;	/* per shard */
+	size_t			max_memory;	/* per shard */
+	caching_shard_t		*shards;
+};
+
+
+static uint32_t entry_hash(const void *data)
+{
+	const caching_entry_t *entry = data;
+
+	return entry->hash;
+}
+
+static int entry_cmp(const void *one, const void *two)
+{
+	const caching_entry_t *a = one;
+	const caching_entry_t *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/*
+ *	The hash tables pick buckets with the low bits of the hash,
+ *	so we pick the shard with the high bits.
+ */
+static caching_shard_t *shard_find(caching_store_t *store,
+				   caching_entry_t *probe, const char *key)
+{
+	probe->key = (char *) key;
+	probe->hash = fr_hash_string(key);
+
+	if (store->num_shards == 1) return &store->shards[0];
+
+	return &store->shards[probe->hash >> store->shift];
+}
+
+static void lru_unlink(caching_shard_t *shard, caching_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void lru_push(caching_shard_t *shard, caching_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if (shard->head) {
+		shard->head->prev = entry;
+	} else {
+		shard->tail = entry;
+	}
+	shard->head = entry;
+}
+
+/*
+ *	Remove an entry from the shard, and free it.
+ */
+static void entry_remove(caching_shard_t *shard, caching_entry_t *entry)
+{
+	lru_unlink(shard, entry);
+	shard->num_entries--;
+	shard->memory -= entry->size;
+
+	fr_hash_table_delete(shard->ht, entry);
+}
+
+caching_store_t *caching_store_create(int num_shards, int max_entries,
+				      size_t max_memory)
+{
+	int i, bits;
+	caching_store_t *store;
+
+	if (num_shards < 1) num_shards = 1;
+	if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+
+	/*
+	 *	Round up to a power of two.
+	 */
+	for (bits = 0; (1 << bits) < num_shards; bits++) {
+		/* nothing */
+	}
+
+	store = malloc(sizeof(*store));
+	if (!store) return NULL;
+	memset(store, 0, sizeof(*store));
+
+	store->num_shards = 1 << bits;
+	store->shift = 32 - bits;
+
+	/*
+	 *	Zero means "no limit".
+	 */
+	if (max_entries > 0) {
+		store->max_entries = max_entries / store->num_shards;
+		if (store->max_entries == 0) store->max_entries = 1;
+	}
+	if (max_memory > 0) {
+		store->max_memory = max_memory / store->num_shards;
+		if (store->max_memory == 0) store->max_memory = 1;
+	}
+
+	store->shards = malloc(store->num_shards * sizeof(store->shards[0]));
+	if (!store->shards) {
+		free(store);
+		return NULL;
+	}
+	memset(store->shards, 0, store->num_shards * sizeof(store->shards[0]));
+
+	for (i = 0; i < store->num_shards; i++) {
+		caching_shard_t *shard = &store->shards[i];
+
+		shard->ht = fr_hash_table_create(entry_hash, entry_cmp, free);
+		if (!shard->ht) {
+			store->num_shards = i;
+			caching_store_free(store);
+			return NULL;
+		}
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+
+	return store;
+}
+
+void caching_store_free(caching_store_t *store)
+{
+	int i;
+
+	if (!store) return;
+
+	for (i = 0; i < store->num_shards; i++) {
+		fr_hash_table_free(store->shards[i].ht);
+		pthread_mutex_destroy(&store->shards[i].mutex);
+	}
+
+	free(store->shards);
+	free(store);
+}
+
+/*
+ *	Add an entry, replacing any old one with the same key.
+ */
+int caching_store_insert(caching_store_t *store, const char *key,
+			 const char *auth_type,
+			 const uint8_t *data, size_t len, time_t expires)
+{
+	size_t keylen;
+	caching_shard_t *shard;
+	caching_entry_t *entry, *old, probe;
+
+	if (len > CACHING_MAX_DATA) return -1;
+
+	keylen = strlen(key);
+	entry = malloc(sizeof(*entry) + len + keylen + 1);
+	if (!entry) return -1;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->expires = expires;
+	entry->size = sizeof(*entry) + len + keylen + 1;
+	strlcpy(entry->auth_type, auth_type, sizeof(entry->auth_type));
+	entry->len = len;
+	entry->data = (uint8_t *) (entry + 1);
+	memcpy(entry->data, data, len);
+	entry->key = (char *) (entry->data + len);
+	memcpy(entry->key, key, keylen + 1);
+
+	shard = shard_find(store, &probe, key);
+	entry->hash = probe.hash;
+
+	pthread_mutex_lock(&shard->mutex);
+	old = fr_hash_table_finddata(shard->ht, &probe);
+	if (old) entry_remove(shard, old);
+
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		pthread_mutex_unlock(&shard->mutex);
+		free(entry);
+		return -1;
+	}
+	lru_push(shard, entry);
+	shard->num_entries++;
+	shard->memory += entry->size;
+	shard->stats.inserts++;
+
+	/*
+	 *	Throw away the least recently used entries until
+	 *	we're back under the limits.  Never the new one.
+	 */
+	while ((shard->tail != entry) &&
+	       ((store->max_entries && (shard->num_entries > store->max_entries)) ||
+		(store->max_memory && (shard->memory > store->max_memory)))) {
+		entry_remove(shard, shard->tail);
+		shard->stats.evictions++;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 0;
+}
+
+/*
+ *	Copy out the cached data for "key".  "data" must have room
+ *	for CACHING_MAX_DATA bytes, and "auth_type" for MAX_AUTH_TYPE.
+ *
+ *	Returns 1 on a hit, and 0 on a miss.  Expired entries are
+ *	removed, and count as a miss.
+ */
+int caching_store_lookup(caching_store_t *store, const char *key,
+			 time_t now, char *auth_type,
+			 uint8_t *data, size_t *len)
+{
+	int found = 0;
+	unsigned long usec;
+	struct timeval start, end;
+	caching_shard_t *shard;
+	caching_entry_t *entry, probe;
+
+	gettimeofday(&start, NULL);
+
+	shard = shard_find(store, &probe, key);
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->stats.queries++;
+
+	entry = fr_hash_table_finddata(shard->ht, &probe);
+	if (entry && (entry->expires <= now)) {
+		entry_remove(shard, entry);
+		shard->stats.expired++;
+		entry = NULL;
+	}
+
+	if (entry) {
+		memcpy(auth_type, entry->auth_type, MAX_AUTH_TYPE);
+		memcpy(data, entry->data, entry->len);
+		*len = entry->len;
+
+		lru_unlink(shard, entry);
+		lru_push(shard, entry);
+
+		shard->stats.hits++;
+		found = 1;
+	}
+
+	gettimeofday(&end, NULL);
+	usec = ((end.tv_sec - start.tv_sec) * 1000000) +
+		(end.tv_usec - start.tv_usec);
+	shard->stats.lookup_usec += usec;
+	if (usec > shard->stats.max_lookup_usec) {
+		shard->stats.max_lookup_usec = usec;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return found;
+}
+
+int caching_store_delete(caching_store_t *store, const char *key)
+{
+	caching_shard_t *shard;
+	caching_entry_t *entry, probe;
+
+	shard = shard_find(store, &probe, key);
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &probe);
+	if (entry) entry_remove(shard, entry);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return (entry != NULL);
+}
+
+/*
+ *	Call "callback" for every entry which hasn't expired.  Each
+ *	shard is locked while it is walked, so this is for saving the
+ *	cache on exit, not for use while busy.
+ */
+int caching_store_walk(caching_store_t *store, time_t now,
+		       caching_store_walk_t callback, void *ctx)
+{
+	int i, num = 0;
+	caching_entry_t *entry;
+
+	for (i = 0; i < store->num_shards; i++) {
+		caching_shard_t *shard = &store->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		for (entry = shard->head; entry != NULL; entry = entry->next) {
+			if (entry->expires <= now) continue;
+
+			if (callback(ctx, entry->key, entry->auth_type,
+				     entry->data, entry->len,
+				     entry->expires) < 0) {
+				pthread_mutex_unlock(&shard->mutex);
+				return -1;
+			}
+			num++;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	return num;
+}
+
+void caching_store_stats(caching_store_t *store, caching_stats_t *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < store->num_shards; i++) {
+		caching_shard_t *shard = &store->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		stats->queries += shard->stats.queries;
+		stats->hits += shard->stats.hits;
+		stats->expired += shard->stats.expired;
+		stats->inserts += shard->stats.inserts;
+		stats->evictions += shard->stats.evictions;
+		stats->entries += shard->num_entries;
+		stats->memory += shard->memory;
+		stats->lookup_usec += shard->stats.lookup_usec;
+		if (shard->stats.max_lookup_usec > stats->max_lookup_usec) {
+			stats->max_lookup_usec = shard->stats.max_lookup_usec;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ *	Integers, addresses and dates are kept in "lvalue", and not
+ *	in the data union.
+ */
+#define IS_LVALUE(_type) (((_type) == PW_TYPE_INTEGER) || \
+			  ((_type) == PW_TYPE_IPADDR) || \
+			  ((_type) == PW_TYPE_DATE) || \
+			  ((_type) == PW_TYPE_BYTE) || \
+			  ((_type) == PW_TYPE_SHORT))
+
+/*
+ *	Returns the encoded length, or -1 if the attributes can't be
+ *	cached (too large, or of a type we don't handle).
+ *
+ *	Each attribute is encoded as:
+ *
+ *	attribute (4 octets, host order)
+ *	vendor    (4 octets, host order)
+ *	type      (1 octet)
+ *	operator  (1 octet)
+ *	tag       (1 octet)
+ *	length    (1 octet)
+ *	value     (4 octets for integers, addresses and dates,
+ *		   otherwise "length" octets)
+ *
+ *	The encoding is only ever read back by the same server, so
+ *	host byte order is fine.
+ */
+#define ATTR_HDR_LEN (12)
+
+ssize_t caching_encode(const VALUE_PAIR *vps, uint8_t *data, size_t len)
+{
+	size_t used = 0;
+	size_t size;
+	uint32_t value, hdr;
+	const uint8_t *src;
+	const VALUE_PAIR *vp;
+
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		if ((vp->type == PW_TYPE_TLV) ||
+		    (vp->type == PW_TYPE_COMBO_IP)) {
+			return -1;
+		}
+
+		if (IS_LVALUE(vp->type)) {
+			value = vp->lvalue;
+			src = (const uint8_t *) &value;
+			size = sizeof(value);
+		} else {
+			src = vp->vp_octets;
+			size = vp->length;
+		}
+
+		if ((vp->length >= MAX_STRING_LEN) ||
+		    ((used + ATTR_HDR_LEN + size) > len)) {
+			return -1;
+		}
+
+		hdr = vp->attribute;
+		memcpy(data + used, &hdr, sizeof(hdr));
+		hdr = vp->vendor;
+		memcpy(data + used + 4, &hdr, sizeof(hdr));
+		data[used + 8] = vp->type;
+		data[used + 9] = vp->operator;
+		data[used + 10] = (uint8_t) vp->flags.tag;
+		data[used + 11] = vp->length;
+		memcpy(data + used + ATTR_HDR_LEN, src, size);
+
+		used += ATTR_HDR_LEN + size;
+	}
+
+	return used;
+}
+
+/*
+ *	Attributes whose type in the dictionary is no longer the
+ *	type they were cached with are skipped.
+ */
+VALUE_PAIR *caching_decode(const uint8_t *data, size_t len)
+{
+	int type;
+	size_t size, length;
+	uint32_t attr, vendor;
+	const uint8_t *p, *end;
+	VALUE_PAIR *head = NULL, **tail = &head, *vp;
+
+	p = data;
+	end = data + len;
+
+	while (p < end) {
+		if ((end - p) < ATTR_HDR_LEN) goto error;
+
+		memcpy(&attr, p, sizeof(attr));
+		memcpy(&vendor, p + 4, sizeof(vendor));
+		type = p[8];
+		length = p[11];
+		size = IS_LVALUE(type) ? sizeof(uint32_t) : length;
+
+		if ((length >= MAX_STRING_LEN) ||
+		    ((size_t) (end - p - ATTR_HDR_LEN) < size)) goto error;
+
+		vp = paircreate(attr, vendor, type);
+		if (!vp) goto error;
+
+		if (vp->type != type) {
+			pairfree(&vp);
+			p += ATTR_HDR_LEN + size;
+			continue;
+		}
+
+		vp->operator = p[9];
+		vp->flags.tag = (int8_t) p[10];
+		vp->length = length;
+		if (IS_LVALUE(type)) {
+			memcpy(&vp->lvalue, p + ATTR_HDR_LEN, size);
+		} else {
+			memcpy(vp->vp_octets, p + ATTR_HDR_LEN, size);
+			vp->vp_octets[size] = '\0';
+		}
+
+		*tail = vp;
+		tail = &vp->next;
+		p += ATTR_HDR_LEN + size;
+	}
+
+	return head;
+
+error:
+	pairfree(&head);
+	return NULL;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../include -I ../../ caching_store.c \
+ *	../../lib/.libs/libfreeradius-radius.a -lpthread -o caching_store
+ *
+ *  ./caching_store [dict_dir] [num_threads] [num_lookups]
+ *
+ *  Compares the old text format (vp_prints / userparse) with the
+ *  binary one, and then measures lookups from several threads
+ *  with one shard and with several.
+ */
+#define NUM_KEYS (10000)
+
+static const char *reply_text[] = {
+	"Framed-IP-Address = 192.0.2.1",
+	"Framed-IP-Netmask = 255.255.255.255",
+	"Service-Type = Framed-User",
+	"Framed-Protocol = PPP",
+	"Session-Timeout = 3600",
+	"Idle-Timeout = 600",
+	"Class = 0x0123456789abcdef0123456789abcdef",
+	"Reply-Message = \"Welcome to the network\"",
+	"Filter-Id = \"standard-user\"",
+	NULL
+};
+
+typedef struct bench_t {
+	caching_store_t	*store;
+	int		num_lookups;
+	unsigned int	seed;
+	int		hits;
+} bench_t;
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static void *bench_thread(void *arg)
+{
+	int i;
+	size_t len;
+	char key[32];
+	char auth_type[MAX_AUTH_TYPE];
+	uint8_t data[CACHING_MAX_DATA];
+	VALUE_PAIR *vps;
+	bench_t *b = arg;
+
+	for (i = 0; i < b->num_lookups; i++) {
+		b->seed = (b->seed * 1103515245) + 12345;
+		snprintf(key, sizeof(key), "session%u",
+			 (b->seed >> 8) % NUM_KEYS);
+
+		if (caching_store_lookup(b->store, key, time(NULL),
+					 auth_type, data, &len)) {
+			vps = caching_decode(data, len);
+			if (vps) b->hits++;
+			pairfree(&vps);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, s, num_threads, num_lookups, count, len;
+	static const int shards[] = { 1, 16, 0 };
+	const char *dict_dir;
+	char text[4096];
+	char key[32];
+	uint8_t data[CACHING_MAX_DATA];
+	ssize_t data_len;
+	double t;
+	struct timeval start;
+	caching_stats_t stats;
+	caching_store_t *store;
+	VALUE_PAIR *vps = NULL, *vp, *copy;
+	pthread_t *tids;
+	bench_t *b;
+
+	dict_dir = (argc > 1) ? argv[1] : "../../../share";
+	num_threads = (argc > 2) ? atoi(argv[2]) : 8;
+	num_lookups = (argc > 3) ? atoi(argv[3]) : 200000;
+	if ((num_threads <= 0) || (num_lookups <= 0)) {
+		fprintf(stderr, "usage: caching_store [dict_dir] [num_threads] [num_lookups]\n");
+		exit(1);
+	}
+
+	if (dict_init(dict_dir, "dictionary") < 0) {
+		fr_perror("caching_store");
+		exit(1);
+	}
+
+	for (i = 0; reply_text[i] != NULL; i++) {
+		if (userparse(reply_text[i], &vps) == T_OP_INVALID) {
+			fr_perror("caching_store");
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Text, as rlm_caching used to do it.
+	 */
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 100000; i++) {
+		len = 0;
+		for (vp = vps; vp != NULL; vp = vp->next) {
+			len += vp_prints(text + len, sizeof(text) - len, vp) + 1;
+		}
+
+		copy = NULL;
+		for (j = 0; j < len; j += strlen(text + j) + 1) {
+			userparse(text + j, &copy);
+		}
+		pairfree(&copy);
+	}
+	t = elapsed(&start);
+	printf("text:   %d bytes, %8.0f encode+decode/s\n", len, 100000 / t);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 100000; i++) {
+		data_len = caching_encode(vps, data, sizeof(data));
+		copy = caching_decode(data, data_len);
+		pairfree(&copy);
+	}
+	t = elapsed(&start);
+	printf("binary: %d bytes, %8.0f encode+decode/s\n", (int) data_len,
+	       100000 / t);
+
+	/*
+	 *	Check that what we decode is what we encoded.
+	 */
+	copy = caching_decode(data, data_len);
+	for (vp = vps, count = 0; vp != NULL; vp = vp->next, count++) {
+		VALUE_PAIR *match = pairfind(copy, vp->attribute, vp->vendor);
+
+		if (!match || (match->length != vp->length) ||
+		    (IS_LVALUE(vp->type) ?
+		     (match->lvalue != vp->lvalue) :
+		     (memcmp(match->vp_octets, vp->vp_octets, vp->length) != 0))) {
+			fprintf(stderr, "Decoded %s doesn't match\n", vp->name);
+			exit(1);
+		}
+	}
+	pairfree(&copy);
+
+	tids = malloc(num_threads * sizeof(tids[0]));
+	b = malloc(num_threads * sizeof(b[0]));
+	if (!tids || !b) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (s = 0; shards[s] != 0; s++) {
+		store = caching_store_create(shards[s], NUM_KEYS / 2, 0);
+		if (!store) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		for (i = 0; i < NUM_KEYS; i++) {
+			snprintf(key, sizeof(key), "session%d", i);
+			caching_store_insert(store, key, "PAP", data, data_len,
+					     time(NULL) + 3600);
+		}
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < num_threads; i++) {
+			b[i].store = store;
+			b[i].num_lookups = num_lookups;
+			b[i].seed = i + 1;
+			b[i].hits = 0;
+			pthread_create(&tids[i], NULL, bench_thread, &b[i]);
+		}
+		for (i = 0; i < num_threads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		t = elapsed(&start);
+
+		caching_store_stats(store, &stats);
+		if (stats.entries > NUM_KEYS / 2) {
+			fprintf(stderr, "LRU limit not enforced\n");
+			exit(1);
+		}
+
+		printf("%3d shards: %8.0f lookups/s, %lu entries, %lu evicted, hit ratio %.1f%%, %.2fus avg\n",
+		       shards[s], (num_threads * (double) num_lookups) / t,
+		       stats.entries, stats.evictions,
+		       (100.0 * stats.hits) / stats.queries,
+		       (double) stats.lookup_usec / stats.queries);
+
+		caching_store_free(store);
+	}
+
+	free(tids);
+	free(b);
+	pairfree(&vps);
+
+	return 0;
+}
+#endif
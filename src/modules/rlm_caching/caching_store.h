@@ -0,0 +1,77 @@
+/*
+ * caching_store.h	In-memory cache for rlm_caching.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _CACHING_STORE_H
+#define _CACHING_STORE_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(caching_store_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define MAX_AUTH_TYPE 32
+
+/*
+ *	The largest encoded attribute list we will cache.
+ */
+#define CACHING_MAX_DATA 4096
+
+/*
+ *	The store does its own locking, one lock per shard.
+ */
+typedef struct caching_store_t caching_store_t;
+
+typedef struct caching_stats_t {
+	unsigned long	queries;
+	unsigned long	hits;
+	unsigned long	expired;
+	unsigned long	inserts;
+	unsigned long	evictions;
+	unsigned long	entries;
+	unsigned long	memory;
+	unsigned long	lookup_usec;	/* total, including lock waits */
+	unsigned long	max_lookup_usec;
+} caching_stats_t;
+
+typedef int (*caching_store_walk_t)(void *ctx, const char *key,
+				    const char *auth_type,
+				    const uint8_t *data, size_t len,
+				    time_t expires);
+
+caching_store_t *caching_store_create(int num_shards, int max_entries,
+				      size_t max_memory);
+void	caching_store_free(caching_store_t *store);
+
+int	caching_store_insert(caching_store_t *store, const char *key,
+			     const char *auth_type,
+			     const uint8_t *data, size_t len, time_t expires);
+int	caching_store_lookup(caching_store_t *store, const char *key,
+			     time_t now, char *auth_type,
+			     uint8_t *data, size_t *len);
+int	caching_store_delete(caching_store_t *store, const char *key);
+int	caching_store_walk(caching_store_t *store, time_t now,
+			   caching_store_walk_t callback, void *ctx);
+void	caching_store_stats(caching_store_t *store, caching_stats_t *stats);
+
+ssize_t	caching_encode(const VALUE_PAIR *vps, uint8_t *data, size_t len);
+VALUE_PAIR *caching_decode(const uint8_t *data, size_t len);
+
+#endif /* _CACHING_STORE_H */
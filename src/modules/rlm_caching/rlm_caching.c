@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <ctype.h>
 
 #include "config.h"
+#include "caching_store.h"
 
 #include <gdbm.h>
 #include <time.h>
@@ -51,8 +52,6 @@ RCSID("$Id$")
 #define gdbm_fdesc(foo) (-1)
 #endif
 
-#define UNIQUEID_MAX_LEN 32
-
 /*
  *	Define a structure for our module configuration.
  *
@@ -62,46 +61,35 @@ RCSID("$Id$")
  */
 typedef struct rlm_caching_t {
 	char *filename;		/* name of the database file */
+	char *db_name;		/* our copy, for after the config is freed */
 	char *key;		/* An xlated string to use as key for the records */
 	char *post_auth;	/* If set and we find a cached entry, set Post-Auth to this value */
 	char *cache_ttl_str;	/* The string represantation of the TTL */
 	int cache_ttl;		/* The cache TTL */
 	int hit_ratio;		/* Show cache hit ratio every so many queries */
 	int cache_rejects;	/* Do we also cache rejects? */
-	int cache_size;		/* The cache size to pass to GDBM */
+	int cache_size;		/* Unused: the file is no longer the cache */
+	int max_entries;	/* The most entries to keep in memory */
+	int max_memory;		/* The most memory to use, in bytes */
+	int num_shards;		/* How many locks to split the cache over */
 	uint32_t cache_queries;	/* The number of cache requests */
-	uint32_t cache_hits;	/* The number of cache hits */
-	GDBM_FILE gdbm;		/* The gdbm file handle */
-#ifdef HAVE_PTHREAD_H
-	pthread_mutex_t mutex;	/* A mutex to lock the gdbm file for only one reader/writer */
-#endif
+	caching_store_t *store;	/* The cache */
 } rlm_caching_t;
 
-#define MAX_RECORD_LEN 750
-#define MAX_AUTH_TYPE 32
-
-#define show_hit_ratio \
-	if (data->hit_ratio && (data->cache_queries % data->hit_ratio) == 0) \
-		radlog(L_INFO, "rlm_caching: Cache Queries: %7d, Cache Hits: %7d, Hit Ratio: %.2f%%", \
-			data->cache_queries,data->cache_hits,hit_ratio)
-
-typedef struct rlm_caching_data {
-	time_t creation;
-	char data[MAX_RECORD_LEN];
-	char auth_type[MAX_AUTH_TYPE];
-	int len;
-} rlm_caching_data;
-
-#ifndef HAVE_PTHREAD_H
 /*
- *	This is a lot simpler than putting ifdef's around
- *	every use of the pthread functions.
+ *	The records in the GDBM file.  The file is only used to keep
+ *	the cache across restarts: it's read when the module is
+ *	instantiated, and written when it's detached.  The encoded
+ *	attributes follow the header.
  */
-#define pthread_mutex_lock(a)
-#define pthread_mutex_unlock(a)
-#define pthread_mutex_init(a,b)
-#define pthread_mutex_destroy(a)
-#endif
+#define CACHING_RECORD_MAGIC (0xfe0c0001)
+
+typedef struct rlm_caching_record {
+	uint32_t magic;
+	uint32_t len;
+	time_t expires;
+	char auth_type[MAX_AUTH_TYPE];
+} rlm_caching_record;
 
 /*
  *	A mapping of configuration file names to internal variables.
@@ -117,9 +105,12 @@ static const CONF_PARSER module_config[] = {
   { "key", PW_TYPE_STRING_PTR, offsetof(rlm_caching_t,key), NULL, "%{Acct-Unique-Session-Id}" },
   { "post-auth", PW_TYPE_STRING_PTR, offsetof(rlm_caching_t,post_auth), NULL,  NULL },
   { "cache-ttl", PW_TYPE_STRING_PTR, offsetof(rlm_caching_t,cache_ttl_str), NULL, "1d" },
-  { "cache-size", PW_TYPE_INTEGER, offsetof(rlm_caching_t,cache_size), NULL, "1000" },
+  { "cache-size", PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, offsetof(rlm_caching_t,cache_size), NULL, NULL },
   { "hit-ratio", PW_TYPE_INTEGER, offsetof(rlm_caching_t,hit_ratio), NULL, "0" },
   { "cache-rejects", PW_TYPE_BOOLEAN, offsetof(rlm_caching_t,cache_rejects), NULL, "yes" },
+  { "max-entries", PW_TYPE_INTEGER, offsetof(rlm_caching_t,max_entries), NULL, "100000" },
+  { "max-memory", PW_TYPE_INTEGER, offsetof(rlm_caching_t,max_memory), NULL, "0" },
+  { "shards", PW_TYPE_INTEGER, offsetof(rlm_caching_t,num_shards), NULL, "16" },
   { NULL, -1, 0, NULL, NULL }
 };
 
@@ -163,6 +154,134 @@ static int find_ttl(char *ttl)
 	return len;
 }
 
+/*
+ *	Log the cache statistics every "hit-ratio" queries.
+ */
+static void show_hit_ratio(rlm_caching_t *data)
+{
+	caching_stats_t stats;
+
+	if (!data->hit_ratio || ((data->cache_queries % data->hit_ratio) != 0))
+		return;
+
+	caching_store_stats(data->store, &stats);
+	radlog(L_INFO, "rlm_caching: Cache Queries: %7lu, Cache Hits: %7lu, Hit Ratio: %.2f%%, Expired: %lu, Entries: %lu, Memory: %lu, Evictions: %lu, Lookup: %.2fus avg %luus max",
+	       stats.queries, stats.hits,
+	       stats.queries ? (100.0 * stats.hits) / stats.queries : 0.0,
+	       stats.expired, stats.entries, stats.memory, stats.evictions,
+	       stats.queries ? (double) stats.lookup_usec / stats.queries : 0.0,
+	       stats.max_lookup_usec);
+}
+
+/*
+ *	Read the cache saved by a previous instance.  Records which
+ *	have expired, or which aren't in our format, are ignored.
+ */
+static int caching_load(rlm_caching_t *data)
+{
+	int num = 0;
+	time_t now;
+	GDBM_FILE gdbm;
+	datum key_datum;
+	datum next_datum;
+	datum data_datum;
+	rlm_caching_record record;
+	char key[MAX_STRING_LEN];
+
+	gdbm = gdbm_open(data->db_name, sizeof(int),
+			GDBM_WRCREAT | GDBM_COUNTER_OPTS, 0600, NULL);
+	if (gdbm == NULL) {
+		radlog(L_ERR, "rlm_caching: Failed to open file %s: %s",
+				data->db_name, strerror(errno));
+		return -1;
+	}
+
+	now = time(NULL);
+	key_datum = gdbm_firstkey(gdbm);
+	while (key_datum.dptr != NULL) {
+		data_datum = gdbm_fetch(gdbm, key_datum);
+		if ((data_datum.dptr != NULL) &&
+		    (key_datum.dsize < (int) sizeof(key)) &&
+		    (data_datum.dsize >= (int) sizeof(record))) {
+			memcpy(&record, data_datum.dptr, sizeof(record));
+			memcpy(key, key_datum.dptr, key_datum.dsize);
+			key[key_datum.dsize] = '\0';
+			record.auth_type[sizeof(record.auth_type) - 1] = '\0';
+
+			if ((record.magic == CACHING_RECORD_MAGIC) &&
+			    (record.len == (data_datum.dsize - sizeof(record))) &&
+			    (record.expires > now) &&
+			    (caching_store_insert(data->store, key,
+						  record.auth_type,
+						  (uint8_t *) data_datum.dptr + sizeof(record),
+						  record.len, record.expires) == 0)) {
+				num++;
+			}
+		}
+		free(data_datum.dptr);
+
+		next_datum = gdbm_nextkey(gdbm, key_datum);
+		free(key_datum.dptr);
+		key_datum = next_datum;
+	}
+	gdbm_close(gdbm);
+
+	return num;
+}
+
+static int caching_write(void *ctx, const char *key, const char *auth_type,
+			 const uint8_t *data, size_t len, time_t expires)
+{
+	GDBM_FILE gdbm = ctx;
+	datum key_datum;
+	datum data_datum;
+	rlm_caching_record *record;
+	uint8_t buffer[sizeof(*record) + CACHING_MAX_DATA];
+
+	record = (rlm_caching_record *) buffer;
+	memset(record, 0, sizeof(*record));
+	record->magic = CACHING_RECORD_MAGIC;
+	record->len = len;
+	record->expires = expires;
+	strlcpy(record->auth_type, auth_type, sizeof(record->auth_type));
+	memcpy(buffer + sizeof(*record), data, len);
+
+	key_datum.dptr = (char *) key;
+	key_datum.dsize = strlen(key);
+	data_datum.dptr = (char *) buffer;
+	data_datum.dsize = sizeof(*record) + len;
+
+	if (gdbm_store(gdbm, key_datum, data_datum, GDBM_REPLACE) < 0) {
+		radlog(L_ERR, "rlm_caching: Failed storing data: %s",
+				gdbm_strerror(gdbm_errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Save the cache, so that the next instance starts warm.
+ */
+static int caching_save(rlm_caching_t *data)
+{
+	int num;
+	GDBM_FILE gdbm;
+
+	gdbm = gdbm_open(data->db_name, sizeof(int),
+			GDBM_NEWDB | GDBM_COUNTER_OPTS, 0600, NULL);
+	if (gdbm == NULL) {
+		radlog(L_ERR, "rlm_caching: Failed to open file %s: %s",
+				data->db_name, strerror(errno));
+		return -1;
+	}
+
+	num = caching_store_walk(data->store, time(NULL), caching_write, gdbm);
+	gdbm_close(gdbm);
+
+	return num;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -176,7 +295,7 @@ static int find_ttl(char *ttl)
 static int caching_instantiate(CONF_SECTION *conf, void **instance)
 {
 	rlm_caching_t *data;
-	int cache_size;
+	int num;
 
 	/*
 	 *	Set up a storage area for instance data
@@ -196,7 +315,6 @@ static int caching_instantiate(CONF_SECTION *conf, void **instance)
 		free(data);
 		return -1;
 	}
-	cache_size = data->cache_size;
 
 	/*
 	 *	Discover the attribute number of the key.
@@ -219,27 +337,40 @@ static int caching_instantiate(CONF_SECTION *conf, void **instance)
 			return -1;
 		}
 	}
-
-	if (data->filename == NULL) {
-		radlog(L_ERR, "rlm_caching: 'filename' must be set.");
+	if ((data->max_entries < 0) || (data->max_memory < 0)) {
+		radlog(L_ERR, "rlm_caching: 'max-entries' and 'max-memory' must be zero or more.");
 		caching_detach(data);
 		return -1;
 	}
-	data->gdbm = gdbm_open(data->filename, sizeof(int),
-			GDBM_WRCREAT | GDBM_COUNTER_OPTS, 0600, NULL);
-	if (data->gdbm == NULL) {
-		radlog(L_ERR, "rlm_caching: Failed to open file %s: %s",
-				data->filename, strerror(errno));
+
+	data->store = caching_store_create(data->num_shards, data->max_entries,
+					   data->max_memory);
+	if (!data->store) {
+		radlog(L_ERR, "rlm_caching: Out of memory");
 		caching_detach(data);
 		return -1;
 	}
-	if (gdbm_setopt(data->gdbm, GDBM_CACHESIZE, &cache_size, sizeof(int)) == -1)
-		radlog(L_ERR, "rlm_caching: Failed to set cache size");
 
 	/*
-	 * Init the mutex
+	 *	The file is optional.  Without it, we start with
+	 *	an empty cache.
 	 */
-	pthread_mutex_init(&data->mutex, NULL);
+	if (data->filename != NULL) {
+		data->db_name = strdup(data->filename);
+		if (!data->db_name) {
+			radlog(L_ERR, "rlm_caching: Out of memory");
+			caching_detach(data);
+			return -1;
+		}
+
+		num = caching_load(data);
+		if (num < 0) {
+			caching_detach(data);
+			return -1;
+		}
+		DEBUG2("rlm_caching: Read %d entries from %s",
+		       num, data->db_name);
+	}
 
 	*instance = data;
 
@@ -253,15 +384,10 @@ static int caching_postauth(void *instance, REQUEST *request)
 {
 	rlm_caching_t *data = (rlm_caching_t *)instance;
 	char key[MAX_STRING_LEN];
-	datum key_datum;
-	datum data_datum;
+	uint8_t buffer[CACHING_MAX_DATA];
 	VALUE_PAIR *reply_vp;
 	VALUE_PAIR *auth_type;
-	rlm_caching_data cache_data;
-	int count = 0;
-	int ret = 0;
-	int size = 0;
-	int rcode = 0;
+	ssize_t len;
 
 	if (pairfind(request->packet->vps, PW_CACHE_NO_CACHING, 0) != NULL){
 		DEBUG("rlm_caching: Cache-No-Caching is set. Returning NOOP");
@@ -294,44 +420,19 @@ static int caching_postauth(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	memset(&cache_data,0,sizeof(rlm_caching_data));
-
-	cache_data.creation = time(NULL);
-	strcpy(cache_data.auth_type,auth_type->vp_strvalue);
-
-	size = MAX_RECORD_LEN;
-
-	while(reply_vp) {
-		if (size <= 1){
-			DEBUG("rlm_caching: Not enough space.");
-			return RLM_MODULE_NOOP;
-		}
-		ret = vp_prints(cache_data.data + count,size,reply_vp);
-		if (ret == 0) {
-			DEBUG("rlm_caching: Record is too large, will not store it.");
-			return RLM_MODULE_NOOP;
-		}
-		count += (ret + 1);
-		size -= (ret + 1);
-		DEBUG("rlm_caching: VP=%s,VALUE=%s,length=%d,cache record length=%d, space left=%d",
-			reply_vp->name,reply_vp->vp_strvalue,ret,count,size);
-		reply_vp = reply_vp->next;
+	len = caching_encode(reply_vp, buffer, sizeof(buffer));
+	if (len < 0) {
+		DEBUG("rlm_caching: Record is too large, or has attributes which can't be cached, will not store it.");
+		return RLM_MODULE_NOOP;
 	}
-	cache_data.len = count;
-
-	DEBUG("rlm_caching: Storing cache for Key='%s'",key);
-	data_datum.dptr = (rlm_caching_data *) &cache_data;
-	data_datum.dsize = sizeof(rlm_caching_data);
-
-	key_datum.dptr = (char *) key;
-	key_datum.dsize = strlen(key);
 
-	pthread_mutex_lock(&data->mutex);
-	rcode = gdbm_store(data->gdbm, key_datum, data_datum, GDBM_REPLACE);
-	pthread_mutex_unlock(&data->mutex);
-	if (rcode < 0) {
-		radlog(L_ERR, "rlm_caching: Failed storing data to %s: %s",
-				data->filename, gdbm_strerror(gdbm_errno));
+	DEBUG("rlm_caching: Storing cache for Key='%s', cache record length=%d",
+	      key, (int) len);
+	if (caching_store_insert(data->store, key, auth_type->vp_strvalue,
+				 buffer, len,
+				 time(NULL) + data->cache_ttl) < 0) {
+		radlog(L_ERR, "rlm_caching: Failed storing cache for Key='%s'",
+		       key);
 		return RLM_MODULE_FAIL;
 	}
 	DEBUG("rlm_caching: New value stored successfully.");
@@ -349,134 +450,93 @@ static int caching_authorize(void *instance, REQUEST *request)
 {
 	rlm_caching_t *data = (rlm_caching_t *) instance;
 	char key[MAX_STRING_LEN];
-	datum key_datum;
-	datum data_datum;
-	rlm_caching_data cache_data;
-	VALUE_PAIR *reply_item;
+	char auth_type[MAX_AUTH_TYPE];
+	uint8_t buffer[CACHING_MAX_DATA];
+	size_t len;
+	VALUE_PAIR *reply_vps;
 	VALUE_PAIR *item;
-	char *tmp;
-	int len = 0;
-	int delete_cache = 0;
-	float hit_ratio = 0.0;
-
-	/* quiet the compiler */
-	instance = instance;
-	request = request;
 
 	if (pairfind(request->packet->vps, PW_CACHE_NO_CACHING, 0) != NULL){
 		DEBUG("rlm_caching: Cache-No-Caching is set. Returning NOOP");
 		return RLM_MODULE_NOOP;
 	}
-	if (pairfind(request->packet->vps, PW_CACHE_DELETE_CACHE, 0) != NULL){
-		DEBUG("rlm_caching: Found Cache-Delete-Cache. Will delete record if found");
-		delete_cache = 1;
-	}
 
 	if (!radius_xlat(key,sizeof(key), data->key, request, NULL)){
 		radlog(L_ERR, "rlm_caching: xlat on key '%s' failed.",data->key);
 		return RLM_MODULE_FAIL;
 	}
 
-	key_datum.dptr = key;
-	key_datum.dsize = strlen(key);
-
+	if (pairfind(request->packet->vps, PW_CACHE_DELETE_CACHE, 0) != NULL){
+		DEBUG("rlm_caching: Found Cache-Delete-Cache. Deleting record for key '%s'",key);
+		caching_store_delete(data->store, key);
+		return RLM_MODULE_NOOP;
+	}
 
-	DEBUG("rlm_caching: Searching the database for key '%s'",key);
-	pthread_mutex_lock(&data->mutex);
-	data_datum = gdbm_fetch(data->gdbm, key_datum);
-	pthread_mutex_unlock(&data->mutex);
+	DEBUG("rlm_caching: Searching the cache for key '%s'",key);
 	data->cache_queries++;
-	if (data_datum.dptr != NULL){
-		DEBUG("rlm_caching: Key Found.");
-		data->cache_hits++;
-		hit_ratio = (float)data->cache_hits / data->cache_queries;
-		hit_ratio *= 100.0;
-		memcpy(&cache_data, data_datum.dptr, sizeof(rlm_caching_data));
-		free(data_datum.dptr);
+	if (!caching_store_lookup(data->store, key, request->timestamp,
+				  auth_type, buffer, &len)) {
+		DEBUG("rlm_caching: Could not find the requested key in the cache, or it has expired.");
+		show_hit_ratio(data);
+		return RLM_MODULE_NOOP;
+	}
 
-		if (delete_cache == 0 && cache_data.creation + data->cache_ttl <= time(NULL)){
-			DEBUG("rlm_caching: Cache entry has expired");
-			DEBUG("rlm_caching: Cache Queries: %7d, Cache Hits: %7d, Hit Ratio: %.2f%%",
-			data->cache_queries,data->cache_hits,hit_ratio);
-			show_hit_ratio;
-			delete_cache = 1;
-		}
-		if (delete_cache){
-			DEBUG("rlm_caching: Deleting record");
+	DEBUG("rlm_caching: Key Found.");
+	reply_vps = caching_decode(buffer, len);
+	if (!reply_vps) {
+		DEBUG("rlm_caching: No reply items found. Returning NOOP");
+		caching_store_delete(data->store, key);
+		show_hit_ratio(data);
+		return RLM_MODULE_NOOP;
+	}
+	pairfree(&request->reply->vps);
+	request->reply->vps = reply_vps;
 
-			pthread_mutex_lock(&data->mutex);
-			gdbm_delete(data->gdbm, key_datum);
-			pthread_mutex_unlock(&data->mutex);
+	if (auth_type[0]){
+		DEBUG("rlm_caching: Adding Auth-Type '%s'",auth_type);
 
-			return RLM_MODULE_NOOP;
-		}
-		tmp = cache_data.data;
-		if (tmp){
-			pairfree(&request->reply->vps);
-			while(tmp && len < cache_data.len){
-				reply_item = NULL;
-				if (userparse(tmp, &reply_item) > 0 && reply_item != NULL)
-					pairadd(&request->reply->vps, reply_item);
-				len += (strlen(tmp) + 1);
-				DEBUG("rlm_caching: VP='%s',VALUE='%s',lenth='%d',cache record length='%d'",
-				reply_item->name,reply_item->vp_strvalue,reply_item->length,len);
-				tmp = cache_data.data + len;
-			}
+		if ((item = pairfind(request->config_items, PW_AUTH_TYPE, 0)) == NULL){
+			item = pairmake("Auth-Type", auth_type, T_OP_SET);
+			pairadd(&request->config_items, item);
 		}
 		else{
-			DEBUG("rlm_caching: No reply items found. Returning NOOP");
-			return RLM_MODULE_NOOP;
+			pairparsevalue(item, auth_type);
 		}
-		if (cache_data.auth_type){
-			DEBUG("rlm_caching: Adding Auth-Type '%s'",cache_data.auth_type);
+	}
+	if (data->post_auth){
+		DEBUG("rlm_caching: Adding Post-Auth-Type '%s'",data->post_auth);
 
-			if ((item = pairfind(request->config_items, PW_AUTH_TYPE, 0)) == NULL){
-				item = pairmake("Auth-Type", cache_data.auth_type, T_OP_SET);
-				pairadd(&request->config_items, item);
-			}
-			else{
-				strcmp(item->vp_strvalue, cache_data.auth_type);
-				item->length = strlen(cache_data.auth_type);
-			}
+		if ((item = pairfind(request->config_items, PW_POST_AUTH_TYPE, 0)) == NULL){
+			item = pairmake("Post-Auth-Type", data->post_auth, T_OP_SET);
+			pairadd(&request->config_items, item);
 		}
-		if (data->post_auth){
-			DEBUG("rlm_caching: Adding Post-Auth-Type '%s'",data->post_auth);
-
-			if ((item = pairfind(request->config_items, PW_POST_AUTH_TYPE, 0)) == NULL){
-				item = pairmake("Post-Auth-Type", data->post_auth, T_OP_SET);
-				pairadd(&request->config_items, item);
-			}
-			else{
-				strcmp(item->vp_strvalue, data->post_auth);
-				item->length = strlen(data->post_auth);
-			}
+		else{
+			pairparsevalue(item, data->post_auth);
 		}
-		item = pairmake("Cache-No-Caching", "YES", T_OP_EQ);
-		pairadd(&request->packet->vps, item);
-
-		DEBUG("rlm_caching: Cache Queries: %7d, Cache Hits: %7d, Hit Ratio: %.2f%%",
-			data->cache_queries,data->cache_hits,hit_ratio);
-		show_hit_ratio;
-
-		return RLM_MODULE_OK;
-	}
-	else{
-		DEBUG("rlm_caching: Could not find the requested key in the database.");
-		DEBUG("rlm_caching: Cache Queries: %7d, Cache Hits: %7d, Hit Ratio: %.2f%%",
-			data->cache_queries,data->cache_hits,hit_ratio);
-		show_hit_ratio;
 	}
+	item = pairmake("Cache-No-Caching", "YES", T_OP_EQ);
+	pairadd(&request->packet->vps, item);
 
-	return RLM_MODULE_NOOP;
+	show_hit_ratio(data);
+
+	return RLM_MODULE_OK;
 }
 
 static int caching_detach(void *instance)
 {
 	rlm_caching_t *data = (rlm_caching_t *) instance;
+	int num;
+
+	if (data->store && data->db_name) {
+		num = caching_save(data);
+		if (num >= 0) {
+			DEBUG2("rlm_caching: Wrote %d entries to %s",
+			       num, data->db_name);
+		}
+	}
 
-	if (data->gdbm)
-		gdbm_close(data->gdbm);
-	pthread_mutex_destroy(&data->mutex);
+	caching_store_free(data->store);
+	free(data->db_name);
 
 	free(instance);
 	return 0;
@@ -0,0 +1,604 @@
+/*
+ * counter_store.c	Sharded in-memory store for rlm_counter.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"counter_store.h"
+
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#endif
+
+/*
+ *	The counters are split across a number of shards, each with
+ *	its own hash table and lock.  Requests for different keys
+ *	then mostly take different locks, instead of all of them
+ *	queueing on one.
+ *
+ *	Resetting the counters just bumps the epoch.  A counter from
+ *	an older epoch is treated as if it wasn't there, and is
+ *	re-used the next time the key is updated.
+ *
+ *	Counters which have changed are put on a per-shard "dirty"
+ *	list, so that writing them to disk doesn't have to look at
+ *	every counter.
+ */
+#define MAX_SHARDS (256)
+
+typedef struct counter_entry_t {
+	struct counter_entry_t	*next_dirty;
+	uint32_t		hash;
+	unsigned int		epoch;
+	int			dirty;
+	rad_counter		counter;
+	size_t			keylen;
+	uint8_t			*key;
+} counter_entry_t;
+
+typedef struct counter_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*ht;
+	counter_entry_t		*dirty;
+	int			num_dirty;
+} counter_shard_t;
+
+struct counter_store_t {
+	unsigned int		epoch;
+	int			num_shards;
+	int			shift;
+	counter_shard_t		*shards;
+};
+
+/*
+ *	What the flush copies out of the shard, so that it can call
+ *	the write callback without holding the lock.
+ */
+typedef struct counter_copy_t {
+	unsigned int		epoch;
+	rad_counter		counter;
+	size_t			keylen;
+	uint8_t			key[MAX_STRING_LEN];
+} counter_copy_t;
+
+
+static uint32_t entry_hash(const void *data)
+{
+	const counter_entry_t *entry = data;
+
+	return entry->hash;
+}
+
+static int entry_cmp(const void *one, const void *two)
+{
+	const counter_entry_t *a = one;
+	const counter_entry_t *b = two;
+
+	if (a->keylen < b->keylen) return -1;
+	if (a->keylen > b->keylen) return +1;
+
+	return memcmp(a->key, b->key, a->keylen);
+}
+
+/*
+ *	The hash tables pick buckets with the low bits of the hash,
+ *	so we pick the shard with the high bits.  Otherwise every
+ *	key in a shard would land in the same few buckets.
+ */
+static counter_shard_t *shard_find(counter_store_t *store,
+				   counter_entry_t *probe,
+				   const uint8_t *key, size_t keylen)
+{
+	probe->key = (uint8_t *) key;
+	probe->keylen = keylen;
+	probe->hash = fr_hash(key, keylen);
+
+	if (store->num_shards == 1) return &store->shards[0];
+
+	return &store->shards[probe->hash >> store->shift];
+}
+
+static counter_entry_t *entry_create(const counter_entry_t *probe)
+{
+	counter_entry_t *entry;
+
+	entry = malloc(sizeof(*entry) + probe->keylen);
+	if (!entry) return NULL;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->hash = probe->hash;
+	entry->keylen = probe->keylen;
+	entry->key = (uint8_t *) (entry + 1);
+	memcpy(entry->key, probe->key, probe->keylen);
+
+	return entry;
+}
+
+static void entry_dirty(counter_shard_t *shard, counter_entry_t *entry)
+{
+	if (entry->dirty) return;
+
+	entry->dirty = 1;
+	entry->next_dirty = shard->dirty;
+	shard->dirty = entry;
+	shard->num_dirty++;
+}
+
+counter_store_t *counter_store_create(int num_shards)
+{
+	int i, bits;
+	counter_store_t *store;
+
+	if (num_shards < 1) num_shards = 1;
+	if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+
+	/*
+	 *	Round up to a power of two.
+	 */
+	for (bits = 0; (1 << bits) < num_shards; bits++) {
+		/* nothing */
+	}
+
+	store = malloc(sizeof(*store));
+	if (!store) return NULL;
+	memset(store, 0, sizeof(*store));
+
+	store->num_shards = 1 << bits;
+	store->shift = 32 - bits;
+	store->shards = malloc(store->num_shards * sizeof(store->shards[0]));
+	if (!store->shards) {
+		free(store);
+		return NULL;
+	}
+	memset(store->shards, 0, store->num_shards * sizeof(store->shards[0]));
+
+	for (i = 0; i < store->num_shards; i++) {
+		counter_shard_t *shard = &store->shards[i];
+
+		shard->ht = fr_hash_table_create(entry_hash, entry_cmp, free);
+		if (!shard->ht) {
+			store->num_shards = i;
+			counter_store_free(store);
+			return NULL;
+		}
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+
+	return store;
+}
+
+void counter_store_free(counter_store_t *store)
+{
+	int i;
+
+	if (!store) return;
+
+	for (i = 0; i < store->num_shards; i++) {
+		fr_hash_table_free(store->shards[i].ht);
+		pthread_mutex_destroy(&store->shards[i].mutex);
+	}
+
+	free(store->shards);
+	free(store);
+}
+
+/*
+ *	Add a counter read from disk.  It isn't dirty.
+ */
+int counter_store_load(counter_store_t *store, const uint8_t *key,
+		       size_t keylen, const rad_counter *counter)
+{
+	counter_shard_t *shard;
+	counter_entry_t *entry, probe;
+
+	if (keylen > MAX_STRING_LEN) return -1;
+
+	shard = shard_find(store, &probe, key, keylen);
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &probe);
+	if (!entry) {
+		entry = entry_create(&probe);
+		if (!entry || !fr_hash_table_insert(shard->ht, entry)) {
+			pthread_mutex_unlock(&shard->mutex);
+			free(entry);
+			return -1;
+		}
+	}
+	entry->epoch = store->epoch;
+	entry->counter = *counter;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 0;
+}
+
+/*
+ *	Returns 1 and fills in the counter if the key has one in the
+ *	current epoch, or 0 if it doesn't.
+ */
+int counter_store_fetch(counter_store_t *store, const uint8_t *key,
+			size_t keylen, rad_counter *counter)
+{
+	int found = 0;
+	counter_shard_t *shard;
+	counter_entry_t *entry, probe;
+
+	if (keylen > MAX_STRING_LEN) return 0;
+
+	shard = shard_find(store, &probe, key, keylen);
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &probe);
+	if (entry && (entry->epoch == store->epoch)) {
+		*counter = entry->counter;
+		found = 1;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return found;
+}
+
+/*
+ *	Read, modify, and write a counter, all under the shard lock.
+ *	Returns 1 if the counter was changed, 0 if the callback
+ *	left it alone, and -1 on error.
+ */
+int counter_store_update(counter_store_t *store, const uint8_t *key,
+			 size_t keylen, counter_store_update_t callback,
+			 void *ctx)
+{
+	int found = 0;
+	rad_counter counter;
+	counter_shard_t *shard;
+	counter_entry_t *entry, probe;
+
+	if (keylen > MAX_STRING_LEN) return -1;
+
+	shard = shard_find(store, &probe, key, keylen);
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &probe);
+	if (entry && (entry->epoch == store->epoch)) {
+		counter = entry->counter;
+		found = 1;
+	} else {
+		memset(&counter, 0, sizeof(counter));
+	}
+
+	if (callback(ctx, &counter, found) < 0) {
+		pthread_mutex_unlock(&shard->mutex);
+		return 0;
+	}
+
+	if (!entry) {
+		entry = entry_create(&probe);
+		if (!entry || !fr_hash_table_insert(shard->ht, entry)) {
+			pthread_mutex_unlock(&shard->mutex);
+			free(entry);
+			return -1;
+		}
+	}
+	entry->epoch = store->epoch;
+	entry->counter = counter;
+	entry_dirty(shard, entry);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 1;
+}
+
+unsigned int counter_store_epoch(counter_store_t *store)
+{
+	unsigned int epoch;
+
+	pthread_mutex_lock(&store->shards[0].mutex);
+	epoch = store->epoch;
+	pthread_mutex_unlock(&store->shards[0].mutex);
+
+	return epoch;
+}
+
+/*
+ *	Reset all of the counters to zero.  Anything which was
+ *	waiting to be written is from the old epoch, so it's thrown
+ *	away.  It's up to the caller to empty the file on disk.
+ */
+unsigned int counter_store_reset(counter_store_t *store)
+{
+	int i;
+	unsigned int epoch;
+	counter_entry_t *entry, *next;
+
+	for (i = 0; i < store->num_shards; i++) {
+		pthread_mutex_lock(&store->shards[i].mutex);
+	}
+
+	epoch = ++store->epoch;
+
+	for (i = store->num_shards - 1; i >= 0; i--) {
+		counter_shard_t *shard = &store->shards[i];
+
+		for (entry = shard->dirty; entry != NULL; entry = next) {
+			next = entry->next_dirty;
+			entry->next_dirty = NULL;
+			entry->dirty = 0;
+		}
+		shard->dirty = NULL;
+		shard->num_dirty = 0;
+
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	return epoch;
+}
+
+/*
+ *	If the write failed, put the counters we didn't write back
+ *	on the dirty list, unless they've been changed or reset in
+ *	the mean time.
+ */
+static void flush_undo(counter_store_t *store, counter_shard_t *shard,
+		       counter_copy_t *copies, int num)
+{
+	int i;
+	counter_entry_t *entry, probe;
+
+	pthread_mutex_lock(&shard->mutex);
+	for (i = 0; i < num; i++) {
+		probe.key = copies[i].key;
+		probe.keylen = copies[i].keylen;
+		probe.hash = fr_hash(probe.key, probe.keylen);
+
+		entry = fr_hash_table_finddata(shard->ht, &probe);
+		if (entry && (entry->epoch == copies[i].epoch) &&
+		    (entry->epoch == store->epoch)) {
+			entry_dirty(shard, entry);
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ *	Call "callback" for each counter which has changed since the
+ *	last flush.  The shard is only locked while we copy its dirty
+ *	counters out, not while they're being written.
+ *
+ *	Returns the number of counters written, or -1 on error.
+ */
+int counter_store_flush(counter_store_t *store,
+			counter_store_write_t callback, void *ctx)
+{
+	int i, j, num, total = 0;
+	counter_entry_t *entry, *next;
+	counter_copy_t *copies;
+
+	for (i = 0; i < store->num_shards; i++) {
+		counter_shard_t *shard = &store->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		if (shard->num_dirty == 0) {
+			pthread_mutex_unlock(&shard->mutex);
+			continue;
+		}
+
+		copies = malloc(shard->num_dirty * sizeof(copies[0]));
+		if (!copies) {
+			pthread_mutex_unlock(&shard->mutex);
+			return -1;
+		}
+
+		num = 0;
+		for (entry = shard->dirty; entry != NULL; entry = next) {
+			next = entry->next_dirty;
+
+			copies[num].epoch = entry->epoch;
+			copies[num].counter = entry->counter;
+			copies[num].keylen = entry->keylen;
+			memcpy(copies[num].key, entry->key, entry->keylen);
+			num++;
+
+			entry->next_dirty = NULL;
+			entry->dirty = 0;
+		}
+		shard->dirty = NULL;
+		shard->num_dirty = 0;
+		pthread_mutex_unlock(&shard->mutex);
+
+		for (j = 0; j < num; j++) {
+			if (callback(ctx, copies[j].key, copies[j].keylen,
+				     &copies[j].counter) < 0) {
+				flush_undo(store, shard, copies + j, num - j);
+				free(copies);
+				return -1;
+			}
+		}
+		total += num;
+
+		free(copies);
+	}
+
+	return total;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../include -I ../../ counter_store.c \
+ *	../../lib/.libs/libfreeradius-radius.a -lpthread -o counter_store
+ *
+ *  ./counter_store [num_threads] [num_users] [num_updates]
+ *
+ *  Has a number of threads update random counters, first with one
+ *  shard (i.e. one lock for everything, as rlm_counter used to
+ *  have), and then with more shards.
+ */
+#include <sys/time.h>
+
+typedef struct bench_t {
+	counter_store_t	*store;
+	int		num_users;
+	int		num_updates;
+	unsigned int	seed;
+} bench_t;
+
+static int bench_add(UNUSED void *ctx, rad_counter *counter,
+		     UNUSED int found)
+{
+	counter->user_counter++;
+
+	return 0;
+}
+
+static int bench_write(void *ctx, UNUSED const uint8_t *key,
+		       UNUSED size_t keylen, const rad_counter *counter)
+{
+	unsigned long *total = ctx;
+
+	*total += counter->user_counter;
+
+	return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+	int i, len;
+	char key[32];
+	rad_counter counter;
+	bench_t *b = arg;
+
+	for (i = 0; i < b->num_updates; i++) {
+		b->seed = (b->seed * 1103515245) + 12345;
+		len = snprintf(key, sizeof(key), "user%u",
+			       (b->seed >> 8) % b->num_users);
+
+		/*
+		 *	Authorize, then accounting.
+		 */
+		counter_store_fetch(b->store, (uint8_t *) key, len, &counter);
+		counter_store_update(b->store, (uint8_t *) key, len,
+				     bench_add, NULL);
+	}
+
+	return NULL;
+}
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, s, num_threads, num_users, num_updates;
+	static const int shards[] = { 1, 4, 16, 64, 0 };
+	double t;
+	unsigned long total;
+	struct timeval start;
+	pthread_t *tids;
+	bench_t *b;
+	counter_store_t *store;
+
+	num_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	num_users = (argc > 2) ? atoi(argv[2]) : 100000;
+	num_updates = (argc > 3) ? atoi(argv[3]) : 1000000;
+	if ((num_threads <= 0) || (num_users <= 0) || (num_updates <= 0)) {
+		fprintf(stderr, "usage: counter_store [num_threads] [num_users] [num_updates]\n");
+		exit(1);
+	}
+
+	tids = malloc(num_threads * sizeof(tids[0]));
+	b = malloc(num_threads * sizeof(b[0]));
+	if (!tids || !b) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	printf("%d threads, %d users, %d updates per thread\n",
+	       num_threads, num_users, num_updates);
+
+	for (s = 0; shards[s] != 0; s++) {
+		store = counter_store_create(shards[s]);
+		if (!store) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < num_threads; i++) {
+			b[i].store = store;
+			b[i].num_users = num_users;
+			b[i].num_updates = num_updates;
+			b[i].seed = i + 1;
+			pthread_create(&tids[i], NULL, bench_thread, &b[i]);
+		}
+		for (i = 0; i < num_threads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		t = elapsed(&start);
+
+		/*
+		 *	Every update must have been counted exactly once.
+		 */
+		total = 0;
+		counter_store_flush(store, bench_write, &total);
+		if (total != (unsigned long) num_threads * num_updates) {
+			fprintf(stderr, "Lost updates: %lu != %lu\n", total,
+				(unsigned long) num_threads * num_updates);
+			exit(1);
+		}
+
+		printf("%3d shards: %10.0f updates/s\n", shards[s],
+		       (num_threads * (double) num_updates) / t);
+
+		/*
+		 *	After a reset, nothing is left to write.
+		 */
+		counter_store_reset(store);
+		total = 0;
+		if (counter_store_flush(store, bench_write, &total) != 0) {
+			fprintf(stderr, "Dirty counters after reset\n");
+			exit(1);
+		}
+
+		counter_store_free(store);
+	}
+
+	free(tids);
+	free(b);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,78 @@
+/*
+ * counter_store.h	Sharded in-memory store for rlm_counter.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _COUNTER_STORE_H
+#define _COUNTER_STORE_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(counter_store_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define UNIQUEID_MAX_LEN 32
+
+/*
+ *	The value stored for each key.  This is also the format of
+ *	the records in the GDBM file, so it can't change.
+ */
+typedef struct rad_counter {
+	unsigned int user_counter;
+	char uniqueid[UNIQUEID_MAX_LEN];
+} rad_counter;
+
+/*
+ *	The store does its own locking, one lock per shard.
+ */
+typedef struct counter_store_t counter_store_t;
+
+/*
+ *	Called with the shard locked.  "found" is zero if the key
+ *	has no counter in the current epoch, in which case the
+ *	counter is all zeros.  Return 0 to store the new value, or
+ *	-1 to leave the old one alone.
+ */
+typedef int (*counter_store_update_t)(void *ctx, rad_counter *counter,
+				      int found);
+
+/*
+ *	Called without any locks held, for each counter which has
+ *	changed since the last flush.
+ */
+typedef int (*counter_store_write_t)(void *ctx, const uint8_t *key,
+				     size_t keylen, const rad_counter *counter);
+
+counter_store_t *counter_store_create(int num_shards);
+void	counter_store_free(counter_store_t *store);
+
+int	counter_store_load(counter_store_t *store, const uint8_t *key,
+			   size_t keylen, const rad_counter *counter);
+int	counter_store_fetch(counter_store_t *store, const uint8_t *key,
+			    size_t keylen, rad_counter *counter);
+int	counter_store_update(counter_store_t *store, const uint8_t *key,
+			     size_t keylen, counter_store_update_t callback,
+			     void *ctx);
+
+unsigned int counter_store_epoch(counter_store_t *store);
+unsigned int counter_store_reset(counter_store_t *store);
+int	counter_store_flush(counter_store_t *store,
+			    counter_store_write_t callback, void *ctx);
+
+#endif /* _COUNTER_STORE_H */
@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <ctype.h>
 
 #include "config.h"
+#include "counter_store.h"
 
 #include <gdbm.h>
 
@@ -50,8 +51,6 @@ RCSID("$Id$")
 #define gdbm_fdesc(foo) (-1)
 #endif
 
-#define UNIQUEID_MAX_LEN 32
-
 /*
  *	Define a structure for our module configuration.
  *
@@ -61,6 +60,7 @@ RCSID("$Id$")
  */
 typedef struct rlm_counter_t {
 	char *filename;		/* name of the database file */
+	char *db_name;		/* our copy, for after the config is freed */
 	char *reset;		/* daily, weekly, monthly, never or user defined */
 	char *key_name;		/* User-Name */
 	char *count_attribute;	/* Acct-Session-Time */
@@ -69,6 +69,8 @@ typedef struct rlm_counter_t {
 	char *reply_name;	/* Session-Timeout */
 	char *service_type;	/* Service-Type to search for */
 	int cache_size;
+	int num_shards;
+	int checkpoint_interval;
 	int service_val;
 	int key_attr;
 	int count_attr;
@@ -77,12 +79,26 @@ typedef struct rlm_counter_t {
 	time_t reset_time;	/* The time of the next reset. */
 	time_t last_reset;	/* The time of the last reset. */
 	int dict_attr;		/* attribute number for the counter. */
+	counter_store_t *store;	/* The counters, in memory */
 	GDBM_FILE gdbm;		/* The gdbm file handle */
+	unsigned int disk_epoch; /* The store epoch the gdbm file is from */
+	time_t next_checkpoint;
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t mutex;	/* A mutex to lock the gdbm file for only one reader/writer */
+	pthread_mutex_t mutex;	/* Protects the reset times */
+	pthread_mutex_t gdbm_mutex; /* Only one writer to the gdbm file */
+	pthread_cond_t cond;	/* Wakes up the checkpoint thread */
+	pthread_t thread;
+	int thread_state;
 #endif
 } rlm_counter_t;
 
+#ifdef HAVE_PTHREAD_H
+#define CHECKPOINT_THREAD_NONE		(0)
+#define CHECKPOINT_THREAD_RUNNING	(1)
+#define CHECKPOINT_THREAD_FAILED	(2)
+#define CHECKPOINT_THREAD_STOPPING	(3)
+#endif
+
 #ifndef HAVE_PTHREAD_H
 /*
  *	This is a lot simpler than putting ifdef's around
@@ -94,11 +110,6 @@ typedef struct rlm_counter_t {
 #define pthread_mutex_destroy(a)
 #endif
 
-typedef struct rad_counter {
-	unsigned int user_counter;
-	char uniqueid[UNIQUEID_MAX_LEN];
-} rad_counter;
-
 /*
  *	A mapping of configuration file names to internal variables.
  *
@@ -118,6 +129,8 @@ static const CONF_PARSER module_config[] = {
   { "reply-name", PW_TYPE_STRING_PTR, offsetof(rlm_counter_t,reply_name), NULL, NULL },
   { "allowed-servicetype", PW_TYPE_STRING_PTR, offsetof(rlm_counter_t,service_type),NULL, NULL },
   { "cache-size", PW_TYPE_INTEGER, offsetof(rlm_counter_t,cache_size), NULL, "1000" },
+  { "shards", PW_TYPE_INTEGER, offsetof(rlm_counter_t,num_shards), NULL, "16" },
+  { "checkpoint-interval", PW_TYPE_INTEGER, offsetof(rlm_counter_t,checkpoint_interval), NULL, "5" },
   { NULL, -1, 0, NULL, NULL }
 };
 
@@ -133,8 +146,6 @@ static int counter_cmp(void *instance,
 		       VALUE_PAIR *check_pairs, VALUE_PAIR **reply_pairs)
 {
 	rlm_counter_t *data = (rlm_counter_t *) instance;
-	datum key_datum;
-	datum count_datum;
 	VALUE_PAIR *key_vp;
 	rad_counter counter;
 
@@ -150,22 +161,17 @@ static int counter_cmp(void *instance,
 		return RLM_MODULE_NOOP;
 	}
 
-	key_datum.dptr = key_vp->vp_strvalue;
-	key_datum.dsize = key_vp->length;
-
-	count_datum = gdbm_fetch(data->gdbm, key_datum);
-
-	if (count_datum.dptr == NULL) {
+	if (!counter_store_fetch(data->store, key_vp->vp_octets,
+				 key_vp->length, &counter)) {
 		return -1;
 	}
-	memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-	free(count_datum.dptr);
 
 	return counter.user_counter - check->vp_integer;
 }
 
 
-static int add_defaults(rlm_counter_t *data)
+static int add_defaults(rlm_counter_t *data, time_t reset_time,
+			time_t last_reset)
 {
 	datum key_datum;
 	datum time_datum;
@@ -176,48 +182,48 @@ static int add_defaults(rlm_counter_t *data)
 
 	key_datum.dptr = (char *) default1;
 	key_datum.dsize = strlen(default1);
-	time_datum.dptr = (char *) &data->reset_time;
+	time_datum.dptr = (char *) &reset_time;
 	time_datum.dsize = sizeof(time_t);
 
 	if (gdbm_store(data->gdbm, key_datum, time_datum, GDBM_REPLACE) < 0){
 		radlog(L_ERR, "rlm_counter: Failed storing data to %s: %s",
-				data->filename, gdbm_strerror(gdbm_errno));
+				data->db_name, gdbm_strerror(gdbm_errno));
 		return RLM_MODULE_FAIL;
 	}
-	DEBUG2("rlm_counter: DEFAULT1 set to %d",(int)data->reset_time);
+	DEBUG2("rlm_counter: DEFAULT1 set to %d",(int)reset_time);
 
 	key_datum.dptr = (char *) default2;
 	key_datum.dsize = strlen(default2);
-	time_datum.dptr = (char *) &data->last_reset;
+	time_datum.dptr = (char *) &last_reset;
 	time_datum.dsize = sizeof(time_t);
 
 	if (gdbm_store(data->gdbm, key_datum, time_datum, GDBM_REPLACE) < 0){
 		radlog(L_ERR, "rlm_counter: Failed storing data to %s: %s",
-				data->filename, gdbm_strerror(gdbm_errno));
+				data->db_name, gdbm_strerror(gdbm_errno));
 		return RLM_MODULE_FAIL;
 	}
-	DEBUG2("rlm_counter: DEFAULT2 set to %d",(int)data->last_reset);
+	DEBUG2("rlm_counter: DEFAULT2 set to %d",(int)last_reset);
 	DEBUG2("rlm_counter: add_defaults: End");
 
 	return RLM_MODULE_OK;
 }
 
-static int reset_db(rlm_counter_t *data)
+static int reset_db(rlm_counter_t *data, time_t reset_time, time_t last_reset)
 {
 	int cache_size = data->cache_size;
 	int ret;
 
 	DEBUG2("rlm_counter: reset_db: Closing database");
-	gdbm_close(data->gdbm);
+	if (data->gdbm) gdbm_close(data->gdbm);
 
 	/*
 	 *	Open a completely new database.
 	 */
-	data->gdbm = gdbm_open(data->filename, sizeof(int),
+	data->gdbm = gdbm_open(data->db_name, sizeof(int),
 			GDBM_NEWDB | GDBM_COUNTER_OPTS, 0600, NULL);
 	if (data->gdbm == NULL) {
 		radlog(L_ERR, "rlm_counter: Failed to open file %s: %s",
-				data->filename, strerror(errno));
+				data->db_name, strerror(errno));
 		return RLM_MODULE_FAIL;
 	}
 	if (gdbm_setopt(data->gdbm, GDBM_CACHESIZE, &cache_size, sizeof(int)) == -1)
@@ -227,7 +233,7 @@ static int reset_db(rlm_counter_t *data)
 	/*
 	 * Add defaults
 	 */
-	ret = add_defaults(data);
+	ret = add_defaults(data, reset_time, last_reset);
 	if (ret != RLM_MODULE_OK)
 		return ret;
 
@@ -303,6 +309,205 @@ static int find_next_reset(rlm_counter_t *data, time_t timeval)
 	return ret;
 }
 
+/*
+ *	See if we have to reset the counters.  The counters are in
+ *	memory, so this is just a new epoch in the store.  The gdbm
+ *	file is emptied at the next checkpoint.
+ */
+static void reset_check(rlm_counter_t *data, time_t now)
+{
+	if (!data->reset_time || (data->reset_time > now)) return;
+
+	pthread_mutex_lock(&data->mutex);
+	if (data->reset_time && (data->reset_time <= now)) {
+		DEBUG("rlm_counter: Time to reset the database.");
+		data->last_reset = data->reset_time;
+		find_next_reset(data, now);
+		counter_store_reset(data->store);
+	}
+	pthread_mutex_unlock(&data->mutex);
+}
+
+/*
+ *	Write one counter to the gdbm file.
+ */
+static int counter_write(void *ctx, const uint8_t *key, size_t keylen,
+			 const rad_counter *counter)
+{
+	rlm_counter_t *data = ctx;
+	datum key_datum;
+	datum count_datum;
+
+	key_datum.dptr = (char *) key;
+	key_datum.dsize = keylen;
+	count_datum.dptr = (char *) counter;
+	count_datum.dsize = sizeof(*counter);
+
+	if (gdbm_store(data->gdbm, key_datum, count_datum, GDBM_REPLACE) < 0) {
+		radlog(L_ERR, "rlm_counter: Failed storing data to %s: %s",
+				data->db_name, gdbm_strerror(gdbm_errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Write the counters which have changed since the last
+ *	checkpoint to the gdbm file.  If the counters have been reset
+ *	in the mean time, empty the file first.
+ */
+static int counter_checkpoint(rlm_counter_t *data)
+{
+	int ret, num;
+	unsigned int epoch;
+	time_t reset_time, last_reset;
+
+	pthread_mutex_lock(&data->mutex);
+	epoch = counter_store_epoch(data->store);
+	reset_time = data->reset_time;
+	last_reset = data->last_reset;
+	pthread_mutex_unlock(&data->mutex);
+
+	pthread_mutex_lock(&data->gdbm_mutex);
+	if (epoch != data->disk_epoch) {
+		ret = reset_db(data, reset_time, last_reset);
+		if (ret != RLM_MODULE_OK) {
+			pthread_mutex_unlock(&data->gdbm_mutex);
+			return ret;
+		}
+		data->disk_epoch = epoch;
+	}
+
+	if (!data->gdbm) {
+		pthread_mutex_unlock(&data->gdbm_mutex);
+		return RLM_MODULE_FAIL;
+	}
+
+	num = counter_store_flush(data->store, counter_write, data);
+	pthread_mutex_unlock(&data->gdbm_mutex);
+
+	if (num < 0) return RLM_MODULE_FAIL;
+
+	if (num > 0) DEBUG2("rlm_counter: Wrote %d counters to %s",
+			    num, data->db_name);
+
+	return RLM_MODULE_OK;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *checkpoint_thread(void *arg)
+{
+	rlm_counter_t *data = arg;
+	struct timeval now;
+	struct timespec when;
+
+	pthread_mutex_lock(&data->mutex);
+	while (data->thread_state == CHECKPOINT_THREAD_RUNNING) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + data->checkpoint_interval;
+		when.tv_nsec = now.tv_usec * 1000;
+
+		pthread_cond_timedwait(&data->cond, &data->mutex, &when);
+		if (data->thread_state != CHECKPOINT_THREAD_RUNNING) break;
+
+		pthread_mutex_unlock(&data->mutex);
+		counter_checkpoint(data);
+		pthread_mutex_lock(&data->mutex);
+	}
+	pthread_mutex_unlock(&data->mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Called after every request.  The server forks after the
+ *	modules are instantiated, so the checkpoint thread is started
+ *	by the first request, and not in instantiate.
+ *
+ *	Without threads, the request which notices that a checkpoint
+ *	is due does it.  With "checkpoint-interval = 0", every change
+ *	is written as it's made.
+ */
+static int checkpoint_due(rlm_counter_t *data, time_t now)
+{
+	if (data->checkpoint_interval == 0) {
+		return counter_checkpoint(data);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (data->thread_state == CHECKPOINT_THREAD_NONE) {
+		pthread_mutex_lock(&data->mutex);
+		if (data->thread_state == CHECKPOINT_THREAD_NONE) {
+			data->thread_state = CHECKPOINT_THREAD_RUNNING;
+			if (pthread_create(&data->thread, NULL,
+					   checkpoint_thread, data) != 0) {
+				radlog(L_ERR, "rlm_counter: Failed to start checkpoint thread: %s",
+				       strerror(errno));
+				data->thread_state = CHECKPOINT_THREAD_FAILED;
+			}
+		}
+		pthread_mutex_unlock(&data->mutex);
+	}
+	if (data->thread_state != CHECKPOINT_THREAD_FAILED) {
+		return RLM_MODULE_OK;
+	}
+#endif
+
+	if (now < data->next_checkpoint) return RLM_MODULE_OK;
+	data->next_checkpoint = now + data->checkpoint_interval;
+
+	return counter_checkpoint(data);
+}
+
+/*
+ *	Read all of the counters into memory.  After this, the gdbm
+ *	file is only written to.
+ */
+static int counter_load(rlm_counter_t *data)
+{
+	int num = 0;
+	datum key_datum;
+	datum next_datum;
+	datum count_datum;
+	rad_counter counter;
+	const char *default1 = "DEFAULT1";
+	const char *default2 = "DEFAULT2";
+
+	key_datum = gdbm_firstkey(data->gdbm);
+	while (key_datum.dptr != NULL) {
+		if (!((key_datum.dsize == (int) strlen(default1)) &&
+		      (memcmp(key_datum.dptr, default1, key_datum.dsize) == 0)) &&
+		    !((key_datum.dsize == (int) strlen(default2)) &&
+		      (memcmp(key_datum.dptr, default2, key_datum.dsize) == 0))) {
+			count_datum = gdbm_fetch(data->gdbm, key_datum);
+			if (count_datum.dptr != NULL) {
+				memset(&counter, 0, sizeof(counter));
+				memcpy(&counter, count_datum.dptr,
+				       ((size_t) count_datum.dsize < sizeof(counter)) ?
+				       (size_t) count_datum.dsize : sizeof(counter));
+				free(count_datum.dptr);
+
+				if (counter_store_load(data->store,
+						       (uint8_t *) key_datum.dptr,
+						       key_datum.dsize,
+						       &counter) < 0) {
+					free(key_datum.dptr);
+					return -1;
+				}
+				num++;
+			}
+		}
+
+		next_datum = gdbm_nextkey(data->gdbm, key_datum);
+		free(key_datum.dptr);
+		key_datum = next_datum;
+	}
+
+	return num;
+}
+
 
 /*
  *	Do any per-module initialization that is separate to each
@@ -338,16 +543,35 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 	}
 	memset(data, 0, sizeof(*data));
 
+	pthread_mutex_init(&data->mutex, NULL);
+	pthread_mutex_init(&data->gdbm_mutex, NULL);
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_init(&data->cond, NULL);
+#endif
+
 	/*
 	 *	If the configuration parameters can't be parsed, then
 	 *	fail.
 	 */
 	if (cf_section_parse(conf, data, module_config) < 0) {
-		free(data);
+		counter_detach(data);
 		return -1;
 	}
 	cache_size = data->cache_size;
 
+	if (data->checkpoint_interval < 0) {
+		radlog(L_ERR, "rlm_counter: 'checkpoint-interval' must be zero or more.");
+		counter_detach(data);
+		return -1;
+	}
+
+	data->store = counter_store_create(data->num_shards);
+	if (!data->store) {
+		radlog(L_ERR, "rlm_counter: Out of memory");
+		counter_detach(data);
+		return -1;
+	}
+
 	/*
 	 *	Discover the attribute number of the key.
 	 */
@@ -433,11 +657,11 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 		counter_detach(data);
 		return -1;
 	}
-	dict_addattr(data->check_name, 0, PW_TYPE_INTEGER, -1, flags);
+	dict_addattr(data->check_name, -1, 0, PW_TYPE_INTEGER, flags);
 	dattr = dict_attrbyname(data->check_name);
 	if (dattr == NULL) {
 		radlog(L_ERR, "rlm_counter: Failed to create check attribute %s",
-				data->counter_name);
+				data->check_name);
 		counter_detach(data);
 		return -1;
 	}
@@ -479,6 +703,12 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 		counter_detach(data);
 		return -1;
 	}
+	data->db_name = strdup(data->filename);
+	if (!data->db_name) {
+		radlog(L_ERR, "rlm_counter: Out of memory");
+		counter_detach(data);
+		return -1;
+	}
 	data->gdbm = gdbm_open(data->filename, sizeof(int),
 			GDBM_WRCREAT | GDBM_COUNTER_OPTS, 0600, NULL);
 	if (data->gdbm == NULL) {
@@ -516,7 +746,7 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 		if (next_reset && next_reset <= now){
 
 			data->last_reset = now;
-			ret = reset_db(data);
+			ret = reset_db(data, data->reset_time, data->last_reset);
 			if (ret != RLM_MODULE_OK){
 				radlog(L_ERR, "rlm_counter: reset_db() failed");
 				counter_detach(data);
@@ -535,7 +765,7 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 		}
 	}
 	else{
-		ret = add_defaults(data);
+		ret = add_defaults(data, data->reset_time, data->last_reset);
 		if (ret != RLM_MODULE_OK){
 			radlog(L_ERR, "rlm_counter: add_defaults() failed");
 			counter_detach(data);
@@ -544,34 +774,110 @@ static int counter_instantiate(CONF_SECTION *conf, void **instance)
 	}
 
 
+	ret = counter_load(data);
+	if (ret < 0) {
+		radlog(L_ERR, "rlm_counter: Failed reading counters from %s",
+				data->filename);
+		counter_detach(data);
+		return -1;
+	}
+	DEBUG2("rlm_counter: Read %d counters from %s", ret, data->filename);
+	data->next_checkpoint = now + data->checkpoint_interval;
+
 	/*
 	 *	Register the counter comparison operation.
 	 */
 	paircompare_register(data->dict_attr, 0, counter_cmp, data);
 
-	/*
-	 * Init the mutex
-	 */
-	pthread_mutex_init(&data->mutex, NULL);
-
 	*instance = data;
 
 	return 0;
 }
 
+typedef struct counter_update_t {
+	rlm_counter_t	*data;
+	REQUEST		*request;
+	VALUE_PAIR	*count_vp;
+	VALUE_PAIR	*uniqueid_vp;
+} counter_update_t;
+
+/*
+ *	Add this packet to the counter.  This is called with the
+ *	counter locked, so nothing else can change it under us.
+ */
+static int counter_add(void *ctx, rad_counter *counter, int found)
+{
+	counter_update_t *update = ctx;
+	rlm_counter_t *data = update->data;
+	REQUEST *request = update->request;
+	VALUE_PAIR *count_vp = update->count_vp;
+	VALUE_PAIR *uniqueid_vp = update->uniqueid_vp;
+	time_t diff;
+
+	if (!found){
+		DEBUG("rlm_counter: Could not find the requested key in the database.");
+		if (uniqueid_vp != NULL)
+			strlcpy(counter->uniqueid,uniqueid_vp->vp_strvalue,
+				sizeof(counter->uniqueid));
+	}
+	else{
+		DEBUG("rlm_counter: Key found.");
+		DEBUG("rlm_counter: Counter Unique ID = '%s'",counter->uniqueid);
+		if (uniqueid_vp != NULL){
+			if (strncmp(uniqueid_vp->vp_strvalue,counter->uniqueid, UNIQUEID_MAX_LEN - 1) == 0){
+				DEBUG("rlm_counter: Unique IDs for user match. Droping the request.");
+				return -1;
+			}
+			strlcpy(counter->uniqueid,uniqueid_vp->vp_strvalue,
+				sizeof(counter->uniqueid));
+		}
+		DEBUG("rlm_counter: User=%s, Counter=%d.",request->username->vp_strvalue,counter->user_counter);
+	}
+
+	if (data->count_attr == PW_ACCT_SESSION_TIME) {
+		/*
+		 *	If session time < diff then the user got in after the
+		 *	last reset. So add his session time, otherwise add the
+		 *	diff.
+		 *
+		 *	That way if he logged in at 23:00 and we reset the
+		 *	daily counter at 24:00 and he logged out at 01:00
+		 *	then we will only count one hour (the one in the new
+		 *	day). That is the right thing
+		 */
+		diff = request->timestamp - data->last_reset;
+		counter->user_counter += (count_vp->vp_integer < diff) ? count_vp->vp_integer : diff;
+
+	} else if (count_vp->type == PW_TYPE_INTEGER) {
+		/*
+		 *	Integers get counted, without worrying about
+		 *	reset dates.
+		 */
+		counter->user_counter += count_vp->vp_integer;
+
+	} else {
+		/*
+		 *	The attribute is NOT an integer, just count once
+		 *	more that we've seen it.
+		 */
+		counter->user_counter++;
+	}
+
+	DEBUG("rlm_counter: User=%s, New Counter=%d.",request->username->vp_strvalue,counter->user_counter);
+
+	return 0;
+}
+
 /*
  *	Write accounting information to this modules database.
  */
 static int counter_accounting(void *instance, REQUEST *request)
 {
 	rlm_counter_t *data = (rlm_counter_t *)instance;
-	datum key_datum;
-	datum count_datum;
 	VALUE_PAIR *key_vp, *count_vp, *proto_vp, *uniqueid_vp;
-	rad_counter counter;
+	counter_update_t update;
 	int rcode;
 	int acctstatustype = 0;
-	time_t diff;
 
 	if ((key_vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0)) != NULL)
 		acctstatustype = key_vp->vp_integer;
@@ -591,18 +897,8 @@ static int counter_accounting(void *instance, REQUEST *request)
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
 	 */
-	if (data->reset_time && (data->reset_time <= request->timestamp)) {
-		int ret;
+	reset_check(data, request->timestamp);
 
-		DEBUG("rlm_counter: Time to reset the database.");
-		data->last_reset = data->reset_time;
-		find_next_reset(data,request->timestamp);
-		pthread_mutex_lock(&data->mutex);
-		ret = reset_db(data);
-		pthread_mutex_unlock(&data->mutex);
-		if (ret != RLM_MODULE_OK)
-			return ret;
-	}
 	/*
 	 * Check if we need to watch out for a specific service-type. If yes then check it
 	 */
@@ -650,80 +946,22 @@ static int counter_accounting(void *instance, REQUEST *request)
 		return RLM_MODULE_NOOP;
 	}
 
-	key_datum.dptr = key_vp->vp_strvalue;
-	key_datum.dsize = key_vp->length;
+	update.data = data;
+	update.request = request;
+	update.count_vp = count_vp;
+	update.uniqueid_vp = uniqueid_vp;
 
 	DEBUG("rlm_counter: Searching the database for key '%s'",key_vp->vp_strvalue);
-	pthread_mutex_lock(&data->mutex);
-	count_datum = gdbm_fetch(data->gdbm, key_datum);
-	pthread_mutex_unlock(&data->mutex);
-	if (count_datum.dptr == NULL){
-		DEBUG("rlm_counter: Could not find the requested key in the database.");
-		counter.user_counter = 0;
-		if (uniqueid_vp != NULL)
-			strlcpy(counter.uniqueid,uniqueid_vp->vp_strvalue,
-				sizeof(counter.uniqueid));
-		else
-			memset((char *)counter.uniqueid,0,UNIQUEID_MAX_LEN);
-	}
-	else{
-		DEBUG("rlm_counter: Key found.");
-		memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-		free(count_datum.dptr);
-		if (counter.uniqueid)
-			DEBUG("rlm_counter: Counter Unique ID = '%s'",counter.uniqueid);
-		if (uniqueid_vp != NULL){
-			if (counter.uniqueid != NULL &&
-				strncmp(uniqueid_vp->vp_strvalue,counter.uniqueid, UNIQUEID_MAX_LEN - 1) == 0){
-				DEBUG("rlm_counter: Unique IDs for user match. Droping the request.");
-				return RLM_MODULE_NOOP;
-			}
-			strlcpy(counter.uniqueid,uniqueid_vp->vp_strvalue,
-				sizeof(counter.uniqueid));
-		}
-		DEBUG("rlm_counter: User=%s, Counter=%d.",request->username->vp_strvalue,counter.user_counter);
-	}
-
-	if (data->count_attr == PW_ACCT_SESSION_TIME) {
-		/*
-		 *	If session time < diff then the user got in after the
-		 *	last reset. So add his session time, otherwise add the
-		 *	diff.
-		 *
-		 *	That way if he logged in at 23:00 and we reset the
-		 *	daily counter at 24:00 and he logged out at 01:00
-		 *	then we will only count one hour (the one in the new
-		 *	day). That is the right thing
-		 */
-		diff = request->timestamp - data->last_reset;
-		counter.user_counter += (count_vp->vp_integer < diff) ? count_vp->vp_integer : diff;
-
-	} else if (count_vp->type == PW_TYPE_INTEGER) {
-		/*
-		 *	Integers get counted, without worrying about
-		 *	reset dates.
-		 */
-		counter.user_counter += count_vp->vp_integer;
-
-	} else {
-		/*
-		 *	The attribute is NOT an integer, just count once
-		 *	more that we've seen it.
-		 */
-		counter.user_counter++;
+	rcode = counter_store_update(data->store, key_vp->vp_octets,
+				     key_vp->length, counter_add, &update);
+	if (rcode < 0) {
+		radlog(L_ERR, "rlm_counter: Failed storing counter for key '%s'",
+				key_vp->vp_strvalue);
+		return RLM_MODULE_FAIL;
 	}
+	if (rcode == 0) return RLM_MODULE_NOOP;
 
-	DEBUG("rlm_counter: User=%s, New Counter=%d.",request->username->vp_strvalue,counter.user_counter);
-	count_datum.dptr = (char *) &counter;
-	count_datum.dsize = sizeof(rad_counter);
-
-	DEBUG("rlm_counter: Storing new value in database.");
-	pthread_mutex_lock(&data->mutex);
-	rcode = gdbm_store(data->gdbm, key_datum, count_datum, GDBM_REPLACE);
-	pthread_mutex_unlock(&data->mutex);
-	if (rcode < 0) {
-		radlog(L_ERR, "rlm_counter: Failed storing data to %s: %s",
-				data->filename, gdbm_strerror(gdbm_errno));
+	if (checkpoint_due(data, request->timestamp) != RLM_MODULE_OK) {
 		return RLM_MODULE_FAIL;
 	}
 	DEBUG("rlm_counter: New value stored successfully.");
@@ -741,8 +979,6 @@ static int counter_authorize(void *instance, REQUEST *request)
 {
 	rlm_counter_t *data = (rlm_counter_t *) instance;
 	int ret=RLM_MODULE_NOOP;
-	datum key_datum;
-	datum count_datum;
 	rad_counter counter;
 	int res=0;
 	VALUE_PAIR *key_vp, *check_vp;
@@ -757,17 +993,7 @@ static int counter_authorize(void *instance, REQUEST *request)
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
 	 */
-	if (data->reset_time && (data->reset_time <= request->timestamp)) {
-		int ret2;
-
-		data->last_reset = data->reset_time;
-		find_next_reset(data,request->timestamp);
-		pthread_mutex_lock(&data->mutex);
-		ret2 = reset_db(data);
-		pthread_mutex_unlock(&data->mutex);
-		if (ret2 != RLM_MODULE_OK)
-			return ret2;
-	}
+	reset_check(data, request->timestamp);
 
 
 	/*
@@ -789,10 +1015,6 @@ static int counter_authorize(void *instance, REQUEST *request)
 		return ret;
 	}
 
-	key_datum.dptr = key_vp->vp_strvalue;
-	key_datum.dsize = key_vp->length;
-
-
 	/*
 	 * Init to be sure
 	 */
@@ -800,13 +1022,9 @@ static int counter_authorize(void *instance, REQUEST *request)
 	counter.user_counter = 0;
 
 	DEBUG("rlm_counter: Searching the database for key '%s'",key_vp->vp_strvalue);
-	pthread_mutex_lock(&data->mutex);
-	count_datum = gdbm_fetch(data->gdbm, key_datum);
-	pthread_mutex_unlock(&data->mutex);
-	if (count_datum.dptr != NULL){
+	if (counter_store_fetch(data->store, key_vp->vp_octets,
+				key_vp->length, &counter)) {
 		DEBUG("rlm_counter: Key Found.");
-		memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-		free(count_datum.dptr);
 	}
 	else
 		DEBUG("rlm_counter: Could not find the requested key in the database.");
@@ -905,9 +1123,36 @@ static int counter_detach(void *instance)
 	rlm_counter_t *data = (rlm_counter_t *) instance;
 
 	paircompare_unregister(data->dict_attr, counter_cmp);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&data->mutex);
+	if (data->thread_state == CHECKPOINT_THREAD_RUNNING) {
+		data->thread_state = CHECKPOINT_THREAD_STOPPING;
+		pthread_cond_signal(&data->cond);
+		pthread_mutex_unlock(&data->mutex);
+		pthread_join(data->thread, NULL);
+	} else {
+		pthread_mutex_unlock(&data->mutex);
+	}
+#endif
+
+	/*
+	 *	Write out anything which changed since the last
+	 *	checkpoint.
+	 */
+	if (data->store && data->gdbm) {
+		counter_checkpoint(data);
+	}
+
 	if (data->gdbm)
 		gdbm_close(data->gdbm);
+	counter_store_free(data->store);
+	free(data->db_name);
 	pthread_mutex_destroy(&data->mutex);
+	pthread_mutex_destroy(&data->gdbm_mutex);
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&data->cond);
+#endif
 
 	free(instance);
 	return 0;
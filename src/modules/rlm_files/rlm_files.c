@@ -578,7 +578,7 @@ static int file_postauth(void *instance, REQUEST *request)
 module_t rlm_files = {
 	RLM_MODULE_INIT,
 	"files",
-	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE | RLM_TYPE_HUP_BACKGROUND,
 	file_instantiate,		/* instantiation */
 	file_detach,			/* detach */
 	{
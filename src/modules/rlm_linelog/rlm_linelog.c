@@ -31,6 +31,9 @@ RCSID("$Id$")
 #include <fcntl.h>
 #endif
 
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
 
@@ -39,6 +42,40 @@ RCSID("$Id$")
 #endif
 #endif
 
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#define LINELOG_DEST_FILE	(0)
+#define LINELOG_DEST_SYSLOG	(1)
+#define LINELOG_DEST_UNIX	(2)
+
+#define WRITER_THREAD_NONE	(0)
+#define WRITER_THREAD_RUNNING	(1)
+#define WRITER_THREAD_FAILED	(2)
+#define WRITER_THREAD_STOPPING	(3)
+
+/*
+ *	Each line in the buffer is one of these, followed by the
+ *	expanded filename, and then the line, with its "\n".
+ */
+typedef struct linelog_record_t {
+	uint16_t	name_len;
+	uint16_t	line_len;
+} linelog_record_t;
+
+/*
+ *	The files which the writer thread has open.
+ */
+#define WRITER_MAX_FDS (16)
+
+typedef struct linelog_fd_t {
+	int		fd;
+	char		*name;
+	time_t		checked;	/* for rotation */
+	uint64_t	used;		/* for re-using the entry */
+} linelog_fd_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -48,6 +85,44 @@ typedef struct rlm_linelog_t {
 	int		permissions;
 	char		*line;
 	char		*reference;
+	int		buffered;
+	int		buffer_size;
+	char		*overflow;
+
+	int		dest;
+	int		block;
+#ifdef HAVE_SYS_UN_H
+	int		sockfd;
+	struct sockaddr_un sockaddr;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Requests append to buffer[current], and the writer
+	 *	thread swaps the buffers and writes out the full one.
+	 */
+	pthread_mutex_t	mutex;
+	pthread_cond_t	data_ready;
+	pthread_cond_t	space_ready;
+	pthread_t	thread;
+	int		thread_state;
+	char		*buffer[2];
+	int		current;
+	size_t		used;
+
+	/*
+	 *	Only touched by the writer thread.
+	 */
+	linelog_fd_t	fds[WRITER_MAX_FDS];
+	uint64_t	fd_uses;
+	char		*name;		/* for messages */
+
+	uint64_t	written;
+	uint64_t	dropped;
+	uint64_t	blocked;
+	uint64_t	errors;
+	uint64_t	dropped_reported;
+#endif
 } rlm_linelog_t;
 
 /*
@@ -68,13 +143,347 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(rlm_linelog_t,line), NULL,  NULL},
 	{ "reference",  PW_TYPE_STRING_PTR,
 	  offsetof(rlm_linelog_t,reference), NULL,  NULL},
+	{ "buffered",  PW_TYPE_BOOLEAN,
+	  offsetof(rlm_linelog_t,buffered), NULL,  "no"},
+	{ "buffer_size",  PW_TYPE_INTEGER,
+	  offsetof(rlm_linelog_t,buffer_size), NULL,  "1048576"},
+	{ "overflow",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_linelog_t,overflow), NULL,  "drop"},
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
 
+#ifdef HAVE_SYS_UN_H
+/*
+ *	Send one line to a UNIX datagram socket.  If nothing is
+ *	listening, or it's too slow, the line is lost.
+ */
+static int linelog_send(rlm_linelog_t *inst, const char *line, size_t len)
+{
+	if (sendto(inst->sockfd, line, len, MSG_DONTWAIT,
+		   (struct sockaddr *) &inst->sockaddr,
+		   sizeof(inst->sockaddr)) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Return an open descriptor for the file.  The most recently
+ *	used files are kept open, and at most once a second we check
+ *	that each one hasn't been rotated away from under us.
+ */
+static int writer_open(rlm_linelog_t *inst, char *filename)
+{
+	int i;
+	char *p;
+	time_t now;
+	struct stat st_fd, st_name;
+	linelog_fd_t *lf = NULL;
+
+	for (i = 0; i < WRITER_MAX_FDS; i++) {
+		if ((inst->fds[i].fd >= 0) &&
+		    (strcmp(filename, inst->fds[i].name) == 0)) {
+			lf = &inst->fds[i];
+			break;
+		}
+
+		/*
+		 *	Otherwise use a free entry (used == 0), or the
+		 *	least recently used one.
+		 */
+		if (!lf || (inst->fds[i].used < lf->used)) lf = &inst->fds[i];
+	}
+
+	if ((lf->fd >= 0) && (strcmp(filename, lf->name) == 0)) {
+		lf->used = ++inst->fd_uses;
+
+		now = time(NULL);
+		if (now == lf->checked) return lf->fd;
+		lf->checked = now;
+
+		if ((fstat(lf->fd, &st_fd) == 0) &&
+		    (stat(filename, &st_name) == 0) &&
+		    (st_fd.st_dev == st_name.st_dev) &&
+		    (st_fd.st_ino == st_name.st_ino)) {
+			return lf->fd;
+		}
+
+		DEBUG2("rlm_linelog: %s was rotated, re-opening it", filename);
+	}
+
+	if (lf->fd >= 0) close(lf->fd);
+	lf->fd = -1;
+	free(lf->name);
+	lf->name = NULL;
+	lf->used = 0;
+
+	/* check path and eventually create subdirs */
+	p = strrchr(filename, '/');
+	if (p) {
+		*p = '\0';
+		if (rad_mkdir(filename, 0700) < 0) {
+			radlog(L_ERR, "rlm_linelog: Failed to create directory %s: %s",
+			       filename, strerror(errno));
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	lf->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT,
+		      inst->permissions);
+	if (lf->fd < 0) {
+		radlog(L_ERR, "rlm_linelog: Failed to open %s: %s",
+		       filename, strerror(errno));
+		return -1;
+	}
+
+	lf->name = strdup(filename);
+	lf->checked = time(NULL);
+	lf->used = ++inst->fd_uses;
+
+	return lf->fd;
+}
+
+/*
+ *	Write out a full buffer.  Consecutive lines for the same file
+ *	go out in one writev().
+ */
+#define WRITER_IOV (64)
+
+static void writer_flush(rlm_linelog_t *inst, char *buffer, size_t len)
+{
+	int fd, num;
+	size_t total;
+	ssize_t rcode;
+	char *p, *end, *name, *line;
+	linelog_record_t rec;
+	struct iovec iov[WRITER_IOV];
+
+	p = buffer;
+	end = buffer + len;
+	while (p < end) {
+		memcpy(&rec, p, sizeof(rec));
+		name = p + sizeof(rec);
+		line = name + rec.name_len + 1;
+
+		if (inst->dest != LINELOG_DEST_FILE) {
+			p = line + rec.line_len;
+#ifdef HAVE_SYS_UN_H
+			if (inst->dest == LINELOG_DEST_UNIX) {
+				if (linelog_send(inst, line, rec.line_len - 1) < 0) {
+					inst->errors++;
+					continue;
+				}
+			}
+#endif
+#ifdef HAVE_SYSLOG_H
+			if (inst->dest == LINELOG_DEST_SYSLOG) {
+				syslog(LOG_INFO, "%.*s", rec.line_len - 1, line);
+			}
+#endif
+			inst->written++;
+			continue;
+		}
+
+		fd = writer_open(inst, name);
+
+		/*
+		 *	Gather all of the following lines for this file.
+		 */
+		num = 0;
+		total = 0;
+		while (1) {
+			iov[num].iov_base = line;
+			iov[num].iov_len = rec.line_len;
+			total += rec.line_len;
+			num++;
+			p = line + rec.line_len;
+
+			if ((p >= end) || (num == WRITER_IOV)) break;
+
+			memcpy(&rec, p, sizeof(rec));
+			if (strcmp(p + sizeof(rec), name) != 0) break;
+			line = p + sizeof(rec) + rec.name_len + 1;
+		}
+
+		if (fd < 0) {
+			inst->errors += num;
+			continue;
+		}
+
+		rcode = writev(fd, iov, num);
+		if ((rcode < 0) || ((size_t) rcode != total)) {
+			radlog(L_ERR, "rlm_linelog: Failed writing to %s: %s",
+			       name, (rcode < 0) ? strerror(errno) : "short write");
+			inst->errors += num;
+			continue;
+		}
+		inst->written += num;
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	rlm_linelog_t *inst = arg;
+	char *buffer;
+	size_t len;
+	uint64_t dropped;
+	struct timeval now;
+	struct timespec when;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (1) {
+		while ((inst->used == 0) &&
+		       (inst->thread_state == WRITER_THREAD_RUNNING)) {
+			gettimeofday(&now, NULL);
+			when.tv_sec = now.tv_sec + 1;
+			when.tv_nsec = now.tv_usec * 1000;
+
+			pthread_cond_timedwait(&inst->data_ready, &inst->mutex,
+					       &when);
+		}
+
+		/*
+		 *	Tell the administrator if lines are being lost,
+		 *	but not more than once a second.
+		 */
+		dropped = inst->dropped - inst->dropped_reported;
+		inst->dropped_reported = inst->dropped;
+		if (dropped) {
+			radlog(L_ERR, "rlm_linelog (%s): Buffer is full: dropped %" PRIu64 " lines",
+			       inst->name, dropped);
+		}
+
+		if (inst->used == 0) break; /* and we're stopping */
+
+		buffer = inst->buffer[inst->current];
+		len = inst->used;
+		inst->current ^= 1;
+		inst->used = 0;
+		pthread_cond_broadcast(&inst->space_ready);
+		pthread_mutex_unlock(&inst->mutex);
+
+		writer_flush(inst, buffer, len);
+
+		pthread_mutex_lock(&inst->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+
+/*
+ *	Copy the line into the buffer, for the writer thread.  The
+ *	thread is started by the first request, as the server forks
+ *	after the modules are instantiated.
+ */
+static int linelog_enqueue(rlm_linelog_t *inst, REQUEST *request,
+			   const char *filename, const char *line)
+{
+	size_t name_len, line_len, need;
+	linelog_record_t rec;
+	char *p;
+
+	name_len = strlen(filename);
+	line_len = strlen(line) + 1;
+	need = sizeof(rec) + name_len + 1 + line_len;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->thread_state == WRITER_THREAD_NONE) {
+		inst->thread_state = WRITER_THREAD_RUNNING;
+		if (pthread_create(&inst->thread, NULL,
+				   writer_thread, inst) != 0) {
+			radlog(L_ERR, "rlm_linelog: Failed to start writer thread: %s",
+			       strerror(errno));
+			inst->thread_state = WRITER_THREAD_FAILED;
+		}
+	}
+
+	if (inst->thread_state != WRITER_THREAD_RUNNING) {
+		pthread_mutex_unlock(&inst->mutex);
+		return -1;
+	}
+
+	while (inst->used + need > (size_t) inst->buffer_size) {
+		if (!inst->block || (need > (size_t) inst->buffer_size)) {
+			inst->dropped++;
+			pthread_mutex_unlock(&inst->mutex);
+			RDEBUG2("Log buffer is full: dropping the line");
+			return 0;
+		}
+
+		inst->blocked++;
+		pthread_cond_wait(&inst->space_ready, &inst->mutex);
+		if (inst->thread_state != WRITER_THREAD_RUNNING) {
+			pthread_mutex_unlock(&inst->mutex);
+			return -1;
+		}
+	}
+
+	rec.name_len = name_len;
+	rec.line_len = line_len;
+
+	p = inst->buffer[inst->current] + inst->used;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, filename, name_len + 1);
+	p += name_len + 1;
+	memcpy(p, line, line_len - 1);
+	p[line_len - 1] = '\n';
+
+	if (inst->used == 0) pthread_cond_signal(&inst->data_ready);
+	inst->used += need;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+#endif
+
 static int linelog_detach(void *instance)
 {
 	rlm_linelog_t *inst = instance;
+#ifdef HAVE_PTHREAD_H
+	int i;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->buffered) {
+		pthread_mutex_lock(&inst->mutex);
+		if (inst->thread_state == WRITER_THREAD_RUNNING) {
+			inst->thread_state = WRITER_THREAD_STOPPING;
+			pthread_cond_signal(&inst->data_ready);
+			pthread_cond_broadcast(&inst->space_ready);
+			pthread_mutex_unlock(&inst->mutex);
+			pthread_join(inst->thread, NULL);
+		} else {
+			pthread_mutex_unlock(&inst->mutex);
+		}
+
+		DEBUG2("rlm_linelog (%s): %" PRIu64 " lines written, %" PRIu64 " dropped, %" PRIu64 " waited for space, %" PRIu64 " errors",
+		       inst->name, inst->written, inst->dropped,
+		       inst->blocked, inst->errors);
+
+		for (i = 0; i < WRITER_MAX_FDS; i++) {
+			if (inst->fds[i].fd >= 0) close(inst->fds[i].fd);
+			free(inst->fds[i].name);
+		}
+		free(inst->name);
+		free(inst->buffer[0]);
+		free(inst->buffer[1]);
+		pthread_mutex_destroy(&inst->mutex);
+		pthread_cond_destroy(&inst->data_ready);
+		pthread_cond_destroy(&inst->space_ready);
+	}
+#endif
+
+#ifdef HAVE_SYS_UN_H
+	if (inst->sockfd >= 0) close(inst->sockfd);
+#endif
 
 	free(inst);
 	return 0;
@@ -85,6 +494,10 @@ static int linelog_detach(void *instance)
  */
 static int linelog_instantiate(CONF_SECTION *conf, void **instance)
 {
+	int buffered;
+#ifdef HAVE_PTHREAD_H
+	int i;
+#endif
 	rlm_linelog_t *inst;
 
 	/*
@@ -92,29 +505,85 @@ static int linelog_instantiate(CONF_SECTION *conf, void **instance)
 	 */
 	inst = rad_malloc(sizeof(*inst));
 	memset(inst, 0, sizeof(*inst));
+#ifdef HAVE_SYS_UN_H
+	inst->sockfd = -1;
+#endif
 
 	/*
 	 *	If the configuration parameters can't be parsed, then
 	 *	fail.
 	 */
 	if (cf_section_parse(conf, inst, module_config) < 0) {
+		inst->buffered = 0;
 		linelog_detach(inst);
 		return -1;
 	}
 
+#ifndef HAVE_PTHREAD_H
+	if (inst->buffered) {
+		radlog(L_INFO, "rlm_linelog: No thread support: ignoring \"buffered = yes\"");
+	}
+#endif
+	/*
+	 *	Nothing below needs undoing until the buffers exist.
+	 */
+	buffered = inst->buffered;
+	inst->buffered = 0;
+
 	if (!inst->filename) {
 		radlog(L_ERR, "rlm_linelog: Must specify an output filename");
 		linelog_detach(inst);
 		return -1;
 	}
 
-#ifndef HAVE_SYSLOG_H
 	if (strcmp(inst->filename, "syslog") == 0) {
+#ifndef HAVE_SYSLOG_H
 		radlog(L_ERR, "rlm_linelog: Syslog output is not supported");
 		linelog_detach(inst);
 		return -1;
-	}
 #endif
+		inst->dest = LINELOG_DEST_SYSLOG;
+
+	} else if (strncmp(inst->filename, "unix:", 5) == 0) {
+#ifdef HAVE_SYS_UN_H
+		const char *path = inst->filename + 5;
+
+		if (strlen(path) >= sizeof(inst->sockaddr.sun_path)) {
+			radlog(L_ERR, "rlm_linelog: Socket path is too long: %s",
+			       path);
+			linelog_detach(inst);
+			return -1;
+		}
+
+		inst->sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (inst->sockfd < 0) {
+			radlog(L_ERR, "rlm_linelog: Failed creating socket: %s",
+			       strerror(errno));
+			linelog_detach(inst);
+			return -1;
+		}
+		inst->sockaddr.sun_family = AF_UNIX;
+		strlcpy(inst->sockaddr.sun_path, path,
+			sizeof(inst->sockaddr.sun_path));
+
+		inst->dest = LINELOG_DEST_UNIX;
+#else
+		radlog(L_ERR, "rlm_linelog: UNIX socket output is not supported");
+		linelog_detach(inst);
+		return -1;
+#endif
+	}
+
+	if (strcmp(inst->overflow, "drop") == 0) {
+		inst->block = 0;
+	} else if (strcmp(inst->overflow, "block") == 0) {
+		inst->block = 1;
+	} else {
+		radlog(L_ERR, "rlm_linelog: Invalid value \"%s\" for overflow.  It must be \"drop\" or \"block\"",
+		       inst->overflow);
+		linelog_detach(inst);
+		return -1;
+	}
 
 	if (!inst->line) {
 		radlog(L_ERR, "rlm_linelog: Must specify a log format");
@@ -122,6 +591,34 @@ static int linelog_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (buffered) {
+		/*
+		 *	The longest line, plus its filename.
+		 */
+		if (inst->buffer_size < 8192) inst->buffer_size = 8192;
+
+		/*
+		 *	The configuration strings are freed before
+		 *	we're detached, and the thread may still be
+		 *	running then.
+		 */
+		inst->name = strdup(cf_section_name2(conf) ?
+				    cf_section_name2(conf) :
+				    cf_section_name1(conf));
+
+		inst->buffer[0] = rad_malloc(inst->buffer_size);
+		inst->buffer[1] = rad_malloc(inst->buffer_size);
+		for (i = 0; i < WRITER_MAX_FDS; i++) {
+			inst->fds[i].fd = -1;
+		}
+		pthread_mutex_init(&inst->mutex, NULL);
+		pthread_cond_init(&inst->data_ready, NULL);
+		pthread_cond_init(&inst->space_ready, NULL);
+		inst->buffered = 1;
+	}
+#endif
+
 	inst->cs = conf;
 	*instance = inst;
 
@@ -193,7 +690,7 @@ static size_t linelog_escape_func(char *out, size_t outlen, const char *in)
 static int do_linelog(void *instance, REQUEST *request)
 {
 	int fd = -1;
-	char buffer[4096];
+	char buffer[4096] = "";
 	char *p;
 	char line[1024];
 	rlm_linelog_t *inst = (rlm_linelog_t*) instance;
@@ -240,10 +737,30 @@ static int do_linelog(void *instance, REQUEST *request)
 	/*
 	 *	FIXME: Check length.
 	 */
-	if (strcmp(inst->filename, "syslog") != 0) {
+	if (inst->dest == LINELOG_DEST_FILE) {
 		radius_xlat(buffer, sizeof(buffer), inst->filename, request,
 			    NULL);
-		
+	}
+
+	/*
+	 *	FIXME: Check length.
+	 */
+	radius_xlat(line, sizeof(line) - 1, value, request,
+		    linelog_escape_func);
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Hand it to the writer thread.  If that isn't running,
+	 *	write it ourselves.
+	 */
+	if (inst->buffered &&
+	    (linelog_enqueue(inst, request, buffer, line) == 0)) {
+		return RLM_MODULE_OK;
+	}
+#endif
+
+	switch (inst->dest) {
+	case LINELOG_DEST_FILE:
 		/* check path and eventually create subdirs */
 		p = strrchr(buffer,'/');
 		if (p) {
@@ -261,24 +778,31 @@ static int do_linelog(void *instance, REQUEST *request)
 			       buffer, strerror(errno));
 			return RLM_MODULE_FAIL;
 		}
-	}
 
-	/*
-	 *	FIXME: Check length.
-	 */
-	radius_xlat(line, sizeof(line) - 1, value, request,
-		    linelog_escape_func);
-
-	if (fd >= 0) {
 		strcat(line, "\n");
 		
 		write(fd, line, strlen(line));
 		close(fd);
+		break;
+
+#ifdef HAVE_SYS_UN_H
+	case LINELOG_DEST_UNIX:
+		if (linelog_send(inst, line, strlen(line)) < 0) {
+			RDEBUG2("Failed sending to %s: %s",
+				inst->filename, strerror(errno));
+			return RLM_MODULE_FAIL;
+		}
+		break;
+#endif
 
 #ifdef HAVE_SYSLOG_H
-	} else {
+	case LINELOG_DEST_SYSLOG:
 		syslog(LOG_INFO, "%s", line);
+		break;
 #endif
+
+	default:
+		break;
 	}
 
 	return RLM_MODULE_OK;
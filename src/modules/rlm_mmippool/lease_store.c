@@ -0,0 +1,912 @@
+/*
+ * lease_store.c	Memory-mapped, sharded store of IP address leases.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"lease_store.h"
+
+#include	<fcntl.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	<sys/time.h>
+
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_trylock(a) (0)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#endif
+
+/*
+ *	The file is a header, followed by one fixed-size record for
+ *	every address in the pool.  It's mapped shared, so every
+ *	change is in the page cache as soon as it's made, and
+ *	survives the server crashing.  Only the records are stored:
+ *	the hash tables and free lists are rebuilt when the file is
+ *	opened, so they can never disagree with it.
+ *
+ *	When a lease is allocated the state is written last, and
+ *	when it's released the state is written first, so a record
+ *	is either a complete lease, or free.
+ *
+ *	Active leases are kept in the hash table of the shard picked
+ *	by their key.  Free addresses are kept on per-shard lists.
+ *	When a shard runs out, it takes an address from another
+ *	shard, and the address stays with the new shard when it's
+ *	released.  So addresses drift to where they're needed.
+ */
+#define LEASE_MAGIC	(0x46524950)	/* "FRIP" */
+#define LEASE_VERSION	(1)
+
+#define LEASE_FREE	(0)
+#define LEASE_ACTIVE	(1)
+
+#define MAX_SHARDS	(256)
+#define NO_LEASE	(0xffffffff)
+
+typedef struct lease_header_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	range_start;
+	uint32_t	range_stop;
+	uint32_t	netmask;
+	uint32_t	num_leases;
+	uint32_t	record_size;
+	uint8_t		reserved[36];
+} lease_header_t;
+
+typedef struct lease_t {
+	uint32_t	ipaddr;		/* network byte order */
+	uint32_t	state;
+	uint8_t		key[LEASE_KEY_LEN];
+	uint32_t	nas;
+	uint32_t	reserved;
+	int64_t		allocated;
+	int64_t		expires;	/* 0 is "never" */
+	uint8_t		pad[16];
+} lease_t;
+
+typedef struct lease_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+	fr_hash_table_t	*ht;
+	uint32_t	free_head;
+	uint32_t	free_tail;
+
+	uint32_t	active;
+	uint64_t	allocations;
+	uint64_t	renewals;
+	uint64_t	releases;
+	uint64_t	failures;
+	uint64_t	alloc_usec;
+	uint32_t	alloc_usec_max;
+} lease_shard_t;
+
+struct lease_store_t {
+	int		fd;
+	size_t		size;
+	uint8_t		*map;
+	lease_t		*leases;
+	uint32_t	num_leases;
+	uint32_t	*next;		/* free lists */
+	int		num_shards;
+	int		shift;
+	lease_shard_t	*shards;
+};
+
+
+static uint32_t lease_hash(const void *data)
+{
+	const lease_t *lease = data;
+
+	return fr_hash(lease->key, sizeof(lease->key));
+}
+
+static int lease_cmp(const void *one, const void *two)
+{
+	const lease_t *a = one;
+	const lease_t *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+/*
+ *	The hash tables pick buckets with the low bits of the hash,
+ *	so we pick the shard with the high bits.
+ */
+static lease_shard_t *shard_find(lease_store_t *store, const lease_t *lease)
+{
+	if (store->num_shards == 1) return &store->shards[0];
+
+	return &store->shards[lease_hash(lease) >> store->shift];
+}
+
+static void free_push(lease_store_t *store, lease_shard_t *shard,
+		      uint32_t idx)
+{
+	store->next[idx] = NO_LEASE;
+	if (shard->free_tail == NO_LEASE) {
+		shard->free_head = idx;
+	} else {
+		store->next[shard->free_tail] = idx;
+	}
+	shard->free_tail = idx;
+}
+
+static uint32_t free_pop(lease_store_t *store, lease_shard_t *shard)
+{
+	uint32_t idx = shard->free_head;
+
+	if (idx == NO_LEASE) return NO_LEASE;
+
+	shard->free_head = store->next[idx];
+	if (shard->free_head == NO_LEASE) shard->free_tail = NO_LEASE;
+
+	return idx;
+}
+
+/*
+ *	Is this address usable?  The network and broadcast addresses
+ *	aren't, unless the netmask is all ones.  This is the same
+ *	rule as rlm_ippool.
+ */
+static int lease_usable(uint32_t ipaddr, uint32_t netmask)
+{
+	uint32_t or_result = ipaddr | netmask;
+
+	if ((~netmask != 0) &&
+	    ((or_result == netmask) || (~or_result == 0))) return 0;
+
+	return 1;
+}
+
+/*
+ *	Write a new file, with every address free.
+ */
+static int lease_store_create(const char *filename, uint32_t range_start,
+			      uint32_t range_stop, uint32_t netmask,
+			      char *errbuf, size_t errlen)
+{
+	int fd;
+	uint32_t i, num;
+	char tmpname[1024];
+	lease_header_t header;
+	lease_t lease;
+	FILE *fp;
+
+	num = 0;
+	for (i = range_start; i <= range_stop; i++) {
+		if (lease_usable(i, netmask)) num++;
+		if (i == 0xffffffff) break;
+	}
+
+	/*
+	 *	Everything else assumes that there's at least one
+	 *	address.
+	 */
+	if (num == 0) {
+		snprintf(errbuf, errlen, "The range has no usable addresses");
+		return -1;
+	}
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		snprintf(errbuf, errlen, "Failed creating %s: %s",
+			 tmpname, strerror(errno));
+		return -1;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		snprintf(errbuf, errlen, "Failed creating %s: %s",
+			 tmpname, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = LEASE_MAGIC;
+	header.version = LEASE_VERSION;
+	header.range_start = range_start;
+	header.range_stop = range_stop;
+	header.netmask = netmask;
+	header.num_leases = num;
+	header.record_size = sizeof(lease_t);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	memset(&lease, 0, sizeof(lease));
+	for (i = range_start; i <= range_stop; i++) {
+		if (lease_usable(i, netmask)) {
+			lease.ipaddr = htonl(i);
+			fwrite(&lease, sizeof(lease), 1, fp);
+		}
+		if (i == 0xffffffff) break;
+	}
+
+	if ((fflush(fp) != 0) || (fsync(fd) < 0) || ferror(fp)) {
+		snprintf(errbuf, errlen, "Failed writing %s: %s",
+			 tmpname, strerror(errno));
+		fclose(fp);
+		unlink(tmpname);
+		return -1;
+	}
+	fclose(fp);
+
+	if (rename(tmpname, filename) < 0) {
+		snprintf(errbuf, errlen, "Failed renaming %s to %s: %s",
+			 tmpname, filename, strerror(errno));
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+void lease_store_close(lease_store_t *store)
+{
+	int i;
+
+	if (!store) return;
+
+	if (store->shards) {
+		for (i = 0; i < store->num_shards; i++) {
+			if (store->shards[i].ht) {
+				fr_hash_table_free(store->shards[i].ht);
+			}
+			pthread_mutex_destroy(&store->shards[i].mutex);
+		}
+		free(store->shards);
+	}
+
+	if (store->map) {
+		msync(store->map, store->size, MS_SYNC);
+		munmap(store->map, store->size);
+	}
+	if (store->fd >= 0) close(store->fd);
+	free(store->next);
+	free(store);
+}
+
+/*
+ *	Open the file, creating it if it doesn't exist, and rebuild
+ *	the shards from it.
+ */
+lease_store_t *lease_store_open(const char *filename, uint32_t range_start,
+				uint32_t range_stop, uint32_t netmask,
+				int num_shards, char *errbuf, size_t errlen)
+{
+	int i;
+	uint32_t idx, ip;
+	time_t now;
+	struct stat st;
+	lease_header_t *header;
+	lease_t *lease;
+	lease_shard_t *shard;
+	lease_store_t *store;
+
+	if ((stat(filename, &st) < 0) && (errno == ENOENT)) {
+		if (lease_store_create(filename, range_start, range_stop,
+				       netmask, errbuf, errlen) < 0) {
+			return NULL;
+		}
+	}
+
+	store = malloc(sizeof(*store));
+	if (!store) {
+		snprintf(errbuf, errlen, "Out of memory");
+		return NULL;
+	}
+	memset(store, 0, sizeof(*store));
+
+	store->fd = open(filename, O_RDWR);
+	if (store->fd < 0) {
+		snprintf(errbuf, errlen, "Failed opening %s: %s",
+			 filename, strerror(errno));
+		goto error;
+	}
+
+	if (fstat(store->fd, &st) < 0) {
+		snprintf(errbuf, errlen, "Failed reading %s: %s",
+			 filename, strerror(errno));
+		goto error;
+	}
+
+	if ((size_t) st.st_size < sizeof(*header)) {
+		snprintf(errbuf, errlen, "%s is not a lease file", filename);
+		goto error;
+	}
+
+	store->size = st.st_size;
+	store->map = mmap(NULL, store->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, store->fd, 0);
+	if (store->map == MAP_FAILED) {
+		store->map = NULL;
+		snprintf(errbuf, errlen, "Failed mapping %s: %s",
+			 filename, strerror(errno));
+		goto error;
+	}
+
+	header = (lease_header_t *) store->map;
+	if ((header->magic != LEASE_MAGIC) ||
+	    (header->version != LEASE_VERSION) ||
+	    (header->record_size != sizeof(lease_t)) ||
+	    (store->size != (sizeof(*header) +
+			     ((size_t) header->num_leases * sizeof(lease_t))))) {
+		snprintf(errbuf, errlen, "%s is not a lease file, or is damaged",
+			 filename);
+		goto error;
+	}
+
+	if (header->num_leases == 0) {
+		snprintf(errbuf, errlen, "%s has no addresses.  Delete it, and restart",
+			 filename);
+		goto error;
+	}
+
+	if ((header->range_start != range_start) ||
+	    (header->range_stop != range_stop) ||
+	    (header->netmask != netmask)) {
+		snprintf(errbuf, errlen, "%s was created for a different range.  Delete it, and restart",
+			 filename);
+		goto error;
+	}
+
+	store->leases = (lease_t *) (store->map + sizeof(*header));
+	store->num_leases = header->num_leases;
+
+	store->next = malloc((store->num_leases + 1) * sizeof(store->next[0]));
+	if (!store->next) {
+		snprintf(errbuf, errlen, "Out of memory");
+		goto error;
+	}
+
+	/*
+	 *	Round the number of shards up to a power of two.
+	 */
+	if (num_shards < 1) num_shards = 1;
+	if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+	store->num_shards = 1;
+	store->shift = 32;
+	while (store->num_shards < num_shards) {
+		store->num_shards <<= 1;
+		store->shift--;
+	}
+
+	store->shards = malloc(store->num_shards * sizeof(store->shards[0]));
+	if (!store->shards) {
+		snprintf(errbuf, errlen, "Out of memory");
+		goto error;
+	}
+	memset(store->shards, 0, store->num_shards * sizeof(store->shards[0]));
+
+	for (i = 0; i < store->num_shards; i++) {
+		shard = &store->shards[i];
+		pthread_mutex_init(&shard->mutex, NULL);
+		shard->free_head = shard->free_tail = NO_LEASE;
+		shard->ht = fr_hash_table_create(lease_hash, lease_cmp, NULL);
+		if (!shard->ht) {
+			snprintf(errbuf, errlen, "Out of memory");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Check every record, and put it where it belongs.
+	 *	Anything odd, or expired, is freed.
+	 */
+	now = time(NULL);
+	ip = range_start;
+	for (idx = 0; idx < store->num_leases; idx++, ip++) {
+		while (!lease_usable(ip, netmask)) ip++;
+
+		lease = &store->leases[idx];
+		if (lease->ipaddr != htonl(ip)) {
+			snprintf(errbuf, errlen, "%s is damaged: record %u has the wrong address",
+				 filename, idx);
+			goto error;
+		}
+
+		if ((lease->state == LEASE_ACTIVE) &&
+		    ((lease->expires == 0) || (lease->expires > now))) {
+			shard = shard_find(store, lease);
+			if (fr_hash_table_insert(shard->ht, lease)) {
+				shard->active++;
+				continue;
+			}
+		}
+
+		lease->state = LEASE_FREE;
+		free_push(store, &store->shards[idx % store->num_shards], idx);
+	}
+
+	return store;
+
+ error:
+	lease_store_close(store);
+	return NULL;
+}
+
+int lease_store_sync(lease_store_t *store)
+{
+	return msync(store->map, store->size, MS_ASYNC);
+}
+
+typedef struct lease_walk_t {
+	time_t		now;
+	uint32_t	nas;
+	int		num;
+	int		max;
+	lease_t		**leases;
+} lease_walk_t;
+
+static int walk_expired(void *ctx, void *data)
+{
+	lease_walk_t *walk = ctx;
+	lease_t *lease = data;
+
+	if (lease->expires && (lease->expires <= walk->now)) {
+		walk->leases[walk->num++] = lease;
+		if (walk->num == walk->max) return 1;
+	}
+
+	return 0;
+}
+
+static int walk_nas(void *ctx, void *data)
+{
+	lease_walk_t *walk = ctx;
+	lease_t *lease = data;
+
+	if (lease->nas == walk->nas) {
+		walk->leases[walk->num++] = lease;
+		if (walk->num == walk->max) return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Called with the shard locked.
+ */
+static void lease_free(lease_store_t *store, lease_shard_t *shard,
+		       lease_t *lease)
+{
+	fr_hash_table_delete(shard->ht, lease);
+	lease->state = LEASE_FREE;
+	free_push(store, shard, lease - store->leases);
+	shard->active--;
+	shard->releases++;
+}
+
+/*
+ *	Called with the shard locked, when it has no free addresses.
+ */
+#define EXPIRE_BATCH (256)
+
+static uint32_t shard_expire(lease_store_t *store, lease_shard_t *shard,
+			     time_t now)
+{
+	int i;
+	lease_t *expired[EXPIRE_BATCH];
+	lease_walk_t walk;
+
+	walk.now = now;
+	walk.num = 0;
+	walk.max = EXPIRE_BATCH;
+	walk.leases = expired;
+
+	fr_hash_table_walk(shard->ht, walk_expired, &walk);
+
+	for (i = 0; i < walk.num; i++) {
+		lease_free(store, shard, expired[i]);
+	}
+
+	return free_pop(store, shard);
+}
+
+/*
+ *	Give the key an address.  If it already has one, the lease is
+ *	renewed, and the same address is returned.
+ *
+ *	Returns 1 for a renewal, 0 for a new lease, and -1 if there
+ *	are no free addresses.
+ */
+int lease_store_alloc(lease_store_t *store, const uint8_t *key,
+		      uint32_t nas, time_t now, time_t expires,
+		      uint32_t *ipaddr)
+{
+	int i, rcode;
+	uint32_t idx, usec;
+	struct timeval start, end;
+	lease_t my_lease, *lease;
+	lease_shard_t *shard, *other;
+
+	gettimeofday(&start, NULL);
+
+	memcpy(my_lease.key, key, sizeof(my_lease.key));
+	shard = shard_find(store, &my_lease);
+
+	pthread_mutex_lock(&shard->mutex);
+
+	lease = fr_hash_table_finddata(shard->ht, &my_lease);
+	if (lease) {
+		lease->nas = nas;
+		lease->allocated = now;
+		lease->expires = expires;
+		shard->renewals++;
+		rcode = 1;
+		goto done;
+	}
+
+	idx = free_pop(store, shard);
+	if (idx == NO_LEASE) idx = shard_expire(store, shard, now);
+
+	/*
+	 *	Take one from another shard.  We already hold a lock,
+	 *	so we can't wait for another one.
+	 */
+	for (i = 1; (idx == NO_LEASE) && (i < store->num_shards); i++) {
+		other = &store->shards[((shard - store->shards) + i) % store->num_shards];
+
+		if (pthread_mutex_trylock(&other->mutex) != 0) continue;
+
+		idx = free_pop(store, other);
+		if (idx == NO_LEASE) idx = shard_expire(store, other, now);
+
+		pthread_mutex_unlock(&other->mutex);
+	}
+
+	/*
+	 *	The others were all busy.  Drop our lock, and wait for
+	 *	each of them in turn.  We only ever hold one of them
+	 *	at a time, and always take them in index order.
+	 */
+	if ((idx == NO_LEASE) && (store->num_shards > 1)) {
+		pthread_mutex_unlock(&shard->mutex);
+
+		for (i = 0; (idx == NO_LEASE) && (i < store->num_shards); i++) {
+			other = &store->shards[i];
+			if (other == shard) continue;
+
+			pthread_mutex_lock(&other->mutex);
+
+			idx = free_pop(store, other);
+			if (idx == NO_LEASE) idx = shard_expire(store, other, now);
+
+			pthread_mutex_unlock(&other->mutex);
+		}
+
+		pthread_mutex_lock(&shard->mutex);
+
+		/*
+		 *	Things may have changed while we weren't
+		 *	holding the lock.  If the key was given an
+		 *	address in the meantime, keep that one, and
+		 *	put the one we took on our own free list.
+		 */
+		lease = fr_hash_table_finddata(shard->ht, &my_lease);
+		if (lease) {
+			if (idx != NO_LEASE) free_push(store, shard, idx);
+			lease->nas = nas;
+			lease->allocated = now;
+			lease->expires = expires;
+			shard->renewals++;
+			rcode = 1;
+			goto done;
+		}
+
+		if (idx == NO_LEASE) idx = free_pop(store, shard);
+	}
+
+	if (idx == NO_LEASE) {
+		shard->failures++;
+		pthread_mutex_unlock(&shard->mutex);
+		return -1;
+	}
+
+	lease = &store->leases[idx];
+	memcpy(lease->key, key, sizeof(lease->key));
+	lease->nas = nas;
+	lease->allocated = now;
+	lease->expires = expires;
+	lease->state = LEASE_ACTIVE;
+
+	fr_hash_table_insert(shard->ht, lease);
+	shard->active++;
+	shard->allocations++;
+	rcode = 0;
+
+ done:
+	*ipaddr = lease->ipaddr;
+
+	gettimeofday(&end, NULL);
+	usec = ((end.tv_sec - start.tv_sec) * 1000000) +
+		(end.tv_usec - start.tv_usec);
+	shard->alloc_usec += usec;
+	if (usec > shard->alloc_usec_max) shard->alloc_usec_max = usec;
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return rcode;
+}
+
+int lease_store_release(lease_store_t *store, const uint8_t *key,
+			uint32_t *ipaddr)
+{
+	lease_t my_lease, *lease;
+	lease_shard_t *shard;
+
+	memcpy(my_lease.key, key, sizeof(my_lease.key));
+	shard = shard_find(store, &my_lease);
+
+	pthread_mutex_lock(&shard->mutex);
+	lease = fr_hash_table_finddata(shard->ht, &my_lease);
+	if (!lease) {
+		pthread_mutex_unlock(&shard->mutex);
+		return -1;
+	}
+
+	if (ipaddr) *ipaddr = lease->ipaddr;
+	lease_free(store, shard, lease);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 0;
+}
+
+/*
+ *	Release every lease given out to a NAS, e.g. when it sends
+ *	Accounting-On after a reboot.  This is one pass over the
+ *	active leases, taking each shard's lock in turn.
+ *
+ *	Returns the number of leases released.
+ */
+int lease_store_release_nas(lease_store_t *store, uint32_t nas)
+{
+	int i, j, num = 0;
+	lease_walk_t walk;
+	lease_shard_t *shard;
+
+	walk.nas = nas;
+	for (i = 0; i < store->num_shards; i++) {
+		shard = &store->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		if (shard->active == 0) {
+			pthread_mutex_unlock(&shard->mutex);
+			continue;
+		}
+
+		walk.num = 0;
+		walk.max = shard->active;
+		walk.leases = malloc(walk.max * sizeof(walk.leases[0]));
+		if (!walk.leases) {
+			pthread_mutex_unlock(&shard->mutex);
+			return -1;
+		}
+
+		fr_hash_table_walk(shard->ht, walk_nas, &walk);
+		for (j = 0; j < walk.num; j++) {
+			lease_free(store, shard, walk.leases[j]);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		free(walk.leases);
+		num += walk.num;
+	}
+
+	return num;
+}
+
+void lease_store_stats(lease_store_t *store, lease_store_stats_t *stats)
+{
+	int i;
+	lease_shard_t *shard;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->total = store->num_leases;
+
+	for (i = 0; i < store->num_shards; i++) {
+		shard = &store->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		stats->active += shard->active;
+		stats->allocations += shard->allocations;
+		stats->renewals += shard->renewals;
+		stats->releases += shard->releases;
+		stats->failures += shard->failures;
+		stats->alloc_usec += shard->alloc_usec;
+		if (shard->alloc_usec_max > stats->alloc_usec_max) {
+			stats->alloc_usec_max = shard->alloc_usec_max;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../ lease_store.c ../../lib/.libs/libfreeradius-radius.a -lpthread -o lease_store
+ *
+ *  ./lease_store [num_threads] [operations per thread]
+ *
+ *  Simulates a NAS reboot: every thread allocates addresses for
+ *  its own subscribers as fast as it can, and releases some of
+ *  them, over a /16.
+ */
+#define BENCH_FILE "/tmp/lease_store.bench"
+
+typedef struct bench_t {
+	lease_store_t	*store;
+	int		num_ops;
+	int		id;
+	int		failed;
+} bench_t;
+
+static void bench_key(uint8_t *key, int id, int n)
+{
+	memset(key, 0, LEASE_KEY_LEN);
+	memcpy(key, &id, sizeof(id));
+	memcpy(key + sizeof(id), &n, sizeof(n));
+}
+
+static void *bench_thread(void *arg)
+{
+	int i;
+	uint32_t ipaddr;
+	uint8_t key[LEASE_KEY_LEN];
+	bench_t *b = arg;
+	time_t now = time(NULL);
+
+	for (i = 0; i < b->num_ops; i++) {
+		bench_key(key, b->id, i % 4096);
+
+		if ((i % 3) == 2) {
+			lease_store_release(b->store, key, NULL);
+			continue;
+		}
+
+		if (lease_store_alloc(b->store, key, b->id, now, 0,
+				      &ipaddr) < 0) {
+			b->failed++;
+		}
+	}
+
+	return NULL;
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, s, num_threads, num_ops, num;
+	static const int shards[] = { 1, 4, 16, 64, 0 };
+	uint32_t start = 0x0a000000, stop = 0x0a00ffff, mask = 0xffff0000;
+	char errbuf[1024];
+	double t;
+	struct timeval when;
+	pthread_t *tids;
+	bench_t *b;
+	lease_store_t *store;
+	lease_store_stats_t stats, after;
+
+	num_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	num_ops = (argc > 2) ? atoi(argv[2]) : 1000000;
+	if ((num_threads <= 0) || (num_ops <= 0)) {
+		fprintf(stderr, "usage: lease_store [num_threads] [num_ops]\n");
+		exit(1);
+	}
+
+	tids = malloc(num_threads * sizeof(tids[0]));
+	b = malloc(num_threads * sizeof(b[0]));
+
+	for (s = 0; shards[s] != 0; s++) {
+		unlink(BENCH_FILE);
+		store = lease_store_open(BENCH_FILE, start, stop, mask,
+					 shards[s], errbuf, sizeof(errbuf));
+		if (!store) {
+			fprintf(stderr, "%s\n", errbuf);
+			exit(1);
+		}
+
+		gettimeofday(&when, NULL);
+		for (i = 0; i < num_threads; i++) {
+			b[i].store = store;
+			b[i].num_ops = num_ops;
+			b[i].id = i + 1;
+			b[i].failed = 0;
+			pthread_create(&tids[i], NULL, bench_thread, &b[i]);
+		}
+		for (i = 0; i < num_threads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		t = elapsed(&when);
+
+		lease_store_stats(store, &stats);
+		printf("%3d shards: %10.0f ops/s, %u of %u in use, %.3f usec/alloc (max %u)\n",
+		       shards[s], (num_threads * (double) num_ops) / t,
+		       stats.active, stats.total,
+		       (double) stats.alloc_usec / (stats.allocations + stats.renewals),
+		       stats.alloc_usec_max);
+
+		/*
+		 *	Everything must come back after a restart.
+		 */
+		lease_store_close(store);
+		store = lease_store_open(BENCH_FILE, start, stop, mask,
+					 shards[s], errbuf, sizeof(errbuf));
+		if (!store) {
+			fprintf(stderr, "%s\n", errbuf);
+			exit(1);
+		}
+		lease_store_stats(store, &after);
+		if (after.active != stats.active) {
+			fprintf(stderr, "Lost leases on re-open: %u != %u\n",
+				after.active, stats.active);
+			exit(1);
+		}
+
+		/*
+		 *	And the NAS reboots.
+		 */
+		gettimeofday(&when, NULL);
+		num = 0;
+		for (i = 0; i < num_threads; i++) {
+			num += lease_store_release_nas(store, i + 1);
+		}
+		t = elapsed(&when);
+		lease_store_stats(store, &after);
+		if ((after.active != 0) || ((uint32_t) num != stats.active)) {
+			fprintf(stderr, "Bulk release left %u leases\n",
+				after.active);
+			exit(1);
+		}
+		printf("            released %d leases in %.3f ms\n",
+		       num, t * 1000);
+
+		lease_store_close(store);
+	}
+
+	unlink(BENCH_FILE);
+	free(tids);
+	free(b);
+
+	return 0;
+}
+#endif
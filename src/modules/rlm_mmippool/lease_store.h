@@ -0,0 +1,67 @@
+/*
+ * lease_store.h	Memory-mapped, sharded store of IP address leases.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _LEASE_STORE_H
+#define _LEASE_STORE_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(lease_store_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define LEASE_KEY_LEN (16)
+
+/*
+ *	The store does its own locking, one lock per shard.
+ */
+typedef struct lease_store_t lease_store_t;
+
+typedef struct lease_store_stats_t {
+	uint32_t	total;
+	uint32_t	active;
+	uint64_t	allocations;
+	uint64_t	renewals;
+	uint64_t	releases;
+	uint64_t	failures;
+	uint64_t	alloc_usec;	/* total, for the average */
+	uint32_t	alloc_usec_max;
+} lease_store_stats_t;
+
+/*
+ *	The range and netmask are in host byte order.  Addresses
+ *	returned are in network byte order, as in vp_ipaddr.
+ */
+lease_store_t *lease_store_open(const char *filename, uint32_t range_start,
+				uint32_t range_stop, uint32_t netmask,
+				int num_shards, char *errbuf, size_t errlen);
+void	lease_store_close(lease_store_t *store);
+int	lease_store_sync(lease_store_t *store);
+
+int	lease_store_alloc(lease_store_t *store, const uint8_t *key,
+			  uint32_t nas, time_t now, time_t expires,
+			  uint32_t *ipaddr);
+int	lease_store_release(lease_store_t *store, const uint8_t *key,
+			    uint32_t *ipaddr);
+int	lease_store_release_nas(lease_store_t *store, uint32_t nas);
+
+void	lease_store_stats(lease_store_t *store, lease_store_stats_t *stats);
+
+#endif /* _LEASE_STORE_H */
@@ -0,0 +1,414 @@
+/*
+ * rlm_mmippool.c	IP address pools in a memory-mapped file.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+#ifdef WITH_DHCP
+#include <freeradius-devel/dhcp.h>
+#endif
+
+#include "../../include/md5.h"
+
+#include "lease_store.h"
+
+/*
+ *	This does the same job as rlm_ippool, but the leases are kept
+ *	in a memory-mapped file instead of GDBM.  Finding a free
+ *	address, and releasing one, don't search the pool, and
+ *	requests for different subscribers mostly don't wait for each
+ *	other.  All of the leases for a NAS can be released when it
+ *	sends Accounting-On or Accounting-Off.
+ */
+typedef struct rlm_mmippool_t {
+	char		*filename;
+	char		*key;
+	uint32_t	range_start;
+	uint32_t	range_stop;
+	uint32_t	netmask;
+	int		override;
+	int		max_timeout;
+	int		shards;
+	int		sync_interval;
+
+	char		*name;
+	lease_store_t	*store;
+	time_t		next_sync;
+} rlm_mmippool_t;
+
+static const CONF_PARSER module_config[] = {
+  { "filename", PW_TYPE_STRING_PTR, offsetof(rlm_mmippool_t,filename), NULL, NULL },
+  { "key", PW_TYPE_STRING_PTR, offsetof(rlm_mmippool_t,key), NULL, "%{NAS-IP-Address} %{NAS-Port}" },
+  { "range-start", PW_TYPE_IPADDR, offsetof(rlm_mmippool_t,range_start), NULL, "0" },
+  { "range-stop", PW_TYPE_IPADDR, offsetof(rlm_mmippool_t,range_stop), NULL, "0" },
+  { "netmask", PW_TYPE_IPADDR, offsetof(rlm_mmippool_t,netmask), NULL, "0" },
+  { "override", PW_TYPE_BOOLEAN, offsetof(rlm_mmippool_t,override), NULL, "no" },
+  { "maximum-timeout", PW_TYPE_INTEGER, offsetof(rlm_mmippool_t,max_timeout), NULL, "0" },
+  { "shards", PW_TYPE_INTEGER, offsetof(rlm_mmippool_t,shards), NULL, "16" },
+  { "sync-interval", PW_TYPE_INTEGER, offsetof(rlm_mmippool_t,sync_interval), NULL, "5" },
+  { NULL, -1, 0, NULL, NULL }
+};
+
+
+/*
+ *	%{pool_name:stat}, where "stat" is one of the names below.
+ */
+static size_t mmippool_xlat(void *instance, REQUEST *request,
+			    char *fmt, char *out, size_t outlen,
+			    UNUSED RADIUS_ESCAPE_STRING func)
+{
+	rlm_mmippool_t *inst = instance;
+	lease_store_stats_t stats;
+	uint64_t value;
+
+	lease_store_stats(inst->store, &stats);
+
+	if (strcmp(fmt, "total") == 0) {
+		value = stats.total;
+	} else if (strcmp(fmt, "used") == 0) {
+		value = stats.active;
+	} else if (strcmp(fmt, "free") == 0) {
+		value = stats.total - stats.active;
+	} else if (strcmp(fmt, "utilization") == 0) {
+		value = (100 * (uint64_t) stats.active) / stats.total;
+	} else if (strcmp(fmt, "allocations") == 0) {
+		value = stats.allocations;
+	} else if (strcmp(fmt, "renewals") == 0) {
+		value = stats.renewals;
+	} else if (strcmp(fmt, "releases") == 0) {
+		value = stats.releases;
+	} else if (strcmp(fmt, "failures") == 0) {
+		value = stats.failures;
+	} else if (strcmp(fmt, "alloc-usec") == 0) {
+		value = stats.allocations + stats.renewals;
+		if (value) value = stats.alloc_usec / value;
+	} else if (strcmp(fmt, "alloc-usec-max") == 0) {
+		value = stats.alloc_usec_max;
+	} else {
+		RDEBUG("Unknown statistic \"%s\"", fmt);
+		*out = '\0';
+		return 0;
+	}
+
+	return snprintf(out, outlen, "%" PRIu64, value);
+}
+
+static int mmippool_detach(void *instance)
+{
+	rlm_mmippool_t *inst = instance;
+	lease_store_stats_t stats;
+
+	if (inst->store) {
+		lease_store_stats(inst->store, &stats);
+		DEBUG2("rlm_mmippool (%s): %u of %u addresses in use, %" PRIu64 " allocations, %" PRIu64 " failed",
+		       inst->name, stats.active, stats.total,
+		       stats.allocations, stats.failures);
+
+		lease_store_close(inst->store);
+	}
+
+	if (inst->name) {
+		xlat_unregister(inst->name, mmippool_xlat);
+		free(inst->name);
+	}
+	free(inst);
+
+	return 0;
+}
+
+static int mmippool_instantiate(CONF_SECTION *conf, void **instance)
+{
+	const char *name;
+	char errbuf[1024];
+	rlm_mmippool_t *inst;
+
+	inst = rad_malloc(sizeof(*inst));
+	memset(inst, 0, sizeof(*inst));
+
+	if (cf_section_parse(conf, inst, module_config) < 0) {
+		free(inst);
+		return -1;
+	}
+
+	if (!inst->filename) {
+		radlog(L_ERR, "rlm_mmippool: 'filename' must be set.");
+		mmippool_detach(inst);
+		return -1;
+	}
+
+	inst->range_start = ntohl(inst->range_start);
+	inst->range_stop = ntohl(inst->range_stop);
+	inst->netmask = ntohl(inst->netmask);
+	if ((inst->range_start == 0) || (inst->range_stop == 0) ||
+	    (inst->range_start >= inst->range_stop)) {
+		radlog(L_ERR, "rlm_mmippool: Invalid range-start or range-stop.");
+		mmippool_detach(inst);
+		return -1;
+	}
+
+	inst->store = lease_store_open(inst->filename, inst->range_start,
+				       inst->range_stop, inst->netmask,
+				       inst->shards, errbuf, sizeof(errbuf));
+	if (!inst->store) {
+		radlog(L_ERR, "rlm_mmippool: %s", errbuf);
+		mmippool_detach(inst);
+		return -1;
+	}
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+	inst->name = strdup(name);
+	xlat_register(inst->name, mmippool_xlat, inst);
+
+	*instance = inst;
+
+	return 0;
+}
+
+
+/*
+ *	The lease key is the MD5 of the expanded "key", as with
+ *	rlm_ippool.
+ */
+static int mmippool_key(rlm_mmippool_t *inst, REQUEST *request,
+			uint8_t *key)
+{
+	char xlat_str[MAX_STRING_LEN];
+	FR_MD5_CTX md5_context;
+
+	if (!radius_xlat(xlat_str, sizeof(xlat_str), inst->key, request, NULL)) {
+		RDEBUG("xlat on the 'key' directive failed");
+		return -1;
+	}
+
+	fr_MD5Init(&md5_context);
+	fr_MD5Update(&md5_context, (uint8_t *) xlat_str, strlen(xlat_str));
+	fr_MD5Final(key, &md5_context);
+
+	RDEBUG2("Lease key is '%s'", xlat_str);
+
+	return 0;
+}
+
+/*
+ *	Who gave out the lease, for Accounting-On/Off.
+ */
+static uint32_t mmippool_nas(REQUEST *request)
+{
+	VALUE_PAIR *vp;
+
+	vp = pairfind(request->packet->vps, PW_NAS_IP_ADDRESS, 0);
+	if (vp) return vp->vp_ipaddr;
+
+	if (request->packet->src_ipaddr.af == AF_INET) {
+		return request->packet->src_ipaddr.ipaddr.ip4addr.s_addr;
+	}
+
+	return 0;
+}
+
+static void mmippool_sync(rlm_mmippool_t *inst, REQUEST *request)
+{
+	if (!inst->sync_interval ||
+	    (request->timestamp < inst->next_sync)) return;
+
+	inst->next_sync = request->timestamp + inst->sync_interval;
+	lease_store_sync(inst->store);
+}
+
+/*
+ *	Release the lease on Accounting-Stop, and every lease for the
+ *	NAS on Accounting-On and Accounting-Off.
+ */
+static int mmippool_accounting(void *instance, REQUEST *request)
+{
+	int num;
+	uint32_t ipaddr;
+	uint8_t key[16];
+	char str[32];
+	VALUE_PAIR *vp;
+	rlm_mmippool_t *inst = instance;
+
+	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0);
+	if (!vp) {
+		RDEBUG("Could not find account status type in packet. Return NOOP.");
+		return RLM_MODULE_NOOP;
+	}
+
+	switch (vp->vp_integer) {
+	case PW_STATUS_STOP:
+		if (mmippool_key(inst, request, key) < 0) {
+			return RLM_MODULE_NOOP;
+		}
+
+		if (lease_store_release(inst->store, key, &ipaddr) < 0) {
+			RDEBUG("Entry not found");
+			return RLM_MODULE_NOTFOUND;
+		}
+
+		RDEBUG("Released ip %s", ip_ntoa(str, ipaddr));
+		break;
+
+	case PW_STATUS_ACCOUNTING_ON:
+	case PW_STATUS_ACCOUNTING_OFF:
+		ipaddr = mmippool_nas(request);
+		num = lease_store_release_nas(inst->store, ipaddr);
+		if (num < 0) return RLM_MODULE_FAIL;
+
+		RDEBUG("Released %d leases for NAS %s", num,
+		       ip_ntoa(str, ipaddr));
+		if (num == 0) return RLM_MODULE_NOOP;
+		break;
+
+	default:
+		RDEBUG("This is not an Accounting-Stop, -On or -Off. Return NOOP.");
+		return RLM_MODULE_NOOP;
+	}
+
+	mmippool_sync(inst, request);
+
+	return RLM_MODULE_OK;
+}
+
+static int mmippool_postauth(void *instance, REQUEST *request)
+{
+	int rcode;
+	uint32_t ipaddr;
+	uint8_t key[16];
+	char str[32];
+	time_t expires;
+	VALUE_PAIR *vp;
+	rlm_mmippool_t *inst = instance;
+	int attr_ipaddr = PW_FRAMED_IP_ADDRESS;
+	int attr_ipmask = PW_FRAMED_IP_NETMASK;
+	int vendor_ipaddr = 0;
+#ifdef WITH_DHCP
+	int dhcp = FALSE;
+#endif
+
+	/*
+	 *	Only run if Pool-Name is our name, or DEFAULT.
+	 */
+	vp = pairfind(request->config_items, PW_POOL_NAME, 0);
+	if (!vp) {
+		RDEBUG("Could not find Pool-Name attribute.");
+		return RLM_MODULE_NOOP;
+	}
+	if ((strcmp(inst->name, vp->vp_strvalue) != 0) &&
+	    (strcmp(vp->vp_strvalue, "DEFAULT") != 0)) {
+		return RLM_MODULE_NOOP;
+	}
+
+#ifdef WITH_DHCP
+	if (request->listener->type == RAD_LISTEN_DHCP) {
+		dhcp = 1;
+		attr_ipaddr = PW_DHCP_YOUR_IP_ADDRESS;
+		vendor_ipaddr = DHCP_MAGIC_VENDOR;
+		attr_ipmask = PW_DHCP_SUBNET_MASK;
+	}
+#endif
+
+	if (pairfind(request->reply->vps, attr_ipaddr, vendor_ipaddr) != NULL) {
+		RDEBUG("Found IP address attribute in reply attribute list.");
+		if (!inst->override) {
+			RDEBUG("override is set to no. Return NOOP.");
+			return RLM_MODULE_NOOP;
+		}
+
+		RDEBUG("Override supplied IP address");
+		pairdelete(&request->reply->vps, attr_ipaddr, vendor_ipaddr);
+	}
+
+	if (mmippool_key(inst, request, key) < 0) return RLM_MODULE_NOOP;
+
+	/*
+	 *	The lease lasts for the Session-Timeout, and no longer
+	 *	than maximum-timeout.
+	 */
+	expires = 0;
+	vp = pairfind(request->reply->vps, PW_SESSION_TIMEOUT, 0);
+	if (vp && vp->vp_integer) {
+		expires = request->timestamp + vp->vp_integer;
+	}
+	if (inst->max_timeout &&
+	    (!expires || (expires > request->timestamp + inst->max_timeout))) {
+		expires = request->timestamp + inst->max_timeout;
+	}
+
+	rcode = lease_store_alloc(inst->store, key, mmippool_nas(request),
+				  request->timestamp, expires, &ipaddr);
+	if (rcode < 0) {
+		RDEBUG("No available ip addresses in pool.");
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	RDEBUG("%s ip %s", rcode ? "Renewed" : "Allocated",
+	       ip_ntoa(str, ipaddr));
+
+#ifdef WITH_DHCP
+	if (dhcp && vp) {
+		VALUE_PAIR *lease;
+
+		lease = radius_paircreate(request, &request->reply->vps,
+					  PW_DHCP_IP_ADDRESS_LEASE_TIME,
+					  DHCP_MAGIC_VENDOR, PW_TYPE_INTEGER);
+		lease->vp_integer = vp->vp_integer;
+		pairdelete(&request->reply->vps, PW_SESSION_TIMEOUT, 0);
+	}
+#endif
+
+	vp = radius_paircreate(request, &request->reply->vps,
+			       attr_ipaddr, vendor_ipaddr, PW_TYPE_IPADDR);
+	vp->vp_ipaddr = ipaddr;
+
+	if (pairfind(request->reply->vps, attr_ipmask, vendor_ipaddr) == NULL) {
+		vp = radius_paircreate(request, &request->reply->vps,
+				       attr_ipmask, vendor_ipaddr,
+				       PW_TYPE_IPADDR);
+		vp->vp_ipaddr = htonl(inst->netmask);
+	}
+
+	mmippool_sync(inst, request);
+
+	return RLM_MODULE_OK;
+}
+
+module_t rlm_mmippool = {
+	RLM_MODULE_INIT,
+	"mmippool",
+	RLM_TYPE_THREAD_SAFE,		/* type */
+	mmippool_instantiate,		/* instantiation */
+	mmippool_detach,		/* detach */
+	{
+		NULL,			/* authentication */
+		NULL,		 	/* authorization */
+		NULL,			/* preaccounting */
+		mmippool_accounting,	/* accounting */
+		NULL,			/* checksimul */
+		NULL,			/* pre-proxy */
+		NULL,			/* post-proxy */
+		mmippool_postauth	/* post-auth */
+	},
+};
@@ -0,0 +1,767 @@
+/*
+ * passwd_snapshot.c	Compiled, read-only passwd files for rlm_passwd.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"passwd_snapshot.h"
+
+#include	<fcntl.h>
+#include	<sys/stat.h>
+#include	<sys/mman.h>
+
+/*
+ *	A snapshot is a passwd file which has been split into fields,
+ *	and indexed with a perfect hash, by rlm_passwd_compile.  The
+ *	module maps it read-only, so loading it costs nothing, all of
+ *	the server processes share one copy through the page cache,
+ *	and a lookup is a few array references.
+ *
+ *	The layout is:
+ *
+ *		header
+ *		uint32_t displacement[num_buckets]
+ *		uint32_t slot[num_slots]	key number, or EMPTY
+ *		snapshot_key_t key[num_keys]
+ *		uint32_t ref[num_refs]		offsets of records in data
+ *		data				records, then key names
+ *
+ *	All offsets are from the start of the file, and everything is
+ *	in host byte order.  A record is one byte giving the number of
+ *	fields it has, followed by the fields as C strings.  Key names
+ *	point into the records, except for lists of keys, where each
+ *	name is added after the records.
+ *
+ *	The index is "hash and displace": a key's bucket is picked
+ *	with one hash, and its slot by mixing a second hash with the
+ *	bucket's displacement.  The compiler picks displacements so
+ *	that no two keys share a slot.
+ */
+#define SNAPSHOT_MAGIC		(0x46525057)	/* "FRPW" */
+#define SNAPSHOT_VERSION	(1)
+#define SNAPSHOT_EMPTY		(0xffffffff)
+#define SNAPSHOT_SEED		(0x9e3779b9)
+#define SNAPSHOT_MAX_TRIES	(1 << 24)
+
+typedef struct snapshot_header_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	file_size;
+	uint32_t	nfields;
+	uint32_t	keyfield;
+	uint32_t	islist;
+	uint32_t	ignorenis;
+	uint32_t	delimiter;
+	uint32_t	num_records;
+	uint32_t	num_keys;
+	uint32_t	num_refs;
+	uint32_t	num_buckets;
+	uint32_t	num_slots;
+	uint32_t	disp_off;
+	uint32_t	slots_off;
+	uint32_t	keys_off;
+	uint32_t	refs_off;
+	uint32_t	data_off;
+	uint32_t	data_size;
+} snapshot_header_t;
+
+typedef struct snapshot_key_t {
+	uint32_t	name;		/* offset in data */
+	uint32_t	first;		/* in ref[] */
+	uint32_t	count;
+} snapshot_key_t;
+
+struct passwd_snapshot_t {
+	void			*map;
+	size_t			size;
+	const snapshot_header_t	*hdr;
+	const uint32_t		*disp;
+	const uint32_t		*slots;
+	const snapshot_key_t	*keys;
+	const uint32_t		*refs;
+	char			*data;
+	int			nfields;
+	int			keyfield;
+};
+
+/*
+ *	Mix the bits, so that changing the displacement moves the
+ *	slot everywhere.  This is the MurmurHash3 finalizer.
+ */
+static uint32_t snapshot_mix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static void snapshot_hash(const char *name, uint32_t *h1, uint32_t *h2)
+{
+	size_t len = strlen(name);
+
+	*h1 = fr_hash(name, len);
+	*h2 = fr_hash_update(name, len, SNAPSHOT_SEED);
+}
+
+static uint32_t snapshot_slot(uint32_t h1, uint32_t h2, uint32_t disp,
+			      uint32_t num_slots)
+{
+	return (h2 ^ snapshot_mix(h1 + disp)) % num_slots;
+}
+
+
+/*
+ *	Everything below is for building a snapshot.
+ */
+typedef struct snapshot_buffer_t {
+	uint8_t		*data;
+	size_t		len;
+	size_t		size;
+} snapshot_buffer_t;
+
+typedef struct snapshot_entry_t {
+	char		*name;
+	uint32_t	record;
+	uint32_t	name_off;	/* in data, or EMPTY */
+	uint32_t	seq;
+	uint32_t	h1;
+	uint32_t	h2;
+} snapshot_entry_t;
+
+static int buffer_append(snapshot_buffer_t *buf, const void *data,
+			 size_t len)
+{
+	uint8_t *p;
+	size_t size;
+
+	if ((buf->len + len) > buf->size) {
+		size = buf->size ? buf->size * 2 : 65536;
+		while (size < (buf->len + len)) size *= 2;
+
+		p = realloc(buf->data, size);
+		if (!p) return -1;
+
+		buf->data = p;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return 0;
+}
+
+/*
+ *	Sort by name, and for the same name, newest line first.  That's
+ *	the order in which the in-memory hash table returns them.
+ */
+static int entry_cmp(const void *one, const void *two)
+{
+	const snapshot_entry_t *a = one;
+	const snapshot_entry_t *b = two;
+	int rcode;
+
+	rcode = strcmp(a->name, b->name);
+	if (rcode != 0) return rcode;
+
+	if (a->seq > b->seq) return -1;
+	if (a->seq < b->seq) return +1;
+	return 0;
+}
+
+/*
+ *	Split a line the same way rlm_passwd does: the last field
+ *	gets everything after the last delimiter we care about.
+ */
+static int snapshot_split(char *str, const passwd_snapshot_format_t *fmt,
+			  char **fields)
+{
+	int fn = 0;
+	size_t i, len;
+
+	len = strlen(str);
+	if (len && (str[len - 1] == '\n')) str[--len] = '\0';
+	if (len && (str[len - 1] == '\r')) str[--len] = '\0';
+	if (!len) return 0;
+
+	fields[fn++] = str;
+	for (i = 0; i < len; i++) {
+		if (str[i] == fmt->delimiter) {
+			str[i] = '\0';
+			fields[fn++] = str + i + 1;
+			if (fn == fmt->nfields) break;
+		}
+	}
+
+	return fn;
+}
+
+static int snapshot_add(snapshot_entry_t **entries, size_t *num,
+			size_t *size, const char *name, uint32_t record,
+			uint32_t name_off, uint32_t seq)
+{
+	snapshot_entry_t *e;
+
+	if (*num == *size) {
+		*size = *size ? *size * 2 : 4096;
+		e = realloc(*entries, *size * sizeof(*e));
+		if (!e) return -1;
+		*entries = e;
+	}
+
+	e = &(*entries)[*num];
+	e->name = strdup(name);
+	if (!e->name) return -1;
+	e->record = record;
+	e->name_off = name_off;
+	e->seq = seq;
+	(*num)++;
+
+	return 0;
+}
+
+/*
+ *	Find displacements which put every key in its own slot.  The
+ *	biggest buckets are placed first, while there's the most room.
+ */
+static int snapshot_place(snapshot_entry_t **keys, uint32_t num_keys,
+			  uint32_t num_buckets, uint32_t num_slots,
+			  uint32_t *disp, uint32_t *slots)
+{
+	uint32_t i, j, k, b, d, max, *start, *count, *order, *member;
+	uint32_t *tried;
+	int rcode = -1;
+
+	start = calloc(num_buckets + 1, sizeof(*start));
+	count = calloc(num_buckets, sizeof(*count));
+	member = malloc((num_keys + 1) * sizeof(*member));
+	order = malloc(num_buckets * sizeof(*order));
+	tried = malloc((num_keys + 1) * sizeof(*tried));
+	if (!start || !count || !member || !order || !tried) goto done;
+
+	for (i = 0; i < num_keys; i++) {
+		count[keys[i]->h1 % num_buckets]++;
+	}
+
+	max = 0;
+	for (b = 0; b < num_buckets; b++) {
+		start[b + 1] = start[b] + count[b];
+		if (count[b] > max) max = count[b];
+		count[b] = 0;
+	}
+
+	for (i = 0; i < num_keys; i++) {
+		b = keys[i]->h1 % num_buckets;
+		member[start[b] + count[b]++] = i;
+	}
+
+	/*
+	 *	Counting sort of the buckets, biggest first.
+	 */
+	k = 0;
+	for (j = max; j > 0; j--) {
+		for (b = 0; b < num_buckets; b++) {
+			if (count[b] == j) order[k++] = b;
+		}
+	}
+
+	for (i = 0; i < num_slots; i++) slots[i] = SNAPSHOT_EMPTY;
+	memset(disp, 0, num_buckets * sizeof(*disp));
+
+	for (i = 0; i < k; i++) {
+		b = order[i];
+
+		for (d = 0; d < SNAPSHOT_MAX_TRIES; d++) {
+			for (j = 0; j < count[b]; j++) {
+				snapshot_entry_t *e = keys[member[start[b] + j]];
+				uint32_t s;
+
+				s = snapshot_slot(e->h1, e->h2, d, num_slots);
+				if (slots[s] != SNAPSHOT_EMPTY) break;
+
+				/*
+				 *	Claim it for now, so that the
+				 *	other keys in the bucket see it.
+				 */
+				slots[s] = member[start[b] + j];
+				tried[j] = s;
+			}
+
+			if (j == count[b]) break;
+
+			while (j > 0) {
+				j--;
+				slots[tried[j]] = SNAPSHOT_EMPTY;
+			}
+		}
+
+		if (d == SNAPSHOT_MAX_TRIES) goto done;
+		disp[b] = d;
+	}
+
+	rcode = 0;
+
+done:
+	free(start);
+	free(count);
+	free(member);
+	free(order);
+	free(tried);
+	return rcode;
+}
+
+int passwd_snapshot_write(const char *infile, const char *outfile,
+			  const passwd_snapshot_format_t *fmt,
+			  unsigned int *num_keys, unsigned int *num_records,
+			  char *errbuf, size_t errlen)
+{
+	FILE *fp;
+	int i, fn, rcode = -1;
+	uint8_t present;
+	uint32_t seq = 0, nk = 0, nb, ns, offset, name_off = 0;
+	size_t num = 0, size = 0, n;
+	char buffer[1024], *list, *next;
+	char *fields[PASSWD_SNAPSHOT_MAX_FIELDS];
+	char tmpname[1024];
+	snapshot_buffer_t data, out;
+	snapshot_entry_t *entries = NULL, **keys = NULL;
+	snapshot_key_t *key_table = NULL;
+	uint32_t *refs = NULL, *disp = NULL, *slots = NULL;
+	snapshot_header_t hdr;
+
+	memset(&data, 0, sizeof(data));
+	memset(&out, 0, sizeof(out));
+
+	if ((fmt->nfields <= 0) || (fmt->nfields > PASSWD_SNAPSHOT_MAX_FIELDS) ||
+	    (fmt->keyfield < 0) || (fmt->keyfield >= fmt->nfields)) {
+		snprintf(errbuf, errlen, "Invalid format");
+		return -1;
+	}
+
+	fp = fopen(infile, "r");
+	if (!fp) {
+		snprintf(errbuf, errlen, "Failed opening %s: %s",
+			 infile, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (!*buffer || (*buffer == '\n')) continue;
+		if (fmt->ignorenis && ((*buffer == '+') || (*buffer == '-'))) {
+			continue;
+		}
+
+		fn = snapshot_split(buffer, fmt, fields);
+		if (fn <= fmt->keyfield) continue;
+		if (!*fields[fmt->keyfield]) continue;
+
+		offset = data.len;
+		present = fn;
+		if (buffer_append(&data, &present, 1) < 0) goto nomem;
+		for (i = 0; i < fn; i++) {
+			if (i == fmt->keyfield) name_off = data.len;
+			if (buffer_append(&data, fields[i],
+					  strlen(fields[i]) + 1) < 0) goto nomem;
+		}
+
+		/*
+		 *	A plain key is already in the record, so the
+		 *	index can point to it there.
+		 */
+		if (!fmt->islist) {
+			if (snapshot_add(&entries, &num, &size,
+					 fields[fmt->keyfield], offset,
+					 name_off, seq) < 0) goto nomem;
+		} else for (list = fields[fmt->keyfield]; list; list = next) {
+			next = strchr(list, ',');
+			if (next) *(next++) = '\0';
+			if (!*list) continue;
+
+			if (snapshot_add(&entries, &num, &size, list,
+					 offset, SNAPSHOT_EMPTY, seq) < 0) goto nomem;
+		}
+
+		seq++;
+	}
+
+	if (ferror(fp)) {
+		snprintf(errbuf, errlen, "Failed reading %s: %s",
+			 infile, strerror(errno));
+		goto done;
+	}
+
+	if (num > 0) qsort(entries, num, sizeof(*entries), entry_cmp);
+
+	/*
+	 *	One key for each distinct name.  The records for a
+	 *	name are the entries which follow it.
+	 */
+	keys = malloc((num + 1) * sizeof(*keys));
+	key_table = malloc((num + 1) * sizeof(*key_table));
+	refs = malloc((num + 1) * sizeof(*refs));
+	if (!keys || !key_table || !refs) goto nomem;
+
+	for (n = 0; n < num; n++) {
+		refs[n] = entries[n].record;
+
+		if ((n > 0) && (strcmp(entries[n].name,
+				       entries[n - 1].name) == 0)) {
+			key_table[nk - 1].count++;
+			continue;
+		}
+
+		snapshot_hash(entries[n].name, &entries[n].h1, &entries[n].h2);
+		keys[nk] = &entries[n];
+		key_table[nk].first = n;
+		key_table[nk].count = 1;
+		if (entries[n].name_off != SNAPSHOT_EMPTY) {
+			key_table[nk].name = entries[n].name_off;
+		} else {
+			key_table[nk].name = data.len;
+			if (buffer_append(&data, entries[n].name,
+					  strlen(entries[n].name) + 1) < 0) goto nomem;
+		}
+		nk++;
+	}
+
+	nb = (nk / 4) + 1;
+	ns = nk + (nk / 4) + 1;
+	disp = malloc(nb * sizeof(*disp));
+	slots = malloc(ns * sizeof(*slots));
+	if (!disp || !slots) goto nomem;
+
+	if (snapshot_place(keys, nk, nb, ns, disp, slots) < 0) {
+		snprintf(errbuf, errlen, "Failed building the index for %s",
+			 infile);
+		goto done;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.nfields = fmt->nfields;
+	hdr.keyfield = fmt->keyfield;
+	hdr.islist = fmt->islist;
+	hdr.ignorenis = fmt->ignorenis;
+	hdr.delimiter = (uint8_t) fmt->delimiter;
+	hdr.num_records = seq;
+	hdr.num_keys = nk;
+	hdr.num_refs = num;
+	hdr.num_buckets = nb;
+	hdr.num_slots = ns;
+	hdr.disp_off = sizeof(hdr);
+	hdr.slots_off = hdr.disp_off + nb * sizeof(*disp);
+	hdr.keys_off = hdr.slots_off + ns * sizeof(*slots);
+	hdr.refs_off = hdr.keys_off + nk * sizeof(*key_table);
+	hdr.data_off = hdr.refs_off + num * sizeof(*refs);
+	hdr.data_size = data.len;
+
+	if (((uint64_t) hdr.data_off + data.len) > 0xffffffff) {
+		snprintf(errbuf, errlen, "%s is too large", infile);
+		goto done;
+	}
+	hdr.file_size = hdr.data_off + data.len;
+
+	if ((buffer_append(&out, &hdr, sizeof(hdr)) < 0) ||
+	    (buffer_append(&out, disp, nb * sizeof(*disp)) < 0) ||
+	    (buffer_append(&out, slots, ns * sizeof(*slots)) < 0) ||
+	    (buffer_append(&out, key_table, nk * sizeof(*key_table)) < 0) ||
+	    (buffer_append(&out, refs, num * sizeof(*refs)) < 0) ||
+	    (buffer_append(&out, data.data, data.len) < 0)) goto nomem;
+
+	/*
+	 *	Write a new file and rename it over the old one, so that
+	 *	running servers keep using the old one until they HUP.
+	 */
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", outfile);
+	fclose(fp);
+	fp = fopen(tmpname, "w");
+	if (!fp) {
+		snprintf(errbuf, errlen, "Failed creating %s: %s",
+			 tmpname, strerror(errno));
+		goto done;
+	}
+
+	if ((fwrite(out.data, 1, out.len, fp) != out.len) ||
+	    (fclose(fp) != 0)) {
+		fp = NULL;
+		snprintf(errbuf, errlen, "Failed writing %s: %s",
+			 tmpname, strerror(errno));
+		unlink(tmpname);
+		goto done;
+	}
+	fp = NULL;
+
+	if (rename(tmpname, outfile) < 0) {
+		snprintf(errbuf, errlen, "Failed renaming %s to %s: %s",
+			 tmpname, outfile, strerror(errno));
+		unlink(tmpname);
+		goto done;
+	}
+
+	if (num_keys) *num_keys = nk;
+	if (num_records) *num_records = seq;
+	rcode = 0;
+	goto done;
+
+nomem:
+	snprintf(errbuf, errlen, "Out of memory");
+
+done:
+	if (fp) fclose(fp);
+	for (n = 0; n < num; n++) free(entries[n].name);
+	free(entries);
+	free(keys);
+	free(key_table);
+	free(refs);
+	free(disp);
+	free(slots);
+	free(data.data);
+	free(out.data);
+
+	return rcode;
+}
+
+
+/*
+ *	Everything below is for using a snapshot.
+ */
+int passwd_snapshot_is_snapshot(const char *filename)
+{
+	int fd;
+	uint32_t magic;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return 0;
+
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		magic = 0;
+	}
+	close(fd);
+
+	return (magic == SNAPSHOT_MAGIC);
+}
+
+static int snapshot_check(const snapshot_header_t *hdr, size_t size,
+			  const passwd_snapshot_format_t *fmt,
+			  char *errbuf, size_t errlen)
+{
+	if ((hdr->magic != SNAPSHOT_MAGIC) ||
+	    (hdr->version != SNAPSHOT_VERSION)) {
+		snprintf(errbuf, errlen, "Unknown snapshot version");
+		return -1;
+	}
+
+	if ((hdr->file_size != size) ||
+	    (hdr->num_buckets == 0) || (hdr->num_slots == 0) ||
+	    (hdr->disp_off != sizeof(*hdr)) ||
+	    (hdr->slots_off != hdr->disp_off + hdr->num_buckets * sizeof(uint32_t)) ||
+	    (hdr->keys_off != hdr->slots_off + hdr->num_slots * sizeof(uint32_t)) ||
+	    (hdr->refs_off != hdr->keys_off + hdr->num_keys * sizeof(snapshot_key_t)) ||
+	    (hdr->data_off != hdr->refs_off + hdr->num_refs * sizeof(uint32_t)) ||
+	    (hdr->data_off > size) ||
+	    (hdr->data_size != size - hdr->data_off)) {
+		snprintf(errbuf, errlen, "Snapshot is truncated or corrupt");
+		return -1;
+	}
+
+	if ((hdr->nfields != (uint32_t) fmt->nfields) ||
+	    (hdr->keyfield != (uint32_t) fmt->keyfield) ||
+	    (hdr->islist != (uint32_t) (fmt->islist != 0)) ||
+	    (hdr->ignorenis != (uint32_t) (fmt->ignorenis != 0)) ||
+	    (hdr->delimiter != (uint8_t) fmt->delimiter)) {
+		snprintf(errbuf, errlen, "Snapshot was compiled with a different format, delimiter, or ignorenislike setting");
+		return -1;
+	}
+
+	return 0;
+}
+
+passwd_snapshot_t *passwd_snapshot_open(const char *filename,
+					const passwd_snapshot_format_t *fmt,
+					char *errbuf, size_t errlen)
+{
+	int fd;
+	struct stat st;
+	void *map;
+	passwd_snapshot_t *snap;
+	const snapshot_header_t *hdr;
+
+	if (fmt->nfields > PASSWD_SNAPSHOT_MAX_FIELDS) {
+		snprintf(errbuf, errlen, "Too many fields");
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		snprintf(errbuf, errlen, "Failed opening %s: %s",
+			 filename, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		snprintf(errbuf, errlen, "Failed reading %s: %s",
+			 filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t) st.st_size < sizeof(*hdr)) {
+		snprintf(errbuf, errlen, "%s is too short", filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		snprintf(errbuf, errlen, "Failed mapping %s: %s",
+			 filename, strerror(errno));
+		return NULL;
+	}
+
+	hdr = map;
+	if (snapshot_check(hdr, st.st_size, fmt, errbuf, errlen) < 0) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	snap = malloc(sizeof(*snap));
+	if (!snap) {
+		snprintf(errbuf, errlen, "Out of memory");
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	snap->map = map;
+	snap->size = st.st_size;
+	snap->hdr = hdr;
+	snap->disp = (const uint32_t *) ((uint8_t *) map + hdr->disp_off);
+	snap->slots = (const uint32_t *) ((uint8_t *) map + hdr->slots_off);
+	snap->keys = (const snapshot_key_t *) ((uint8_t *) map + hdr->keys_off);
+	snap->refs = (const uint32_t *) ((uint8_t *) map + hdr->refs_off);
+	snap->data = (char *) map + hdr->data_off;
+	snap->nfields = hdr->nfields;
+	snap->keyfield = hdr->keyfield;
+
+	return snap;
+}
+
+void passwd_snapshot_close(passwd_snapshot_t *snap)
+{
+	if (!snap) return;
+
+	munmap(snap->map, snap->size);
+	free(snap);
+}
+
+unsigned int passwd_snapshot_num_keys(const passwd_snapshot_t *snap)
+{
+	return snap->hdr->num_keys;
+}
+
+const char *passwd_snapshot_key(const passwd_snapshot_t *snap,
+				unsigned int key)
+{
+	uint32_t name;
+
+	if (key >= snap->hdr->num_keys) return NULL;
+
+	name = snap->keys[key].name;
+	if ((name >= snap->hdr->data_size) ||
+	    !memchr(snap->data + name, 0, snap->hdr->data_size - name)) {
+		return NULL;
+	}
+
+	return snap->data + name;
+}
+
+/*
+ *	Returns the key number, or -1 if the name isn't there.
+ */
+int passwd_snapshot_find(const passwd_snapshot_t *snap, const char *name,
+			 unsigned int *count)
+{
+	uint32_t h1, h2, key;
+	const char *p;
+
+	snapshot_hash(name, &h1, &h2);
+	key = snap->slots[snapshot_slot(h1, h2,
+					snap->disp[h1 % snap->hdr->num_buckets],
+					snap->hdr->num_slots)];
+	if (key == SNAPSHOT_EMPTY) return -1;
+
+	p = passwd_snapshot_key(snap, key);
+	if (!p || (strcmp(p, name) != 0)) return -1;
+
+	if (((uint64_t) snap->keys[key].first + snap->keys[key].count) >
+	    snap->hdr->num_refs) return -1;
+
+	if (count) *count = snap->keys[key].count;
+	return key;
+}
+
+/*
+ *	Point "fields" at the n'th record for a key.  Nothing is
+ *	copied: the strings are in the mapped file.
+ */
+int passwd_snapshot_record(const passwd_snapshot_t *snap, unsigned int key,
+			   unsigned int n, char **fields)
+{
+	int i, present;
+	uint32_t ref;
+	char *p, *end;
+
+	if ((key >= snap->hdr->num_keys) ||
+	    (n >= snap->keys[key].count)) return -1;
+
+	ref = snap->refs[snap->keys[key].first + n];
+	if (ref >= snap->hdr->data_size) return -1;
+
+	p = snap->data + ref;
+	end = snap->data + snap->hdr->data_size;
+	present = (uint8_t) *(p++);
+
+	for (i = 0; i < snap->nfields; i++) {
+		if (i >= present) {
+			fields[i] = NULL;
+			continue;
+		}
+
+		fields[i] = p;
+		p = memchr(p, 0, end - p);
+		if (!p) return -1;
+		p++;
+	}
+
+	/*
+	 *	For lists, the key field holds all of the names.  The
+	 *	caller wants the one which matched.
+	 */
+	fields[snap->keyfield] = snap->data + snap->keys[key].name;
+
+	return 0;
+}
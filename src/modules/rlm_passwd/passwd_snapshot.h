@@ -0,0 +1,69 @@
+/*
+ * passwd_snapshot.h	Compiled, read-only passwd files for rlm_passwd.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _PASSWD_SNAPSHOT_H
+#define _PASSWD_SNAPSHOT_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(passwd_snapshot_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	The most fields a record can have.  The module builds the
+ *	result of a lookup in a fixed buffer, so this is bounded.
+ */
+#define PASSWD_SNAPSHOT_MAX_FIELDS (64)
+
+/*
+ *	How the text file was read when the snapshot was made.  The
+ *	module checks that these match its configuration.
+ */
+typedef struct passwd_snapshot_format_t {
+	int		nfields;
+	int		keyfield;
+	int		islist;
+	int		ignorenis;
+	char		delimiter;
+} passwd_snapshot_format_t;
+
+typedef struct passwd_snapshot_t passwd_snapshot_t;
+
+int	passwd_snapshot_write(const char *infile, const char *outfile,
+			      const passwd_snapshot_format_t *fmt,
+			      unsigned int *num_keys, unsigned int *num_records,
+			      char *errbuf, size_t errlen);
+
+int	passwd_snapshot_is_snapshot(const char *filename);
+passwd_snapshot_t *passwd_snapshot_open(const char *filename,
+					const passwd_snapshot_format_t *fmt,
+					char *errbuf, size_t errlen);
+void	passwd_snapshot_close(passwd_snapshot_t *snap);
+
+unsigned int passwd_snapshot_num_keys(const passwd_snapshot_t *snap);
+const char *passwd_snapshot_key(const passwd_snapshot_t *snap,
+				unsigned int key);
+int	passwd_snapshot_find(const passwd_snapshot_t *snap, const char *name,
+			     unsigned int *count);
+int	passwd_snapshot_record(const passwd_snapshot_t *snap, unsigned int key,
+			       unsigned int n, char **fields);
+
+#endif /* _PASSWD_SNAPSHOT_H */
@@ -24,6 +24,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
+#include "passwd_snapshot.h"
+
 struct mypasswd {
 	struct mypasswd *next;
 	char *listflag;
@@ -38,10 +40,25 @@ struct hashtable {
 	int ignorenis;
 	char * filename;
 	struct mypasswd **table;
-	struct mypasswd *last_found;
 	char buffer[1024];
 	FILE *fp;
 	char delimiter;
+	passwd_snapshot_t *snap;
+};
+
+/*
+ *	How far a lookup has got.  It belongs to the caller, so that
+ *	two lookups don't move each other's place in the results.
+ */
+struct passwd_cursor {
+	struct mypasswd *last_found;
+	int snap_key;
+	unsigned int snap_count;
+	unsigned int snap_next;
+	union {			/* the record, for snapshots */
+		struct mypasswd	record;
+		char		buffer[1024];
+	} snap_record;
 };
 
 
@@ -143,6 +160,10 @@ static void release_hash_table(struct hashtable * ht){
 		fclose(ht->fp);
 		ht->fp = NULL;
 	}
+	if (ht->snap) {
+		passwd_snapshot_close(ht->snap);
+		ht->snap = NULL;
+	}
 	ht->tablesize = 0;
 }
 
@@ -165,6 +186,8 @@ static struct hashtable * build_hash_table (const char * file, int nfields,
 	char *list;
 	char *nextlist=0;
 	int i;
+	passwd_snapshot_format_t fmt;
+	char errbuf[1024];
 
 	ht = (struct hashtable *) rad_malloc(sizeof(struct hashtable));
 	if(!ht) {
@@ -183,6 +206,28 @@ static struct hashtable * build_hash_table (const char * file, int nfields,
 	ht->ignorenis = ignorenis;
 	if (delimiter) ht->delimiter = delimiter;
 	else ht->delimiter = ':';
+
+	/*
+	 *	A snapshot made by rlm_passwd_compile is used in place,
+	 *	whatever the hashsize.
+	 */
+	if (passwd_snapshot_is_snapshot(file)) {
+		fmt.nfields = nfields;
+		fmt.keyfield = keyfield;
+		fmt.islist = islist;
+		fmt.ignorenis = ignorenis;
+		fmt.delimiter = ht->delimiter;
+		ht->snap = passwd_snapshot_open(file, &fmt, errbuf, sizeof(errbuf));
+		if (!ht->snap) {
+			radlog(L_ERR, "rlm_passwd: %s: %s", file, errbuf);
+			free(ht->filename);
+			free(ht);
+			return NULL;
+		}
+		ht->tablesize = 0;
+		return ht;
+	}
+
 	if(!tablesize) return ht;
 	if(!(ht->fp = fopen(file,"r"))) {
 		free(ht->filename);
@@ -245,7 +290,8 @@ static struct hashtable * build_hash_table (const char * file, int nfields,
 #undef passwd
 }
 
-static struct mypasswd * get_next(char *name, struct hashtable *ht)
+static struct mypasswd * get_next(char *name, struct hashtable *ht,
+				  struct passwd_cursor *cursor)
 {
 #define passwd ((struct mypasswd *) ht->buffer)
 	struct mypasswd * hashentry;
@@ -253,13 +299,26 @@ static struct mypasswd * get_next(char *name, struct hashtable *ht)
 	int len;
 	char *list, *nextlist;
 
+	if (ht->snap) {
+		struct mypasswd *record = &cursor->snap_record.record;
+
+		if (cursor->snap_key < 0 ||
+		    cursor->snap_next >= cursor->snap_count)
+			return NULL;
+		if (passwd_snapshot_record(ht->snap, cursor->snap_key,
+					   cursor->snap_next++,
+					   record->field) < 0)
+			return NULL;
+		record->next = NULL;
+		return record;
+	}
 	if (ht->tablesize > 0) {
-		/* get saved address of next item to check from buffer */
-		hashentry = ht->last_found;
+		/* get saved address of next item to check from the cursor */
+		hashentry = cursor->last_found;
 		for (; hashentry; hashentry = hashentry->next) {
 			if (!strcmp(hashentry->field[ht->keyfield], name)) {
 				/* save new address */
-				ht->last_found = hashentry->next;
+				cursor->last_found = hashentry->next;
 				return hashentry;
 			}
 		}
@@ -291,19 +350,27 @@ static struct mypasswd * get_next(char *name, struct hashtable *ht)
 #undef passwd
 }
 
-static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht)
+static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht,
+				    struct passwd_cursor *cursor)
 {
 	int h;
 	struct mypasswd * hashentry;
 
 	if (!ht || !name || *name == '\0') return NULL;
-	ht->last_found = NULL;
+	cursor->last_found = NULL;
+	if (ht->snap) {
+		/* no parsing or allocation, the fields point into the file */
+		cursor->snap_key = passwd_snapshot_find(ht->snap, name,
+							&cursor->snap_count);
+		cursor->snap_next = 0;
+		return get_next(name, ht, cursor);
+	}
 	if (ht->tablesize > 0) {
 		h = hash (name, ht->tablesize);
 		for (hashentry = ht->table[h]; hashentry; hashentry = hashentry->next)
 			if (!strcmp(hashentry->field[ht->keyfield], name)){
-				/* save address of next item to check into buffer */
-				ht->last_found=hashentry->next;
+				/* save address of next item to check into the cursor */
+				cursor->last_found=hashentry->next;
 				return hashentry;
 			}
 		return NULL;
@@ -313,7 +380,7 @@ static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht)
 		ht->fp = NULL;
 	}
 	if (!(ht->fp=fopen(ht->filename, "r"))) return NULL;
-	return get_next(name, ht);
+	return get_next(name, ht, cursor);
 }
 
 #ifdef TEST
@@ -324,6 +391,7 @@ int main(void){
  struct hashtable *ht;
  char *buffer;
  struct mypasswd* pw;
+ struct passwd_cursor cursor;
  int i;
 
  ht = build_hash_table("/etc/group", 4, 3, 1, 100, 0, ":");
@@ -338,9 +406,9 @@ int main(void){
 
  while(fgets(buffer, 1024, stdin)){
   buffer[strlen(buffer)-1] = 0;
-  pw = get_pw_nam(buffer, ht);
+  pw = get_pw_nam(buffer, ht, &cursor);
   printpw(pw,4);
-  while (pw = get_next(buffer, ht)) printpw(pw,4);
+  while (pw = get_next(buffer, ht, &cursor)) printpw(pw,4);
  }
  release_ht(ht);
 }
@@ -520,6 +588,7 @@ static int passwd_map(void *instance, REQUEST *request)
 	char buffer[1024];
 	VALUE_PAIR * key;
 	struct mypasswd * pw;
+	struct passwd_cursor cursor;
 	int found = 0;
 
 	for (key = request->packet->vps;
@@ -529,14 +598,14 @@ static int passwd_map(void *instance, REQUEST *request)
 		 *	Ensure we have the string form of the attribute
 		 */
 		vp_prints_value(buffer, sizeof(buffer), key, 0);
-		if (! (pw = get_pw_nam(buffer, inst->ht)) ) {
+		if (! (pw = get_pw_nam(buffer, inst->ht, &cursor)) ) {
 			continue;
 		}
 		do {
 			addresult(inst, request, &request->config_items, pw, 0, "config_items");
 			addresult(inst, request, &request->reply->vps, pw, 1, "reply_items");
 			addresult(inst, request, &request->packet->vps, 	pw, 2, "request_items");
-		} while ( (pw = get_next(buffer, inst->ht)) );
+		} while ( (pw = get_next(buffer, inst->ht, &cursor)) );
 		found++;
 		if (!inst->allowmultiple) break;
 	}
@@ -551,7 +620,7 @@ static int passwd_map(void *instance, REQUEST *request)
 module_t rlm_passwd = {
 	RLM_MODULE_INIT,
 	"passwd",
-	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,   	/* type */
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE | RLM_TYPE_HUP_BACKGROUND,   	/* type */
 	passwd_instantiate,		/* instantiation */
 	passwd_detach,			/* detach */
 	{
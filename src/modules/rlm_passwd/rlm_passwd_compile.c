@@ -0,0 +1,180 @@
+/*
+ * rlm_passwd_compile.c	Compile a passwd file into a snapshot for rlm_passwd.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"passwd_snapshot.h"
+
+#include	<sys/time.h>
+
+static const char *progname = "rlm_passwd_compile";
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: %s [-d delimiter] [-k] [-q] -f format infile outfile\n", progname);
+	fprintf(stderr, "  -d delimiter   Field separator in infile (default ':')\n");
+	fprintf(stderr, "  -f format      The \"format\" from the passwd module configuration\n");
+	fprintf(stderr, "  -k             Keep NIS-like records (\"ignorenislike = no\")\n");
+	fprintf(stderr, "  -q             Don't print statistics\n");
+	exit(1);
+}
+
+/*
+ *	Work out the number of fields, the key field, and whether the
+ *	key is a list, from the format.  This is the same syntax as the
+ *	module uses.
+ */
+static int parse_format(const char *format, passwd_snapshot_format_t *fmt)
+{
+	const char *p = format;
+
+	fmt->nfields = 0;
+	fmt->keyfield = -1;
+	fmt->islist = 0;
+
+	while (1) {
+		if (*p == '*') {
+			fmt->keyfield = fmt->nfields;
+			p++;
+		}
+		if (*p == ',') {
+			fmt->islist = 1;
+			p++;
+		}
+		if (*p == '=') p++;
+		if (*p == '~') p++;
+
+		fmt->nfields++;
+
+		p = strchr(p, ':');
+		if (!p) break;
+		p++;
+	}
+
+	if (fmt->keyfield < 0) {
+		fprintf(stderr, "%s: No field marked as key in format \"%s\"\n",
+			progname, format);
+		return -1;
+	}
+
+	if (fmt->nfields > PASSWD_SNAPSHOT_MAX_FIELDS) {
+		fprintf(stderr, "%s: Too many fields in format \"%s\"\n",
+			progname, format);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Make sure that every key can be found again.
+ */
+static int verify(const char *filename, const passwd_snapshot_format_t *fmt)
+{
+	unsigned int i, num, count;
+	const char *name;
+	char errbuf[1024];
+	char *fields[PASSWD_SNAPSHOT_MAX_FIELDS];
+	passwd_snapshot_t *snap;
+
+	snap = passwd_snapshot_open(filename, fmt, errbuf, sizeof(errbuf));
+	if (!snap) {
+		fprintf(stderr, "%s: %s\n", progname, errbuf);
+		return -1;
+	}
+
+	num = passwd_snapshot_num_keys(snap);
+	for (i = 0; i < num; i++) {
+		name = passwd_snapshot_key(snap, i);
+		if (!name ||
+		    (passwd_snapshot_find(snap, name, &count) != (int) i) ||
+		    (passwd_snapshot_record(snap, i, count - 1, fields) < 0)) {
+			fprintf(stderr, "%s: Verification of %s failed at key %u\n",
+				progname, filename, i);
+			passwd_snapshot_close(snap);
+			return -1;
+		}
+	}
+
+	passwd_snapshot_close(snap);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, quiet = 0;
+	unsigned int num_keys, num_records;
+	char *format = NULL;
+	char errbuf[1024];
+	struct timeval start, end;
+	passwd_snapshot_format_t fmt;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.delimiter = ':';
+	fmt.ignorenis = 1;
+
+	while ((c = getopt(argc, argv, "d:f:kq")) != EOF) {
+		switch (c) {
+		case 'd':
+			if (!optarg[0] || (optarg[0] == '\n')) usage();
+			fmt.delimiter = optarg[0];
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'k':
+			fmt.ignorenis = 0;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (!format || (argc != 2)) usage();
+
+	if (parse_format(format, &fmt) < 0) exit(1);
+
+	gettimeofday(&start, NULL);
+	if (passwd_snapshot_write(argv[0], argv[1], &fmt, &num_keys,
+				  &num_records, errbuf, sizeof(errbuf)) < 0) {
+		fprintf(stderr, "%s: %s\n", progname, errbuf);
+		exit(1);
+	}
+
+	if (verify(argv[1], &fmt) < 0) exit(1);
+	gettimeofday(&end, NULL);
+
+	if (!quiet) {
+		printf("%s: %u records, %u keys, %.3f seconds\n", argv[1],
+		       num_records, num_keys,
+		       (end.tv_sec - start.tv_sec) +
+		       (end.tv_usec - start.tv_usec) / 1000000.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * perl_pool.c	Bounded pool of cloned Perl interpreters.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"perl_pool.h"
+
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#else
+/*
+ *	Without threads there's only ever one call in progress, so
+ *	there's always an idle clone, and nothing ever waits.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#define pthread_cond_wait(a,b)
+#define pthread_cond_signal(a)
+#define pthread_cond_init(a,b)
+#define pthread_cond_destroy(a)
+#endif
+
+/*
+ *	A Perl interpreter can only be used by one thread at a time.
+ *	Rather than giving every server thread its own clone, we keep
+ *	a bounded pool of them.  A call takes an idle clone, and puts
+ *	it back when it's done.  If there are none idle, and the pool
+ *	isn't full, another clone is made.  Otherwise, the call waits
+ *	for one to come back.
+ *
+ *	Cloning is done with the pool locked, because perl_clone()
+ *	walks the parent interpreter, and two threads can't safely
+ *	do that at the same time.
+ */
+struct perl_pool_t {
+	void		*parent;
+	perl_pool_clone_t clone;
+	perl_pool_destroy_t destroy;
+
+	int		num_clones;
+	int		max_clones;
+	perl_clone_t	*clones;	/* array of max_clones */
+	perl_clone_t	*idle;
+	uint64_t	waits;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+#endif
+};
+
+
+/*
+ *	Called with the pool locked.
+ */
+static perl_clone_t *perl_pool_grow(perl_pool_t *pool)
+{
+	perl_clone_t *c;
+
+	if (pool->num_clones >= pool->max_clones) return NULL;
+
+	c = &pool->clones[pool->num_clones];
+	c->interp = pool->clone(pool->parent);
+	if (!c->interp) return NULL;
+
+	c->id = pool->num_clones++;
+	c->calls = 0;
+	c->next = NULL;
+
+	return c;
+}
+
+perl_pool_t *perl_pool_create(void *parent, int start, int max,
+			      perl_pool_clone_t clone,
+			      perl_pool_destroy_t destroy)
+{
+	int i;
+	perl_pool_t *pool;
+	perl_clone_t *c;
+
+	if (max < 1) max = 1;
+	if (start > max) start = max;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool) return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	pool->clones = malloc(max * sizeof(*pool->clones));
+	if (!pool->clones) {
+		free(pool);
+		return NULL;
+	}
+	memset(pool->clones, 0, max * sizeof(*pool->clones));
+
+	pool->parent = parent;
+	pool->clone = clone;
+	pool->destroy = destroy;
+	pool->max_clones = max;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	/*
+	 *	Clone the ones we were asked for now, so that the
+	 *	first requests don't pay for it.
+	 */
+	for (i = 0; i < start; i++) {
+		c = perl_pool_grow(pool);
+		if (!c) {
+			perl_pool_free(pool);
+			return NULL;
+		}
+
+		c->next = pool->idle;
+		pool->idle = c;
+	}
+
+	return pool;
+}
+
+/*
+ *	All of the clones must have been put back.
+ */
+void perl_pool_free(perl_pool_t *pool)
+{
+	int i;
+
+	if (!pool) return;
+
+	for (i = 0; i < pool->num_clones; i++) {
+		pool->destroy(pool->clones[i].interp);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	free(pool->clones);
+	free(pool);
+}
+
+perl_clone_t *perl_pool_get(perl_pool_t *pool)
+{
+	perl_clone_t *c;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->idle) {
+		c = perl_pool_grow(pool);
+		if (c) {
+			c->calls++;
+			pthread_mutex_unlock(&pool->mutex);
+			return c;
+		}
+
+		/*
+		 *	The pool is full, or we couldn't clone.  If
+		 *	nothing is out, then waiting won't help.
+		 */
+		if (pool->num_clones == 0) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+
+		pool->waits++;
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+
+	c = pool->idle;
+	pool->idle = c->next;
+	c->next = NULL;
+	c->calls++;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return c;
+}
+
+void perl_pool_put(perl_pool_t *pool, perl_clone_t *c)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	c->next = pool->idle;
+	pool->idle = c;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int perl_pool_num_clones(perl_pool_t *pool)
+{
+	return pool->num_clones;
+}
+
+const perl_clone_t *perl_pool_clone(perl_pool_t *pool, int id)
+{
+	if ((id < 0) || (id >= pool->num_clones)) return NULL;
+
+	return &pool->clones[id];
+}
+
+uint64_t perl_pool_waits(perl_pool_t *pool)
+{
+	return pool->waits;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../ `perl -MExtUtils::Embed -e ccopts` \
+ *	perl_pool.c ../../lib/.libs/libfreeradius-radius.a \
+ *	`perl -MExtUtils::Embed -e ldopts` -o perl_pool
+ *
+ *  ./perl_pool [num_threads] [calls per thread] [loop count]
+ *
+ *  Every thread calls a small Perl function as fast as it can.
+ *  It's run first with a pool of one clone, which is what a
+ *  thread-unsafe module gets, and then with one clone per thread.
+ */
+#ifdef DEBUG
+#undef DEBUG
+#endif
+#ifdef INADDR_ANY
+#undef INADDR_ANY
+#endif
+
+#include <EXTERN.h>
+#include <perl.h>
+#include <sys/time.h>
+
+static const char *bench_script =
+	"sub work {"
+	"  my $s = 0;"
+	"  for my $i (1 .. $_[0]) { $s += $i * 2 }"
+	"  return $s;"
+	"}";
+
+typedef struct bench_t {
+	perl_pool_t	*pool;
+	int		num_calls;
+	int		loops;
+	long		result;
+} bench_t;
+
+static void *bench_clone(void *parent)
+{
+	PerlInterpreter *interp;
+
+	PERL_SET_CONTEXT((PerlInterpreter *) parent);
+	interp = perl_clone(parent, 0);
+	{
+		dTHXa(interp);
+		PERL_SET_CONTEXT(interp);
+		ptr_table_free(PL_ptr_table);
+		PL_ptr_table = NULL;
+	}
+
+	return interp;
+}
+
+static void bench_destroy(void *arg)
+{
+	PerlInterpreter *interp = arg;
+
+	PERL_SET_CONTEXT(interp);
+	perl_destruct(interp);
+	perl_free(interp);
+}
+
+static void *bench_thread(void *arg)
+{
+	int i;
+	bench_t *b = arg;
+	perl_clone_t *c;
+
+	for (i = 0; i < b->num_calls; i++) {
+		c = perl_pool_get(b->pool);
+		if (!c) {
+			fprintf(stderr, "No interpreter\n");
+			exit(1);
+		}
+
+		PERL_SET_CONTEXT((PerlInterpreter *) c->interp);
+		{
+			dTHXa((PerlInterpreter *) c->interp);
+			dSP;
+
+			ENTER;
+			SAVETMPS;
+			PUSHMARK(SP);
+			XPUSHs(sv_2mortal(newSViv(b->loops)));
+			PUTBACK;
+
+			if (call_pv("work", G_SCALAR) == 1) {
+				SPAGAIN;
+				b->result += POPi;
+				PUTBACK;
+			}
+
+			FREETMPS;
+			LEAVE;
+		}
+
+		perl_pool_put(b->pool, c);
+	}
+
+	return NULL;
+}
+
+static double bench_run(PerlInterpreter *parent, int num_threads,
+			int max_clones, int num_calls, int loops)
+{
+	int i;
+	double usec;
+	struct timeval start, end;
+	pthread_t *tids;
+	bench_t *b;
+	perl_pool_t *pool;
+
+	pool = perl_pool_create(parent, max_clones, max_clones,
+				bench_clone, bench_destroy);
+	if (!pool) {
+		fprintf(stderr, "Failed creating pool\n");
+		exit(1);
+	}
+
+	tids = malloc(num_threads * sizeof(*tids));
+	b = malloc(num_threads * sizeof(*b));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_threads; i++) {
+		b[i].pool = pool;
+		b[i].num_calls = num_calls;
+		b[i].loops = loops;
+		b[i].result = 0;
+		pthread_create(&tids[i], NULL, bench_thread, &b[i]);
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+
+	usec = ((end.tv_sec - start.tv_sec) * 1000000.0) +
+		(end.tv_usec - start.tv_usec);
+
+	printf("%2d threads, %2d clones: %8.0f calls/s, %llu waits\n",
+	       num_threads, max_clones,
+	       (num_threads * num_calls) / (usec / 1000000.0),
+	       (unsigned long long) perl_pool_waits(pool));
+	for (i = 0; i < perl_pool_num_clones(pool); i++) {
+		printf("\tclone %d: %llu calls\n", i,
+		       (unsigned long long) perl_pool_clone(pool, i)->calls);
+	}
+
+	perl_pool_free(pool);
+	free(tids);
+	free(b);
+
+	return usec;
+}
+
+int main(int argc, char **argv, char **env)
+{
+	int num_threads, num_calls, loops;
+	char *embed[] = { "", "-e", "0", NULL };
+	int embed_argc = 3;
+	char **embed_argv = embed;
+	PerlInterpreter *parent;
+
+	num_threads = (argc > 1) ? atoi(argv[1]) : 4;
+	num_calls = (argc > 2) ? atoi(argv[2]) : 20000;
+	loops = (argc > 3) ? atoi(argv[3]) : 100;
+
+	PERL_SYS_INIT3(&embed_argc, &embed_argv, &env);
+	parent = perl_alloc();
+	perl_construct(parent);
+	PERL_SET_CONTEXT(parent);
+	perl_parse(parent, NULL, embed_argc, embed_argv, NULL);
+	perl_run(parent);
+	{
+		dTHXa(parent);
+		eval_pv(bench_script, TRUE);
+	}
+
+	bench_run(parent, num_threads, 1, num_calls, loops);
+	bench_run(parent, num_threads, num_threads, num_calls, loops);
+
+	PERL_SET_CONTEXT(parent);
+	perl_destruct(parent);
+	perl_free(parent);
+	PERL_SYS_TERM();
+
+	return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+/*
+ * perl_pool.h	Bounded pool of cloned Perl interpreters.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _PERL_POOL_H
+#define _PERL_POOL_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(perl_pool_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	The pool doesn't know anything about Perl.  The module gives
+ *	it functions to clone the parent interpreter, and to destroy
+ *	a clone.
+ */
+typedef void *(*perl_pool_clone_t)(void *parent);
+typedef void (*perl_pool_destroy_t)(void *interp);
+
+typedef struct perl_clone_t {
+	void		*interp;
+	int		id;
+	uint64_t	calls;
+	struct perl_clone_t *next;
+} perl_clone_t;
+
+typedef struct perl_pool_t perl_pool_t;
+
+perl_pool_t *perl_pool_create(void *parent, int start, int max,
+			      perl_pool_clone_t clone,
+			      perl_pool_destroy_t destroy);
+void	perl_pool_free(perl_pool_t *pool);
+
+perl_clone_t *perl_pool_get(perl_pool_t *pool);
+void	perl_pool_put(perl_pool_t *pool, perl_clone_t *clone);
+
+int	perl_pool_num_clones(perl_pool_t *pool);
+const perl_clone_t *perl_pool_clone(perl_pool_t *pool, int id);
+uint64_t perl_pool_waits(perl_pool_t *pool);
+
+#endif /* _PERL_POOL_H */
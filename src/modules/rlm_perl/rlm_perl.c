@@ -41,6 +41,8 @@ RCSID("$Id$")
 #include <dlfcn.h>
 #include <semaphore.h>
 
+#include "perl_pool.h"
+
 #ifdef __APPLE__
 extern char **environ;
 #endif
@@ -77,8 +79,12 @@ typedef struct perl_inst {
 #endif
 	char	*xlat_name;
 	char	*perl_flags;
+	int	start_clones;
+	int	max_clones;
 	PerlInterpreter *perl;
-	pthread_key_t	*thread_key;
+#ifdef USE_ITHREADS
+	perl_pool_t	*pool;
+#endif
 } PERL_INST;
 /*
  *	A mapping of configuration file names to internal variables.
@@ -126,6 +132,10 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(PERL_INST,func_start_accounting), NULL, NULL},
 	{ "func_stop_accounting", PW_TYPE_STRING_PTR,
 	  offsetof(PERL_INST,func_stop_accounting), NULL, NULL},
+	{ "start_clones", PW_TYPE_INTEGER,
+	  offsetof(PERL_INST,start_clones), NULL, "4"},
+	{ "max_clones", PW_TYPE_INTEGER,
+	  offsetof(PERL_INST,max_clones), NULL, "32"},
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -232,8 +242,9 @@ static void rlm_perl_destruct(PerlInterpreter *perl)
 	perl_free(perl);
 }
 
-static void rlm_destroy_perl(PerlInterpreter *perl)
+static void rlm_destroy_perl(void *arg)
 {
+	PerlInterpreter *perl = arg;
 	void	**handles;
 
 	dTHXa(perl);
@@ -244,22 +255,17 @@ static void rlm_destroy_perl(PerlInterpreter *perl)
 	rlm_perl_close_handles(handles);
 }
 
-/* Create Key */
-static void rlm_perl_make_key(pthread_key_t *key)
-{
-	pthread_key_create(key, rlm_destroy_perl);
-}
-
-static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
+/*
+ *	Called by the pool, with the pool locked.
+ */
+static void *rlm_perl_clone(void *arg)
 {
+	PerlInterpreter *perl = arg;
 	PerlInterpreter *interp;
 	UV clone_flags = 0;
 
 	PERL_SET_CONTEXT(perl);
 
-	interp = pthread_getspecific(*key);
-	if (interp) return interp;
-
 	interp = perl_clone(perl, clone_flags);
 	{
 		dTHXa(interp);
@@ -273,8 +279,6 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 	PERL_SET_CONTEXT(aTHX);
     	rlm_perl_clear_handles(aTHX);
 
-	pthread_setspecific(*key, interp);
-
 	return interp;
 }
 #endif
@@ -324,6 +328,9 @@ static size_t perl_xlat(void *instance, REQUEST *request, char *fmt, char *out,
 
 	PERL_INST	*inst= (PERL_INST *) instance;
 	PerlInterpreter *perl;
+#ifdef USE_ITHREADS
+	perl_clone_t	*clone;
+#endif
 	char		params[1024], *ptr, *tmp;
 	int		count;
 	size_t		ret = 0;
@@ -337,13 +344,15 @@ static size_t perl_xlat(void *instance, REQUEST *request, char *fmt, char *out,
 		return 0;
 	}
 
-#ifndef WITH_ITHREADS
-	perl = inst->perl;
-#else
-	perl = rlm_perl_clone(inst->perl,inst->thread_key);
-	{
-	  dTHXa(perl);
+#ifdef USE_ITHREADS
+	clone = perl_pool_get(inst->pool);
+	if (!clone) {
+		radlog(L_ERR, "rlm_perl: No interpreter available");
+		return 0;
 	}
+	perl = clone->interp;
+#else
+	perl = inst->perl;
 #endif
 	PERL_SET_CONTEXT(perl);
 	{
@@ -382,6 +391,9 @@ static size_t perl_xlat(void *instance, REQUEST *request, char *fmt, char *out,
 	LEAVE ;
 
 	}
+#ifdef USE_ITHREADS
+	perl_pool_put(inst->pool, clone);
+#endif
 	return ret;
 }
 /*
@@ -435,16 +447,6 @@ static int perl_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 	
-	/*
-	 *	Create pthread key. This key will be stored in instance
-	 */
-
-#ifdef USE_ITHREADS
-	inst->thread_key = rad_malloc(sizeof(*inst->thread_key));
-	memset(inst->thread_key,0,sizeof(*inst->thread_key));
-	
-	rlm_perl_make_key(inst->thread_key);
-#endif
 	embed[0] = NULL;
 	if (inst->perl_flags) {
 		embed[1] = inst->perl_flags;
@@ -524,6 +526,31 @@ static int perl_instantiate(CONF_SECTION *conf, void **instance)
 	rad_request_proxy_reply_hv = get_hv("RAD_REQUEST_PROXY_REPLY",1);
 #endif
 
+#ifdef USE_ITHREADS
+	/*
+	 *	Calls are made in clones of the interpreter, so that
+	 *	they can run at the same time.  The clones made here
+	 *	are copied into the child when the server forks.
+	 */
+	if (inst->max_clones < 1) inst->max_clones = 1;
+	if (inst->start_clones < 0) inst->start_clones = 0;
+	if (inst->start_clones > inst->max_clones) {
+		inst->start_clones = inst->max_clones;
+	}
+
+	inst->pool = perl_pool_create(inst->perl, inst->start_clones,
+				      inst->max_clones, rlm_perl_clone,
+				      rlm_destroy_perl);
+	if (!inst->pool) {
+		radlog(L_ERR, "rlm_perl: Failed cloning the interpreter");
+		rlm_perl_destruct(inst->perl);
+		free(embed);
+		free(inst);
+		return -1;
+	}
+	PERL_SET_CONTEXT(inst->perl);
+#endif
+
 	xlat_name = cf_section_name2(conf);
 	if (xlat_name == NULL)
 		xlat_name = cf_section_name1(conf);
@@ -671,13 +698,24 @@ static int rlmperl_call(void *instance, REQUEST *request, char *function_name)
 #endif
 
 #ifdef USE_ITHREADS
-	PerlInterpreter *interp;
+	perl_clone_t	*clone;
+#endif
 
-	interp = rlm_perl_clone(inst->perl,inst->thread_key);
-	{
-	  dTHXa(interp);
-	  PERL_SET_CONTEXT(interp);
+	/*
+	 *	Radius has told us to call this function, but none
+	 *	is defined.
+	 */
+	if (!function_name) {
+		return RLM_MODULE_FAIL;
 	}
+
+#ifdef USE_ITHREADS
+	clone = perl_pool_get(inst->pool);
+	if (!clone) {
+		radlog(L_ERR, "rlm_perl: No interpreter available");
+		return RLM_MODULE_FAIL;
+	}
+	PERL_SET_CONTEXT((PerlInterpreter *) clone->interp);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -687,15 +725,6 @@ static int rlmperl_call(void *instance, REQUEST *request, char *function_name)
 	ENTER;
 	SAVETMPS;
 
-
-	/*
-	 *	Radius has told us to call this function, but none
-	 *	is defined.
-	 */
-	if (!function_name) {
-		return RLM_MODULE_FAIL;
-	}
-
 	rad_reply_hv = get_hv("RAD_REPLY",1);
 	rad_check_hv = get_hv("RAD_CHECK",1);
 	rad_config_hv = get_hv("RAD_CONFIG",1);
@@ -803,6 +832,9 @@ static int rlmperl_call(void *instance, REQUEST *request, char *function_name)
 #endif
 
 	}
+#ifdef USE_ITHREADS
+	perl_pool_put(inst->pool, clone);
+#endif
 	return exitstatus;
 }
 
@@ -992,11 +1024,30 @@ static int perl_detach(void *instance)
 	}
 
 	xlat_unregister(inst->xlat_name, perl_xlat);
-	free(inst->xlat_name);
 
 #ifdef USE_ITHREADS
+	if (inst->pool) {
+		int i;
+		const perl_clone_t *c;
+
+		for (i = 0; i < perl_pool_num_clones(inst->pool); i++) {
+			c = perl_pool_clone(inst->pool, i);
+			radlog(L_DBG, "rlm_perl (%s): clone %d handled %llu calls",
+			       inst->xlat_name, c->id,
+			       (unsigned long long) c->calls);
+		}
+		radlog(L_DBG, "rlm_perl (%s): waited for a free clone %llu times",
+		       inst->xlat_name,
+		       (unsigned long long) perl_pool_waits(inst->pool));
+
+		perl_pool_free(inst->pool);
+	}
+	free(inst->xlat_name);
+
 	rlm_perl_destruct(inst->perl);
 #else
+	free(inst->xlat_name);
+
 	perl_destruct(inst->perl);
 	perl_free(inst->perl);
 #endif
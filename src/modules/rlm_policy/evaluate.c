@@ -694,10 +694,7 @@ static int evaluate_condition(policy_state_t *state, const policy_item_t *item)
 				    (rxmatch[i].rm_so == -1)) {
 					p = request_data_get(state->request, state->request,
 							     REQUEST_DATA_REGEX | i);
-					if (p) {
-						free(p);
-						continue;
-					}
+					if (p) continue;
 
 					/*
 					 *	No previous match
@@ -716,17 +713,14 @@ static int evaluate_condition(policy_state_t *state, const policy_item_t *item)
 
 				/*
 				 *	Copy substring, and add it to
-				 *	the request.
-				 *
-				 *	Note that we don't check
-				 *	for out of memory, which is
-				 *	the only error we can get...
+				 *	the request.  It's free'd
+				 *	with the request.
 				 */
-				p = strdup(rxbuffer);
+				p = request_mem_strdup(state->request, rxbuffer);
 				request_data_add(state->request,
 						 state->request,
 						 REQUEST_DATA_REGEX | i,
-						 p, free);
+						 p, NULL);
 			}
 
 		}
@@ -0,0 +1,302 @@
+/*
+ * huntgroup_index.c	Index of huntgroups by NAS address.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"huntgroup_index.h"
+
+/*
+ *	Most huntgroups entries are just "NAS-IP-Address == a.b.c.d",
+ *	sometimes with "NAS-Port < 24".  The module gives us those,
+ *	numbered in file order, and we keep them in a hash table
+ *	by address.  A lookup returns the number of the first entry
+ *	which matches the address and port, or -1.
+ *
+ *	Entries for an address are kept in file order, so the first
+ *	one whose ports match is the one the linear scan would find.
+ */
+typedef struct hunt_entry_t {
+	int		entry;
+	int		num_ranges;	/* 0 means any port */
+	hunt_range_t	*ranges;
+} hunt_entry_t;
+
+typedef struct hunt_addr_t {
+	uint32_t	ipaddr;
+	int		num_entries;
+	int		max_entries;
+	hunt_entry_t	*entries;
+} hunt_addr_t;
+
+struct hunt_index_t {
+	fr_hash_table_t	*ht;
+};
+
+
+static uint32_t hunt_addr_hash(const void *data)
+{
+	const hunt_addr_t *a = data;
+
+	return fr_hash(&a->ipaddr, sizeof(a->ipaddr));
+}
+
+static int hunt_addr_cmp(const void *one, const void *two)
+{
+	const hunt_addr_t *a = one;
+	const hunt_addr_t *b = two;
+
+	if (a->ipaddr < b->ipaddr) return -1;
+	if (a->ipaddr > b->ipaddr) return +1;
+	return 0;
+}
+
+static void hunt_addr_free(void *data)
+{
+	int i;
+	hunt_addr_t *a = data;
+
+	for (i = 0; i < a->num_entries; i++) {
+		free(a->entries[i].ranges);
+	}
+	free(a->entries);
+	free(a);
+}
+
+hunt_index_t *hunt_index_create(void)
+{
+	hunt_index_t *idx;
+
+	idx = malloc(sizeof(*idx));
+	if (!idx) return NULL;
+
+	idx->ht = fr_hash_table_create(hunt_addr_hash, hunt_addr_cmp,
+				       hunt_addr_free);
+	if (!idx->ht) {
+		free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+void hunt_index_free(hunt_index_t *idx)
+{
+	if (!idx) return;
+
+	fr_hash_table_free(idx->ht);
+	free(idx);
+}
+
+/*
+ *	Entries must be added in file order.  The ranges are copied.
+ */
+int hunt_index_add(hunt_index_t *idx, int entry, uint32_t ipaddr,
+		   const hunt_range_t *ranges, int num_ranges)
+{
+	hunt_addr_t my_addr, *a;
+	hunt_entry_t *e;
+
+	my_addr.ipaddr = ipaddr;
+	a = fr_hash_table_finddata(idx->ht, &my_addr);
+	if (!a) {
+		a = malloc(sizeof(*a));
+		if (!a) return -1;
+		memset(a, 0, sizeof(*a));
+		a->ipaddr = ipaddr;
+
+		if (!fr_hash_table_insert(idx->ht, a)) {
+			free(a);
+			return -1;
+		}
+	}
+
+	if (a->num_entries == a->max_entries) {
+		int max = a->max_entries ? a->max_entries * 2 : 1;
+
+		e = realloc(a->entries, max * sizeof(*e));
+		if (!e) return -1;
+		a->entries = e;
+		a->max_entries = max;
+	}
+
+	e = &a->entries[a->num_entries];
+	e->entry = entry;
+	e->num_ranges = num_ranges;
+	e->ranges = NULL;
+	if (num_ranges > 0) {
+		e->ranges = malloc(num_ranges * sizeof(*ranges));
+		if (!e->ranges) return -1;
+		memcpy(e->ranges, ranges, num_ranges * sizeof(*ranges));
+	}
+	a->num_entries++;
+
+	return 0;
+}
+
+int hunt_index_find(hunt_index_t *idx, uint32_t ipaddr,
+		    int have_port, uint32_t port)
+{
+	int i, j;
+	hunt_addr_t my_addr, *a;
+	hunt_entry_t *e;
+
+	my_addr.ipaddr = ipaddr;
+	a = fr_hash_table_finddata(idx->ht, &my_addr);
+	if (!a) return -1;
+
+	for (i = 0; i < a->num_entries; i++) {
+		e = &a->entries[i];
+
+		if (e->num_ranges == 0) return e->entry;
+		if (!have_port) continue;
+
+		for (j = 0; j < e->num_ranges; j++) {
+			if ((e->ranges[j].lo <= port) &&
+			    (port <= e->ranges[j].hi)) return e->entry;
+		}
+	}
+
+	return -1;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../ huntgroup_index.c ../../lib/.libs/libfreeradius-radius.a -o huntgroup_index
+ *
+ *  Compares a linear scan of the entries, as the module used to do,
+ *  with the index.
+ */
+#include <sys/time.h>
+
+typedef struct linear_entry_t {
+	uint32_t	ipaddr;
+	int		num_ranges;
+	hunt_range_t	*ranges;
+} linear_entry_t;
+
+static int linear_find(linear_entry_t *entries, int num, uint32_t ipaddr,
+		       uint32_t port)
+{
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		if (entries[i].ipaddr != ipaddr) continue;
+		if (entries[i].num_ranges == 0) return i;
+
+		for (j = 0; j < entries[i].num_ranges; j++) {
+			if ((entries[i].ranges[j].lo <= port) &&
+			    (port <= entries[i].ranges[j].hi)) return i;
+		}
+	}
+
+	return -1;
+}
+
+static double usec(struct timeval *start, struct timeval *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000000.0) +
+		(end->tv_usec - start->tv_usec);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 100, 10000, 100000 };
+	int s, i, n, loops, a, b;
+	volatile int found = 0;
+	struct timeval start, end;
+	double t_linear, t_index;
+	hunt_range_t ranges[2] = { { 1, 24 }, { 48, 48 } };
+	linear_entry_t *entries;
+	hunt_index_t *idx;
+
+	loops = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	for (s = 0; s < 3; s++) {
+		n = sizes[s];
+
+		entries = malloc(n * sizeof(*entries));
+		idx = hunt_index_create();
+
+		/*
+		 *	Every fourth entry has ports, and every eighth
+		 *	shares its address with the one before it.
+		 */
+		for (i = 0; i < n; i++) {
+			entries[i].ipaddr = htonl(0x0a000000 + i - ((i & 7) == 7));
+			entries[i].num_ranges = 0;
+			entries[i].ranges = NULL;
+			if ((i & 3) == 3) {
+				entries[i].num_ranges = 2;
+				entries[i].ranges = ranges;
+			}
+
+			hunt_index_add(idx, i, entries[i].ipaddr,
+				       entries[i].ranges, entries[i].num_ranges);
+		}
+
+		/*
+		 *	Check that they agree.
+		 */
+		for (i = 0; i < n + 10; i++) {
+			uint32_t ip = htonl(0x0a000000 + i);
+			uint32_t port = i % 50;
+
+			a = linear_find(entries, n, ip, port);
+			b = hunt_index_find(idx, ip, 1, port);
+			if (a != b) {
+				fprintf(stderr, "Mismatch at %d: linear %d index %d\n",
+					i, a, b);
+				exit(1);
+			}
+		}
+
+		/*
+		 *	Scale the linear loops down, or it takes forever.
+		 */
+		a = loops / (n / 100);
+		if (a < 100) a = 100;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < a; i++) {
+			found += linear_find(entries, n, htonl(0x0a000000 + (i % n)), i % 50);
+		}
+		gettimeofday(&end, NULL);
+		t_linear = usec(&start, &end) / a;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < loops; i++) {
+			found += hunt_index_find(idx, htonl(0x0a000000 + (i % n)), 1, i % 50);
+		}
+		gettimeofday(&end, NULL);
+		t_index = usec(&start, &end) / loops;
+
+		printf("%6d entries: linear %10.3f usec/lookup, index %.3f usec/lookup\n",
+		       n, t_linear, t_index);
+
+		free(entries);
+		hunt_index_free(idx);
+	}
+
+	return 0;
+}
+#endif
@@ -0,0 +1,45 @@
+/*
+ * huntgroup_index.h	Index of huntgroups by NAS address.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _HUNTGROUP_INDEX_H
+#define _HUNTGROUP_INDEX_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(huntgroup_index_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+typedef struct hunt_range_t {
+	uint32_t	lo;
+	uint32_t	hi;
+} hunt_range_t;
+
+typedef struct hunt_index_t hunt_index_t;
+
+hunt_index_t *hunt_index_create(void);
+void	hunt_index_free(hunt_index_t *idx);
+
+int	hunt_index_add(hunt_index_t *idx, int entry, uint32_t ipaddr,
+		       const hunt_range_t *ranges, int num_ranges);
+int	hunt_index_find(hunt_index_t *idx, uint32_t ipaddr,
+			int have_port, uint32_t port);
+
+#endif /* _HUNTGROUP_INDEX_H */
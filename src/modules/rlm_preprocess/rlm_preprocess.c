@@ -32,11 +32,26 @@ RCSID("$Id$")
 
 #include	<ctype.h>
 
+#include	"huntgroup_index.h"
+
+typedef struct hints_key_t {
+	const char	*name;
+	int		num_entries;
+	PAIR_LIST	**entries;
+} hints_key_t;
+
 typedef struct rlm_preprocess_t {
 	char		*huntgroup_file;
 	char		*hints_file;
 	PAIR_LIST	*huntgroups;
 	PAIR_LIST	*hints;
+	int		num_huntgroups;
+	PAIR_LIST	**huntgroup_list;
+	int		num_generic;
+	int		*generic;	/* entries which aren't indexed */
+	hunt_index_t	*hunt_index;
+	fr_hash_table_t	*hint_keys;
+	hints_key_t	hint_defaults;
 	int		with_ascend_hack;
 	int		ascend_channels_per_line;
 	int		with_ntdomain_hack;
@@ -316,19 +331,20 @@ static int hunt_paircmp(REQUEST *req, VALUE_PAIR *request, VALUE_PAIR *check)
  *	Add hints to the info sent by the terminal server
  *	based on the pattern of the username, and other attributes.
  */
-static int hints_setup(PAIR_LIST *hints, REQUEST *request)
+static int hints_setup(rlm_preprocess_t *data, REQUEST *request)
 {
 	char		*name;
 	VALUE_PAIR	*add;
 	VALUE_PAIR	*tmp;
 	PAIR_LIST	*i;
 	VALUE_PAIR *request_pairs;
-	int		updated = 0, ft;
+	int		updated = 0, ft, n;
+	hints_key_t	my_key, *key;
 
 
 	request_pairs = request->packet->vps;
 
-	if (hints == NULL || request_pairs == NULL)
+	if (data->hints == NULL || request_pairs == NULL)
 		return RLM_MODULE_NOOP;
 
 	/*
@@ -345,13 +361,20 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 		 */
 		return RLM_MODULE_NOOP;
 
-	for (i = hints; i; i = i->next) {
+	/*
+	 *	The entries for this name, and the DEFAULTs, in file order.
+	 */
+	my_key.name = name;
+	key = fr_hash_table_finddata(data->hint_keys, &my_key);
+	if (!key) key = &data->hint_defaults;
+
+	for (n = 0; n < key->num_entries; n++) {
+		i = key->entries[n];
+
 		/*
 		 *	Use "paircompare", which is a little more general...
 		 */
-		if (((strcmp(i->name, "DEFAULT") == 0) ||
-		     (strcmp(i->name, name) == 0)) &&
-		    (paircompare(request, request_pairs, i->check, NULL) == 0)) {
+		if (paircompare(request, request_pairs, i->check, NULL) == 0) {
 			RDEBUG2("  hints: Matched %s at %d",
 			       i->name, i->lineno);
 			/*
@@ -375,10 +398,62 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 	return RLM_MODULE_UPDATED;
 }
 
+/*
+ *	Find the first huntgroup entry which matches the request.
+ *
+ *	Entries which are only "NAS-IP-Address == x", with maybe a
+ *	NAS-Port comparison, are in the index.  The rest are checked
+ *	in order, but only those before the best match from the index.
+ */
+static PAIR_LIST *huntgroup_find(rlm_preprocess_t *data, REQUEST *request)
+{
+	int		n, best = -1;
+	VALUE_PAIR	*nas, *port;
+	VALUE_PAIR	*request_pairs = request->packet->vps;
+	PAIR_LIST	*i;
+
+	nas = pairfind(request_pairs, PW_NAS_IP_ADDRESS, 0);
+	port = pairfind(request_pairs, PW_NAS_PORT, 0);
+
+	/*
+	 *	paircompare() tries every copy of an attribute, and
+	 *	the index only looks at one.  This is rare enough
+	 *	that we just do it the slow way.
+	 */
+	if ((nas && pairfind(nas->next, PW_NAS_IP_ADDRESS, 0)) ||
+	    (port && pairfind(port->next, PW_NAS_PORT, 0))) {
+		for (i = data->huntgroups; i; i = i->next) {
+			if (paircompare(request, request_pairs, i->check, NULL) == 0) {
+				return i;
+			}
+		}
+		return NULL;
+	}
+
+	if (nas) {
+		best = hunt_index_find(data->hunt_index, nas->vp_ipaddr,
+				       (port != NULL),
+				       port ? port->vp_integer : 0);
+	}
+
+	for (n = 0; n < data->num_generic; n++) {
+		if ((best >= 0) && (data->generic[n] > best)) break;
+
+		i = data->huntgroup_list[data->generic[n]];
+		if (paircompare(request, request_pairs, i->check, NULL) == 0) {
+			return i;
+		}
+	}
+
+	if (best < 0) return NULL;
+
+	return data->huntgroup_list[best];
+}
+
 /*
  *	See if we have access to the huntgroup.
  */
-static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
+static int huntgroup_access(rlm_preprocess_t *data, REQUEST *request)
 {
 	PAIR_LIST	*i;
 	int		r = RLM_MODULE_OK;
@@ -388,16 +463,11 @@ static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
 	 *	We're not controlling access by huntgroups:
 	 *	Allow them in.
 	 */
-	if (huntgroups == NULL)
+	if (data->huntgroups == NULL)
 		return RLM_MODULE_OK;
 
-	for(i = huntgroups; i; i = i->next) {
-		/*
-		 *	See if this entry matches.
-		 */
-		if (paircompare(request, request_pairs, i->check, NULL) != 0)
-			continue;
-
+	i = huntgroup_find(data, request);
+	if (i) {
 		/*
 		 *	Now check for access.
 		 */
@@ -421,7 +491,6 @@ static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
 			}
 			r = RLM_MODULE_OK;
 		}
-		break;
 	}
 
 	return r;
@@ -467,6 +536,253 @@ static int add_nas_attr(REQUEST *request)
 }
 
 
+/*
+ *	See if a huntgroup entry can go into the index.  It has to
+ *	be "NAS-IP-Address == x", and at most one comparison of
+ *	NAS-Port with a number.  Anything else means we need
+ *	paircompare().
+ */
+static int huntgroup_indexable(PAIR_LIST *pl, uint32_t *ipaddr,
+			       hunt_range_t *range, int *num_ranges)
+{
+	VALUE_PAIR *vp;
+	VALUE_PAIR *nas = NULL, *port = NULL;
+
+	for (vp = pl->check; vp != NULL; vp = vp->next) {
+		/*
+		 *	paircompare() ignores these.
+		 */
+		if ((vp->operator == T_OP_SET) ||
+		    (vp->operator == T_OP_ADD)) continue;
+
+		if (vp->flags.do_xlat || (vp->vendor != 0)) return 0;
+
+		if ((vp->attribute == PW_NAS_IP_ADDRESS) && !nas &&
+		    (vp->operator == T_OP_CMP_EQ)) {
+			nas = vp;
+			continue;
+		}
+
+		if ((vp->attribute == PW_NAS_PORT) && !port) {
+			port = vp;
+			continue;
+		}
+
+		return 0;
+	}
+
+	if (!nas) return 0;
+
+	*ipaddr = nas->vp_ipaddr;
+	*num_ranges = 0;
+	if (!port) return 1;
+
+	/*
+	 *	The NAS-Port comparison in rlm_expr treats values
+	 *	containing ',' or '-' as a list of ranges.  Leave
+	 *	those to it.
+	 */
+	if (strchr(port->vp_strvalue, ',') ||
+	    strchr(port->vp_strvalue, '-')) return 0;
+
+	range->lo = 0;
+	range->hi = 0xffffffff;
+	switch (port->operator) {
+	case T_OP_CMP_EQ:
+		range->lo = range->hi = port->vp_integer;
+		break;
+
+	case T_OP_LT:
+		if (port->vp_integer == 0) return 0;
+		range->hi = port->vp_integer - 1;
+		break;
+
+	case T_OP_LE:
+		range->hi = port->vp_integer;
+		break;
+
+	case T_OP_GT:
+		if (port->vp_integer == 0xffffffff) return 0;
+		range->lo = port->vp_integer + 1;
+		break;
+
+	case T_OP_GE:
+		range->lo = port->vp_integer;
+		break;
+
+	default:
+		return 0;
+	}
+	*num_ranges = 1;
+
+	return 1;
+}
+
+/*
+ *	Number the huntgroups, and put the simple ones into the index.
+ */
+static int huntgroup_compile(rlm_preprocess_t *data)
+{
+	int n, num_ranges;
+	uint32_t ipaddr;
+	hunt_range_t range;
+	PAIR_LIST *pl;
+
+	for (pl = data->huntgroups; pl != NULL; pl = pl->next) {
+		data->num_huntgroups++;
+	}
+
+	data->huntgroup_list = rad_malloc((data->num_huntgroups + 1) *
+					  sizeof(data->huntgroup_list[0]));
+	data->generic = rad_malloc((data->num_huntgroups + 1) *
+				   sizeof(data->generic[0]));
+
+	data->hunt_index = hunt_index_create();
+	if (!data->hunt_index) return -1;
+
+	for (pl = data->huntgroups, n = 0; pl != NULL; pl = pl->next, n++) {
+		data->huntgroup_list[n] = pl;
+
+		if (!huntgroup_indexable(pl, &ipaddr, &range, &num_ranges)) {
+			data->generic[data->num_generic++] = n;
+			continue;
+		}
+
+		if (hunt_index_add(data->hunt_index, n, ipaddr,
+				   &range, num_ranges) < 0) return -1;
+	}
+
+	DEBUG2("rlm_preprocess: %d huntgroups, %d indexed by NAS-IP-Address",
+	       data->num_huntgroups, data->num_huntgroups - data->num_generic);
+
+	return 0;
+}
+
+static uint32_t hints_key_hash(const void *data)
+{
+	const hints_key_t *k = data;
+
+	return fr_hash_string(k->name);
+}
+
+static int hints_key_cmp(const void *one, const void *two)
+{
+	const hints_key_t *a = one;
+	const hints_key_t *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static void hints_key_free(void *data)
+{
+	hints_key_t *k = data;
+
+	free(k->entries);
+	free(k);
+}
+
+/*
+ *	Make room for a name's own entries, and all of the DEFAULTs.
+ */
+static int hints_alloc_key(void *ctx, void *data)
+{
+	int *num_defaults = ctx;
+	hints_key_t *k = data;
+
+	k->entries = rad_malloc((k->num_entries + *num_defaults) *
+				sizeof(k->entries[0]));
+	k->num_entries = 0;
+	return 0;
+}
+
+static int hints_add_default(void *ctx, void *data)
+{
+	PAIR_LIST *pl = ctx;
+	hints_key_t *k = data;
+
+	k->entries[k->num_entries++] = pl;
+	return 0;
+}
+
+/*
+ *	Build the per-name lists of hints.
+ */
+static int hints_compile(rlm_preprocess_t *data)
+{
+	int num_defaults = 0;
+	PAIR_LIST *pl;
+	hints_key_t my_key, *k;
+
+	data->hint_keys = fr_hash_table_create(hints_key_hash, hints_key_cmp,
+					       hints_key_free);
+	if (!data->hint_keys) return -1;
+
+	for (pl = data->hints; pl != NULL; pl = pl->next) {
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			num_defaults++;
+			continue;
+		}
+
+		my_key.name = pl->name;
+		k = fr_hash_table_finddata(data->hint_keys, &my_key);
+		if (!k) {
+			k = rad_malloc(sizeof(*k));
+			memset(k, 0, sizeof(*k));
+			k->name = pl->name;
+			if (!fr_hash_table_insert(data->hint_keys, k)) {
+				free(k);
+				return -1;
+			}
+		}
+		k->num_entries++;
+	}
+
+	/*
+	 *	Fill in the lists, in file order.
+	 */
+	data->hint_defaults.name = "DEFAULT";
+	data->hint_defaults.entries = rad_malloc((num_defaults + 1) *
+						 sizeof(PAIR_LIST *));
+
+	fr_hash_table_walk(data->hint_keys, hints_alloc_key, &num_defaults);
+
+	for (pl = data->hints; pl != NULL; pl = pl->next) {
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			data->hint_defaults.entries[data->hint_defaults.num_entries++] = pl;
+			fr_hash_table_walk(data->hint_keys, hints_add_default, pl);
+			continue;
+		}
+
+		my_key.name = pl->name;
+		k = fr_hash_table_finddata(data->hint_keys, &my_key);
+		rad_assert(k != NULL);
+		k->entries[k->num_entries++] = pl;
+	}
+
+	return 0;
+}
+
+/*
+ *      Clean up the module's instance.
+ */
+static int preprocess_detach(void *instance)
+{
+	rlm_preprocess_t *data = (rlm_preprocess_t *) instance;
+
+	pairlist_free(&(data->huntgroups));
+	pairlist_free(&(data->hints));
+
+	free(data->huntgroup_list);
+	free(data->generic);
+	hunt_index_free(data->hunt_index);
+	if (data->hint_keys) fr_hash_table_free(data->hint_keys);
+	free(data->hint_defaults.entries);
+
+	free(data);
+
+	return 0;
+}
+
 /*
  *	Initialize.
  */
@@ -501,10 +817,18 @@ static int preprocess_instantiate(CONF_SECTION *conf, void **instance)
 		if (rcode < 0) {
 			radlog(L_ERR|L_CONS, "rlm_preprocess: Error reading %s",
 			       data->huntgroup_file);
+			preprocess_detach(data);
 			return -1;
 		}
 	}
 
+	if (huntgroup_compile(data) < 0) {
+		radlog(L_ERR|L_CONS, "rlm_preprocess: Failed indexing %s",
+		       data->huntgroup_file);
+		preprocess_detach(data);
+		return -1;
+	}
+
 	/*
 	 *	Read the hints file.
 	 */
@@ -513,10 +837,18 @@ static int preprocess_instantiate(CONF_SECTION *conf, void **instance)
 		if (rcode < 0) {
 			radlog(L_ERR|L_CONS, "rlm_preprocess: Error reading %s",
 			       data->hints_file);
+			preprocess_detach(data);
 			return -1;
 		}
 	}
 
+	if (hints_compile(data) < 0) {
+		radlog(L_ERR|L_CONS, "rlm_preprocess: Failed indexing %s",
+		       data->hints_file);
+		preprocess_detach(data);
+		return -1;
+	}
+
 	/*
 	 *	Save the instantiation data for later.
 	 */
@@ -576,7 +908,7 @@ static int preprocess_authorize(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	hints_setup(data->hints, request);
+	hints_setup(data, request);
 
 	/*
 	 *      If there is a PW_CHAP_PASSWORD attribute but there
@@ -593,8 +925,7 @@ static int preprocess_authorize(void *instance, REQUEST *request)
 		memcpy(vp->vp_strvalue, request->packet->vector, AUTH_VECTOR_LEN);
 	}
 
-	if ((r = huntgroup_access(request,
-				  data->huntgroups)) != RLM_MODULE_OK) {
+	if ((r = huntgroup_access(data, request)) != RLM_MODULE_OK) {
 		char buf[1024];
 		radlog_request(L_AUTH, 0, request, "No huntgroup access: [%s] (%s)",
 		       request->username ? request->username->vp_strvalue : "<NO User-Name>",
@@ -642,10 +973,9 @@ static int preprocess_preaccounting(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	hints_setup(data->hints, request);
+	hints_setup(data, request);
 
-	if ((r = huntgroup_access(request,
-				  data->huntgroups)) != RLM_MODULE_OK) {
+	if ((r = huntgroup_access(data, request)) != RLM_MODULE_OK) {
 		char buf[1024];
 		radlog_request(L_INFO, 0, request, "No huntgroup access: [%s] (%s)",
 		       request->username ? request->username->vp_strvalue : "<NO User-Name>",
@@ -656,26 +986,11 @@ static int preprocess_preaccounting(void *instance, REQUEST *request)
 	return r;
 }
 
-/*
- *      Clean up the module's instance.
- */
-static int preprocess_detach(void *instance)
-{
-	rlm_preprocess_t *data = (rlm_preprocess_t *) instance;
-
-	pairlist_free(&(data->huntgroups));
-	pairlist_free(&(data->hints));
-
-	free(data);
-
-	return 0;
-}
-
 /* globally exported name */
 module_t rlm_preprocess = {
 	RLM_MODULE_INIT,
 	"preprocess",
-	RLM_TYPE_CHECK_CONFIG_SAFE,   	/* type */
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE | RLM_TYPE_HUP_BACKGROUND,	/* type */
 	preprocess_instantiate,	/* instantiation */
 	preprocess_detach,	/* detach */
 	{
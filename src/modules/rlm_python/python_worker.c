@@ -0,0 +1,842 @@
+/*
+ * python_worker.c	Pre-forked worker processes for rlm_python.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	<freeradius-devel/radiusd.h>
+
+#include	"python_worker.h"
+
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<sys/socket.h>
+#include	<sys/time.h>
+#include	<sys/wait.h>
+
+#ifdef HAVE_PTHREAD_H
+#include	<pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#endif
+
+/*
+ *	The Python interpreter has one lock, so however many threads
+ *	the server has, only one of them can be running Python code.
+ *	Instead, we fork() some copies of the server once the Python
+ *	functions have been loaded, and send the calls to them over
+ *	a socketpair.  Each worker handles one call at a time.
+ *
+ *	A call is a frame: a header, and then the attributes.  The
+ *	attributes are copied as they are in memory, as both ends
+ *	are the same binary, with the same dictionaries.  The reply
+ *	is a frame with the return code, the reply items, and then
+ *	the config items.
+ *
+ *	A caller picks the worker with the fewest calls queued for
+ *	it, and waits on its lock.  A worker which fails is marked
+ *	dead, and isn't used again.  When the server closes its end
+ *	of the socket, the worker calls the "done" function, and
+ *	exits.
+ */
+#define PW_MAX_FRAME	(1 << 20)
+
+typedef struct pw_header_t {
+	uint32_t	length;		/* of the data after the header */
+	int32_t		code;		/* function, or return code */
+	uint16_t	num[2];		/* request, or reply and config */
+} pw_header_t;
+
+typedef struct pw_vp_t {
+	uint32_t	attribute;
+	uint32_t	vendor;
+	uint32_t	lvalue;
+	uint16_t	length;
+	uint8_t		type;
+	uint8_t		operator;
+	int8_t		tag;
+	uint8_t		pad[3];
+} pw_vp_t;
+
+typedef struct pw_buf_t {
+	uint8_t		*data;
+	size_t		len;
+	size_t		size;
+} pw_buf_t;
+
+typedef struct python_worker_t {
+	pid_t		pid;
+	int		fd;
+	int		dead;
+	pw_buf_t	buf;
+	int		queued;		/* the stats are protected by the pool mutex */
+	int		queued_max;
+	uint64_t	calls;
+	uint64_t	usec;
+	uint32_t	usec_max;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} python_worker_t;
+
+struct python_pool_t {
+	int		num_workers;
+	python_worker_t	*workers;
+	int		next;
+	const python_pool_ops_t *ops;
+	void		*ctx;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+};
+
+
+static int pw_grow(pw_buf_t *buf, size_t need)
+{
+	size_t size;
+	uint8_t *data;
+
+	if (buf->len + need <= buf->size) return 0;
+
+	size = buf->size ? buf->size : 4096;
+	while (size < buf->len + need) size *= 2;
+
+	data = realloc(buf->data, size);
+	if (!data) {
+		radlog(L_ERR, "rlm_python: Out of memory");
+		return -1;
+	}
+	buf->data = data;
+	buf->size = size;
+
+	return 0;
+}
+
+/*
+ *	These live in "lvalue", not in the data.
+ */
+static int pw_is_lvalue(int type)
+{
+	switch (type) {
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_IPADDR:
+	case PW_TYPE_DATE:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+		return 1;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int pw_encode(pw_buf_t *buf, VALUE_PAIR *vps, uint16_t *count)
+{
+	size_t length;
+	pw_vp_t rec;
+	VALUE_PAIR *vp;
+
+	*count = 0;
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		/*
+		 *	TLVs point to their data.  They're never
+		 *	seen by the Python code, either.
+		 */
+		if (vp->type == PW_TYPE_TLV) continue;
+		if (*count == 65535) break;
+
+		length = pw_is_lvalue(vp->type) ? 0 : vp->length;
+		if (length >= sizeof(vp->data)) continue;
+
+		if (pw_grow(buf, sizeof(rec) + length) < 0) return -1;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.attribute = vp->attribute;
+		rec.vendor = vp->vendor;
+		rec.lvalue = vp->lvalue;
+		rec.length = vp->length;
+		rec.type = vp->type;
+		rec.operator = vp->operator;
+		rec.tag = vp->flags.tag;
+
+		memcpy(buf->data + buf->len, &rec, sizeof(rec));
+		buf->len += sizeof(rec);
+		if (length > 0) {
+			memcpy(buf->data + buf->len, &vp->data, length);
+			buf->len += length;
+		}
+
+		(*count)++;
+	}
+
+	return 0;
+}
+
+/*
+ *	Returns the number of bytes used, or -1 on error.
+ */
+static ssize_t pw_decode(const uint8_t *data, size_t len, int count,
+			 VALUE_PAIR **out)
+{
+	int i;
+	size_t used = 0, length;
+	pw_vp_t rec;
+	VALUE_PAIR *head = NULL, **tail = &head, *vp;
+
+	for (i = 0; i < count; i++) {
+		if ((len - used) < sizeof(rec)) goto malformed;
+		memcpy(&rec, data + used, sizeof(rec));
+		used += sizeof(rec);
+
+		length = pw_is_lvalue(rec.type) ? 0 : rec.length;
+		if ((length >= sizeof(vp->data)) ||
+		    ((len - used) < length)) goto malformed;
+
+		vp = paircreate(rec.attribute, rec.vendor, rec.type);
+		if (!vp) {
+			pairfree(&head);
+			return -1;
+		}
+
+		vp->operator = rec.operator;
+		vp->flags.tag = rec.tag;
+		vp->lvalue = rec.lvalue;
+		vp->length = rec.length;
+		if (length > 0) {
+			memcpy(&vp->data, data + used, length);
+			used += length;
+		}
+		if (vp->type == PW_TYPE_STRING) vp->vp_strvalue[length] = '\0';
+
+		*tail = vp;
+		tail = &vp->next;
+	}
+
+	*out = head;
+	return used;
+
+malformed:
+	radlog(L_ERR, "rlm_python: Malformed attributes in frame");
+	pairfree(&head);
+	return -1;
+}
+
+static int pw_write(int fd, const uint8_t *data, size_t len)
+{
+	ssize_t rcode;
+
+	while (len > 0) {
+		rcode = write(fd, data, len);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			radlog(L_ERR, "rlm_python: Failed writing to worker: %s",
+			       strerror(errno));
+			return -1;
+		}
+
+		data += rcode;
+		len -= rcode;
+	}
+
+	return 0;
+}
+
+/*
+ *	Returns 1 when it has read everything, 0 on EOF before
+ *	anything was read, and -1 on error.
+ */
+static int pw_read(int fd, uint8_t *data, size_t len)
+{
+	ssize_t rcode;
+	size_t total = 0;
+
+	while (total < len) {
+		rcode = read(fd, data + total, len - total);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			radlog(L_ERR, "rlm_python: Failed reading from worker: %s",
+			       strerror(errno));
+			return -1;
+		}
+
+		if (rcode == 0) {
+			if (total == 0) return 0;
+			radlog(L_ERR, "rlm_python: Worker closed the socket");
+			return -1;
+		}
+
+		total += rcode;
+	}
+
+	return 1;
+}
+
+/*
+ *	Encode one or two lists into the buffer, after room for the
+ *	header, and send it.
+ */
+static int pw_send(int fd, pw_buf_t *buf, int code,
+		   VALUE_PAIR *one, VALUE_PAIR *two)
+{
+	pw_header_t hdr;
+
+	buf->len = 0;
+	if (pw_grow(buf, sizeof(hdr)) < 0) return -1;
+	buf->len = sizeof(hdr);
+
+	memset(&hdr, 0, sizeof(hdr));
+	if ((pw_encode(buf, one, &hdr.num[0]) < 0) ||
+	    (pw_encode(buf, two, &hdr.num[1]) < 0)) return -1;
+
+	hdr.length = buf->len - sizeof(hdr);
+	hdr.code = code;
+	memcpy(buf->data, &hdr, sizeof(hdr));
+
+	return pw_write(fd, buf->data, buf->len);
+}
+
+static int pw_recv(int fd, pw_buf_t *buf, int *code,
+		   VALUE_PAIR **one, VALUE_PAIR **two)
+{
+	int rcode;
+	ssize_t used;
+	pw_header_t hdr;
+
+	*one = *two = NULL;
+
+	rcode = pw_read(fd, (uint8_t *) &hdr, sizeof(hdr));
+	if (rcode <= 0) return rcode;
+
+	if (hdr.length > PW_MAX_FRAME) {
+		radlog(L_ERR, "rlm_python: Frame is too large");
+		return -1;
+	}
+
+	buf->len = 0;
+	if (pw_grow(buf, hdr.length) < 0) return -1;
+	if (pw_read(fd, buf->data, hdr.length) <= 0) return -1;
+
+	used = pw_decode(buf->data, hdr.length, hdr.num[0], one);
+	if (used < 0) return -1;
+
+	if (pw_decode(buf->data + used, hdr.length - used,
+		      hdr.num[1], two) < 0) {
+		pairfree(one);
+		return -1;
+	}
+
+	*code = hdr.code;
+	return 1;
+}
+
+/*
+ *	The worker side.  This never returns.
+ */
+static void python_worker_run(python_pool_t *pool, int fd)
+{
+	int func, rcode;
+	pw_buf_t buf;
+	VALUE_PAIR *vps, *unused, *reply, *config;
+
+	memset(&buf, 0, sizeof(buf));
+
+	while (pw_recv(fd, &buf, &func, &vps, &unused) > 0) {
+		pairfree(&unused);
+
+		reply = config = NULL;
+		rcode = pool->ops->call(pool->ctx, func, vps, &reply, &config);
+		pairfree(&vps);
+
+		if (pw_send(fd, &buf, rcode, reply, config) < 0) {
+			pairfree(&reply);
+			pairfree(&config);
+			break;
+		}
+
+		pairfree(&reply);
+		pairfree(&config);
+	}
+
+	if (pool->ops->done) pool->ops->done(pool->ctx);
+
+	_exit(0);
+}
+
+python_pool_t *python_pool_create(int num_workers,
+				  const python_pool_ops_t *ops, void *ctx)
+{
+	int i, j, sv[2];
+	pid_t pid;
+	python_pool_t *pool;
+	python_worker_t *w;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool) return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	pool->workers = malloc(num_workers * sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	memset(pool->workers, 0, num_workers * sizeof(*pool->workers));
+
+	pool->ops = ops;
+	pool->ctx = ctx;
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	for (i = 0; i < num_workers; i++) {
+		w = &pool->workers[i];
+		w->fd = -1;
+		w->dead = 1;
+		pthread_mutex_init(&w->mutex, NULL);
+		pool->num_workers++;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			radlog(L_ERR, "rlm_python: Failed creating socket: %s",
+			       strerror(errno));
+			python_pool_free(pool);
+			return NULL;
+		}
+
+		if (ops->prefork) ops->prefork(ctx);
+
+		pid = fork();
+		if (pid == 0) {
+			if (ops->postfork) ops->postfork(ctx, 1);
+
+			close(sv[0]);
+			for (j = 0; j < i; j++) close(pool->workers[j].fd);
+
+			/*
+			 *	The server tells us to go away by
+			 *	closing the socket.
+			 */
+			signal(SIGHUP, SIG_IGN);
+			signal(SIGINT, SIG_IGN);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+
+			python_worker_run(pool, sv[1]);
+		}
+
+		if (ops->postfork) ops->postfork(ctx, 0);
+		close(sv[1]);
+
+		if (pid < 0) {
+			radlog(L_ERR, "rlm_python: Failed forking worker: %s",
+			       strerror(errno));
+			close(sv[0]);
+			python_pool_free(pool);
+			return NULL;
+		}
+
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		w->fd = sv[0];
+		w->pid = pid;
+		w->dead = 0;
+	}
+
+	return pool;
+}
+
+void python_pool_free(python_pool_t *pool)
+{
+	int i, status;
+	python_worker_t *w;
+
+	if (!pool) return;
+
+	/*
+	 *	Close all of the sockets first, so that the workers
+	 *	can exit in parallel.
+	 */
+	for (i = 0; i < pool->num_workers; i++) {
+		w = &pool->workers[i];
+
+		pthread_mutex_lock(&w->mutex);
+		if (w->fd >= 0) close(w->fd);
+		w->fd = -1;
+		w->dead = 1;
+		pthread_mutex_unlock(&w->mutex);
+	}
+
+	for (i = 0; i < pool->num_workers; i++) {
+		w = &pool->workers[i];
+
+		/*
+		 *	The server may already have reaped it.
+		 */
+		if (w->pid > 0) waitpid(w->pid, &status, 0);
+
+		free(w->buf.data);
+		pthread_mutex_destroy(&w->mutex);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool);
+}
+
+static void python_worker_failed(python_worker_t *w)
+{
+	close(w->fd);
+	w->fd = -1;
+	w->dead = 1;
+}
+
+/*
+ *	Returns the return code of the function, or -1 if the call
+ *	couldn't be made.  The reply and config items are added to
+ *	the lists.
+ */
+int python_pool_call(python_pool_t *pool, int func, VALUE_PAIR *vps,
+		     VALUE_PAIR **reply, VALUE_PAIR **config)
+{
+	int i, rcode, io, answered;
+	uint32_t usec;
+	struct timeval start, end;
+	python_worker_t *w = NULL, *this;
+	VALUE_PAIR *r, *c;
+
+	/*
+	 *	Start looking after the last one we picked, so that
+	 *	idle workers are used in turn.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->num_workers; i++) {
+		this = &pool->workers[(pool->next + i) % pool->num_workers];
+		if (this->dead) continue;
+
+		if (!w || (this->queued < w->queued)) w = this;
+		if (w->queued == 0) break;
+	}
+
+	if (!w) {
+		pthread_mutex_unlock(&pool->mutex);
+		radlog(L_ERR, "rlm_python: No workers are running");
+		return -1;
+	}
+
+	pool->next = (w - pool->workers) + 1;
+	w->queued++;
+	if (w->queued > w->queued_max) w->queued_max = w->queued;
+	pthread_mutex_unlock(&pool->mutex);
+
+	rcode = -1;
+	r = c = NULL;
+	answered = 0;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->dead) {
+		radlog(L_ERR, "rlm_python: Worker %d exited", (int) w->pid);
+		goto done;
+	}
+
+	gettimeofday(&start, NULL);
+
+	if (pw_send(w->fd, &w->buf, func, vps, NULL) < 0) {
+		python_worker_failed(w);
+		goto done;
+	}
+
+	io = pw_recv(w->fd, &w->buf, &rcode, &r, &c);
+	if (io <= 0) {
+		if (io == 0) radlog(L_ERR, "rlm_python: Worker %d exited",
+				    (int) w->pid);
+		python_worker_failed(w);
+		rcode = -1;
+		goto done;
+	}
+
+	gettimeofday(&end, NULL);
+	usec = ((end.tv_sec - start.tv_sec) * 1000000) +
+		(end.tv_usec - start.tv_usec);
+	answered = 1;
+
+done:
+	pthread_mutex_unlock(&w->mutex);
+
+	/*
+	 *	The statistics are read under the pool mutex, so
+	 *	they're updated under it, too.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	w->queued--;
+	if (answered) {
+		w->calls++;
+		w->usec += usec;
+		if (usec > w->usec_max) w->usec_max = usec;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (r) pairadd(reply, r);
+	if (c) pairadd(config, c);
+
+	return rcode;
+}
+
+int python_pool_num_workers(python_pool_t *pool)
+{
+	return pool->num_workers;
+}
+
+int python_pool_stats(python_pool_t *pool, int worker,
+		      python_worker_stats_t *stats)
+{
+	python_worker_t *w;
+
+	if ((worker < 0) || (worker >= pool->num_workers)) return -1;
+	w = &pool->workers[worker];
+
+	pthread_mutex_lock(&pool->mutex);
+	stats->pid = w->pid;
+	stats->dead = w->dead;
+	stats->queued = w->queued;
+	stats->queued_max = w->queued_max;
+	stats->calls = w->calls;
+	stats->usec = w->usec;
+	stats->usec_max = w->usec_max;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../ python_worker.c ../../lib/.libs/libfreeradius-radius.a -lpthread -o python_worker
+ *
+ *  ./python_worker [num_threads] [calls per thread] [usec of work per call]
+ *
+ *  Times encoding and decoding a typical Access-Request, and then
+ *  has every thread make calls as fast as it can, through one
+ *  worker, and then through one worker per thread.  The workers
+ *  spin for the given time, in place of running Python code.
+ */
+typedef struct bench_t {
+	python_pool_t	*pool;
+	int		num_calls;
+	int		failed;
+} bench_t;
+
+static int bench_work;
+
+int radlog(int lvl, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	return lvl;
+}
+
+static int bench_same(VALUE_PAIR *a, VALUE_PAIR *b)
+{
+	while (a && b) {
+		if ((a->attribute != b->attribute) ||
+		    (a->vendor != b->vendor) ||
+		    (a->lvalue != b->lvalue) ||
+		    (a->length != b->length)) return 0;
+		if (!pw_is_lvalue(a->type) &&
+		    (memcmp(&a->data, &b->data, a->length) != 0)) return 0;
+
+		a = a->next;
+		b = b->next;
+	}
+
+	return (a == b);
+}
+
+static double usec_since(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return ((end.tv_sec - start->tv_sec) * 1000000.0) +
+		(end.tv_usec - start->tv_usec);
+}
+
+static int bench_call(UNUSED void *ctx, UNUSED int func, VALUE_PAIR *vps,
+		      VALUE_PAIR **reply, UNUSED VALUE_PAIR **config)
+{
+	struct timeval start;
+
+	if (!pairfind(vps, PW_USER_NAME, 0)) return 1;
+
+	gettimeofday(&start, NULL);
+	while (usec_since(&start) < bench_work) {
+		/* nothing */
+	}
+
+	pairadd(reply, pairmake("Reply-Message", "Hello", T_OP_EQ));
+	pairadd(reply, pairmake("Session-Timeout", "3600", T_OP_EQ));
+	return 2;
+}
+
+static const python_pool_ops_t bench_ops = {
+	NULL, NULL, bench_call, NULL
+};
+
+static VALUE_PAIR *bench_request;
+
+static void *bench_thread(void *arg)
+{
+	int i;
+	bench_t *b = arg;
+	VALUE_PAIR *reply;
+
+	for (i = 0; i < b->num_calls; i++) {
+		reply = NULL;
+		if (python_pool_call(b->pool, 0, bench_request,
+				     &reply, &reply) != 2) b->failed++;
+		if (!pairfind(reply, PW_REPLY_MESSAGE, 0)) b->failed++;
+		pairfree(&reply);
+	}
+
+	return NULL;
+}
+
+static void bench_run(int num_threads, int num_workers, int num_calls)
+{
+	int i;
+	double usec;
+	struct timeval start;
+	pthread_t *tids;
+	bench_t *b;
+	python_pool_t *pool;
+	python_worker_stats_t stats;
+
+	pool = python_pool_create(num_workers, &bench_ops, NULL);
+	if (!pool) {
+		fprintf(stderr, "Failed creating pool\n");
+		exit(1);
+	}
+
+	tids = malloc(num_threads * sizeof(*tids));
+	b = malloc(num_threads * sizeof(*b));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_threads; i++) {
+		b[i].pool = pool;
+		b[i].num_calls = num_calls;
+		b[i].failed = 0;
+		pthread_create(&tids[i], NULL, bench_thread, &b[i]);
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(tids[i], NULL);
+		if (b[i].failed) {
+			fprintf(stderr, "Thread %d: %d calls failed\n",
+				i, b[i].failed);
+			exit(1);
+		}
+	}
+	usec = usec_since(&start);
+
+	printf("%2d threads, %2d workers: %8.0f calls/s\n",
+	       num_threads, num_workers,
+	       (num_threads * num_calls) / (usec / 1000000.0));
+
+	for (i = 0; i < num_workers; i++) {
+		python_pool_stats(pool, i, &stats);
+		printf("\tworker %d: %8llu calls, %6.1f usec avg, %6u usec max, queue max %d\n",
+		       i, (unsigned long long) stats.calls,
+		       stats.calls ? (double) stats.usec / stats.calls : 0.0,
+		       stats.usec_max, stats.queued_max);
+	}
+
+	python_pool_free(pool);
+	free(tids);
+	free(b);
+}
+
+int main(int argc, char **argv)
+{
+	int i, loops, num_threads, num_calls;
+	uint16_t count;
+	struct timeval start;
+	pw_buf_t buf;
+	VALUE_PAIR *vps;
+
+	num_threads = (argc > 1) ? atoi(argv[1]) : 4;
+	num_calls = (argc > 2) ? atoi(argv[2]) : 20000;
+	bench_work = (argc > 3) ? atoi(argv[3]) : 20;
+
+	if (dict_init("../../../share", "dictionary") < 0) {
+		fprintf(stderr, "%s\n", fr_strerror());
+		exit(1);
+	}
+
+	pairadd(&bench_request, pairmake("User-Name", "bob@example.com", T_OP_EQ));
+	pairadd(&bench_request, pairmake("User-Password", "hello", T_OP_EQ));
+	pairadd(&bench_request, pairmake("NAS-IP-Address", "192.0.2.1", T_OP_EQ));
+	pairadd(&bench_request, pairmake("NAS-Port", "1234", T_OP_EQ));
+	pairadd(&bench_request, pairmake("NAS-Port-Type", "Ethernet", T_OP_EQ));
+	pairadd(&bench_request, pairmake("Service-Type", "Framed-User", T_OP_EQ));
+	pairadd(&bench_request, pairmake("Called-Station-Id", "00-11-22-33-44-55:ssid", T_OP_EQ));
+	pairadd(&bench_request, pairmake("Calling-Station-Id", "66-77-88-99-aa-bb", T_OP_EQ));
+	pairadd(&bench_request, pairmake("Acct-Session-Id", "4b1a2c3d00000001", T_OP_EQ));
+	pairadd(&bench_request, pairmake("Framed-MTU", "1400", T_OP_EQ));
+
+	/*
+	 *	Check that it survives the trip.
+	 */
+	memset(&buf, 0, sizeof(buf));
+	pw_encode(&buf, bench_request, &count);
+	if ((pw_decode(buf.data, buf.len, count, &vps) != (ssize_t) buf.len) ||
+	    !bench_same(bench_request, vps)) {
+		fprintf(stderr, "Attributes didn't survive encoding\n");
+		exit(1);
+	}
+	pairfree(&vps);
+
+	loops = 1000000;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		buf.len = 0;
+		pw_encode(&buf, bench_request, &count);
+		pw_decode(buf.data, buf.len, count, &vps);
+		pairfree(&vps);
+	}
+	printf("%d attributes, %d bytes: %.3f usec to encode and decode\n",
+	       count, (int) buf.len, usec_since(&start) / loops);
+	free(buf.data);
+
+	bench_run(num_threads, 1, num_calls);
+	bench_run(num_threads, num_threads, num_calls);
+
+	pairfree(&bench_request);
+
+	return 0;
+}
+#endif
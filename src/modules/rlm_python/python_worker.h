@@ -0,0 +1,66 @@
+/*
+ * python_worker.h	Pre-forked worker processes for rlm_python.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _PYTHON_WORKER_H
+#define _PYTHON_WORKER_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(python_worker_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	The pool doesn't know anything about Python.  These are
+ *	called in the parent around each fork(), and in the worker
+ *	for every call, and when the parent goes away.
+ */
+typedef struct python_pool_ops_t {
+	void	(*prefork)(void *ctx);
+	void	(*postfork)(void *ctx, int child);
+	int	(*call)(void *ctx, int func, VALUE_PAIR *vps,
+			VALUE_PAIR **reply, VALUE_PAIR **config);
+	void	(*done)(void *ctx);
+} python_pool_ops_t;
+
+typedef struct python_worker_stats_t {
+	pid_t		pid;
+	int		dead;
+	int		queued;
+	int		queued_max;
+	uint64_t	calls;
+	uint64_t	usec;		/* total, for the average */
+	uint32_t	usec_max;
+} python_worker_stats_t;
+
+typedef struct python_pool_t python_pool_t;
+
+python_pool_t *python_pool_create(int num_workers,
+				  const python_pool_ops_t *ops, void *ctx);
+void	python_pool_free(python_pool_t *pool);
+
+int	python_pool_call(python_pool_t *pool, int func, VALUE_PAIR *vps,
+			 VALUE_PAIR **reply, VALUE_PAIR **config);
+
+int	python_pool_num_workers(python_pool_t *pool);
+int	python_pool_stats(python_pool_t *pool, int worker,
+			  python_worker_stats_t *stats);
+
+#endif /* _PYTHON_WORKER_H */
@@ -30,6 +30,8 @@ RCSID("$Id$")
 
 #include <Python.h>
 
+#include "python_worker.h"
+
 #define Pyx_BLOCK_THREADS    {PyGILState_STATE __gstate = PyGILState_Ensure();
 #define Pyx_UNBLOCK_THREADS   PyGILState_Release(__gstate);}
 
@@ -62,6 +64,10 @@ struct rlm_python_t {
 		send_coa,
 #endif
 		detach;
+
+	int		workers;
+	python_pool_t	*pool;
+	char		*xlat_name;
 };
 
 /*
@@ -95,6 +101,9 @@ static CONF_PARSER module_config[] = {
 
 #undef A
 
+  { "workers", PW_TYPE_INTEGER,
+    offsetof(struct rlm_python_t, workers), NULL, "0" },
+
   { NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -340,8 +349,9 @@ static int python_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp)
 	return -1;
 }
 
-static int python_function(REQUEST *request, PyObject *pFunc,
-			   const char *funcname)
+static int python_call(PyObject *pFunc, const char *funcname,
+		       VALUE_PAIR *vps, VALUE_PAIR **reply,
+		       VALUE_PAIR **config)
 {
 	VALUE_PAIR      *vp;
 	PyObject        *pRet = NULL;
@@ -364,13 +374,11 @@ static int python_function(REQUEST *request, PyObject *pFunc,
 	 *	tuple, since the tuple is not used elsewhere.
 	 *
 	 *	Determine the size of our tuple by walking through the packet.
-	 *	If request is NULL, pass None.
+	 *	If there are no attributes, pass None.
 	 */
 	tuplelen = 0;
-	if (request != NULL) {
-		for (vp = request->packet->vps; vp; vp = vp->next)
-			tuplelen++;
-	}
+	for (vp = vps; vp; vp = vp->next)
+		tuplelen++;
 
 	gstate = PyGILState_Ensure();
 	
@@ -382,7 +390,7 @@ static int python_function(REQUEST *request, PyObject *pFunc,
 		if ((pArgs = PyTuple_New(tuplelen)) == NULL)
 			goto failed;
 
-		for (vp = request->packet->vps;
+		for (vp = vps;
 		     vp != NULL;
 		     vp = vp->next, i++) {
 			PyObject *pPair;
@@ -408,7 +416,10 @@ static int python_function(REQUEST *request, PyObject *pFunc,
 	if (pRet == NULL)
 		goto failed;
 	
-	if (request == NULL)
+	/*
+	 *	No request, so there's nowhere to put the attributes.
+	 */
+	if (reply == NULL)
 		goto okay;
 
 	/*
@@ -440,11 +451,9 @@ static int python_function(REQUEST *request, PyObject *pFunc,
 		/* Now have the return value */
 		ret = PyInt_AsLong(pTupleInt);
 		/* Reply item tuple */
-		python_vptuple(&request->reply->vps,
-			       PyTuple_GET_ITEM(pRet, 1), funcname);
+		python_vptuple(reply, PyTuple_GET_ITEM(pRet, 1), funcname);
 		/* Config item tuple */
-		python_vptuple(&request->config_items,
-			       PyTuple_GET_ITEM(pRet, 2), funcname);
+		python_vptuple(config, PyTuple_GET_ITEM(pRet, 2), funcname);
 
 	} else if (PyInt_CheckExact(pRet)) {
 		/* Just an integer */
@@ -474,6 +483,154 @@ static int python_function(REQUEST *request, PyObject *pFunc,
 	return -1;
 }
 
+static int python_function(REQUEST *request, PyObject *pFunc,
+			   const char *funcname)
+{
+	if (request == NULL)
+		return python_call(pFunc, funcname, NULL, NULL, NULL);
+
+	return python_call(pFunc, funcname, request->packet->vps,
+			   &request->reply->vps, &request->config_items);
+}
+
+/*
+ *	With "workers" set, the calls are made in pre-forked copies
+ *	of the server, so that more than one of them can run at a
+ *	time.  The functions are identified by their offset in the
+ *	instance data, which is the same in the workers, as they're
+ *	copies of us.
+ */
+#define PY_FUNC(data, func) \
+	((struct py_function_def *)(((char *) (data)) + (func)))
+
+static PyGILState_STATE python_fork_state;
+
+/*
+ *	Hold the interpreter lock across fork(), so that the worker
+ *	gets the interpreter in a known state.
+ */
+static void python_worker_prefork(UNUSED void *ctx)
+{
+	python_fork_state = PyGILState_Ensure();
+}
+
+static void python_worker_postfork(UNUSED void *ctx, int child)
+{
+	if (child) PyOS_AfterFork();
+	PyGILState_Release(python_fork_state);
+}
+
+static int python_worker_call(void *ctx, int func, VALUE_PAIR *vps,
+			      VALUE_PAIR **reply, VALUE_PAIR **config)
+{
+	struct py_function_def *def = PY_FUNC(ctx, func);
+
+	return python_call(def->function, def->function_name,
+			   vps, reply, config);
+}
+
+/*
+ *	The server has gone away, or the module is being reloaded.
+ */
+static void python_worker_done(void *ctx)
+{
+	struct rlm_python_t *data = ctx;
+
+	python_function(NULL, data->detach.function, "detach");
+}
+
+static const python_pool_ops_t python_pool_ops = {
+	python_worker_prefork,
+	python_worker_postfork,
+	python_worker_call,
+	python_worker_done
+};
+
+static int python_dispatch(void *instance, REQUEST *request, int func,
+			   const char *funcname)
+{
+	struct rlm_python_t *data = instance;
+	struct py_function_def *def = PY_FUNC(data, func);
+
+	if (!data->pool)
+		return python_function(request, def->function, funcname);
+
+	/* Return with "OK, continue" if the function is not defined. */
+	if (def->function == NULL)
+		return RLM_MODULE_OK;
+
+	return python_pool_call(data->pool, func, request->packet->vps,
+				&request->reply->vps, &request->config_items);
+}
+
+/*
+ *	%{python:calls 0}, or %{python:calls} for all of the workers.
+ *	The statistics are calls, usec (average), usec-max, queue,
+ *	queue-max, and pid.
+ */
+static size_t python_xlat(void *instance, REQUEST *request, char *fmt,
+			  char *out, size_t outlen,
+			  UNUSED RADIUS_ESCAPE_STRING func)
+{
+	int i, first, last;
+	char stat[32], *p;
+	uint64_t calls = 0, usec = 0, value = 0;
+	struct rlm_python_t *data = instance;
+	python_worker_stats_t stats;
+
+	strlcpy(stat, fmt, sizeof(stat));
+	p = strchr(stat, ' ');
+	if (p) {
+		*(p++) = '\0';
+		first = last = atoi(p);
+		if ((first < 0) ||
+		    (first >= python_pool_num_workers(data->pool))) {
+			RDEBUG("No such worker %d", first);
+			*out = '\0';
+			return 0;
+		}
+	} else {
+		first = 0;
+		last = python_pool_num_workers(data->pool) - 1;
+	}
+
+	for (i = first; i <= last; i++) {
+		python_pool_stats(data->pool, i, &stats);
+		calls += stats.calls;
+		usec += stats.usec;
+
+		if (strcmp(stat, "usec-max") == 0) {
+			if (stats.usec_max > value) value = stats.usec_max;
+
+		} else if (strcmp(stat, "queue") == 0) {
+			value += stats.queued;
+
+		} else if (strcmp(stat, "queue-max") == 0) {
+			if ((uint64_t) stats.queued_max > value) {
+				value = stats.queued_max;
+			}
+
+		} else if (strcmp(stat, "pid") == 0) {
+			value = stats.pid;
+
+		} else if ((strcmp(stat, "calls") != 0) &&
+			   (strcmp(stat, "usec") != 0)) {
+			RDEBUG("Unknown statistic \"%s\"", stat);
+			*out = '\0';
+			return 0;
+		}
+	}
+
+	if (strcmp(stat, "calls") == 0) {
+		value = calls;
+	} else if (strcmp(stat, "usec") == 0) {
+		value = calls ? (usec / calls) : 0;
+	}
+
+	snprintf(out, outlen, "%llu", (unsigned long long) value);
+	return strlen(out);
+}
+
 /*
  *	Import a user module and load a function from it
  */
@@ -571,6 +728,8 @@ static void python_instance_clear(struct rlm_python_t *data)
 static int python_instantiate(CONF_SECTION *conf, void **instance)
 {
         struct rlm_python_t    *data = NULL;
+	const char	*xlat_name;
+	int		ret;
 
         /*
          *      Set up a storage area for instance data
@@ -618,8 +777,29 @@ static int python_instantiate(CONF_SECTION *conf, void **instance)
 	 *	Call the instantiate function.  No request.  Use the
 	 *	return value.
 	 */
-	return python_function(NULL, data->instantiate.function,
-			       "instantiate");
+	ret = python_function(NULL, data->instantiate.function,
+			      "instantiate");
+	if ((ret < 0) || (data->workers <= 0)) return ret;
+
+	/*
+	 *	The workers are forked after the instantiate function
+	 *	has run, so they all get whatever it set up.
+	 */
+	data->pool = python_pool_create(data->workers, &python_pool_ops,
+					data);
+	if (!data->pool) {
+		*instance = NULL;
+		python_instance_clear(data);
+		free(data);
+		return -1;
+	}
+
+	xlat_name = cf_section_name2(conf);
+	if (!xlat_name) xlat_name = cf_section_name1(conf);
+	data->xlat_name = strdup(xlat_name);
+	xlat_register(data->xlat_name, python_xlat, data);
+
+	return ret;
  failed:
         python_error();
         python_instance_clear(data);
@@ -630,10 +810,30 @@ static int python_instantiate(CONF_SECTION *conf, void **instance)
 static int python_detach(void *instance)
 {
         struct rlm_python_t    *data = (struct rlm_python_t *) instance;
-        int             ret;
-	
-        ret = python_function(NULL, data->detach.function, "detach");
-	
+        int             i, ret = 0;
+	python_worker_stats_t stats;
+
+	/*
+	 *	The workers call the detach function when we close
+	 *	their sockets.
+	 */
+	if (data->pool) {
+		for (i = 0; i < python_pool_num_workers(data->pool); i++) {
+			python_pool_stats(data->pool, i, &stats);
+			radlog(L_DBG, "rlm_python (%s): worker %d handled %llu calls, average %llu usec, maximum %u usec, maximum queue %d",
+			       data->xlat_name, i,
+			       (unsigned long long) stats.calls,
+			       (unsigned long long) (stats.calls ? (stats.usec / stats.calls) : 0),
+			       stats.usec_max, stats.queued_max);
+		}
+
+		xlat_unregister(data->xlat_name, python_xlat);
+		free(data->xlat_name);
+		python_pool_free(data->pool);
+	} else {
+		ret = python_function(NULL, data->detach.function, "detach");
+	}
+
         python_instance_clear(data);
 	
         free(data);
@@ -641,7 +841,7 @@ static int python_detach(void *instance)
 }
 
 #define A(x) static int python_##x(void *instance, REQUEST *request) { \
-  return python_function(request, ((struct rlm_python_t *)instance)->x.function, #x); \
+  return python_dispatch(instance, request, offsetof(struct rlm_python_t, x), #x); \
 }
 
 A(authenticate)
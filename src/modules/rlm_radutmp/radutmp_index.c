@@ -0,0 +1,581 @@
+/*
+ * radutmp_index.c	In-memory index of a radutmp file.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+
+#include	<freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include	"radutmp_index.h"
+
+#include	<ctype.h>
+
+/*
+ *	The radutmp file is an array of fixed-size records, one per
+ *	NAS / port.  New NAS / port combinations are appended to the
+ *	end, and records are never removed, only marked idle.
+ *
+ *	We keep one small slot per record, indexed by record number,
+ *	plus two hashes: NAS / port to the record for it, and user
+ *	name to the list of records where that user is logged in.
+ *	Finding a user's sessions is then a hash lookup, instead of
+ *	reading the whole file.
+ */
+typedef struct radutmp_user_t radutmp_user_t;
+
+typedef struct radutmp_slot_t {
+	radutmp_user_t	*user;	/* NULL if the record isn't a login */
+	int		next;	/* next session for the same user */
+} radutmp_slot_t;
+
+typedef struct radutmp_nas_port_t {
+	uint32_t	nas_address;
+	unsigned int	nas_port;
+	int		slot;
+} radutmp_nas_port_t;
+
+struct radutmp_user_t {
+	char		login[RUT_NAMESIZE + 1];
+	int		simul_count;
+	int		first;	/* first session, or -1 */
+};
+
+struct radutmp_index_t {
+	int		case_sensitive;
+
+	radutmp_slot_t	*slots;
+	int		num_slots;
+	int		max_slots;
+
+	fr_hash_table_t	*nas_ports;
+	fr_hash_table_t	*users;
+
+	/*
+	 *	What the file looked like the last time we read
+	 *	or wrote it.  If it's changed, someone else has
+	 *	written to it, and we re-build the index.
+	 */
+	int		valid;
+	dev_t		dev;
+	ino_t		ino;
+	off_t		size;
+	time_t		mtime;
+	long		mtime_nsec;
+};
+
+/*
+ *	Records are updated in place, so someone else's write usually
+ *	leaves the size and inode alone, and only the mtime changes.
+ *	POSIX.1-2008 systems give us the sub-second part of it, so that
+ *	two writes in the same second can be told apart.  Elsewhere,
+ *	we have only the seconds.
+ */
+#if defined(_POSIX_VERSION) && (_POSIX_VERSION >= 200809L)
+#define ST_MTIME_NSEC(_st) ((long) (_st)->st_mtim.tv_nsec)
+#else
+#define ST_MTIME_NSEC(_st) (0)
+#endif
+
+#define SLOT_OFFSET(_i) ((off_t) (_i) * (off_t) sizeof(struct radutmp))
+
+static uint32_t nas_port_hash(const void *data)
+{
+	const radutmp_nas_port_t *np = data;
+	uint32_t hash;
+
+	hash = fr_hash(&np->nas_address, sizeof(np->nas_address));
+	return fr_hash_update(&np->nas_port, sizeof(np->nas_port), hash);
+}
+
+static int nas_port_cmp(const void *one, const void *two)
+{
+	const radutmp_nas_port_t *a = one;
+	const radutmp_nas_port_t *b = two;
+
+	if (a->nas_address < b->nas_address) return -1;
+	if (a->nas_address > b->nas_address) return +1;
+
+	if (a->nas_port < b->nas_port) return -1;
+	if (a->nas_port > b->nas_port) return +1;
+
+	return 0;
+}
+
+static uint32_t user_hash(const void *data)
+{
+	const radutmp_user_t *user = data;
+
+	return fr_hash_string(user->login);
+}
+
+static int user_cmp(const void *one, const void *two)
+{
+	const radutmp_user_t *a = one;
+	const radutmp_user_t *b = two;
+
+	return strcmp(a->login, b->login);
+}
+
+/*
+ *	The name in the file may fill the whole field, and not be
+ *	zero terminated.  Names longer than the field are compared
+ *	on the part which fits, just as strncmp() would.
+ */
+static void user_key(const radutmp_index_t *idx, char *key, const char *login)
+{
+	size_t i;
+
+	for (i = 0; (i < RUT_NAMESIZE) && login[i]; i++) {
+		key[i] = idx->case_sensitive ? login[i] : tolower((int) login[i]);
+	}
+	key[i] = '\0';
+}
+
+static int index_init(radutmp_index_t *idx)
+{
+	if (idx->nas_ports) fr_hash_table_free(idx->nas_ports);
+	if (idx->users) fr_hash_table_free(idx->users);
+	idx->num_slots = 0;
+	idx->valid = 0;
+
+	idx->nas_ports = fr_hash_table_create(nas_port_hash, nas_port_cmp,
+					      free);
+	idx->users = fr_hash_table_create(user_hash, user_cmp, free);
+	if (!idx->nas_ports || !idx->users) return -1;
+
+	return 0;
+}
+
+radutmp_index_t *radutmp_index_create(int case_sensitive)
+{
+	radutmp_index_t *idx;
+
+	idx = malloc(sizeof(*idx));
+	if (!idx) return NULL;
+	memset(idx, 0, sizeof(*idx));
+
+	idx->case_sensitive = case_sensitive;
+
+	if (index_init(idx) < 0) {
+		radutmp_index_free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+void radutmp_index_free(radutmp_index_t *idx)
+{
+	if (!idx) return;
+
+	if (idx->nas_ports) fr_hash_table_free(idx->nas_ports);
+	if (idx->users) fr_hash_table_free(idx->users);
+	free(idx->slots);
+	free(idx);
+}
+
+/*
+ *	Take a login away from the user it was counted against.
+ */
+static void slot_logout(radutmp_index_t *idx, int i)
+{
+	int *last;
+	radutmp_user_t *user = idx->slots[i].user;
+
+	if (!user) return;
+
+	for (last = &user->first; *last >= 0; last = &idx->slots[*last].next) {
+		if (*last == i) {
+			*last = idx->slots[i].next;
+			break;
+		}
+	}
+
+	idx->slots[i].user = NULL;
+	idx->slots[i].next = -1;
+
+	if (--user->simul_count == 0) {
+		fr_hash_table_delete(idx->users, user);
+	}
+}
+
+static int slot_login(radutmp_index_t *idx, int i, const char *login)
+{
+	radutmp_user_t my_user, *user;
+
+	user_key(idx, my_user.login, login);
+
+	user = fr_hash_table_finddata(idx->users, &my_user);
+	if (!user) {
+		user = malloc(sizeof(*user));
+		if (!user) return -1;
+
+		memcpy(user->login, my_user.login, sizeof(user->login));
+		user->simul_count = 0;
+		user->first = -1;
+
+		if (!fr_hash_table_insert(idx->users, user)) {
+			free(user);
+			return -1;
+		}
+	}
+
+	idx->slots[i].user = user;
+	idx->slots[i].next = user->first;
+	user->first = i;
+	user->simul_count++;
+
+	return 0;
+}
+
+/*
+ *	Update the index for one record, which has just been read
+ *	from, or written to, the file.
+ */
+static int slot_update(radutmp_index_t *idx, int i, const struct radutmp *u)
+{
+	radutmp_nas_port_t my_np, *np;
+
+	if (i >= idx->max_slots) {
+		int max_slots = idx->max_slots ? idx->max_slots * 2 : 1024;
+		radutmp_slot_t *slots;
+
+		while (max_slots <= i) max_slots *= 2;
+
+		slots = realloc(idx->slots, max_slots * sizeof(*slots));
+		if (!slots) return -1;
+
+		idx->slots = slots;
+		idx->max_slots = max_slots;
+	}
+
+	while (idx->num_slots <= i) {
+		idx->slots[idx->num_slots].user = NULL;
+		idx->slots[idx->num_slots].next = -1;
+		idx->num_slots++;
+	}
+
+	/*
+	 *	The first record for a NAS / port is the one
+	 *	which gets updated, so that's the one we remember.
+	 */
+	my_np.nas_address = u->nas_address;
+	my_np.nas_port = u->nas_port;
+	np = fr_hash_table_finddata(idx->nas_ports, &my_np);
+	if (!np) {
+		np = malloc(sizeof(*np));
+		if (!np) return -1;
+
+		*np = my_np;
+		np->slot = i;
+
+		if (!fr_hash_table_insert(idx->nas_ports, np)) {
+			free(np);
+			return -1;
+		}
+	} else if (np->slot > i) {
+		np->slot = i;
+	}
+
+	slot_logout(idx, i);
+
+	if (u->type == P_LOGIN) return slot_login(idx, i, u->login);
+
+	return 0;
+}
+
+int radutmp_index_stale(const radutmp_index_t *idx, const struct stat *st)
+{
+	return (!idx->valid ||
+		(idx->dev != st->st_dev) ||
+		(idx->ino != st->st_ino) ||
+		(idx->size != st->st_size) ||
+		(idx->mtime != st->st_mtime) ||
+		(idx->mtime_nsec != ST_MTIME_NSEC(st)));
+}
+
+void radutmp_index_stat(radutmp_index_t *idx, const struct stat *st)
+{
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->size = st->st_size;
+	idx->mtime = st->st_mtime;
+	idx->mtime_nsec = ST_MTIME_NSEC(st);
+	idx->valid = 1;
+}
+
+/*
+ *	(Re)build the index from the file.  The caller should hold
+ *	the file lock, and should call radutmp_index_stat() after.
+ */
+int radutmp_index_build(radutmp_index_t *idx, int fd)
+{
+	int i, n, num;
+	ssize_t len;
+	struct radutmp u[256];
+
+	if (index_init(idx) < 0) return -1;
+
+	if (lseek(fd, (off_t) 0, SEEK_SET) < 0) return -1;
+
+	num = 0;
+	while ((len = read(fd, u, sizeof(u))) > 0) {
+		n = len / sizeof(u[0]);
+
+		for (i = 0; i < n; i++) {
+			if (slot_update(idx, num + i, &u[i]) < 0) return -1;
+		}
+		num += n;
+
+		/*
+		 *	A partial record at the end of the file is
+		 *	over-written by the next new entry.
+		 */
+		if ((size_t) len < sizeof(u)) break;
+	}
+
+	if (len < 0) return -1;
+
+	return 0;
+}
+
+/*
+ *	Where the record for a NAS / port is, or -1 if there isn't one.
+ */
+off_t radutmp_index_find(radutmp_index_t *idx,
+			 uint32_t nas_address, unsigned int nas_port)
+{
+	radutmp_nas_port_t my_np, *np;
+
+	my_np.nas_address = nas_address;
+	my_np.nas_port = nas_port;
+
+	np = fr_hash_table_finddata(idx->nas_ports, &my_np);
+	if (!np) return -1;
+
+	return SLOT_OFFSET(np->slot);
+}
+
+/*
+ *	Where a new record should be written.
+ */
+off_t radutmp_index_end(const radutmp_index_t *idx)
+{
+	return SLOT_OFFSET(idx->num_slots);
+}
+
+/*
+ *	A record has been written to the file.
+ */
+int radutmp_index_update(radutmp_index_t *idx, off_t offset,
+			 const struct radutmp *u)
+{
+	return slot_update(idx, offset / sizeof(*u), u);
+}
+
+int radutmp_index_count(radutmp_index_t *idx, const char *login)
+{
+	radutmp_user_t my_user, *user;
+
+	user_key(idx, my_user.login, login);
+
+	user = fr_hash_table_finddata(idx->users, &my_user);
+	if (!user) return 0;
+
+	return user->simul_count;
+}
+
+/*
+ *	Where the records for a user's sessions are.  Returns the
+ *	number of sessions, which may be more than "max".
+ */
+int radutmp_index_sessions(radutmp_index_t *idx, const char *login,
+			   off_t *offsets, int max)
+{
+	int i, num;
+	radutmp_user_t my_user, *user;
+
+	user_key(idx, my_user.login, login);
+
+	user = fr_hash_table_finddata(idx->users, &my_user);
+	if (!user) return 0;
+
+	num = 0;
+	for (i = user->first; i >= 0; i = idx->slots[i].next) {
+		if (num < max) offsets[num] = SLOT_OFFSET(i);
+		num++;
+	}
+
+	return num;
+}
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../../include -I ../../ radutmp_index.c \
+ *	../../lib/.libs/libfreeradius-radius.a -o radutmp_index
+ *
+ *  ./radutmp_index [num_sessions] [num_lookups]
+ *
+ *  Writes a synthetic radutmp file, and compares counting a user's
+ *  sessions by reading the file (as checksimul used to) against
+ *  looking them up in the index.
+ */
+#include <fcntl.h>
+#include <sys/time.h>
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static int scan_count(int fd, const char *login)
+{
+	int count = 0;
+	struct radutmp u;
+
+	lseek(fd, (off_t) 0, SEEK_SET);
+	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+		if ((strncmp(login, u.login, RUT_NAMESIZE) == 0) &&
+		    (u.type == P_LOGIN)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	int i, fd, num, lookups, scans, count, total;
+	char filename[] = "/tmp/radutmp.XXXXXX";
+	char login[RUT_NAMESIZE];
+	char session_id[RUT_SESSSIZE + 1];
+	double t;
+	struct timeval start;
+	struct stat st;
+	struct radutmp u;
+	radutmp_index_t *idx;
+
+	num = (argc > 1) ? atoi(argv[1]) : 500000;
+	lookups = (argc > 2) ? atoi(argv[2]) : 1000000;
+	if ((num <= 0) || (lookups <= 0)) {
+		fprintf(stderr, "usage: radutmp_index [num_sessions] [num_lookups]\n");
+		exit(1);
+	}
+
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		perror(filename);
+		exit(1);
+	}
+	unlink(filename);
+
+	/*
+	 *	One user per ten sessions, spread over many NASes.
+	 */
+	for (i = 0; i < num; i++) {
+		memset(&u, 0, sizeof(u));
+		snprintf(u.login, sizeof(u.login), "user%d", i % (num / 10 + 1));
+		u.nas_address = htonl(0x0a000000 + (i / 4096));
+		u.nas_port = i % 4096;
+		snprintf(session_id, sizeof(session_id), "%08x", i);
+		memcpy(u.session_id, session_id, sizeof(u.session_id));
+		u.type = (i % 7) ? P_LOGIN : P_IDLE;
+
+		if (write(fd, &u, sizeof(u)) != sizeof(u)) {
+			perror("write");
+			exit(1);
+		}
+	}
+	printf("radutmp file with %d records (%lu bytes)\n",
+	       num, (unsigned long) num * sizeof(u));
+
+	idx = radutmp_index_create(1);
+	if (!idx) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	if (radutmp_index_build(idx, fd) < 0) {
+		fprintf(stderr, "Failed building index\n");
+		exit(1);
+	}
+	fstat(fd, &st);
+	radutmp_index_stat(idx, &st);
+	printf("built index in %.3fs\n", elapsed(&start));
+
+	/*
+	 *	Check the index against the file.
+	 */
+	for (i = 0; i < 100; i++) {
+		snprintf(login, sizeof(login), "user%d", (i * 7919) % (num / 10 + 1));
+		if (scan_count(fd, login) != radutmp_index_count(idx, login)) {
+			fprintf(stderr, "Count mismatch for %s\n", login);
+			exit(1);
+		}
+	}
+
+	scans = 20;
+	total = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < scans; i++) {
+		snprintf(login, sizeof(login), "user%d", i);
+		total += scan_count(fd, login);
+	}
+	t = elapsed(&start);
+	printf("file scan:  %8.0f checks/s (%.3fms each)\n",
+	       scans / t, (t * 1000) / scans);
+
+	count = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < lookups; i++) {
+		snprintf(login, sizeof(login), "user%d", i % (num / 10 + 1));
+		count += radutmp_index_count(idx, login);
+	}
+	t = elapsed(&start);
+	printf("index:      %8.0f checks/s (%.3fus each)\n",
+	       lookups / t, (t * 1000000) / lookups);
+
+	/*
+	 *	Log everyone out, and make sure nothing is left.
+	 */
+	for (i = 0; i < num; i++) {
+		if (lseek(fd, SLOT_OFFSET(i), SEEK_SET) < 0) break;
+		if (read(fd, &u, sizeof(u)) != sizeof(u)) break;
+		u.type = P_IDLE;
+		radutmp_index_update(idx, SLOT_OFFSET(i), &u);
+	}
+	if (fr_hash_table_num_elements(idx->users) != 0) {
+		fprintf(stderr, "Users left after logout\n");
+		exit(1);
+	}
+
+	radutmp_index_free(idx);
+	close(fd);
+
+	return (total + count) ? 0 : 1;
+}
+#endif
@@ -0,0 +1,56 @@
+/*
+ * radutmp_index.h	In-memory index of a radutmp file.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010  The FreeRADIUS server project
+ */
+#ifndef _RADUTMP_INDEX_H
+#define _RADUTMP_INDEX_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(radutmp_index_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/radutmp.h>
+
+#include <sys/stat.h>
+
+/*
+ *	The index does no locking of its own.  The caller has to
+ *	serialize access to it.
+ */
+typedef struct radutmp_index_t radutmp_index_t;
+
+radutmp_index_t *radutmp_index_create(int case_sensitive);
+void	radutmp_index_free(radutmp_index_t *idx);
+
+int	radutmp_index_stale(const radutmp_index_t *idx, const struct stat *st);
+void	radutmp_index_stat(radutmp_index_t *idx, const struct stat *st);
+int	radutmp_index_build(radutmp_index_t *idx, int fd);
+
+off_t	radutmp_index_find(radutmp_index_t *idx,
+			   uint32_t nas_address, unsigned int nas_port);
+off_t	radutmp_index_end(const radutmp_index_t *idx);
+int	radutmp_index_update(radutmp_index_t *idx, off_t offset,
+			     const struct radutmp *u);
+
+int	radutmp_index_count(radutmp_index_t *idx, const char *login);
+int	radutmp_index_sessions(radutmp_index_t *idx, const char *login,
+			       off_t *offsets, int max);
+
+#endif /* _RADUTMP_INDEX_H */
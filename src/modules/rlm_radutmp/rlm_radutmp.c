@@ -33,32 +33,47 @@ RCSID("$Id$")
 #include        <limits.h>
 
 #include "config.h"
+#include "radutmp_index.h"
 
 #define LOCK_LEN sizeof(struct radutmp)
 
 static const char porttypes[] = "ASITX";
 
 /*
- *	used for caching radutmp lookups in the accounting component. The
- *	session (checksimul) component doesn't use it, but probably should.
+ *	Each radutmp file has an in-memory index, so that we don't
+ *	have to read the whole file to find a NAS / port, or to count
+ *	a user's sessions.  The filename can be dynamically expanded,
+ *	so there may be more than one.
  */
-typedef struct nas_port {
-	uint32_t		nasaddr;
-	unsigned int	port;
-	off_t			offset;
-	struct nas_port 	*next;
-} NAS_PORT;
+typedef struct radutmp_file_t {
+	char		*filename;
+	radutmp_index_t	*idx;
+} radutmp_file_t;
 
 typedef struct rlm_radutmp_t {
-	NAS_PORT	*nas_port_list;
 	char		*filename;
 	char		*username;
 	int		case_sensitive;
 	int		check_nas;
 	int		permission;
 	int		callerid_ok;
+
+	fr_hash_table_t	*files;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;	/* protects the indexes */
+#endif
 } rlm_radutmp_t;
 
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#endif
+
 static const CONF_PARSER module_config[] = {
 	{ "filename", PW_TYPE_STRING_PTR,
 	  offsetof(rlm_radutmp_t,filename), NULL,  RADUTMP },
@@ -75,6 +90,30 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
+static uint32_t file_hash(const void *data)
+{
+	const radutmp_file_t *file = data;
+
+	return fr_hash_string(file->filename);
+}
+
+static int file_cmp(const void *one, const void *two)
+{
+	const radutmp_file_t *a = one;
+	const radutmp_file_t *b = two;
+
+	return strcmp(a->filename, b->filename);
+}
+
+static void file_free(void *data)
+{
+	radutmp_file_t *file = data;
+
+	radutmp_index_free(file->idx);
+	free(file->filename);
+	free(file);
+}
+
 static int radutmp_instantiate(CONF_SECTION *conf, void **instance)
 {
 	rlm_radutmp_t *inst;
@@ -90,7 +129,15 @@ static int radutmp_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
-	inst->nas_port_list = NULL;
+	inst->files = fr_hash_table_create(file_hash, file_cmp, file_free);
+	if (!inst->files) {
+		radlog(L_ERR, "rlm_radutmp: Out of memory");
+		free(inst);
+		return -1;
+	}
+
+	pthread_mutex_init(&inst->mutex, NULL);
+
 	*instance = inst;
 	return 0;
 }
@@ -101,27 +148,94 @@ static int radutmp_instantiate(CONF_SECTION *conf, void **instance)
  */
 static int radutmp_detach(void *instance)
 {
-	NAS_PORT *p, *next;
 	rlm_radutmp_t *inst = instance;
 
-	for (p = inst->nas_port_list ; p ; p=next) {
-		next = p->next;
-		free(p);
-	}
+	fr_hash_table_free(inst->files);
+	pthread_mutex_destroy(&inst->mutex);
 	free(inst);
 	return 0;
 }
 
+/*
+ *	Get the index for an open radutmp file, and (re)build it
+ *	if the file has been changed by someone else.
+ *
+ *	Called with the mutex held.  If "locked" is not set, the file
+ *	is locked while the index is being built.
+ */
+static radutmp_index_t *radutmp_index_get(rlm_radutmp_t *inst,
+					  char *filename, int fd, int locked)
+{
+	struct stat st;
+	radutmp_file_t my_file, *file;
+
+	my_file.filename = filename;
+	file = fr_hash_table_finddata(inst->files, &my_file);
+	if (!file) {
+		file = rad_malloc(sizeof(*file));
+		file->filename = strdup(filename);
+		file->idx = radutmp_index_create(inst->case_sensitive);
+		if (!file->filename || !file->idx ||
+		    !fr_hash_table_insert(inst->files, file)) {
+			radlog(L_ERR, "rlm_radutmp: Out of memory");
+			file_free(file);
+			return NULL;
+		}
+	}
+
+	if (fstat(fd, &st) < 0) {
+		radlog(L_ERR, "rlm_radutmp: Error accessing file %s: %s",
+		       filename, strerror(errno));
+		return NULL;
+	}
+
+	if (!radutmp_index_stale(file->idx, &st)) return file->idx;
+
+	DEBUG2("  rlm_radutmp: Reading %s", filename);
+
+	if (!locked) rad_lockfd(fd, LOCK_LEN);
+	if ((radutmp_index_build(file->idx, fd) < 0) ||
+	    (fstat(fd, &st) < 0)) {
+		radlog(L_ERR, "rlm_radutmp: Error reading file %s: %s",
+		       filename, strerror(errno));
+		if (!locked) {
+			lseek(fd, (off_t) 0, SEEK_SET);
+			rad_unlockfd(fd, LOCK_LEN);
+		}
+		return NULL;
+	}
+	if (!locked) {
+		lseek(fd, (off_t) 0, SEEK_SET);
+		rad_unlockfd(fd, LOCK_LEN);
+	}
+
+	radutmp_index_stat(file->idx, &st);
+
+	return file->idx;
+}
+
+/*
+ *	We've written to the file, so the index is up to date with it.
+ */
+static void radutmp_index_written(radutmp_index_t *idx, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == 0) radutmp_index_stat(idx, &st);
+}
+
 /*
  *	Zap all users on a NAS from the radutmp file.
  */
-static int radutmp_zap(UNUSED rlm_radutmp_t *inst,
-		       const char *filename,
+static int radutmp_zap(rlm_radutmp_t *inst,
+		       char *filename,
 		       uint32_t nasaddr,
 		       time_t t)
 {
 	struct radutmp	u;
 	int		fd;
+	off_t		offset;
+	radutmp_index_t	*idx;
 
 	if (t == 0) time(&t);
 
@@ -137,6 +251,10 @@ static int radutmp_zap(UNUSED rlm_radutmp_t *inst,
 	 */
 	rad_lockfd(fd, LOCK_LEN);
 
+	pthread_mutex_lock(&inst->mutex);
+	idx = radutmp_index_get(inst, filename, fd, 1);
+	lseek(fd, (off_t)0, SEEK_SET);
+
 	/*
 	 *	Find the entry for this NAS / portno combination.
 	 */
@@ -147,34 +265,25 @@ static int radutmp_zap(UNUSED rlm_radutmp_t *inst,
 	  /*
 	   *	Match. Zap it.
 	   */
-	  if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
+	  if ((offset = lseek(fd, -(off_t)sizeof(u), SEEK_CUR)) < 0) {
 	    radlog(L_ERR, "rlm_radutmp: radutmp_zap: negative lseek!");
-	    lseek(fd, (off_t)0, SEEK_SET);
+	    offset = lseek(fd, (off_t)0, SEEK_SET);
 	  }
 	  u.type = P_IDLE;
 	  u.time = t;
-	  write(fd, &u, sizeof(u));
+	  if ((write(fd, &u, sizeof(u)) == sizeof(u)) && idx) {
+	    radutmp_index_update(idx, offset, &u);
+	  }
 	}
-	close(fd);	/* and implicitely release the locks */
 
-	return 0;
-}
+	if (idx) radutmp_index_written(idx, fd);
+	pthread_mutex_unlock(&inst->mutex);
 
-/*
- *	Lookup a NAS_PORT in the nas_port_list
- */
-static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, unsigned int port)
-{
-	NAS_PORT	*cl;
+	close(fd);	/* and implicitely release the locks */
 
-	for(cl = nas_port_list; cl; cl = cl->next)
-		if (nasaddr == cl->nasaddr &&
-			port == cl->port)
-			break;
-	return cl;
+	return 0;
 }
 
-
 #ifdef WITH_ACCOUNTING
 /*
  *	Store logins in the RADIUS utmp file.
@@ -194,8 +303,9 @@ static int radutmp_accounting(void *instance, REQUEST *request)
 	char		filename[1024];
 	char		ip_name[32]; /* 255.255.255.255 */
 	const char	*nas;
-	NAS_PORT	*cache;
 	int		r;
+	off_t		offset;
+	radutmp_index_t	*idx;
 
 	if (request->packet->src_ipaddr.af != AF_INET) {
 		DEBUG("rlm_radutmp: IPv6 not supported!");
@@ -424,28 +534,28 @@ static int radutmp_accounting(void *instance, REQUEST *request)
 	 */
 	rad_lockfd(fd, LOCK_LEN);
 
+	pthread_mutex_lock(&inst->mutex);
+	idx = radutmp_index_get(inst, filename, fd, 1);
+	if (!idx) {
+		pthread_mutex_unlock(&inst->mutex);
+		close(fd);
+		return RLM_MODULE_FAIL;
+	}
+
 	/*
 	 *	Find the entry for this NAS / portno combination.
 	 */
-	if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address,
-				   ut.nas_port)) != NULL) {
-		lseek(fd, (off_t)cache->offset, SEEK_SET);
-	}
-
 	r = 0;
-	off = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		off += sizeof(u);
-		if (u.nas_address != ut.nas_address ||
-		    u.nas_port	  != ut.nas_port)
-			continue;
-
+	offset = radutmp_index_find(idx, ut.nas_address, ut.nas_port);
+	if ((offset >= 0) &&
+	    (lseek(fd, offset, SEEK_SET) >= 0) &&
+	    (read(fd, &u, sizeof(u)) == sizeof(u))) do {
 		/*
 		 *	Don't compare stop records to unused entries.
 		 */
 		if (status == PW_STATUS_STOP &&
 		    u.type == P_IDLE) {
-			continue;
+			break;
 		}
 
 		if (status == PW_STATUS_STOP &&
@@ -494,15 +604,13 @@ static int radutmp_accounting(void *instance, REQUEST *request)
 			ut.time = u.time;
 		}
 
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			radlog(L_ERR, "rlm_radutmp: negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
-			off = 0;
-		} else
-			off -= sizeof(u);
 		r = 1;
-		break;
-	} /* read the file until we find a match */
+	} while (0);
+
+	/*
+	 *	No entry for this NAS / port: add one to the end.
+	 */
+	if (r == 0) offset = radutmp_index_end(idx);
 
 	/*
 	 *	Found the entry, do start/update it with
@@ -510,21 +618,11 @@ static int radutmp_accounting(void *instance, REQUEST *request)
 	 */
 	if (r >= 0 &&  (status == PW_STATUS_START ||
 			status == PW_STATUS_ALIVE)) {
-		/*
-		 *	Remember where the entry was, because it's
-		 *	easier than searching through the entire file.
-		 */
-		if (cache == NULL) {
-			cache = rad_malloc(sizeof(NAS_PORT));
-			cache->nasaddr = ut.nas_address;
-			cache->port = ut.nas_port;
-			cache->offset = off;
-			cache->next = inst->nas_port_list;
-			inst->nas_port_list = cache;
-		}
-
 		ut.type = P_LOGIN;
-		write(fd, &ut, sizeof(u));
+		if ((lseek(fd, offset, SEEK_SET) >= 0) &&
+		    (write(fd, &ut, sizeof(ut)) == sizeof(ut))) {
+			radutmp_index_update(idx, offset, &ut);
+		}
 	}
 
 	/*
@@ -536,12 +634,19 @@ static int radutmp_accounting(void *instance, REQUEST *request)
 			u.type = P_IDLE;
 			u.time = ut.time;
 			u.delay = ut.delay;
-			write(fd, &u, sizeof(u));
+			if ((lseek(fd, offset, SEEK_SET) >= 0) &&
+			    (write(fd, &u, sizeof(u)) == sizeof(u))) {
+				radutmp_index_update(idx, offset, &u);
+			}
 		} else if (r == 0) {
 			radlog(L_ERR, "rlm_radutmp: Logout for NAS %s port %u, but no Login record",
 			       nas, ut.nas_port);
 		}
 	}
+
+	radutmp_index_written(idx, fd);
+	pthread_mutex_unlock(&inst->mutex);
+
 	close(fd);	/* and implicitely release the locks */
 
 	return RLM_MODULE_OK;
@@ -563,11 +668,14 @@ static int radutmp_checksimul(void *instance, REQUEST *request)
 {
 	struct radutmp	u;
 	int		fd;
+	int		i, num;
+	off_t		*offsets;
 	VALUE_PAIR	*vp;
 	uint32_t	ipno = 0;
 	char		*call_num = NULL;
 	int		rcode;
 	rlm_radutmp_t	*inst = instance;
+	radutmp_index_t	*idx;
 	char		login[256];
 	char		filename[1024];
 
@@ -597,38 +705,50 @@ static int radutmp_checksimul(void *instance, REQUEST *request)
 	*login = '\0';
 	radius_xlat(login, sizeof(login), inst->username, request, NULL);
 	if (!*login) {
+		close(fd);
 		return RLM_MODULE_NOOP;
 	}
 
+	/*
+	 *	Count how many sessions the user MAY have.
+	 */
+	pthread_mutex_lock(&inst->mutex);
+	idx = radutmp_index_get(inst, filename, fd, 0);
+	if (!idx) {
+		pthread_mutex_unlock(&inst->mutex);
+		close(fd);
+		return RLM_MODULE_FAIL;
+	}
+
 	/*
 	 *	WTF?  This is probably wrong... we probably want to
 	 *	be able to check users across multiple session accounting
 	 *	methods.
 	 */
-	request->simul_count = 0;
-
-	/*
-	 *	Loop over utmp, counting how many people MAY be logged in.
-	 */
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		if (((strncmp(login, u.login, RUT_NAMESIZE) == 0) ||
-		     (!inst->case_sensitive &&
-		      (strncasecmp(login, u.login, RUT_NAMESIZE) == 0))) &&
-		    (u.type == P_LOGIN)) {
-			++request->simul_count;
-		}
-	}
+	request->simul_count = radutmp_index_count(idx, login);
 
 	/*
 	 *	The number of users logged in is OK,
 	 *	OR, we've been told to not check the NAS.
 	 */
 	if ((request->simul_count < request->simul_max) ||
+	    (request->simul_count == 0) ||
 	    !inst->check_nas) {
+		pthread_mutex_unlock(&inst->mutex);
 		close(fd);
 		return RLM_MODULE_OK;
 	}
-	lseek(fd, (off_t)0, SEEK_SET);
+
+	/*
+	 *	Remember where the user's sessions are.  We can't hold
+	 *	the mutex while checking them, as zapping a stale
+	 *	session writes to the file.
+	 */
+	num = request->simul_count;
+	offsets = rad_malloc(num * sizeof(offsets[0]));
+	num = radutmp_index_sessions(idx, login, offsets, num);
+	if (num > request->simul_count) num = request->simul_count;
+	pthread_mutex_unlock(&inst->mutex);
 
 	/*
 	 *	Setup some stuff, like for MPP detection.
@@ -650,7 +770,16 @@ static int radutmp_checksimul(void *instance, REQUEST *request)
 	 *	static IP's like DSL.
 	 */
 	request->simul_count = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+	for (i = 0; i < num; i++) {
+		if ((lseek(fd, offsets[i], SEEK_SET) < 0) ||
+		    (read(fd, &u, sizeof(u)) != sizeof(u))) {
+			continue;
+		}
+
+		/*
+		 *	The record may have changed since we looked
+		 *	at the index.
+		 */
 		if (((strncmp(login, u.login, RUT_NAMESIZE) == 0) ||
 		     (!inst->case_sensitive &&
 		      (strncasecmp(login, u.login, RUT_NAMESIZE) == 0))) &&
@@ -683,6 +812,7 @@ static int radutmp_checksimul(void *instance, REQUEST *request)
 			 *	to return, and we don't want
 			 *	to block everyone else while
 			 *	that's happening.  */
+			lseek(fd, (off_t)0, SEEK_SET);
 			rad_unlockfd(fd, LOCK_LEN);
 			rcode = rad_check_ts(u.nas_address, u.nas_port,
 					     utmp_login, session_id);
@@ -719,12 +849,14 @@ static int radutmp_checksimul(void *instance, REQUEST *request)
 				 *	Return an error.
 				 */
 				close(fd);
+				free(offsets);
 				radlog(L_ERR, "rlm_radutmp: Failed to check the terminal server for user '%s'.", utmp_login);
 				return RLM_MODULE_FAIL;
 			}
 		}
 	}
 	close(fd);		/* and implicitely release the locks */
+	free(offsets);
 
 	return RLM_MODULE_OK;
 }
@@ -28,11 +28,480 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 
 #ifdef WITH_PROXY
-static void cleanup(RADIUS_PACKET *packet)
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+/*
+ *	This is a lot simpler than putting ifdef's around
+ *	every use of the pthread functions.
+ */
+#define pthread_mutex_lock(a)
+#define pthread_mutex_unlock(a)
+#define pthread_mutex_init(a,b)
+#define pthread_mutex_destroy(a)
+#endif
+
+#define SENDER_THREAD_NONE	(0)
+#define SENDER_THREAD_RUNNING	(1)
+#define SENDER_THREAD_FAILED	(2)
+#define SENDER_THREAD_STOPPING	(3)
+
+/*
+ *	One socket per home server, opened the first time we send
+ *	to it, and kept until the module is detached.
+ */
+typedef struct replicate_dst_t {
+	fr_ipaddr_t	ipaddr;
+	int		port;
+	fr_ipaddr_t	src_ipaddr;
+	int		sockfd;
+
+	uint64_t	sent;
+	uint64_t	resent;
+	uint64_t	dropped;
+	uint64_t	errors;
+} replicate_dst_t;
+
+/*
+ *	An encoded packet, waiting for the sender thread.
+ */
+typedef struct replicate_entry_t {
+	struct replicate_entry_t *next;
+	replicate_dst_t	*dst;
+	int		tries;
+	time_t		when;		/* of the next re-send */
+	size_t		len;
+	uint8_t		data[1];
+} replicate_entry_t;
+
+typedef struct rlm_replicate_t {
+	int		queue_size;
+	int		resend;
+	int		resend_delay;
+
+	char		*name;		/* for messages */
+
+	/*
+	 *	Everything below is protected by the mutex, except
+	 *	the re-send list, which only the thread touches.
+	 */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_cond_t	data_ready;
+	pthread_t	thread;
+#endif
+	int		thread_state;
+	fr_hash_table_t	*dsts;
+
+	replicate_entry_t *head;
+	replicate_entry_t **tail;
+	size_t		queued;		/* bytes, including re-sends */
+
+	replicate_entry_t *resends;
+
+	uint64_t	dropped;
+	uint64_t	dropped_reported;
+} rlm_replicate_t;
+
+static const CONF_PARSER module_config[] = {
+	{ "queue_size", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t,queue_size), NULL, "0" },
+	{ "resend", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t,resend), NULL, "0" },
+	{ "resend_delay", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t,resend_delay), NULL, "1" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	Only hash the bytes which fr_ipaddr_cmp() looks at.
+ */
+static uint32_t dst_hash_ipaddr(const fr_ipaddr_t *ipaddr, uint32_t hash)
 {
-	if (!packet) return;
-	if (packet->sockfd >= 0) close(packet->sockfd);
-	rad_free(&packet);
+	hash = fr_hash_update(&ipaddr->af, sizeof(ipaddr->af), hash);
+
+	if (ipaddr->af == AF_INET) {
+		return fr_hash_update(&ipaddr->ipaddr.ip4addr,
+				      sizeof(ipaddr->ipaddr.ip4addr), hash);
+	}
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	if (ipaddr->af == AF_INET6) {
+		return fr_hash_update(&ipaddr->ipaddr.ip6addr,
+				      sizeof(ipaddr->ipaddr.ip6addr), hash);
+	}
+#endif
+
+	return hash;
+}
+
+static uint32_t dst_hash(const void *data)
+{
+	uint32_t hash;
+	const replicate_dst_t *dst = data;
+
+	hash = fr_hash(&dst->port, sizeof(dst->port));
+	hash = dst_hash_ipaddr(&dst->ipaddr, hash);
+	return dst_hash_ipaddr(&dst->src_ipaddr, hash);
+}
+
+static int dst_cmp(const void *one, const void *two)
+{
+	int rcode;
+	const replicate_dst_t *a = one;
+	const replicate_dst_t *b = two;
+
+	rcode = a->port - b->port;
+	if (rcode != 0) return rcode;
+
+	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (rcode != 0) return rcode;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+static void dst_free(void *data)
+{
+	replicate_dst_t *dst = data;
+
+	if (dst->sockfd >= 0) close(dst->sockfd);
+	free(dst);
+}
+
+/*
+ *	Find the socket for a home server, opening it if necessary.
+ */
+static replicate_dst_t *dst_find(rlm_replicate_t *inst, REQUEST *request,
+				 home_server *home)
+{
+	replicate_dst_t my_dst, *dst;
+
+	memset(&my_dst, 0, sizeof(my_dst));
+	my_dst.ipaddr = home->ipaddr;
+	my_dst.port = home->port;
+	my_dst.src_ipaddr = home->src_ipaddr;
+
+	pthread_mutex_lock(&inst->mutex);
+	dst = fr_hash_table_finddata(inst->dsts, &my_dst);
+	if (dst) {
+		pthread_mutex_unlock(&inst->mutex);
+		return dst;
+	}
+
+	dst = rad_malloc(sizeof(*dst));
+	memcpy(dst, &my_dst, sizeof(*dst));
+
+	dst->sockfd = fr_socket(&home->src_ipaddr, 0);
+	if (dst->sockfd < 0) {
+		pthread_mutex_unlock(&inst->mutex);
+		RDEBUG("ERROR: Failed opening socket: %s", fr_strerror());
+		free(dst);
+		return NULL;
+	}
+
+	if (!fr_hash_table_insert(inst->dsts, dst)) {
+		pthread_mutex_unlock(&inst->mutex);
+		dst_free(dst);
+		return NULL;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return dst;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Returns 0 if it was sent, 1 if it's worth trying again
+ *	later, and -1 if not.
+ */
+static int sender_send(replicate_entry_t *e)
+{
+	struct sockaddr_storage dst;
+	socklen_t sizeof_dst;
+
+	if (!fr_ipaddr2sockaddr(&e->dst->ipaddr, e->dst->port,
+				&dst, &sizeof_dst)) return -1;
+
+	if (sendto(e->dst->sockfd, e->data, e->len, MSG_DONTWAIT,
+		   (struct sockaddr *) &dst, sizeof_dst) == (ssize_t) e->len) {
+		return 0;
+	}
+
+	switch (errno) {
+	case EAGAIN:
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EINTR:
+	case ENOBUFS:
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return 1;
+
+	default:
+		break;
+	}
+
+	return -1;
+}
+
+/*
+ *	Send a list of packets.  The ones which fail, and can be
+ *	re-sent, go onto the re-send list.  Returns the number of
+ *	bytes freed.
+ */
+static size_t sender_flush(rlm_replicate_t *inst, replicate_entry_t *list,
+			   time_t now, int stopping)
+{
+	int rcode;
+	size_t freed = 0;
+	replicate_entry_t *e, *next;
+
+	for (e = list; e != NULL; e = next) {
+		next = e->next;
+
+		rcode = sender_send(e);
+
+		pthread_mutex_lock(&inst->mutex);
+		if (rcode == 0) {
+			e->dst->sent++;
+			if (e->tries > 0) e->dst->resent++;
+
+		} else if ((rcode > 0) && !stopping &&
+			   (e->tries < inst->resend)) {
+			e->tries++;
+			e->when = now + inst->resend_delay;
+			e->next = inst->resends;
+			inst->resends = e;
+			pthread_mutex_unlock(&inst->mutex);
+			continue;
+
+		} else {
+			e->dst->errors++;
+		}
+		pthread_mutex_unlock(&inst->mutex);
+
+		freed += e->len;
+		free(e);
+	}
+
+	return freed;
+}
+
+static void *sender_thread(void *arg)
+{
+	rlm_replicate_t *inst = arg;
+	int stopping;
+	time_t now;
+	uint64_t dropped;
+	size_t freed;
+	struct timeval tv;
+	struct timespec when;
+	replicate_entry_t *batch, *due, *e, **last;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (1) {
+		if (!inst->head &&
+		    (inst->thread_state == SENDER_THREAD_RUNNING)) {
+			gettimeofday(&tv, NULL);
+			when.tv_sec = tv.tv_sec + 1;
+			when.tv_nsec = tv.tv_usec * 1000;
+
+			pthread_cond_timedwait(&inst->data_ready, &inst->mutex,
+					       &when);
+		}
+
+		/*
+		 *	Tell the administrator if packets are being
+		 *	lost, but not more than once a second.
+		 */
+		dropped = inst->dropped - inst->dropped_reported;
+		inst->dropped_reported = inst->dropped;
+		if (dropped) {
+			radlog(L_ERR, "rlm_replicate (%s): Queue is full: dropped %" PRIu64 " packets",
+			       inst->name, dropped);
+		}
+
+		stopping = (inst->thread_state != SENDER_THREAD_RUNNING);
+
+		/*
+		 *	Take everything which is queued, and the
+		 *	re-sends which are due, in one go.
+		 */
+		batch = inst->head;
+		inst->head = NULL;
+		inst->tail = &inst->head;
+
+		now = time(NULL);
+		due = NULL;
+		last = &inst->resends;
+		while ((e = *last) != NULL) {
+			if (stopping || (e->when <= now)) {
+				*last = e->next;
+				e->next = due;
+				due = e;
+			} else {
+				last = &e->next;
+			}
+		}
+		pthread_mutex_unlock(&inst->mutex);
+
+		if (stopping && !batch && !due) break;
+
+		freed = sender_flush(inst, batch, now, stopping);
+		freed += sender_flush(inst, due, now, stopping);
+
+		pthread_mutex_lock(&inst->mutex);
+		inst->queued -= freed;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Copy the encoded packet onto the queue.  The thread is started
+ *	by the first request, as the server forks after the modules
+ *	are instantiated.
+ */
+static int replicate_enqueue(rlm_replicate_t *inst, REQUEST *request,
+			     replicate_dst_t *dst, RADIUS_PACKET *packet)
+{
+	replicate_entry_t *e;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->thread_state == SENDER_THREAD_NONE) {
+		inst->thread_state = SENDER_THREAD_RUNNING;
+		if (pthread_create(&inst->thread, NULL,
+				   sender_thread, inst) != 0) {
+			radlog(L_ERR, "rlm_replicate: Failed to start sender thread: %s",
+			       strerror(errno));
+			inst->thread_state = SENDER_THREAD_FAILED;
+		}
+	}
+
+	if (inst->thread_state != SENDER_THREAD_RUNNING) {
+		pthread_mutex_unlock(&inst->mutex);
+		return -1;
+	}
+
+	if ((inst->queued + packet->data_len) > (size_t) inst->queue_size) {
+		inst->dropped++;
+		dst->dropped++;
+		pthread_mutex_unlock(&inst->mutex);
+		RDEBUG2("Replication queue is full: dropping the packet");
+		return 0;
+	}
+	inst->queued += packet->data_len;
+	pthread_mutex_unlock(&inst->mutex);
+
+	e = rad_malloc(sizeof(*e) + packet->data_len);
+	e->next = NULL;
+	e->dst = dst;
+	e->tries = 0;
+	e->when = 0;
+	e->len = packet->data_len;
+	memcpy(e->data, packet->data, packet->data_len);
+
+	pthread_mutex_lock(&inst->mutex);
+	if (!inst->head) pthread_cond_signal(&inst->data_ready);
+	*inst->tail = e;
+	inst->tail = &e->next;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+#endif
+
+static int dst_print_stats(void *ctx, void *data)
+{
+	rlm_replicate_t *inst = ctx;
+	replicate_dst_t *dst = data;
+	char buffer[128];
+
+	DEBUG2("rlm_replicate (%s): %s port %d: %" PRIu64 " sent, %" PRIu64 " re-sent, %" PRIu64 " dropped, %" PRIu64 " errors",
+	       inst->name, ip_ntoh(&dst->ipaddr, buffer, sizeof(buffer)),
+	       dst->port, dst->sent, dst->resent, dst->dropped, dst->errors);
+
+	return 0;
+}
+
+static int replicate_detach(void *instance)
+{
+	rlm_replicate_t *inst = instance;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->thread_state == SENDER_THREAD_RUNNING) {
+		inst->thread_state = SENDER_THREAD_STOPPING;
+		pthread_cond_signal(&inst->data_ready);
+		pthread_mutex_unlock(&inst->mutex);
+		pthread_join(inst->thread, NULL);
+	} else {
+		pthread_mutex_unlock(&inst->mutex);
+	}
+#endif
+
+	if (inst->dsts) {
+		fr_hash_table_walk(inst->dsts, dst_print_stats, inst);
+		fr_hash_table_free(inst->dsts);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_cond_destroy(&inst->data_ready);
+#endif
+
+	free(inst->name);
+	free(inst);
+	return 0;
+}
+
+static int replicate_instantiate(CONF_SECTION *conf, void **instance)
+{
+	rlm_replicate_t *inst;
+
+	inst = rad_malloc(sizeof(*inst));
+	memset(inst, 0, sizeof(*inst));
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->data_ready, NULL);
+#endif
+	inst->tail = &inst->head;
+
+	/*
+	 *	The configuration strings are freed before we're
+	 *	detached, and the thread may still be running then.
+	 */
+	inst->name = strdup(cf_section_name2(conf) ?
+			    cf_section_name2(conf) :
+			    cf_section_name1(conf));
+
+	if (cf_section_parse(conf, inst, module_config) < 0) {
+		replicate_detach(inst);
+		return -1;
+	}
+
+#ifndef HAVE_PTHREAD_H
+	if (inst->queue_size > 0) {
+		radlog(L_INFO, "rlm_replicate: No thread support: ignoring \"queue_size\"");
+		inst->queue_size = 0;
+	}
+#endif
+	if (inst->queue_size < 0) inst->queue_size = 0;
+	if (inst->resend < 0) inst->resend = 0;
+	if (inst->resend_delay < 1) inst->resend_delay = 1;
+
+	inst->dsts = fr_hash_table_create(dst_hash, dst_cmp, dst_free);
+	if (!inst->dsts) {
+		replicate_detach(inst);
+		return -1;
+	}
+
+	*instance = inst;
+	return 0;
 }
 
 /*
@@ -41,15 +510,15 @@ static void cleanup(RADIUS_PACKET *packet)
 static int replicate_packet(void *instance, REQUEST *request)
 {
 	int rcode = RLM_MODULE_NOOP;
+	rlm_replicate_t *inst = instance;
 	VALUE_PAIR *vp, *last;
 	home_server *home;
 	REALM *realm;
 	home_pool_t *pool;
+	replicate_dst_t *dst;
 	RADIUS_PACKET *packet = NULL;
 
-	instance = instance;	/* -Wunused */
 	last = request->config_items;
-
 	/*
 	 *	Send as many packets as necessary to different
 	 *	destinations.
@@ -73,7 +542,7 @@ static int replicate_packet(void *instance, REQUEST *request)
 		default:
 			RDEBUG2("ERROR: Cannot replicate unknown packet code %d",
 				request->packet->code);
-			cleanup(packet);
+			rad_free(&packet);
 			return RLM_MODULE_FAIL;
 		
 		case PW_AUTHENTICATION_REQUEST:
@@ -107,6 +576,12 @@ static int replicate_packet(void *instance, REQUEST *request)
 			continue;
 		}
 		
+		dst = dst_find(inst, request, home);
+		if (!dst) {
+			rad_free(&packet);
+			return RLM_MODULE_FAIL;
+		}
+
 		if (!packet) {
 			packet = rad_alloc(1);
 			if (!packet) return RLM_MODULE_FAIL;
@@ -114,17 +589,10 @@ static int replicate_packet(void *instance, REQUEST *request)
 			packet->code = request->packet->code;
 			packet->id = fr_rand() & 0xff;
 
-			packet->sockfd = fr_socket(&home->src_ipaddr, 0);
-			if (packet->sockfd < 0) {
-				RDEBUG("ERROR: Failed opening socket: %s", fr_strerror());
-				cleanup(packet);
-				return RLM_MODULE_FAIL;
-			}
-
 			packet->vps = paircopy(request->packet->vps);
 			if (!packet->vps) {
 				RDEBUG("ERROR: Out of memory!");
-				cleanup(packet);
+				rad_free(&packet);
 				return RLM_MODULE_FAIL;
 			}
 
@@ -158,11 +626,33 @@ static int replicate_packet(void *instance, REQUEST *request)
 		/*
 		 *	(Re)-Write these.
 		 */
+		packet->sockfd = dst->sockfd;
 		packet->dst_ipaddr = home->ipaddr;
 		packet->dst_port = home->port;
 		memset(&packet->src_ipaddr, 0, sizeof(packet->src_ipaddr));
 		packet->src_port = 0;
 		
+#ifdef HAVE_PTHREAD_H
+		/*
+		 *	Encode and sign the packet here, and let the
+		 *	sender thread send it.
+		 */
+		if (inst->queue_size > 0) {
+			RDEBUG("Queueing packet for Realm %s", realm->name);
+			if ((rad_encode(packet, NULL, home->secret) < 0) ||
+			    (rad_sign(packet, NULL, home->secret) < 0) ||
+			    (replicate_enqueue(inst, request, dst, packet) < 0)) {
+				RDEBUG("ERROR: Failed replicating packet: %s",
+				       fr_strerror());
+				rad_free(&packet);
+				return RLM_MODULE_FAIL;
+			}
+
+			rcode = RLM_MODULE_OK;
+			continue;
+		}
+#endif
+
 		/*
 		 *	Encode, sign and then send the packet.
 		 */
@@ -170,17 +660,24 @@ static int replicate_packet(void *instance, REQUEST *request)
 		if (rad_send(packet, NULL, home->secret) < 0) {
 			RDEBUG("ERROR: Failed replicating packet: %s",
 			       fr_strerror());
-			cleanup(packet);
+			pthread_mutex_lock(&inst->mutex);
+			dst->errors++;
+			pthread_mutex_unlock(&inst->mutex);
+			rad_free(&packet);
 			return RLM_MODULE_FAIL;
 		}
 
+		pthread_mutex_lock(&inst->mutex);
+		dst->sent++;
+		pthread_mutex_unlock(&inst->mutex);
+
 		/*
 		 *	We've sent it to at least one destination.
 		 */
 		rcode = RLM_MODULE_OK;
 	}
 
-	cleanup(packet);
+	rad_free(&packet);
 	return rcode;
 }
 #else
@@ -204,8 +701,13 @@ module_t rlm_replicate = {
 	RLM_MODULE_INIT,
 	"replicate",
 	RLM_TYPE_THREAD_SAFE,		/* type */
+#ifdef WITH_PROXY
+	replicate_instantiate,		/* instantiation */
+	replicate_detach,		/* detach */
+#else
 	NULL,				/* instantiation */
 	NULL,				/* detach */
+#endif
 	{
 		NULL,			/* authentication */
 		replicate_packet,	/* authorization */
@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+#  Load test for overload control.
+#
+#  Floods the server with slow Accounting Interim-Updates.  Once the
+#  queue has backed up, it sends a second flood of Interim-Updates,
+#  along with Access-Requests which are in the middle of an EAP
+#  conversation.  The server should discard the Interim-Updates, and
+#  answer every one of the Access-Requests.
+#
+#	./overload.sh [port] [secret] [metrics port]
+#
+
+PORT=${1:-12350}
+SECRET=${2:-testing123}
+METRICS_PORT=${3:-12360}
+ACCTPORT=`expr $PORT + 1`
+
+INTERIM=200
+CONTINUE=20
+
+rm -rf .overload
+mkdir .overload
+
+for i in `seq 1 $INTERIM`
+do
+  cat >> .overload/interim <<EOF
+User-Name = "slow"
+Acct-Status-Type = Interim-Update
+Acct-Session-Id = "overload-$i"
+NAS-IP-Address = 127.0.0.1
+
+EOF
+done
+
+for i in `seq 1 $CONTINUE`
+do
+  cat >> .overload/continue <<EOF
+User-Name = "fast"
+User-Password = "fast"
+State = 0x`printf %08x $i`
+
+EOF
+done
+
+echo "Running overload test..."
+
+../main/radclient -q -p $INTERIM -r 1 -t 2 -d . -f .overload/interim \
+	127.0.0.1:$ACCTPORT acct $SECRET > .overload/interim.log 2>&1 &
+FIRST_PID=$!
+
+#
+#  Give the queue time to back up.
+#
+sleep 1
+
+../main/radclient -q -p $INTERIM -r 1 -t 2 -d . -f .overload/interim \
+	127.0.0.1:$ACCTPORT acct $SECRET > .overload/interim2.log 2>&1 &
+SECOND_PID=$!
+
+../main/radclient -s -p $CONTINUE -r 3 -t 2 -d . -f .overload/continue \
+	127.0.0.1:$PORT auth $SECRET > .overload/continue.log 2>&1
+
+wait $FIRST_PID $SECOND_PID
+
+#
+#  Ask the "metrics" listener what was discarded.
+#
+exec 3<>/dev/tcp/127.0.0.1/$METRICS_PORT || exit 1
+printf "GET /metrics HTTP/1.0\r\n\r\n" >&3
+cat <&3 > .overload/metrics
+exec 3<&-
+
+dropped() {
+	grep "^freeradius_overload_dropped_total{class=\"$1\"}" .overload/metrics | sed 's/.* //'
+}
+
+RCODE=0
+APPROVED=`grep "Total approved auths" .overload/continue.log | sed 's/.* //'`
+SHED_INTERIM=`dropped acct_interim`
+SHED_CONTINUE=`dropped auth_continue`
+
+if [ "$APPROVED" != "$CONTINUE" ]; then
+  echo "EAP continuations : FAILED ($APPROVED of $CONTINUE answered)"
+  RCODE=1
+else
+  echo "EAP continuations : Success"
+fi
+
+if [ -z "$SHED_INTERIM" ] || [ "$SHED_INTERIM" = "0" ]; then
+  echo "Interim-Update shedding : FAILED (nothing discarded)"
+  RCODE=1
+else
+  echo "Interim-Update shedding : Success ($SHED_INTERIM discarded)"
+fi
+
+if [ "$SHED_CONTINUE" != "0" ]; then
+  echo "EAP continuation shedding : FAILED ($SHED_CONTINUE discarded)"
+  RCODE=1
+fi
+
+if [ "$RCODE" = "0" ]
+then
+    rm -rf .overload
+    echo "Overload test succeeded"
+else
+    echo "See .overload/ for more details"
+fi
+
+exit $RCODE